@@ -0,0 +1,503 @@
+//microbenchmarks of the relay hot path: tunnel framing, frame decoding,
+//stream lookup and the frame scheduler, each reported per frame.
+//  relay_bench [--frames=N] [--filter=substring] [--pool=bytes]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#include "forward_codec.h"
+#include "frame_batcher.h"
+#include "frame_scheduler.h"
+#include "mem_pool.h"
+#include "metrics.h"
+#include "stream_table.h"
+#include "options.hpp"
+#include "log.hpp"
+
+std::atomic<Log*> Log::instance(NULL);
+
+//every allocation the process makes, libevent's included once its
+//allocator is routed through here. with --pool libevent goes through
+//BufferPool and only its trips to malloc count
+static uint64_t allocations = 0;
+
+static uint64_t Allocations() {
+    return allocations + Metrics::Local()->pool_fresh[kPoolBuffers].Get();
+}
+
+void* operator new(size_t size) {
+    allocations++;
+    void* p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+static void* bench_malloc(size_t size) {
+    allocations++;
+    return malloc(size);
+}
+
+static void* bench_realloc(void* p, size_t size) {
+    allocations++;
+    return realloc(p, size);
+}
+
+static void bench_free(void* p) {
+    free(p);
+}
+
+//frame payload sizes as the tunnel sees them
+enum {
+    //keystrokes, small requests and acks
+    kMixInteractive = 0,
+    //web browsing: mostly small frames, some medium, a few full ones
+    kMixWeb,
+    //downloads chunked at the default --frame-bytes
+    kMixBulk,
+    kMixCount
+};
+
+static const char* kMixNames[kMixCount] = { "interactive", "web", "bulk" };
+
+enum {
+    kFullFrame = 16384,
+    //frames one loop iteration hands to the batcher before it flushes
+    kBurst = 16,
+    //what the socket takes before the bench drains the output
+    kSocketBytes = 256 * 1024
+};
+
+static uint32_t Random(uint32_t* state) {
+    //xorshift32, the same sequence on every run
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static std::vector<uint32_t> MakeSizes(int mix, size_t count) {
+    std::vector<uint32_t> sizes(count);
+    uint32_t state = 2463534242u;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t r = Random(&state);
+        switch (mix) {
+        case kMixInteractive:
+            sizes[i] = 32 + r % 480;
+            break;
+        case kMixWeb:
+            if (r % 10 < 5)
+                sizes[i] = 32 + (r >> 8) % 480;
+            else if (r % 10 < 8)
+                sizes[i] = 1024 + (r >> 8) % 3072;
+            else
+                sizes[i] = kFullFrame;
+            break;
+        default:
+            sizes[i] = kFullFrame;
+            break;
+        }
+    }
+    return sizes;
+}
+
+//stream ids the frames are spread over
+static std::vector<HashType> MakeStreams(size_t frames, size_t streams) {
+    std::vector<HashType> ids(frames);
+    uint32_t state = 88675123u;
+    for (size_t i = 0; i < frames; i++)
+        ids[i] = Random(&state) % streams + 1;
+    return ids;
+}
+
+static char payload[kFullFrame];
+
+//a stream read as Sock5Client::OnSockRead sees it: the bytes land in an
+//input buffer and the frame takes them over
+static void ReadFrame(evbuffer* input, ForwardData& data, uint32_t len) {
+    evbuffer_add(input, payload, len);
+    data.MoveFrom(input, len);
+}
+
+struct Result {
+    Result():
+        frames(0),
+        bytes(0),
+        waits(0),
+        waited(0) {
+    }
+    uint64_t frames;
+    uint64_t bytes;
+    //frames a case times the queueing of, and the bytes sent ahead of them
+    uint64_t waits;
+    uint64_t waited;
+};
+
+class Bench {
+public:
+    Bench(const std::string& filter, size_t frames):
+        filter_(filter),
+        frames_(frames) {
+    }
+
+    size_t Frames() const {
+        return frames_;
+    }
+
+    //runs the case once to warm up and once measured
+    void Run(const std::string& name, const std::function<Result()>& body) {
+        if (!filter_.empty() && name.find(filter_) == std::string::npos)
+            return;
+        body();
+        uint64_t allocs = Allocations();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        Result result = body();
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        allocs = Allocations() - allocs;
+        double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        if (result.frames == 0)
+            result.frames = 1;
+        char rate[32] = "-";
+        if (result.bytes > 0)
+            snprintf(rate, sizeof(rate), "%.1f", result.bytes / (ns / 1e9) / (1024 * 1024));
+        char wait[48] = "";
+        if (result.waits > 0)
+            snprintf(wait, sizeof(wait), " %8.0f B ahead/wait", (double)result.waited / result.waits);
+        printf("%-32s %10.1f ns/frame %10s MB/s %8.2f allocs/frame%s\n",
+               name.c_str(), ns / result.frames, rate, (double)allocs / result.frames, wait);
+        fflush(stdout);
+    }
+
+private:
+    std::string filter_;
+
+    size_t frames_;
+};
+
+//ProxyClient::SendFrame and TCPClient::SendFrame without a batch: every
+//frame is encoded straight into the socket's output buffer
+static Result EncodeFrames(const std::vector<uint32_t>& sizes,
+                           const std::vector<HashType>& streams,
+                           int version) {
+    ForwardCodec codec;
+    codec.SetSendVersion(version);
+    evbuffer* input = evbuffer_new();
+    evbuffer* output = evbuffer_new();
+    Result result;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        ForwardData data(streams[i]);
+        ReadFrame(input, data, sizes[i]);
+        codec.Encode(data, output);
+        result.bytes += sizes[i];
+        if (evbuffer_get_length(output) >= kSocketBytes)
+            evbuffer_drain(output, evbuffer_get_length(output));
+    }
+    result.frames = sizes.size();
+    evbuffer_free(input);
+    evbuffer_free(output);
+    return result;
+}
+
+//the same frames through FrameBatcher, flushed after every burst the way
+//the loop does once its active callbacks ran
+static Result BatchFrames(event_base* base,
+                          const std::vector<uint32_t>& sizes,
+                          const std::vector<HashType>& streams) {
+    ForwardCodec codec;
+    codec.SetSendVersion(ForwardCodec::kVersion2);
+    FrameBatcher batcher(base, &codec, 64 * 1024, 0);
+    evbuffer* input = evbuffer_new();
+    evbuffer* output = evbuffer_new();
+    batcher.SetOutput(output);
+    Result result;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        ForwardData data(streams[i]);
+        ReadFrame(input, data, sizes[i]);
+        batcher.Write(data);
+        result.bytes += sizes[i];
+        if (i % kBurst == kBurst - 1)
+            batcher.Flush();
+        if (evbuffer_get_length(output) >= kSocketBytes)
+            evbuffer_drain(output, evbuffer_get_length(output));
+    }
+    batcher.Flush();
+    result.frames = sizes.size();
+    evbuffer_free(input);
+    evbuffer_free(output);
+    return result;
+}
+
+//what ParseData works through: the wire bytes arrive in socket sized
+//reads and every complete frame is decoded off the front
+static Result DecodeFrames(const std::string& wire, size_t frames, int version) {
+    ForwardCodec codec;
+    codec.SetRecvVersion(version);
+    evbuffer* input = evbuffer_new();
+    Result result;
+    for (size_t offset = 0; offset < wire.size(); offset += kSocketBytes) {
+        size_t len = wire.size() - offset < kSocketBytes ? wire.size() - offset : kSocketBytes;
+        evbuffer_add(input, wire.data() + offset, len);
+        while (true) {
+            ForwardData data(kHashTypeInvalid);
+            int ret = codec.Decode(input, data);
+            if (ret != ForwardCodec::kFrameReady)
+                break;
+            result.bytes += data.len_;
+            result.frames++;
+        }
+    }
+    evbuffer_free(input);
+    if (result.frames != frames)
+        fprintf(stderr, "decoded %llu of %llu frames\n",
+                (unsigned long long)result.frames, (unsigned long long)frames);
+    return result;
+}
+
+static std::string EncodeWire(const std::vector<uint32_t>& sizes,
+                              const std::vector<HashType>& streams,
+                              int version) {
+    ForwardCodec codec;
+    codec.SetSendVersion(version);
+    evbuffer* output = evbuffer_new();
+    for (size_t i = 0; i < sizes.size(); i++) {
+        ForwardData data(streams[i], sizes[i], payload);
+        codec.Encode(data, output);
+    }
+    std::string wire(evbuffer_get_length(output), '\0');
+    evbuffer_remove(output, &wire[0], wire.size());
+    evbuffer_free(output);
+    return wire;
+}
+
+//frames of many streams queued behind a busy tunnel and drained again
+static Result ScheduleFrames(const std::vector<uint32_t>& sizes,
+                             const std::vector<HashType>& streams,
+                             bool sparse) {
+    FrameScheduler scheduler(kFullFrame, sparse);
+    evbuffer* input = evbuffer_new();
+    Result result;
+    for (size_t i = 0; i < sizes.size(); i += kBurst) {
+        size_t end = i + kBurst < sizes.size() ? i + kBurst : sizes.size();
+        for (size_t j = i; j < end; j++) {
+            ForwardData data(streams[j]);
+            ReadFrame(input, data, sizes[j]);
+            scheduler.Push(data);
+        }
+        while (true) {
+            ForwardData data(kHashTypeInvalid);
+            if (!scheduler.Pop(data))
+                break;
+            result.bytes += data.len_;
+        }
+    }
+    result.frames = sizes.size();
+    evbuffer_free(input);
+    return result;
+}
+
+//a download that queues its next frame as soon as the last one left, so
+//it never holds more than one, next to a keystroke every few frames. the
+//bulk bytes sent between a keystroke's push and its pop are its wait
+static Result ScheduleTrickle(size_t frames, bool sparse) {
+    enum {
+        kBulk = 1,
+        kKey = 2,
+        kKeyEvery = 4,
+        kKeyBytes = 64
+    };
+    FrameScheduler scheduler(kFullFrame, sparse);
+    evbuffer* input = evbuffer_new();
+    Result result;
+    ForwardData first(kBulk);
+    ReadFrame(input, first, kFullFrame);
+    scheduler.Push(first);
+    uint64_t ahead = 0;
+    for (size_t i = 0; i < frames; i++) {
+        ForwardData data(kHashTypeInvalid);
+        if (!scheduler.Pop(data))
+            break;
+        result.bytes += data.len_;
+        if (data.to_ == kKey) {
+            result.waits++;
+            result.waited += ahead;
+        } else {
+            ahead += data.len_;
+            ForwardData next(kBulk);
+            ReadFrame(input, next, kFullFrame);
+            scheduler.Push(next);
+        }
+        if (i % kKeyEvery == 0) {
+            ForwardData key(kKey);
+            ReadFrame(input, key, kKeyBytes);
+            scheduler.Push(key);
+            ahead = 0;
+        }
+    }
+    result.frames = frames;
+    evbuffer_free(input);
+    return result;
+}
+
+struct Stream {
+    int dummy;
+};
+
+//streams open on a tunnel and the order frames name them in
+struct StreamSet {
+    StreamSet(size_t streams, size_t frames):
+        values(streams),
+        ids(streams),
+        order(MakeStreams(frames, streams)) {
+    }
+    std::vector<Stream> values;
+    std::vector<HashType> ids;
+    std::vector<HashType> order;
+};
+
+//the forwarder resolves every frame from the agent in its StreamTable
+static Result LookupTable(const StreamTable<Stream>& table, const StreamSet& set) {
+    Result result;
+    size_t found = 0;
+    for (size_t i = 0; i < set.order.size(); i++)
+        found += table.Find(set.ids[set.order[i] - 1]) != NULL;
+    result.frames = set.order.size();
+    if (found != result.frames)
+        fprintf(stderr, "found %zu of %llu streams\n", found, (unsigned long long)result.frames);
+    return result;
+}
+
+//the agent resolves them in its StreamMap
+static Result LookupMap(const StreamMap<Stream>& map, const StreamSet& set) {
+    Result result;
+    size_t found = 0;
+    for (size_t i = 0; i < set.order.size(); i++)
+        found += map.Find(set.ids[set.order[i] - 1]) != NULL;
+    result.frames = set.order.size();
+    if (found != result.frames)
+        fprintf(stderr, "found %zu of %llu streams\n", found, (unsigned long long)result.frames);
+    return result;
+}
+
+//stream ids are handed out by the table, GetHashFromConnectInfo is gone;
+//a close followed by an accept is what a short connection costs
+static Result ChurnTable(StreamTable<Stream>& table, StreamSet& set) {
+    Result result;
+    for (size_t i = 0; i < set.order.size(); i++) {
+        size_t slot = set.order[i] - 1;
+        table.Remove(set.ids[slot]);
+        set.ids[slot] = table.Insert(&set.values[slot]);
+    }
+    result.frames = set.order.size();
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    Options options(argc, argv);
+    int frames = options.GetInt("frames", 200000);
+    int pool_bytes = options.GetInt("pool", 0);
+    if (frames <= 0 || pool_bytes < 0) {
+        fprintf(stderr, "usage: relay_bench [--frames=N] [--filter=substring] [--pool=bytes]\n");
+        return 1;
+    }
+    //before libevent allocates anything
+    if (pool_bytes > 0)
+        BufferPool::Install(pool_bytes);
+    else
+        event_set_mem_functions(bench_malloc, bench_realloc, bench_free);
+    //registered here so the first case does not count it
+    Metrics::Local();
+    Bench bench(options.Get("filter", ""), frames);
+    event_base* base = event_base_new();
+    if (!base) {
+        fprintf(stderr, "Could not initialize libevent!\n");
+        return 1;
+    }
+    memset(payload, 'x', sizeof(payload));
+    for (int mix = 0; mix < kMixCount; mix++) {
+        //bulk frames are large, fewer of them keep the case short
+        size_t count = mix == kMixBulk ? bench.Frames() / 8 : bench.Frames();
+        std::vector<uint32_t> sizes = MakeSizes(mix, count);
+        std::vector<HashType> streams = MakeStreams(count, 64);
+        std::string name = kMixNames[mix];
+        bench.Run("encode/v1/" + name, [&]() {
+            return EncodeFrames(sizes, streams, ForwardCodec::kVersion1);
+        });
+        bench.Run("encode/v2/" + name, [&]() {
+            return EncodeFrames(sizes, streams, ForwardCodec::kVersion2);
+        });
+        bench.Run("batch/v2/" + name, [&]() {
+            return BatchFrames(base, sizes, streams);
+        });
+        std::string wire1 = EncodeWire(sizes, streams, ForwardCodec::kVersion1);
+        std::string wire2 = EncodeWire(sizes, streams, ForwardCodec::kVersion2);
+        bench.Run("decode/v1/" + name, [&]() {
+            return DecodeFrames(wire1, count, ForwardCodec::kVersion1);
+        });
+        bench.Run("decode/v2/" + name, [&]() {
+            return DecodeFrames(wire2, count, ForwardCodec::kVersion2);
+        });
+        bench.Run("schedule/drr/" + name, [&]() {
+            return ScheduleFrames(sizes, streams, false);
+        });
+        bench.Run("schedule/sparse/" + name, [&]() {
+            return ScheduleFrames(sizes, streams, true);
+        });
+    }
+    bench.Run("schedule/drr/trickle", [&]() {
+        return ScheduleTrickle(bench.Frames(), false);
+    });
+    bench.Run("schedule/sparse/trickle", [&]() {
+        return ScheduleTrickle(bench.Frames(), true);
+    });
+    static const size_t kStreamCounts[] = { 64, 4096, 262144 };
+    for (size_t i = 0; i < sizeof(kStreamCounts) / sizeof(kStreamCounts[0]); i++) {
+        size_t streams = kStreamCounts[i];
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "/%zu", streams);
+        StreamSet set(streams, bench.Frames());
+        StreamTable<Stream> table;
+        for (size_t j = 0; j < streams; j++)
+            set.ids[j] = table.Insert(&set.values[j]);
+        bench.Run(std::string("lookup/table") + suffix, [&]() {
+            return LookupTable(table, set);
+        });
+        bench.Run(std::string("churn/table") + suffix, [&]() {
+            return ChurnTable(table, set);
+        });
+        //ids an older forwarder hashed, spread over the whole range
+        StreamMap<Stream> map;
+        uint32_t state = 521288629u;
+        for (size_t j = 0; j < streams; j++) {
+            do {
+                set.ids[j] = Random(&state);
+            } while (set.ids[j] == (HashType)kHashTypeInvalid || !map.Insert(set.ids[j], &set.values[j]));
+        }
+        bench.Run(std::string("lookup/map") + suffix, [&]() {
+            return LookupMap(map, set);
+        });
+    }
+    event_base_free(base);
+    return 0;
+}
@@ -0,0 +1,906 @@
+//end to end load on one box: starts proxy_forward and proxy_server on
+//loopback next to an in process backend, then drives socks5 streams
+//through the forwarder's sock port to that backend.
+//  relay_loadgen [--connections=N] [--rate=N] [--duration=sec]
+//                [--pattern=rr|echo|upload|download] [--request=bytes]
+//                [--response=bytes] [--requests=N] [--think=ms]
+//                [--forward=path] [--server=path] [--forward-args="..."]
+//                [--server-args="..."] [--proxy-log=file] [--external]
+//                [--tcp-port=N] [--sock-port=N] [--backend-port=N]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+#include "options.hpp"
+
+enum {
+    //client sends request bytes, backend answers with response bytes
+    kPatternRequestResponse = 0,
+    //backend returns what it reads, request bytes per round trip
+    kPatternEcho,
+    //client writes as fast as the relay takes it
+    kPatternUpload,
+    //backend writes as fast as the relay takes it
+    kPatternDownload
+};
+
+enum {
+    kPayloadSize = 64 * 1024,
+    //a streaming writer tops its output up to this
+    kStreamWindow = 256 * 1024,
+    kProbeIntervalMs = 200,
+    kReadyTimeoutMs = 15000,
+    kLaunchIntervalMs = 10
+};
+
+static char payload[kPayloadSize];
+
+static int64_t Now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//payload bytes by reference, nothing is copied into the buffer
+static void AddPayload(evbuffer* out, size_t len) {
+    while (len > 0) {
+        size_t chunk = len < kPayloadSize ? len : kPayloadSize;
+        evbuffer_add_reference(out, payload, chunk, NULL, NULL);
+        len -= chunk;
+    }
+}
+
+struct LoadConfig {
+    LoadConfig():
+        connections(1000),
+        rate(0),
+        duration(10),
+        pattern(kPatternRequestResponse),
+        request(64),
+        response(1024),
+        requests(0),
+        think_ms(0),
+        tcp_port(21587),
+        sock_port(21589),
+        backend_port(21590),
+        external(false) {
+    }
+    int connections;
+    //new connections per second, 0 opens them as fast as slots free up
+    int rate;
+    int duration;
+    int pattern;
+    size_t request;
+    size_t response;
+    //round trips before a connection closes and a new one takes its slot,
+    //0 keeps it for the whole run
+    int requests;
+    int think_ms;
+    int tcp_port;
+    int sock_port;
+    int backend_port;
+    //proxies are already running, nothing is spawned
+    bool external;
+    std::string forward;
+    std::string server;
+    std::string forward_args;
+    std::string server_args;
+    std::string proxy_log;
+};
+
+struct LoadStats {
+    LoadStats():
+        launched(0),
+        established(0),
+        failed(0),
+        broken(0),
+        completed(0),
+        active(0),
+        peak_active(0),
+        bytes_up(0),
+        bytes_down(0) {
+    }
+    uint64_t launched;
+    uint64_t established;
+    //connect or socks handshake did not succeed
+    uint64_t failed;
+    //lost after the handshake before it was done
+    uint64_t broken;
+    //closed after its round trips
+    uint64_t completed;
+    int active;
+    int peak_active;
+    //payload the backend read and the clients read
+    uint64_t bytes_up;
+    uint64_t bytes_down;
+    std::vector<uint32_t> setup_us;
+    std::vector<uint32_t> rtt_us;
+};
+
+class Loadgen;
+
+//accepted by the in process backend, one per relayed stream
+class BackendConn {
+public:
+    BackendConn(Loadgen* loadgen, bufferevent* bev);
+
+    ~BackendConn();
+
+    void OnRead();
+
+    void OnWrite();
+
+    void OnEvent(short events);
+
+private:
+    Loadgen* loadgen_;
+
+    bufferevent* bev_;
+
+    //request bytes read since the last answer
+    size_t pending_;
+};
+
+//one socks5 client, a slot of the load
+class LoadClient {
+public:
+    enum {
+        kConnecting = 0,
+        kMethodReply,
+        kConnectReply,
+        kRunning
+    };
+
+    LoadClient(Loadgen* loadgen, bool probe);
+
+    ~LoadClient();
+
+    bool Start();
+
+    void OnConnected();
+
+    void OnRead();
+
+    void OnWrite();
+
+    void OnEvent(short events);
+
+    void OnThink();
+
+    void Finish(bool ok);
+
+    bool IsProbe() const {
+        return probe_;
+    }
+
+private:
+    //false when the handshake failed or needs more bytes, see state_
+    bool ReadHandshake(evbuffer* input);
+
+    void SendRequest();
+
+    Loadgen* loadgen_;
+
+    bufferevent* bev_;
+
+    event* think_event_;
+
+    bool probe_;
+
+    int state_;
+
+    int64_t started_us_;
+
+    int64_t sent_us_;
+
+    size_t expected_;
+
+    size_t received_;
+
+    int requests_;
+};
+
+class Loadgen {
+public:
+    Loadgen(event_base* base, const LoadConfig& config);
+
+    ~Loadgen();
+
+    bool Init();
+
+    void Run();
+
+    //prints the summary of the measured window
+    void Report();
+
+    const LoadConfig& Config() const {
+        return config_;
+    }
+
+    LoadStats& Stats() {
+        return stats_;
+    }
+
+    event_base* Base() const {
+        return base_;
+    }
+
+    bool Measuring() const {
+        return measuring_;
+    }
+
+    void OnAccept(evutil_socket_t fd);
+
+    void OnBackendClosed(BackendConn* conn);
+
+    void OnClientClosed(LoadClient* client);
+
+    void OnProbe(bool ok);
+
+    void Launch();
+
+    void Probe();
+
+    void Stop();
+
+private:
+    pid_t Spawn(const std::string& path, const std::vector<std::string>& args);
+
+    void Reap(pid_t pid);
+
+    event_base* base_;
+
+    LoadConfig config_;
+
+    LoadStats stats_;
+
+    evconnlistener* listener_;
+
+    event* launch_event_;
+
+    event* probe_event_;
+
+    event* stop_event_;
+
+    pid_t forward_pid_;
+
+    pid_t server_pid_;
+
+    std::set<LoadClient*> clients_;
+
+    std::set<BackendConn*> backends_;
+
+    bool measuring_;
+
+    int64_t probe_started_us_;
+
+    int64_t started_us_;
+
+    int64_t stopped_us_;
+};
+
+static void backendreadcb(bufferevent* bev, void* ctx) {
+    static_cast<BackendConn*>(ctx)->OnRead();
+}
+
+static void backendwritecb(bufferevent* bev, void* ctx) {
+    static_cast<BackendConn*>(ctx)->OnWrite();
+}
+
+static void backendeventcb(bufferevent* bev, short events, void* ctx) {
+    static_cast<BackendConn*>(ctx)->OnEvent(events);
+}
+
+BackendConn::BackendConn(Loadgen* loadgen, bufferevent* bev):
+    loadgen_(loadgen),
+    bev_(bev),
+    pending_(0) {
+    bufferevent_setcb(bev_, backendreadcb, backendwritecb, backendeventcb, this);
+    bufferevent_setwatermark(bev_, EV_WRITE, kStreamWindow / 2, 0);
+    bufferevent_enable(bev_, EV_READ | EV_WRITE);
+    if (loadgen_->Config().pattern == kPatternDownload)
+        OnWrite();
+}
+
+BackendConn::~BackendConn() {
+    bufferevent_free(bev_);
+}
+
+void BackendConn::OnRead() {
+    evbuffer* input = bufferevent_get_input(bev_);
+    size_t len = evbuffer_get_length(input);
+    if (loadgen_->Measuring())
+        loadgen_->Stats().bytes_up += len;
+    const LoadConfig& config = loadgen_->Config();
+    switch (config.pattern) {
+    case kPatternEcho:
+        bufferevent_write_buffer(bev_, input);
+        return;
+    case kPatternRequestResponse:
+        pending_ += len;
+        while (pending_ >= config.request) {
+            pending_ -= config.request;
+            AddPayload(bufferevent_get_output(bev_), config.response);
+        }
+        break;
+    }
+    evbuffer_drain(input, len);
+}
+
+void BackendConn::OnWrite() {
+    if (loadgen_->Config().pattern != kPatternDownload)
+        return;
+    evbuffer* output = bufferevent_get_output(bev_);
+    size_t queued = evbuffer_get_length(output);
+    if (queued < kStreamWindow)
+        AddPayload(output, kStreamWindow - queued);
+}
+
+void BackendConn::OnEvent(short events) {
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+        loadgen_->OnBackendClosed(this);
+}
+
+static void clientreadcb(bufferevent* bev, void* ctx) {
+    static_cast<LoadClient*>(ctx)->OnRead();
+}
+
+static void clientwritecb(bufferevent* bev, void* ctx) {
+    static_cast<LoadClient*>(ctx)->OnWrite();
+}
+
+static void clienteventcb(bufferevent* bev, short events, void* ctx) {
+    static_cast<LoadClient*>(ctx)->OnEvent(events);
+}
+
+static void thinkcb(evutil_socket_t fd, short what, void* ctx) {
+    static_cast<LoadClient*>(ctx)->OnThink();
+}
+
+LoadClient::LoadClient(Loadgen* loadgen, bool probe):
+    loadgen_(loadgen),
+    bev_(NULL),
+    think_event_(NULL),
+    probe_(probe),
+    state_(kConnecting),
+    started_us_(0),
+    sent_us_(0),
+    expected_(0),
+    received_(0),
+    requests_(0) {
+}
+
+LoadClient::~LoadClient() {
+    if (think_event_)
+        event_free(think_event_);
+    if (bev_)
+        bufferevent_free(bev_);
+}
+
+bool LoadClient::Start() {
+    const LoadConfig& config = loadgen_->Config();
+    bev_ = bufferevent_socket_new(loadgen_->Base(), -1, BEV_OPT_CLOSE_ON_FREE);
+    if (!bev_)
+        return false;
+    bufferevent_setcb(bev_, clientreadcb, clientwritecb, clienteventcb, this);
+    bufferevent_setwatermark(bev_, EV_WRITE, kStreamWindow / 2, 0);
+    bufferevent_enable(bev_, EV_READ | EV_WRITE);
+    sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(config.sock_port);
+    started_us_ = Now();
+    return bufferevent_socket_connect(bev_, (sockaddr*)&sin, sizeof(sin)) == 0;
+}
+
+void LoadClient::OnConnected() {
+    const LoadConfig& config = loadgen_->Config();
+    //greeting and CONNECT 127.0.0.1:backend in one write
+    unsigned char hello[13] = { 5, 1, 0, 5, 1, 0, 1, 127, 0, 0, 1, 0, 0 };
+    hello[11] = (unsigned char)(config.backend_port >> 8);
+    hello[12] = (unsigned char)(config.backend_port);
+    bufferevent_write(bev_, hello, sizeof(hello));
+    state_ = kMethodReply;
+}
+
+bool LoadClient::ReadHandshake(evbuffer* input) {
+    if (state_ == kMethodReply) {
+        if (evbuffer_get_length(input) < 2)
+            return false;
+        unsigned char reply[2];
+        evbuffer_remove(input, reply, sizeof(reply));
+        if (reply[0] != 5 || reply[1] != 0) {
+            Finish(false);
+            return false;
+        }
+        state_ = kConnectReply;
+    }
+    //ver rep rsv atyp addr port
+    unsigned char head[5];
+    if (evbuffer_copyout(input, head, sizeof(head)) < (ev_ssize_t)sizeof(head))
+        return false;
+    if (head[0] != 5 || head[1] != 0) {
+        Finish(false);
+        return false;
+    }
+    size_t len;
+    switch (head[3]) {
+    case 1:
+        len = 4 + 4 + 2;
+        break;
+    case 4:
+        len = 4 + 16 + 2;
+        break;
+    case 3:
+        len = 4 + 1 + head[4] + 2;
+        break;
+    default:
+        Finish(false);
+        return false;
+    }
+    if (evbuffer_get_length(input) < len)
+        return false;
+    evbuffer_drain(input, len);
+    return true;
+}
+
+void LoadClient::OnRead() {
+    evbuffer* input = bufferevent_get_input(bev_);
+    if (state_ != kRunning) {
+        if (!ReadHandshake(input))
+            return;
+        if (probe_) {
+            Finish(true);
+            return;
+        }
+        state_ = kRunning;
+        LoadStats& stats = loadgen_->Stats();
+        stats.established++;
+        if (loadgen_->Measuring())
+            stats.setup_us.push_back((uint32_t)(Now() - started_us_));
+        const LoadConfig& config = loadgen_->Config();
+        if (config.pattern == kPatternUpload)
+            OnWrite();
+        else if (config.pattern != kPatternDownload)
+            SendRequest();
+    }
+    size_t len = evbuffer_get_length(input);
+    evbuffer_drain(input, len);
+    if (loadgen_->Measuring())
+        loadgen_->Stats().bytes_down += len;
+    if (expected_ == 0)
+        return;
+    received_ += len;
+    if (received_ < expected_)
+        return;
+    //one round trip is complete, the next request waits for it
+    if (loadgen_->Measuring())
+        loadgen_->Stats().rtt_us.push_back((uint32_t)(Now() - sent_us_));
+    expected_ = 0;
+    requests_++;
+    const LoadConfig& config = loadgen_->Config();
+    if (config.requests > 0 && requests_ >= config.requests) {
+        Finish(true);
+        return;
+    }
+    if (config.think_ms > 0) {
+        if (!think_event_)
+            think_event_ = evtimer_new(loadgen_->Base(), thinkcb, this);
+        timeval delay = { config.think_ms / 1000, (config.think_ms % 1000) * 1000 };
+        evtimer_add(think_event_, &delay);
+        return;
+    }
+    SendRequest();
+}
+
+void LoadClient::OnWrite() {
+    if (state_ != kRunning || loadgen_->Config().pattern != kPatternUpload)
+        return;
+    evbuffer* output = bufferevent_get_output(bev_);
+    size_t queued = evbuffer_get_length(output);
+    if (queued < kStreamWindow)
+        AddPayload(output, kStreamWindow - queued);
+}
+
+void LoadClient::OnThink() {
+    SendRequest();
+}
+
+void LoadClient::SendRequest() {
+    const LoadConfig& config = loadgen_->Config();
+    expected_ = config.pattern == kPatternEcho ? config.request : config.response;
+    received_ = 0;
+    sent_us_ = Now();
+    AddPayload(bufferevent_get_output(bev_), config.request);
+}
+
+void LoadClient::OnEvent(short events) {
+    if (events & BEV_EVENT_CONNECTED) {
+        OnConnected();
+        return;
+    }
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+        Finish(false);
+}
+
+void LoadClient::Finish(bool ok) {
+    LoadStats& stats = loadgen_->Stats();
+    if (probe_) {
+        loadgen_->OnProbe(ok);
+    } else if (state_ != kRunning) {
+        stats.failed++;
+    } else if (ok) {
+        stats.completed++;
+    } else {
+        stats.broken++;
+    }
+    loadgen_->OnClientClosed(this);
+}
+
+static void acceptcb(evconnlistener* listener, evutil_socket_t fd,
+                     sockaddr* address, int socklen, void* ctx) {
+    static_cast<Loadgen*>(ctx)->OnAccept(fd);
+}
+
+static void launchcb(evutil_socket_t fd, short what, void* ctx) {
+    static_cast<Loadgen*>(ctx)->Launch();
+}
+
+static void probecb(evutil_socket_t fd, short what, void* ctx) {
+    static_cast<Loadgen*>(ctx)->Probe();
+}
+
+static void stopcb(evutil_socket_t fd, short what, void* ctx) {
+    static_cast<Loadgen*>(ctx)->Stop();
+}
+
+static std::vector<std::string> SplitArgs(const std::string& text) {
+    std::vector<std::string> args;
+    std::istringstream in(text);
+    std::string arg;
+    while (in >> arg)
+        args.push_back(arg);
+    return args;
+}
+
+//the directory this binary lives in, where the build puts the proxies too
+static std::string SelfDir() {
+    char path[4096];
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len <= 0)
+        return ".";
+    path[len] = '\0';
+    char* slash = strrchr(path, '/');
+    if (!slash)
+        return ".";
+    *slash = '\0';
+    return path;
+}
+
+Loadgen::Loadgen(event_base* base, const LoadConfig& config):
+    base_(base),
+    config_(config),
+    listener_(NULL),
+    launch_event_(NULL),
+    probe_event_(NULL),
+    stop_event_(NULL),
+    forward_pid_(-1),
+    server_pid_(-1),
+    measuring_(false),
+    probe_started_us_(0),
+    started_us_(0),
+    stopped_us_(0) {
+}
+
+Loadgen::~Loadgen() {
+    for (std::set<LoadClient*>::iterator it = clients_.begin(); it != clients_.end(); ++it)
+        delete *it;
+    for (std::set<BackendConn*>::iterator it = backends_.begin(); it != backends_.end(); ++it)
+        delete *it;
+    if (launch_event_)
+        event_free(launch_event_);
+    if (probe_event_)
+        event_free(probe_event_);
+    if (stop_event_)
+        event_free(stop_event_);
+    if (listener_)
+        evconnlistener_free(listener_);
+    Reap(server_pid_);
+    Reap(forward_pid_);
+}
+
+bool Loadgen::Init() {
+    sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(config_.backend_port);
+    listener_ = evconnlistener_new_bind(base_, acceptcb, this,
+                                        LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, 4096,
+                                        (sockaddr*)&sin, sizeof(sin));
+    if (!listener_) {
+        fprintf(stderr, "Could not listen on backend port %d\n", config_.backend_port);
+        return false;
+    }
+    launch_event_ = event_new(base_, -1, EV_PERSIST, launchcb, this);
+    probe_event_ = evtimer_new(base_, probecb, this);
+    stop_event_ = evtimer_new(base_, stopcb, this);
+    if (!config_.external) {
+        char port[16];
+        std::vector<std::string> args;
+        snprintf(port, sizeof(port), "%d", config_.tcp_port);
+        args.push_back(port);
+        snprintf(port, sizeof(port), "%d", config_.sock_port);
+        args.push_back(port);
+        std::vector<std::string> extra = SplitArgs(config_.forward_args);
+        args.insert(args.end(), extra.begin(), extra.end());
+        forward_pid_ = Spawn(config_.forward, args);
+        args.clear();
+        args.push_back("127.0.0.1");
+        snprintf(port, sizeof(port), "%d", config_.tcp_port);
+        args.push_back(port);
+        args.push_back("--foreground");
+        extra = SplitArgs(config_.server_args);
+        args.insert(args.end(), extra.begin(), extra.end());
+        server_pid_ = Spawn(config_.server, args);
+        if (forward_pid_ < 0 || server_pid_ < 0)
+            return false;
+    }
+    probe_started_us_ = Now();
+    Probe();
+    return true;
+}
+
+pid_t Loadgen::Spawn(const std::string& path, const std::vector<std::string>& args) {
+    std::vector<char*> argv;
+    argv.push_back(const_cast<char*>(path.c_str()));
+    for (size_t i = 0; i < args.size(); i++)
+        argv.push_back(const_cast<char*>(args[i].c_str()));
+    argv.push_back(NULL);
+    std::string log = config_.proxy_log.empty() ? "/dev/null" : config_.proxy_log;
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        execv(path.c_str(), &argv[0]);
+        fprintf(stderr, "Could not start %s: %s\n", path.c_str(), strerror(errno));
+        _exit(127);
+    }
+    if (pid < 0)
+        fprintf(stderr, "fork failed: %s\n", strerror(errno));
+    return pid;
+}
+
+void Loadgen::Reap(pid_t pid) {
+    if (pid <= 0)
+        return;
+    //the proxies shut down on SIGINT, a stuck one is killed
+    kill(pid, SIGINT);
+    for (int i = 0; i < 50; i++) {
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return;
+        usleep(100 * 1000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+void Loadgen::Run() {
+    event_base_dispatch(base_);
+}
+
+void Loadgen::Probe() {
+    //a lone stream through the whole chain, the load starts once one
+    //makes it to the backend
+    LoadClient* client = new LoadClient(this, true);
+    clients_.insert(client);
+    if (!client->Start())
+        client->Finish(false);
+}
+
+void Loadgen::OnProbe(bool ok) {
+    if (ok) {
+        printf("relay ready after %.1f ms, %d connections for %d s\n",
+               (Now() - probe_started_us_) / 1000.0, config_.connections, config_.duration);
+        fflush(stdout);
+        measuring_ = true;
+        started_us_ = Now();
+        timeval tick = { 0, kLaunchIntervalMs * 1000 };
+        event_add(launch_event_, &tick);
+        timeval duration = { config_.duration, 0 };
+        evtimer_add(stop_event_, &duration);
+        Launch();
+        return;
+    }
+    if (Now() - probe_started_us_ > kReadyTimeoutMs * 1000) {
+        fprintf(stderr, "relay not ready after %d ms\n", (int)kReadyTimeoutMs);
+        event_base_loopbreak(base_);
+        return;
+    }
+    timeval retry = { 0, kProbeIntervalMs * 1000 };
+    evtimer_add(probe_event_, &retry);
+}
+
+void Loadgen::Launch() {
+    if (!measuring_)
+        return;
+    int64_t allowed = config_.connections - stats_.active;
+    if (config_.rate > 0) {
+        int64_t budget = (Now() - started_us_) * config_.rate / 1000000 - (int64_t)stats_.launched;
+        if (budget < allowed)
+            allowed = budget;
+    }
+    for (int64_t i = 0; i < allowed; i++) {
+        LoadClient* client = new LoadClient(this, false);
+        clients_.insert(client);
+        stats_.launched++;
+        stats_.active++;
+        if (stats_.active > stats_.peak_active)
+            stats_.peak_active = stats_.active;
+        if (!client->Start())
+            client->Finish(false);
+    }
+}
+
+void Loadgen::OnAccept(evutil_socket_t fd) {
+    bufferevent* bev = bufferevent_socket_new(base_, fd, BEV_OPT_CLOSE_ON_FREE);
+    if (!bev) {
+        evutil_closesocket(fd);
+        return;
+    }
+    backends_.insert(new BackendConn(this, bev));
+}
+
+void Loadgen::OnBackendClosed(BackendConn* conn) {
+    backends_.erase(conn);
+    delete conn;
+}
+
+void Loadgen::OnClientClosed(LoadClient* client) {
+    if (clients_.erase(client) == 0)
+        return;
+    //probes never took a slot
+    if (!client->IsProbe())
+        stats_.active--;
+    delete client;
+}
+
+void Loadgen::Stop() {
+    measuring_ = false;
+    stopped_us_ = Now();
+    event_base_loopbreak(base_);
+}
+
+static double Percentile(const std::vector<uint32_t>& sorted, double q) {
+    if (sorted.empty())
+        return 0;
+    size_t index = (size_t)(q * sorted.size());
+    if (index >= sorted.size())
+        index = sorted.size() - 1;
+    return sorted[index] / 1000.0;
+}
+
+static void PrintLatency(const char* name, std::vector<uint32_t>& samples) {
+    std::sort(samples.begin(), samples.end());
+    printf("%-14s %9zu samples  p50 %8.3f ms  p99 %8.3f ms  p999 %8.3f ms  max %8.3f ms\n",
+           name, samples.size(), Percentile(samples, 0.5), Percentile(samples, 0.99),
+           Percentile(samples, 0.999), samples.empty() ? 0 : samples.back() / 1000.0);
+}
+
+void Loadgen::Report() {
+    if (started_us_ == 0)
+        return;
+    double seconds = (stopped_us_ - started_us_) / 1e6;
+    printf("connections    %9llu launched  %llu established  %llu failed  %llu broken"
+           "  %llu completed  %d peak active\n",
+           (unsigned long long)stats_.launched, (unsigned long long)stats_.established,
+           (unsigned long long)stats_.failed, (unsigned long long)stats_.broken,
+           (unsigned long long)stats_.completed, stats_.peak_active);
+    printf("connect rate   %9.1f /s\n", stats_.established / seconds);
+    PrintLatency("setup", stats_.setup_us);
+    if (config_.pattern == kPatternRequestResponse || config_.pattern == kPatternEcho) {
+        PrintLatency("round trip", stats_.rtt_us);
+        printf("requests       %9.1f /s\n", stats_.rtt_us.size() / seconds);
+    }
+    printf("throughput     up %.1f MB/s  down %.1f MB/s\n",
+           stats_.bytes_up / seconds / (1024 * 1024), stats_.bytes_down / seconds / (1024 * 1024));
+}
+
+static void usage() {
+    fprintf(stderr, "usage: relay_loadgen [--connections=N] [--rate=N] [--duration=sec]"
+            " [--pattern=rr|echo|upload|download] [--request=bytes] [--response=bytes]"
+            " [--requests=N] [--think=ms] [--forward=path] [--server=path]"
+            " [--forward-args=\"...\"] [--server-args=\"...\"] [--proxy-log=file] [--external]"
+            " [--tcp-port=N] [--sock-port=N] [--backend-port=N]\n");
+    exit(1);
+}
+
+//every slot holds a client and a backend socket, the proxies two each
+static void RaiseFileLimit() {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+        return;
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+int main(int argc, char *argv[]) {
+    Options options(argc, argv);
+    LoadConfig config;
+    config.connections = options.GetInt("connections", config.connections);
+    config.rate = options.GetInt("rate", config.rate);
+    config.duration = options.GetInt("duration", config.duration);
+    config.request = options.GetInt("request", (int)config.request);
+    config.response = options.GetInt("response", (int)config.response);
+    config.requests = options.GetInt("requests", config.requests);
+    config.think_ms = options.GetInt("think", config.think_ms);
+    config.tcp_port = options.GetInt("tcp-port", config.tcp_port);
+    config.sock_port = options.GetInt("sock-port", config.sock_port);
+    config.backend_port = options.GetInt("backend-port", config.backend_port);
+    config.external = options.Has("external");
+    std::string dir = SelfDir();
+    config.forward = options.Get("forward", dir + "/proxy_forward");
+    config.server = options.Get("server", dir + "/proxy_server");
+    config.forward_args = options.Get("forward-args", "");
+    config.server_args = options.Get("server-args", "");
+    config.proxy_log = options.Get("proxy-log", "");
+    std::string pattern = options.Get("pattern", "rr");
+    if (pattern == "rr")
+        config.pattern = kPatternRequestResponse;
+    else if (pattern == "echo")
+        config.pattern = kPatternEcho;
+    else if (pattern == "upload")
+        config.pattern = kPatternUpload;
+    else if (pattern == "download")
+        config.pattern = kPatternDownload;
+    else
+        usage();
+    if (config.connections <= 0 || config.duration <= 0 || config.rate < 0 ||
+        config.request == 0 || config.requests < 0 || config.think_ms < 0)
+        usage();
+    if (config.pattern == kPatternRequestResponse && config.response == 0)
+        usage();
+    memset(payload, 'x', sizeof(payload));
+    RaiseFileLimit();
+    signal(SIGPIPE, SIG_IGN);
+    event_base* base = event_base_new();
+    if (!base) {
+        fprintf(stderr, "Could not initialize libevent!\n");
+        return 1;
+    }
+    int ret = 1;
+    {
+        Loadgen loadgen(base, config);
+        if (loadgen.Init()) {
+            loadgen.Run();
+            loadgen.Report();
+            ret = loadgen.Stats().established > 0 ? 0 : 1;
+        }
+    }
+    event_base_free(base);
+    return ret;
+}
@@ -0,0 +1,854 @@
+#include "datagram_link.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include "log.hpp"
+#include "metrics.h"
+#include "frame_scheduler.h"
+
+enum {
+    kPacketSyn = 1,
+    kPacketSynAck,
+    kPacketData,
+    kPacketAck,
+    kPacketClose,
+    kPacketChallenge,
+    kPacketResponse
+};
+
+enum {
+    kHeaderSize = 9,
+    kTokenSize = 8,
+    kDataHeaderSize = kHeaderSize + 10,
+    kAckHeaderSize = kHeaderSize + 5,
+    kMaxMtu = 9000,
+    kFlagFrameEnd = 1
+};
+
+enum {
+    //newest received ranges reported per ack
+    kAckRanges = 32,
+    //every second datagram is acked at once, a lone one after the delay
+    kAckEvery = 2,
+    kAckDelayUs = 5 * 1000,
+    //newer datagrams acked before an older one counts as lost, and the
+    //most reordering either threshold grows to
+    kPacketThreshold = 3,
+    kMaxReorderPackets = 64,
+    kMaxReorderEighths = 16,
+    //lost datagrams remembered for spotting reordering
+    kLostMemory = 1024,
+    kInitialPackets = 10,
+    kMinPackets = 2,
+    //caps the window, and with it what a link holds in flight
+    kMaxWindow = 4 * 1024 * 1024,
+    kInitialRtoUs = 300 * 1000,
+    kMinRtoUs = 30 * 1000,
+    kMaxRtoUs = 10 * 1000 * 1000,
+    //timeouts in a row without an ack before the peer is given up on
+    kMaxBackoff = 10,
+    kSynIntervalUs = 250 * 1000,
+    //how far from the newest received pn a datagram from a new address
+    //may be and still count as the agent's
+    kMoveWindow = 16 * 1024,
+    kSynAttempts = 6,
+    //a tunnel that let go of its end is noticed on this tick
+    kTickUs = 1000 * 1000
+};
+
+static void PutUint32(unsigned char* p, uint32_t v) {
+    p[0] = (unsigned char)(v);
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static uint32_t GetUint32(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void PutUint64(unsigned char* p, uint64_t v) {
+    PutUint32(p, (uint32_t)v);
+    PutUint32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t GetUint64(const unsigned char* p) {
+    return (uint64_t)GetUint32(p) | ((uint64_t)GetUint32(p + 4) << 32);
+}
+
+static bool SameAddress(const sockaddr_in& a, const sockaddr_in& b) {
+    return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+//the 64 bit number closest to expected that ends in the 32 bits sent
+static uint64_t Expand(uint32_t wire, uint64_t expected) {
+    const uint64_t window = (uint64_t)1 << 32;
+    uint64_t candidate = (expected & ~(window - 1)) | wire;
+    if (candidate + window / 2 <= expected)
+        return candidate + window;
+    if (candidate > expected + window / 2 && candidate >= window)
+        return candidate - window;
+    return candidate;
+}
+
+static void timercb(evutil_socket_t fd, short what, void *ctx) {
+    DatagramLink* pLink = static_cast<DatagramLink*>(ctx);
+    pLink->OnTimer();
+}
+
+static void endreadcb(struct bufferevent *bev, void *ctx) {
+    DatagramLink* pLink = static_cast<DatagramLink*>(ctx);
+    pLink->OnTunnelRead();
+}
+
+bufferevent* DatagramLink::Connect(event_base* event_loop,
+                                   const std::string& ip,
+                                   int port,
+                                   uint8_t slot,
+                                   const TunnelConfig& config) {
+    uint64_t conv = 0;
+    while (conv == 0) {
+        evutil_secure_rng_get_bytes(&conv, sizeof(conv));
+        conv = (conv & ~(uint64_t)0xff) | slot;
+    }
+    sockaddr_in peer;
+    memset(&peer, 0, sizeof(peer));
+    DatagramLink* link = new DatagramLink(event_loop, NULL, NULL, conv, peer, config);
+    link->socket_ = new DatagramSocket(event_loop, link, config.udp_mtu);
+    bufferevent* bev = NULL;
+    if (link->socket_->Connect(ip, port))
+        bev = link->Init();
+    if (!bev) {
+        delete link;
+        return NULL;
+    }
+    link->socket_->SetSimulator(config.sim_loss_percent, config.sim_delay_ms, config.sim_jitter_ms);
+    link->SendSyn();
+    return bev;
+}
+
+size_t DatagramLink::SegmentBytes(size_t mtu) {
+    return mtu - kDataHeaderSize;
+}
+
+DatagramLink::DatagramLink(event_base* event_loop,
+                           DatagramSocket* socket,
+                           DatagramListener* listener,
+                           uint64_t conv,
+                           const sockaddr_in& peer,
+                           const TunnelConfig& config):
+    event_loop_(event_loop),
+    socket_(socket),
+    listener_(listener),
+    conv_(conv),
+    peer_(peer),
+    challenge_(0),
+    challenge_us_(0),
+    config_(config),
+    status_(kConnecting),
+    end_(NULL),
+    timer_(NULL),
+    frame_(NULL),
+    ordered_(true),
+    switch_segment_(0),
+    next_segment_(1),
+    send_cursor_(1),
+    segment_bytes_(0),
+    unsent_bytes_(0),
+    next_pn_(1),
+    largest_acked_(0),
+    bytes_in_flight_(0),
+    cwnd_(kInitialPackets * config.udp_mtu),
+    ssthresh_(kMaxWindow),
+    recovery_pn_(0),
+    srtt_us_(0),
+    rttvar_us_(0),
+    latest_rtt_us_(0),
+    backoff_(0),
+    progress_us_(0),
+    loss_deadline_us_(0),
+    reorder_packets_(kPacketThreshold),
+    reorder_eighths_(1),
+    cut_pn_(0),
+    undo_cwnd_(0),
+    undo_ssthresh_(0),
+    largest_received_(0),
+    largest_received_us_(0),
+    unacked_packets_(0),
+    ack_deadline_us_(0),
+    syn_attempts_(0),
+    syn_deadline_us_(0),
+    held_bytes_(0) {
+    memset(&candidate_, 0, sizeof(candidate_));
+}
+
+bufferevent* DatagramLink::Init() {
+    bufferevent* pair[2];
+    if (bufferevent_pair_new(event_loop_, BEV_OPT_DEFER_CALLBACKS, pair) != 0) {
+        LOGE << "Could not create a bufferevent pair!\n";
+        return NULL;
+    }
+    end_ = pair[0];
+    bufferevent_setcb(end_, endreadcb, NULL, NULL, this);
+    bufferevent_enable(end_, EV_READ | EV_WRITE);
+    for (int i = 0; i < kLanes; i++)
+        lanes_[i].partial = evbuffer_new();
+    frame_ = evbuffer_new();
+    timer_ = evtimer_new(event_loop_, timercb, this);
+    charge_.Bind(config_.budget);
+    Arm();
+    return pair[1];
+}
+
+DatagramLink::~DatagramLink() {
+    if (timer_)
+        event_free(timer_);
+    if (end_)
+        bufferevent_free(end_);
+    if (frame_)
+        evbuffer_free(frame_);
+    for (int i = 0; i < kLanes; i++) {
+        if (lanes_[i].partial)
+            evbuffer_free(lanes_[i].partial);
+    }
+    if (listener_)
+        listener_->RemoveLink(conv_);
+    else
+        delete socket_;
+}
+
+void DatagramLink::SendSyn() {
+    SendControl(kPacketSyn);
+    socket_->Flush();
+    syn_attempts_++;
+    syn_deadline_us_ = DatagramSocket::Now() + ((int64_t)kSynIntervalUs << (syn_attempts_ - 1));
+    Arm();
+}
+
+void DatagramLink::SendControl(uint8_t type) {
+    unsigned char packet[kHeaderSize];
+    packet[0] = type;
+    PutUint64(packet + 1, conv_);
+    socket_->Send(peer_, packet, sizeof(packet));
+}
+
+void DatagramLink::SendToken(uint8_t type, const sockaddr_in& to, uint64_t token) {
+    unsigned char packet[kHeaderSize + kTokenSize];
+    packet[0] = type;
+    PutUint64(packet + 1, conv_);
+    PutUint64(packet + kHeaderSize, token);
+    socket_->Send(to, packet, sizeof(packet));
+}
+
+void DatagramLink::OnDatagram(const sockaddr_in& from, const unsigned char* data, size_t size) {
+    if (size >= kHeaderSize && GetUint64(data + 1) == conv_)
+        OnPacket(from, data, size);
+}
+
+void DatagramLink::OnPacket(const sockaddr_in& from, const unsigned char* data, size_t size) {
+    if (size < kHeaderSize || status_ == kClosing)
+        return;
+    uint8_t type = data[0];
+    data += kHeaderSize;
+    size -= kHeaderSize;
+    //the agent's socket is connected, what it gets is from the forwarder
+    if (listener_ && !SameAddress(from, peer_) && !CheckMoved(from, type, data, size))
+        return;
+    if (type == kPacketChallenge) {
+        if (!listener_ && size >= kTokenSize)
+            SendToken(kPacketResponse, peer_, GetUint64(data));
+        return;
+    }
+    if (type == kPacketResponse)
+        return;
+    if (type == kPacketClose) {
+        LOGW << "udp tunnel closed by the peer\n";
+        Shutdown(BEV_EVENT_EOF, false);
+        return;
+    }
+    if (type == kPacketSyn) {
+        SendControl(kPacketSynAck);
+        return;
+    }
+    if (status_ == kConnecting && (type == kPacketSynAck || type == kPacketData)) {
+        //data means the forwarder took the syn and its answer got lost
+        status_ = kEstablished;
+        bufferevent* tunnel = bufferevent_pair_get_partner(end_);
+        if (tunnel)
+            bufferevent_trigger_event(tunnel, BEV_EVENT_CONNECTED, BEV_TRIG_DEFER_CALLBACKS);
+    }
+    if (type == kPacketData)
+        OnData(GetUint32(data), data, size);
+    else if (type == kPacketAck)
+        OnAck(data, size);
+    Arm();
+}
+
+bool DatagramLink::CheckMoved(const sockaddr_in& from, uint8_t type, const unsigned char* data, size_t size) {
+    if (type == kPacketResponse) {
+        if (challenge_ && SameAddress(from, candidate_) && size >= kTokenSize &&
+                GetUint64(data) == challenge_) {
+            //an agent behind a rebinding nat keeps its conv
+            peer_ = from;
+            challenge_ = 0;
+            char address[INET_ADDRSTRLEN] = { 0 };
+            evutil_inet_ntop(AF_INET, &from.sin_addr, address, sizeof(address));
+            LOGI << "udp tunnel moved to " << address << ":" << ntohs(from.sin_port) << "\n";
+        }
+        return false;
+    }
+    bool known = false;
+    if (type == kPacketData && size >= 4) {
+        uint64_t pn = Expand(GetUint32(data), largest_received_);
+        uint64_t distance = pn > largest_received_ ? pn - largest_received_ : largest_received_ - pn;
+        known = distance <= kMoveWindow && !Received(pn);
+    } else if (type == kPacketAck && size >= kAckHeaderSize - kHeaderSize + 8) {
+        uint64_t largest = Expand(GetUint32(data + kAckHeaderSize - kHeaderSize), next_pn_ - 1);
+        known = in_flight_.find(largest) != in_flight_.end();
+    }
+    if (!known)
+        return false;
+    int64_t now = DatagramSocket::Now();
+    if (!challenge_ || !SameAddress(from, candidate_)) {
+        candidate_ = from;
+        while (challenge_ == 0)
+            evutil_secure_rng_get_bytes(&challenge_, sizeof(challenge_));
+        challenge_us_ = 0;
+    }
+    //asked again once an rtt passed without an answer
+    if (now - challenge_us_ >= Rto()) {
+        SendToken(kPacketChallenge, candidate_, challenge_);
+        challenge_us_ = now;
+    }
+    return true;
+}
+
+void DatagramLink::OnTunnelRead() {
+    if (status_ != kEstablished)
+        return;
+    SendPending();
+    socket_->Flush();
+    Arm();
+}
+
+void DatagramLink::Pull() {
+    evbuffer* input = bufferevent_get_input(end_);
+    size_t segment_size = SegmentBytes(config_.udp_mtu);
+    //enabling hands over what the tunnel wrote meanwhile
+    if (!(bufferevent_get_enabled(end_) & EV_READ))
+        bufferevent_enable(end_, EV_READ);
+    while (status_ == kEstablished && unsent_bytes_ < (size_t)config_.tunnel_buffer &&
+            segment_bytes_ < kMaxWindow * 2) {
+        ForwardData data(kHashTypeInvalid);
+        int ret = framing_.Decode(input, data);
+        if (ret == ForwardCodec::kNeedMore)
+            break;
+        if (ret == ForwardCodec::kFrameError) {
+            LOGE << "bad frame from the tunnel\n";
+            Shutdown(BEV_EVENT_ERROR, true);
+            break;
+        }
+        uint8_t lane = 0;
+        bool stream_op = FrameScheduler::IsStreamOp(data.op_) || data.op_ == ForwardData::kWindowUpdate;
+        if (!ordered_ && stream_op && data.to_ != (HashType)kHashTypeInvalid)
+            lane = 1 + data.to_ % (kLanes - 1);
+        //the accept or commit is the last frame in the old version
+        int version = 0;
+        HelloInfo hello;
+        if (data.op_ == ForwardData::kHello && ForwardCodec::ParseHello(data, &hello) &&
+                (hello.kind == ForwardCodec::kHelloAccept || hello.kind == ForwardCodec::kHelloCommit))
+            version = std::max(hello.version, (int)ForwardCodec::kVersion1);
+        framing_.Encode(data, frame_);
+        Lane& target = lanes_[lane];
+        for (size_t left = evbuffer_get_length(frame_); left > 0; left = evbuffer_get_length(frame_)) {
+            Segment& segment = segments_.insert(segments_.end(),
+                                                std::make_pair(next_segment_++, Segment()))->second;
+            size_t size = std::min(left, segment_size);
+            segment.lane = lane;
+            segment.seq = (uint32_t)target.next_send++;
+            segment.flags = size == left ? kFlagFrameEnd : 0;
+            segment.payload.resize(size);
+            evbuffer_remove(frame_, &segment.payload[0], size);
+            segment_bytes_ += size;
+            unsent_bytes_ += size;
+        }
+        if (version) {
+            framing_.SetRecvVersion(version);
+            framing_.SetSendVersion(version);
+            switch_segment_ = next_segment_ - 1;
+        }
+    }
+    //not a read watermark, that could cut a frame longer than it in two.
+    //the tunnel's output backs up instead and its scheduler holds on
+    if (status_ == kEstablished && (unsent_bytes_ >= (size_t)config_.tunnel_buffer ||
+            segment_bytes_ >= kMaxWindow * 2))
+        bufferevent_disable(end_, EV_READ);
+    ChargeBudget();
+}
+
+void DatagramLink::SendPending() {
+    int64_t now = DatagramSocket::Now();
+    MetricsBlock* metrics = Metrics::Local();
+    while (status_ == kEstablished && bytes_in_flight_ + config_.udp_mtu <= cwnd_) {
+        std::map<uint64_t, Segment>::iterator segment;
+        uint64_t id;
+        if (!lost_.empty()) {
+            id = lost_.front();
+            lost_.pop_front();
+            segment = segments_.find(id);
+            //acked through an earlier copy meanwhile
+            if (segment == segments_.end())
+                continue;
+            metrics->datagram_retransmits.Add(1);
+        } else {
+            if (send_cursor_ == next_segment_)
+                Pull();
+            if (send_cursor_ == next_segment_)
+                break;
+            id = send_cursor_++;
+            segment = segments_.find(id);
+            unsent_bytes_ -= segment->second.payload.size();
+        }
+        Transmit(id, segment->second, now);
+    }
+}
+
+void DatagramLink::Transmit(uint64_t id, Segment& segment, int64_t now) {
+    unsigned char packet[kMaxMtu];
+    uint64_t pn = next_pn_++;
+    packet[0] = kPacketData;
+    PutUint64(packet + 1, conv_);
+    PutUint32(packet + kHeaderSize, (uint32_t)pn);
+    packet[kHeaderSize + 4] = segment.lane;
+    packet[kHeaderSize + 5] = segment.flags;
+    PutUint32(packet + kHeaderSize + 6, segment.seq);
+    memcpy(packet + kDataHeaderSize, segment.payload.data(), segment.payload.size());
+    size_t size = kDataHeaderSize + segment.payload.size();
+    socket_->Send(peer_, packet, size);
+    SentPacket& sent = in_flight_.insert(in_flight_.end(), std::make_pair(pn, SentPacket()))->second;
+    sent.segment = id;
+    sent.sent_us = now;
+    sent.bytes = size;
+    bytes_in_flight_ += size;
+}
+
+void DatagramLink::OnData(uint32_t wire_pn, const unsigned char* data, size_t size) {
+    if (size < kDataHeaderSize - kHeaderSize)
+        return;
+    int64_t now = DatagramSocket::Now();
+    uint64_t pn = Expand(wire_pn, largest_received_);
+    uint8_t index = data[4];
+    uint8_t flags = data[5];
+    uint32_t wire_seq = GetUint32(data + 6);
+    data += kDataHeaderSize - kHeaderSize;
+    size -= kDataHeaderSize - kHeaderSize;
+    if (index >= kLanes)
+        return;
+    bool in_order = pn == largest_received_ + 1;
+    if (!RecordReceived(pn))
+        return;
+    if (pn > largest_received_) {
+        largest_received_ = pn;
+        largest_received_us_ = now;
+    }
+    Lane& lane = lanes_[index];
+    uint64_t seq = Expand(wire_seq, lane.next_receive);
+    if (seq == lane.next_receive) {
+        Deliver(lane, data, size, flags);
+        lane.next_receive++;
+        //whatever waited behind the gap follows
+        while (!lane.held.empty() && lane.held.begin()->first == lane.next_receive) {
+            Segment& held = lane.held.begin()->second;
+            Deliver(lane, (const unsigned char*)held.payload.data(), held.payload.size(), held.flags);
+            held_bytes_ -= held.payload.size();
+            lane.held.erase(lane.held.begin());
+            lane.next_receive++;
+        }
+        ChargeBudget();
+    } else if (seq > lane.next_receive && lane.held.find(seq) == lane.held.end()) {
+        Segment& held = lane.held[seq];
+        held.flags = flags;
+        held.payload.assign((const char*)data, size);
+        held_bytes_ += size;
+        ChargeBudget();
+    }
+    //a gap is reported at once so the sender sees the loss early
+    unacked_packets_++;
+    if (!in_order || unacked_packets_ >= kAckEvery)
+        SendAck();
+    else if (!ack_deadline_us_)
+        ack_deadline_us_ = now + kAckDelayUs;
+}
+
+bool DatagramLink::RecordReceived(uint64_t pn) {
+    std::map<uint64_t, uint64_t>::iterator next = received_.upper_bound(pn);
+    if (next != received_.begin()) {
+        std::map<uint64_t, uint64_t>::iterator prev = next;
+        --prev;
+        if (pn <= prev->second)
+            return false;
+        if (pn == prev->second + 1) {
+            prev->second = pn;
+            if (next != received_.end() && next->first == pn + 1) {
+                prev->second = next->second;
+                received_.erase(next);
+            }
+            return true;
+        }
+    }
+    uint64_t high = pn;
+    if (next != received_.end() && next->first == pn + 1) {
+        high = next->second;
+        received_.erase(next);
+    }
+    received_[pn] = high;
+    if (received_.size() > kAckRanges)
+        received_.erase(received_.begin());
+    return true;
+}
+
+bool DatagramLink::Received(uint64_t pn) {
+    std::map<uint64_t, uint64_t>::iterator next = received_.upper_bound(pn);
+    if (next == received_.begin())
+        return false;
+    --next;
+    return pn <= next->second;
+}
+
+void DatagramLink::Deliver(Lane& lane, const unsigned char* data, size_t size, uint8_t flags) {
+    evbuffer_add(lane.partial, data, size);
+    //the tunnel only ever sees whole frames, in the order of their lane
+    if (flags & kFlagFrameEnd)
+        bufferevent_write_buffer(end_, lane.partial);
+}
+
+void DatagramLink::SendAck() {
+    unsigned char packet[kAckHeaderSize + kAckRanges * 8];
+    int64_t delay = DatagramSocket::Now() - largest_received_us_;
+    packet[0] = kPacketAck;
+    PutUint64(packet + 1, conv_);
+    PutUint32(packet + kHeaderSize, (uint32_t)std::max(delay, (int64_t)0));
+    size_t count = 0;
+    for (std::map<uint64_t, uint64_t>::reverse_iterator iter = received_.rbegin();
+            iter != received_.rend() && count < kAckRanges; ++iter, count++) {
+        PutUint32(packet + kAckHeaderSize + count * 8, (uint32_t)iter->second);
+        PutUint32(packet + kAckHeaderSize + count * 8 + 4, (uint32_t)iter->first);
+    }
+    packet[kHeaderSize + 4] = (unsigned char)count;
+    socket_->Send(peer_, packet, kAckHeaderSize + count * 8);
+    unacked_packets_ = 0;
+    ack_deadline_us_ = 0;
+}
+
+void DatagramLink::OnAck(const unsigned char* data, size_t size) {
+    if (size < kAckHeaderSize - kHeaderSize)
+        return;
+    int64_t now = DatagramSocket::Now();
+    int64_t ack_delay = GetUint32(data);
+    size_t count = data[4];
+    data += kAckHeaderSize - kHeaderSize;
+    size -= kAckHeaderSize - kHeaderSize;
+    if (count == 0 || size < count * 8)
+        return;
+    size_t acked_bytes = 0;
+    uint64_t largest_newly = 0;
+    int64_t rtt_sample = 0;
+    uint64_t newest = next_pn_ - 1;
+    uint64_t largest = Expand(GetUint32(data), newest);
+    for (size_t i = 0; i < count; i++) {
+        uint64_t high = Expand(GetUint32(data + i * 8), newest);
+        uint64_t low = Expand(GetUint32(data + i * 8 + 4), newest);
+        if (low > high || high > newest)
+            continue;
+        std::map<uint64_t, SentPacket>::iterator iter = in_flight_.lower_bound(low);
+        while (iter != in_flight_.end() && iter->first <= high) {
+            if (iter->first == largest)
+                rtt_sample = now - iter->second.sent_us;
+            acked_bytes += iter->second.bytes;
+            bytes_in_flight_ -= iter->second.bytes;
+            largest_newly = std::max(largest_newly, iter->first);
+            std::map<uint64_t, Segment>::iterator segment = segments_.find(iter->second.segment);
+            if (segment != segments_.end()) {
+                segment_bytes_ -= segment->second.payload.size();
+                segments_.erase(segment);
+            }
+            in_flight_.erase(iter++);
+        }
+        std::set<uint64_t>::iterator lost = declared_lost_.lower_bound(low);
+        while (lost != declared_lost_.end() && *lost <= high) {
+            OnSpuriousLoss(*lost, largest);
+            declared_lost_.erase(lost++);
+        }
+    }
+    if (largest <= newest && largest > largest_acked_)
+        largest_acked_ = largest;
+    if (rtt_sample > 0)
+        UpdateRtt(rtt_sample, ack_delay);
+    if (acked_bytes > 0) {
+        backoff_ = 0;
+        progress_us_ = now;
+        //no growth for what was sent before the last cut
+        if (largest_newly > recovery_pn_) {
+            if (cwnd_ < ssthresh_)
+                cwnd_ += acked_bytes;
+            else
+                cwnd_ += config_.udp_mtu * acked_bytes / cwnd_;
+            cwnd_ = std::min(cwnd_, (size_t)kMaxWindow);
+        }
+    }
+    DetectLoss(now);
+    if (ordered_ && switch_segment_ &&
+            (segments_.empty() || segments_.begin()->first > switch_segment_)) {
+        //the peer's tunnel got the switch, streams may overtake each other
+        ordered_ = false;
+    }
+    SendPending();
+    ChargeBudget();
+}
+
+void DatagramLink::DetectLoss(int64_t now) {
+    loss_deadline_us_ = 0;
+    if (largest_acked_ == 0)
+        return;
+    int64_t window = std::max(srtt_us_, latest_rtt_us_) * (8 + reorder_eighths_) / 8;
+    window = std::max(window, (int64_t)1000);
+    std::map<uint64_t, SentPacket>::iterator iter = in_flight_.begin();
+    while (iter != in_flight_.end() && iter->first < largest_acked_) {
+        if (largest_acked_ - iter->first >= reorder_packets_ || iter->second.sent_us + window <= now) {
+            OnLost(iter++);
+            continue;
+        }
+        int64_t deadline = iter->second.sent_us + window;
+        if (!loss_deadline_us_ || deadline < loss_deadline_us_)
+            loss_deadline_us_ = deadline;
+        ++iter;
+    }
+}
+
+void DatagramLink::OnLost(std::map<uint64_t, SentPacket>::iterator packet) {
+    bytes_in_flight_ -= packet->second.bytes;
+    if (segments_.find(packet->second.segment) != segments_.end())
+        lost_.push_back(packet->second.segment);
+    declared_lost_.insert(packet->first);
+    if (declared_lost_.size() > kLostMemory)
+        declared_lost_.erase(declared_lost_.begin());
+    //one cut per window, the first loss past the last cut starts a new one
+    if (packet->first > recovery_pn_) {
+        cut_pn_ = packet->first;
+        undo_cwnd_ = cwnd_;
+        undo_ssthresh_ = ssthresh_;
+        recovery_pn_ = next_pn_ - 1;
+        ssthresh_ = std::max(cwnd_ / 2, (size_t)kMinPackets * config_.udp_mtu);
+        cwnd_ = ssthresh_;
+    }
+    in_flight_.erase(packet);
+}
+
+void DatagramLink::OnSpuriousLoss(uint64_t pn, uint64_t largest) {
+    if (largest > pn)
+        reorder_packets_ = std::max(reorder_packets_, largest - pn + 1);
+    reorder_packets_ = std::min(reorder_packets_, (uint64_t)kMaxReorderPackets);
+    reorder_eighths_ = std::min(reorder_eighths_ * 2, (int)kMaxReorderEighths);
+    if (pn == cut_pn_ && undo_cwnd_ > cwnd_) {
+        cwnd_ = undo_cwnd_;
+        ssthresh_ = undo_ssthresh_;
+        cut_pn_ = 0;
+    }
+}
+
+void DatagramLink::OnRetransmitTimeout() {
+    if (++backoff_ > kMaxBackoff) {
+        LOGW << "udp tunnel peer stopped acking\n";
+        Shutdown(BEV_EVENT_ERROR, true);
+        return;
+    }
+    //everything out there is sent again, the window starts over
+    for (std::map<uint64_t, SentPacket>::iterator iter = in_flight_.begin(); iter != in_flight_.end(); ++iter) {
+        if (segments_.find(iter->second.segment) != segments_.end())
+            lost_.push_back(iter->second.segment);
+    }
+    in_flight_.clear();
+    bytes_in_flight_ = 0;
+    loss_deadline_us_ = 0;
+    //a timeout is not undone
+    cut_pn_ = 0;
+    recovery_pn_ = next_pn_ - 1;
+    ssthresh_ = std::max(cwnd_ / 2, (size_t)kMinPackets * config_.udp_mtu);
+    cwnd_ = kMinPackets * config_.udp_mtu;
+}
+
+int64_t DatagramLink::Rto() {
+    if (srtt_us_ == 0)
+        return kInitialRtoUs;
+    int64_t rto = srtt_us_ + std::max(rttvar_us_ * 4, (int64_t)1000) + kAckDelayUs;
+    return std::min(std::max(rto, (int64_t)kMinRtoUs), (int64_t)kMaxRtoUs);
+}
+
+int64_t DatagramLink::RetransmitDeadline() {
+    int64_t start = std::max(in_flight_.begin()->second.sent_us, progress_us_);
+    return start + (Rto() << backoff_);
+}
+
+void DatagramLink::UpdateRtt(int64_t sample_us, int64_t ack_delay_us) {
+    latest_rtt_us_ = sample_us;
+    //the time the peer sat on the ack is not path delay
+    if (sample_us > ack_delay_us)
+        sample_us -= ack_delay_us;
+    if (srtt_us_ == 0) {
+        srtt_us_ = sample_us;
+        rttvar_us_ = sample_us / 2;
+        return;
+    }
+    int64_t error = srtt_us_ > sample_us ? srtt_us_ - sample_us : sample_us - srtt_us_;
+    rttvar_us_ = (rttvar_us_ * 3 + error) / 4;
+    srtt_us_ = (srtt_us_ * 7 + sample_us) / 8;
+}
+
+void DatagramLink::OnTimer() {
+    if (status_ == kClosing) {
+        delete this;
+        return;
+    }
+    if (!bufferevent_pair_get_partner(end_)) {
+        //the tunnel let go of its end
+        Shutdown(0, true);
+        return;
+    }
+    int64_t now = DatagramSocket::Now();
+    if (status_ == kConnecting) {
+        if (now < syn_deadline_us_) {
+            Arm();
+            return;
+        }
+        if (syn_attempts_ >= kSynAttempts) {
+            LOGW << "forwarder did not answer the udp tunnel\n";
+            Shutdown(BEV_EVENT_ERROR, false);
+            return;
+        }
+        SendSyn();
+        return;
+    }
+    if (ack_deadline_us_ && now >= ack_deadline_us_)
+        SendAck();
+    if (loss_deadline_us_ && now >= loss_deadline_us_)
+        DetectLoss(now);
+    if (!in_flight_.empty() && now >= RetransmitDeadline()) {
+        OnRetransmitTimeout();
+        if (status_ == kClosing)
+            return;
+    }
+    SendPending();
+    socket_->Flush();
+    Arm();
+}
+
+void DatagramLink::Arm() {
+    if (status_ == kClosing)
+        return;
+    int64_t now = DatagramSocket::Now();
+    int64_t deadline = now + kTickUs;
+    if (status_ == kConnecting)
+        deadline = std::min(deadline, syn_deadline_us_);
+    if (ack_deadline_us_)
+        deadline = std::min(deadline, ack_deadline_us_);
+    if (loss_deadline_us_)
+        deadline = std::min(deadline, loss_deadline_us_);
+    if (!in_flight_.empty())
+        deadline = std::min(deadline, RetransmitDeadline());
+    int64_t delay = std::max(deadline - now, (int64_t)0);
+    timeval timeout = { (long)(delay / 1000000), (long)(delay % 1000000) };
+    event_add(timer_, &timeout);
+}
+
+void DatagramLink::ChargeBudget() {
+    charge_.Update(segment_bytes_ + held_bytes_);
+}
+
+void DatagramLink::Shutdown(short what, bool notify_peer) {
+    if (status_ == kClosing)
+        return;
+    status_ = kClosing;
+    if (notify_peer)
+        SendControl(kPacketClose);
+    socket_->Flush();
+    bufferevent* tunnel = bufferevent_pair_get_partner(end_);
+    if (tunnel && what)
+        bufferevent_trigger_event(tunnel, what, BEV_TRIG_DEFER_CALLBACKS);
+    //the socket may be delivering to this link right now
+    event_active(timer_, EV_TIMEOUT, 0);
+}
+
+//////////////////////////////////////////////
+DatagramListener::DatagramListener(event_base* event_loop,
+                                   IDatagramTunnelNotify* notify,
+                                   const TunnelConfig& config):
+    event_loop_(event_loop),
+    notify_(notify),
+    config_(config),
+    socket_(NULL) {
+}
+
+DatagramListener::~DatagramListener() {
+    std::map<uint64_t, DatagramLink*> links;
+    links.swap(links_);
+    for (std::map<uint64_t, DatagramLink*>::iterator iter = links.begin(); iter != links.end(); ++iter) {
+        DatagramLink* link = iter->second;
+        link->listener_ = NULL;
+        link->socket_ = NULL;
+        delete link;
+    }
+    delete socket_;
+}
+
+bool DatagramListener::Init(const std::string& ip, int port, bool reuse_port, int workers) {
+    socket_ = new DatagramSocket(event_loop_, this, config_.udp_mtu);
+    if (!socket_->Bind(ip, port, reuse_port))
+        return false;
+    //the conv goes out low byte first, right behind the type
+    if (workers > 1 && !socket_->Steer(1, workers))
+        LOGW << "udp tunnels are spread over workers by address only\n";
+    socket_->SetSimulator(config_.sim_loss_percent, config_.sim_delay_ms, config_.sim_jitter_ms);
+    return true;
+}
+
+void DatagramListener::OnDatagram(const sockaddr_in& from, const unsigned char* data, size_t size) {
+    if (size < kHeaderSize)
+        return;
+    uint64_t conv = GetUint64(data + 1);
+    std::map<uint64_t, DatagramLink*>::iterator iter = links_.find(conv);
+    if (iter != links_.end()) {
+        iter->second->OnPacket(from, data, size);
+        return;
+    }
+    if (data[0] == kPacketSyn && conv != 0) {
+        DatagramLink* link = new DatagramLink(event_loop_, socket_, this, conv, from, config_);
+        bufferevent* bev = link->Init();
+        if (!bev) {
+            link->listener_ = NULL;
+            link->socket_ = NULL;
+            delete link;
+            return;
+        }
+        link->status_ = DatagramLink::kEstablished;
+        links_[conv] = link;
+        link->OnPacket(from, data, size);
+        char address[INET_ADDRSTRLEN] = { 0 };
+        evutil_inet_ntop(AF_INET, &from.sin_addr, address, sizeof(address));
+        LOGI << "udp tunnel from " << address << ":" << ntohs(from.sin_port) << "\n";
+        notify_->OnDatagramTunnel(bev);
+        return;
+    }
+    //a link this side forgot, after a restart say, tell the agent to dial again
+    if (data[0] != kPacketClose) {
+        unsigned char packet[kHeaderSize];
+        packet[0] = kPacketClose;
+        PutUint64(packet + 1, conv);
+        socket_->Send(from, packet, sizeof(packet));
+    }
+}
+
+void DatagramListener::RemoveLink(uint64_t conv) {
+    links_.erase(conv);
+}
@@ -0,0 +1,336 @@
+#ifndef _DATAGRAM_LINK_H_
+#define _DATAGRAM_LINK_H_
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "forward_codec.h"
+#include "tunnel_config.h"
+#include "memory_budget.h"
+#include "datagram_socket.h"
+
+class DatagramListener;
+
+//reliable, congestion controlled tunnel transport over udp. the tunnel
+//keeps talking to a bufferevent: the link holds one end of a bufferevent
+//pair and the tunnel the other. frames the tunnel writes are cut into
+//datagrams on one of kLanes ordered lanes picked by stream id, so a lost
+//datagram only holds back the streams of its lane while the others keep
+//being delivered, each frame whole.
+//
+//packet: type(1) conv(8), then by type
+//  syn, syn ack, close: nothing
+//  data: pn(4) lane(1) flags(1) seq(4) payload
+//  ack: delay_us(4) count(1), count times high(4) low(4), newest first
+//  challenge, response: token(8)
+//pn numbers every datagram, a retransmission gets a new one; seq numbers
+//the segments of one lane. frames stay on lane 0 until the peer acked the
+//hello that switched the framing version, so its tunnel reads the switch
+//ahead of anything sent behind it.
+//a datagram is lost once three newer ones or 9/8 rtt worth of newer ones
+//were acked, or when the retransmission timeout fires; the window
+//follows NewReno. an ack for a datagram already called lost means the
+//path reorders: both thresholds widen and a cut it caused is undone.
+//the conv is all the forwarder knows an agent by, 56 of its bits are
+//random. a datagram from another address than the agent's is only taken
+//when it shows it knows the link: a new pn close to the newest one, or an
+//ack of a datagram in flight. the link moves there once the address also
+//answered a challenge; a close from anywhere else is ignored
+class DatagramLink : public IDatagramNotify {
+public:
+    enum {
+        kLanes = 64
+    };
+
+    //agent: dials the forwarder over its own socket. the returned end
+    //reports BEV_EVENT_CONNECTED once the forwarder answered. slot is the
+    //low byte of the conv, forwarder workers take tunnels by it
+    static bufferevent* Connect(event_base* event_loop,
+                                const std::string& ip,
+                                int port,
+                                uint8_t slot,
+                                const TunnelConfig& config);
+
+    DatagramLink(event_base* event_loop,
+                 DatagramSocket* socket,
+                 DatagramListener* listener,
+                 uint64_t conv,
+                 const sockaddr_in& peer,
+                 const TunnelConfig& config);
+
+    //the tunnel's end of the pair, NULL on failure
+    bufferevent* Init();
+
+    //every datagram carrying this link's conv, from wherever
+    void OnPacket(const sockaddr_in& from, const unsigned char* data, size_t size);
+
+    //agent's own socket
+    virtual void OnDatagram(const sockaddr_in& from, const unsigned char* data, size_t size);
+
+    //frames the tunnel wrote
+    void OnTunnelRead();
+
+    void OnTimer();
+
+    static size_t SegmentBytes(size_t mtu);
+
+private:
+    struct Segment {
+        uint8_t lane;
+        uint8_t flags;
+        uint32_t seq;
+        std::string payload;
+    };
+
+    struct SentPacket {
+        uint64_t segment;
+        int64_t sent_us;
+        size_t bytes;
+    };
+
+    struct Lane {
+        Lane():
+            next_send(0),
+            next_receive(0),
+            partial(NULL) {
+        }
+        uint64_t next_send;
+        uint64_t next_receive;
+        //segments that arrived ahead of next_receive
+        std::map<uint64_t, Segment> held;
+        //head of the frame being put together
+        evbuffer* partial;
+    };
+
+    enum {
+        kConnecting = 0,
+        kEstablished,
+        kClosing
+    };
+
+    ~DatagramLink();
+
+    void SendSyn();
+
+    void SendControl(uint8_t type);
+
+    void SendToken(uint8_t type, const sockaddr_in& to, uint64_t token);
+
+    //a datagram from another address than peer_, true when it proves to
+    //come from the agent and is taken. challenges that address
+    bool CheckMoved(const sockaddr_in& from, uint8_t type, const unsigned char* data, size_t size);
+
+    //frames from the pair into segments, while the send queue has room
+    void Pull();
+
+    //new and lost segments, as far as the window allows
+    void SendPending();
+
+    void Transmit(uint64_t id, Segment& segment, int64_t now);
+
+    void OnData(uint32_t wire_pn, const unsigned char* data, size_t size);
+
+    //false for a datagram seen before
+    bool RecordReceived(uint64_t pn);
+
+    bool Received(uint64_t pn);
+
+    void OnAck(const unsigned char* data, size_t size);
+
+    void Deliver(Lane& lane, const unsigned char* data, size_t size, uint8_t flags);
+
+    void SendAck();
+
+    void DetectLoss(int64_t now);
+
+    void OnLost(std::map<uint64_t, SentPacket>::iterator packet);
+
+    //pn was called lost and then acked, largest is the newest acked
+    void OnSpuriousLoss(uint64_t pn, uint64_t largest);
+
+    void OnRetransmitTimeout();
+
+    int64_t Rto();
+
+    //when the oldest datagram out there is given up on
+    int64_t RetransmitDeadline();
+
+    void UpdateRtt(int64_t sample_us, int64_t ack_delay_us);
+
+    //wakes OnTimer at the earliest thing due
+    void Arm();
+
+    void ChargeBudget();
+
+    //tells the tunnel with what, the peer with a close when asked to, and
+    //lets the timer free the link
+    void Shutdown(short what, bool notify_peer);
+
+    event_base* event_loop_;
+
+    DatagramSocket* socket_;
+
+    //NULL on the agent, which owns socket_
+    DatagramListener* listener_;
+
+    uint64_t conv_;
+
+    sockaddr_in peer_;
+
+    //address the agent seems to have moved to, and the token it must
+    //echo before the link follows. 0 while none is asked for
+    sockaddr_in candidate_;
+
+    uint64_t challenge_;
+
+    int64_t challenge_us_;
+
+    TunnelConfig config_;
+
+    int status_;
+
+    //the tunnel holds the partner
+    bufferevent* end_;
+
+    event* timer_;
+
+    //framing of what the tunnel writes, follows its version switch
+    ForwardCodec framing_;
+
+    //one frame on its way into segments
+    evbuffer* frame_;
+
+    //all frames on lane 0 until the switching hello was acked
+    bool ordered_;
+
+    //last segment of the hello that switched the framing, 0 for none yet
+    uint64_t switch_segment_;
+
+    Lane lanes_[kLanes];
+
+    //unacked segments by id, the ones from send_cursor_ on were never sent
+    std::map<uint64_t, Segment> segments_;
+
+    uint64_t next_segment_;
+
+    uint64_t send_cursor_;
+
+    size_t segment_bytes_;
+
+    size_t unsent_bytes_;
+
+    //segments of lost datagrams, ahead of new ones
+    std::deque<uint64_t> lost_;
+
+    std::map<uint64_t, SentPacket> in_flight_;
+
+    uint64_t next_pn_;
+
+    uint64_t largest_acked_;
+
+    size_t bytes_in_flight_;
+
+    size_t cwnd_;
+
+    size_t ssthresh_;
+
+    //losses of datagrams up to this one belong to the last cut
+    uint64_t recovery_pn_;
+
+    int64_t srtt_us_;
+
+    int64_t rttvar_us_;
+
+    int64_t latest_rtt_us_;
+
+    int backoff_;
+
+    //last ack for new data, restarts the retransmission timer as in tcp
+    int64_t progress_us_;
+
+    int64_t loss_deadline_us_;
+
+    //newer datagrams acked before an older one is lost, and by how many
+    //eighths of an rtt past one rtt it may trail them
+    uint64_t reorder_packets_;
+
+    int reorder_eighths_;
+
+    //called lost and not acked since
+    std::set<uint64_t> declared_lost_;
+
+    //the loss that started the last cut, and the window from before it
+    uint64_t cut_pn_;
+
+    size_t undo_cwnd_;
+
+    size_t undo_ssthresh_;
+
+    //datagrams received, low to high, the newest ones are acked
+    std::map<uint64_t, uint64_t> received_;
+
+    uint64_t largest_received_;
+
+    int64_t largest_received_us_;
+
+    int unacked_packets_;
+
+    int64_t ack_deadline_us_;
+
+    int syn_attempts_;
+
+    int64_t syn_deadline_us_;
+
+    //segments kept for sending and the ones held for reordering
+    BudgetCharge charge_;
+
+    size_t held_bytes_;
+
+    friend class DatagramListener;
+};
+
+class IDatagramTunnelNotify {
+public:
+    virtual ~IDatagramTunnelNotify() {};
+    //a new agent tunnel arrived, bev is its end of the link
+    virtual void OnDatagramTunnel(bufferevent* bev) = 0;
+};
+
+//forwarder end: one udp socket, links told apart by the conv the agent
+//picked. an agent that moves to another address keeps its link
+class DatagramListener : public IDatagramNotify {
+public:
+    DatagramListener(event_base* event_loop,
+                     IDatagramTunnelNotify* notify,
+                     const TunnelConfig& config);
+
+    ~DatagramListener();
+
+    //workers above 1 share the port, each takes the convs whose low byte
+    //is its index modulo workers
+    bool Init(const std::string& ip, int port, bool reuse_port, int workers);
+
+    virtual void OnDatagram(const sockaddr_in& from, const unsigned char* data, size_t size);
+
+    void RemoveLink(uint64_t conv);
+
+private:
+    event_base* event_loop_;
+
+    IDatagramTunnelNotify* notify_;
+
+    TunnelConfig config_;
+
+    DatagramSocket* socket_;
+
+    std::map<uint64_t, DatagramLink*> links_;
+};
+
+#endif
@@ -0,0 +1,313 @@
+#include "datagram_socket.h"
+
+#include <string.h>
+#include <errno.h>
+#include <chrono>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+
+#include "log.hpp"
+#include "metrics.h"
+
+enum {
+    //datagrams per sendmmsg/recvmmsg call
+    kBatch = 64,
+    //read batches per wakeup before the socket yields to the loop
+    kMaxRounds = 8,
+    //a window of datagrams in flight fits the kernel buffers
+    kSocketBuffer = 4 * 1024 * 1024
+};
+
+static void readcb(evutil_socket_t fd, short what, void *ctx) {
+    DatagramSocket* pSocket = static_cast<DatagramSocket*>(ctx);
+    pSocket->OnReadable();
+}
+
+static void writecb(evutil_socket_t fd, short what, void *ctx) {
+    DatagramSocket* pSocket = static_cast<DatagramSocket*>(ctx);
+    pSocket->OnWritable();
+}
+
+static void releasecb(evutil_socket_t fd, short what, void *ctx) {
+    DatagramSocket* pSocket = static_cast<DatagramSocket*>(ctx);
+    pSocket->OnRelease();
+}
+
+static bool WouldBlock(int error) {
+#ifdef _WIN32
+    return error == WSAEWOULDBLOCK;
+#else
+    return error == EAGAIN || error == EWOULDBLOCK || error == EINTR;
+#endif
+}
+
+static bool ToAddress(const std::string& ip, int port, sockaddr_in* sin) {
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    if (ip.empty())
+        return true;
+    return inet_pton(AF_INET, ip.c_str(), &sin->sin_addr.s_addr) == 1;
+}
+
+LinkSimulator::LinkSimulator(double loss_percent, int delay_ms, int jitter_ms):
+    loss_percent_(loss_percent),
+    delay_us_((int64_t)delay_ms * 1000),
+    jitter_us_((int64_t)jitter_ms * 1000) {
+    uint32_t seed;
+    evutil_secure_rng_get_bytes(&seed, sizeof(seed));
+    random_.seed(seed);
+}
+
+bool LinkSimulator::Pass(int64_t* delay_us) {
+    if (loss_percent_ > 0 &&
+            std::uniform_real_distribution<double>(0, 100)(random_) < loss_percent_)
+        return false;
+    *delay_us = delay_us_;
+    if (jitter_us_ > 0)
+        *delay_us += std::uniform_int_distribution<int64_t>(0, jitter_us_)(random_);
+    return true;
+}
+
+DatagramSocket::DatagramSocket(event_base* event_loop, IDatagramNotify* notify, size_t mtu):
+    event_loop_(event_loop),
+    notify_(notify),
+    mtu_(mtu),
+    fd_(-1),
+    connected_(false),
+    read_event_(NULL),
+    write_event_(NULL),
+    receive_buffer_(kBatch * mtu, '\0'),
+    simulator_(NULL),
+    release_event_(NULL) {
+}
+
+DatagramSocket::~DatagramSocket() {
+    if (read_event_)
+        event_free(read_event_);
+    if (write_event_)
+        event_free(write_event_);
+    if (release_event_)
+        event_free(release_event_);
+    if (fd_ >= 0)
+        evutil_closesocket(fd_);
+    delete simulator_;
+}
+
+bool DatagramSocket::Open() {
+    fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd_ < 0) {
+        LOGE << "Could not create a udp socket!\n";
+        return false;
+    }
+    evutil_make_socket_nonblocking(fd_);
+    evutil_make_socket_closeonexec(fd_);
+    //capped by the kernel's rmem_max and wmem_max, best effort
+    int size = kSocketBuffer;
+    setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, (const char*)&size, sizeof(size));
+    setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, (const char*)&size, sizeof(size));
+    read_event_ = event_new(event_loop_, fd_, EV_READ | EV_PERSIST, readcb, this);
+    write_event_ = event_new(event_loop_, fd_, EV_WRITE, writecb, this);
+    event_add(read_event_, NULL);
+    return true;
+}
+
+bool DatagramSocket::Bind(const std::string& ip, int port, bool reuse_port) {
+    sockaddr_in sin;
+    if (!ToAddress(ip, port, &sin) || !Open())
+        return false;
+    evutil_make_listen_socket_reuseable(fd_);
+    if (reuse_port)
+        evutil_make_listen_socket_reuseable_port(fd_);
+    if (bind(fd_, (sockaddr*)&sin, sizeof(sin)) != 0) {
+        LOGE << "Could not bind udp port " << port << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool DatagramSocket::Steer(uint32_t offset, int groups) {
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    //skb data starts at the udp payload; a datagram too short to load
+    //from goes to the first socket
+    sock_filter code[] = {
+        { BPF_LD | BPF_B | BPF_ABS, 0, 0, offset },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)groups },
+        { BPF_RET | BPF_A, 0, 0, 0 }
+    };
+    sock_fprog program = { (unsigned short)(sizeof(code) / sizeof(code[0])), code };
+    return setsockopt(fd_, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == 0;
+#else
+    return false;
+#endif
+}
+
+bool DatagramSocket::Connect(const std::string& ip, int port) {
+    sockaddr_in sin;
+    if (!ToAddress(ip, port, &sin) || !Open())
+        return false;
+    if (connect(fd_, (sockaddr*)&sin, sizeof(sin)) != 0) {
+        LOGE << "Could not connect udp socket to " << ip << ":" << port << "\n";
+        return false;
+    }
+    connected_ = true;
+    return true;
+}
+
+void DatagramSocket::SetSimulator(double loss_percent, int delay_ms, int jitter_ms) {
+    delete simulator_;
+    simulator_ = new LinkSimulator(loss_percent, delay_ms, jitter_ms);
+    if (!simulator_->Active()) {
+        delete simulator_;
+        simulator_ = NULL;
+        return;
+    }
+    if (!release_event_)
+        release_event_ = event_new(event_loop_, -1, 0, releasecb, this);
+    LOGI << "udp simulator: loss " << loss_percent << "% delay " << delay_ms
+         << " ms jitter " << jitter_ms << " ms\n";
+}
+
+void DatagramSocket::Send(const sockaddr_in& to, const unsigned char* data, size_t size) {
+    Datagram datagram;
+    datagram.to = to;
+    datagram.data.assign((const char*)data, size);
+    int64_t delay = 0;
+    if (simulator_ && !simulator_->Pass(&delay)) {
+        Metrics::Local()->datagram_sim_drops.Add(1);
+        return;
+    }
+    if (delay == 0) {
+        Queue(datagram);
+        return;
+    }
+    int64_t due = Now() + delay;
+    bool first = held_.empty() || due < held_.begin()->first;
+    held_.insert(std::make_pair(due, std::move(datagram)));
+    if (first) {
+        timeval timeout = { (long)(delay / 1000000), (long)(delay % 1000000) };
+        event_add(release_event_, &timeout);
+    }
+}
+
+void DatagramSocket::Queue(Datagram& datagram) {
+    queue_.push_back(std::move(datagram));
+    if (queue_.size() >= kBatch)
+        Flush();
+}
+
+void DatagramSocket::OnRelease() {
+    int64_t now = Now();
+    while (!held_.empty() && held_.begin()->first <= now) {
+        Queue(held_.begin()->second);
+        held_.erase(held_.begin());
+    }
+    Flush();
+    if (!held_.empty()) {
+        int64_t delay = held_.begin()->first - now;
+        timeval timeout = { (long)(delay / 1000000), (long)(delay % 1000000) };
+        event_add(release_event_, &timeout);
+    }
+}
+
+void DatagramSocket::Flush() {
+    //a queue waiting for EV_WRITE goes out from there, in order
+    if (queue_.empty() || event_pending(write_event_, EV_WRITE, NULL))
+        return;
+    MetricsBlock* metrics = Metrics::Local();
+    while (!queue_.empty()) {
+#ifdef __linux__
+        mmsghdr messages[kBatch];
+        iovec iovs[kBatch];
+        size_t count = 0;
+        memset(messages, 0, sizeof(messages));
+        for (auto iter = queue_.begin(); iter != queue_.end() && count < kBatch; ++iter, count++) {
+            iovs[count].iov_base = &iter->data[0];
+            iovs[count].iov_len = iter->data.size();
+            messages[count].msg_hdr.msg_iov = &iovs[count];
+            messages[count].msg_hdr.msg_iovlen = 1;
+            if (!connected_) {
+                messages[count].msg_hdr.msg_name = &iter->to;
+                messages[count].msg_hdr.msg_namelen = sizeof(iter->to);
+            }
+        }
+        int sent = sendmmsg(fd_, messages, count, 0);
+#else
+        Datagram& front = queue_.front();
+        int sent = sendto(fd_, front.data.data(), (int)front.data.size(), 0,
+                          connected_ ? NULL : (sockaddr*)&front.to,
+                          connected_ ? 0 : sizeof(front.to));
+        sent = sent < 0 ? -1 : 1;
+#endif
+        if (sent < 0) {
+            int error = EVUTIL_SOCKET_ERROR();
+            if (WouldBlock(error)) {
+                event_add(write_event_, NULL);
+                return;
+            }
+            //an unreachable peer loses the datagram like the network would
+            sent = 1;
+        }
+        metrics->datagrams[kMetricsOut].Add(sent);
+        queue_.erase(queue_.begin(), queue_.begin() + sent);
+    }
+}
+
+void DatagramSocket::OnWritable() {
+    Flush();
+}
+
+void DatagramSocket::OnReadable() {
+    MetricsBlock* metrics = Metrics::Local();
+    std::string& buffer = receive_buffer_;
+    for (int round = 0; round < kMaxRounds; round++) {
+#ifdef __linux__
+        mmsghdr messages[kBatch];
+        iovec iovs[kBatch];
+        sockaddr_in from[kBatch];
+        memset(messages, 0, sizeof(messages));
+        for (size_t i = 0; i < kBatch; i++) {
+            iovs[i].iov_base = &buffer[i * mtu_];
+            iovs[i].iov_len = mtu_;
+            messages[i].msg_hdr.msg_iov = &iovs[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+            messages[i].msg_hdr.msg_name = &from[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        }
+        int received = recvmmsg(fd_, messages, kBatch, 0, NULL);
+#else
+        sockaddr_in from[1];
+        socklen_t from_len = sizeof(from[0]);
+        int size = recvfrom(fd_, &buffer[0], (int)mtu_, 0, (sockaddr*)&from[0], &from_len);
+        int received = size < 0 ? -1 : 1;
+#endif
+        if (received <= 0)
+            break;
+        metrics->datagrams[kMetricsIn].Add(received);
+        for (int i = 0; i < received; i++) {
+#ifdef __linux__
+            //longer than any peer sends, cut short by the kernel
+            if (messages[i].msg_hdr.msg_flags & MSG_TRUNC)
+                continue;
+            size_t size = messages[i].msg_len;
+#endif
+            notify_->OnDatagram(from[i], (const unsigned char*)&buffer[i * mtu_], size);
+        }
+        //acks and replies of the whole batch leave together
+        Flush();
+        if (received < kBatch)
+            break;
+    }
+}
+
+int64_t DatagramSocket::Now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,122 @@
+#ifndef _DATAGRAM_SOCKET_H_
+#define _DATAGRAM_SOCKET_H_
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <random>
+#include <string>
+
+#include <event2/event.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netinet/in.h>
+#endif
+
+class IDatagramNotify {
+public:
+    virtual ~IDatagramNotify() {};
+    virtual void OnDatagram(const sockaddr_in& from, const unsigned char* data, size_t size) = 0;
+};
+
+//drops and delays datagrams on their way out, so the udp transport can be
+//tried against loss and latency on loopback. jitter reorders what it holds
+class LinkSimulator {
+public:
+    LinkSimulator(double loss_percent, int delay_ms, int jitter_ms);
+
+    bool Active() const {
+        return loss_percent_ > 0 || delay_us_ > 0 || jitter_us_ > 0;
+    }
+
+    //false when the datagram is lost, otherwise how long to hold it
+    bool Pass(int64_t* delay_us);
+
+private:
+    double loss_percent_;
+
+    int64_t delay_us_;
+
+    int64_t jitter_us_;
+
+    std::minstd_rand random_;
+};
+
+//one udp socket of the datagram transport. Send only queues, the queue
+//leaves in sendmmsg batches on Flush and what the kernel does not take
+//waits for the socket to turn writable. reads come in recvmmsg batches
+class DatagramSocket {
+public:
+    DatagramSocket(event_base* event_loop, IDatagramNotify* notify, size_t mtu);
+
+    ~DatagramSocket();
+
+    //forwarder: one socket answers every agent, workers share the port
+    bool Bind(const std::string& ip, int port, bool reuse_port);
+
+    //forwarder workers: the kernel hands each datagram to the socket of
+    //the group the byte at offset picks, modulo groups, in bind order.
+    //false where SO_ATTACH_REUSEPORT_CBPF is missing
+    bool Steer(uint32_t offset, int groups);
+
+    //agent: one socket per tunnel, datagrams from anyone else are dropped
+    bool Connect(const std::string& ip, int port);
+
+    //outgoing datagrams go through the simulator from now on
+    void SetSimulator(double loss_percent, int delay_ms, int jitter_ms);
+
+    //the datagram is copied, to is ignored on a connected socket
+    void Send(const sockaddr_in& to, const unsigned char* data, size_t size);
+
+    void Flush();
+
+    void OnReadable();
+
+    void OnWritable();
+
+    //releases the datagrams the simulator held that are due
+    void OnRelease();
+
+    static int64_t Now();
+
+private:
+    struct Datagram {
+        sockaddr_in to;
+        std::string data;
+    };
+
+    bool Open();
+
+    void Queue(Datagram& datagram);
+
+    event_base* event_loop_;
+
+    IDatagramNotify* notify_;
+
+    size_t mtu_;
+
+    evutil_socket_t fd_;
+
+    bool connected_;
+
+    event* read_event_;
+
+    event* write_event_;
+
+    std::deque<Datagram> queue_;
+
+    //kBatch datagrams of mtu_ bytes each
+    std::string receive_buffer_;
+
+    LinkSimulator* simulator_;
+
+    //by release time
+    std::multimap<int64_t, Datagram> held_;
+
+    event* release_event_;
+};
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef _FLOW_CONTROL_H_
+#define _FLOW_CONTROL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "forward_codec.h"
+
+//per stream credit accounting. the sender may have at most the peer's
+//window of payload outstanding; the receiver hands credit back with a
+//kWindowUpdate once bytes have left its socket's output buffer.
+//a default constructed window is disabled and never blocks
+class FlowWindow {
+public:
+    FlowWindow():
+        enabled_(false),
+        send_window_(0),
+        send_credit_(0),
+        recv_window_(0),
+        received_(0),
+        granted_(0) {
+    }
+    FlowWindow(uint32_t send_credit, uint32_t recv_window):
+        enabled_(true),
+        send_window_(send_credit),
+        send_credit_(send_credit),
+        recv_window_(recv_window),
+        received_(0),
+        granted_(0) {
+    }
+    bool Enabled() const {
+        return enabled_;
+    }
+    //sender side
+    size_t Sendable(size_t want) const {
+        if (!enabled_) return want;
+        return want < send_credit_ ? want : send_credit_;
+    }
+    void OnSent(size_t len) {
+        if (enabled_) send_credit_ -= len;
+    }
+    bool Blocked() const {
+        return enabled_ && send_credit_ == 0;
+    }
+    void OnCredit(uint32_t credit) {
+        send_credit_ += credit;
+    }
+    //receiver side, queued is what still waits in the socket output buffer
+    void OnReceived(size_t len) {
+        received_ += len;
+    }
+    uint32_t TakeCredit(size_t queued) {
+        if (!enabled_ || queued > received_) return 0;
+        uint64_t credit = received_ - queued - granted_;
+        if (credit == 0 || credit < recv_window_ / 4) return 0;
+        granted_ += credit;
+        return (uint32_t)credit;
+    }
+    //writecb fires once the output buffer drained below this
+    size_t WriteLowWatermark() const {
+        return enabled_ ? recv_window_ / 2 : 0;
+    }
+    //never buffer more from the source than the peer would take
+    size_t ReadHighWatermark() const {
+        return enabled_ ? send_window_ : 0;
+    }
+    static void EncodeCredit(uint32_t credit, unsigned char* buf) {
+        buf[0] = (unsigned char)(credit);
+        buf[1] = (unsigned char)(credit >> 8);
+        buf[2] = (unsigned char)(credit >> 16);
+        buf[3] = (unsigned char)(credit >> 24);
+    }
+    static bool DecodeCredit(ForwardData& data, uint32_t* credit) {
+        unsigned char buf[4];
+        if (evbuffer_copyout(data.data_, buf, sizeof(buf)) != sizeof(buf)) return false;
+        *credit = (uint32_t)buf[0] | ((uint32_t)buf[1] << 8) |
+                  ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+        return true;
+    }
+private:
+    bool enabled_;
+
+    uint32_t send_window_;
+
+    uint64_t send_credit_;
+
+    uint32_t recv_window_;
+
+    uint64_t received_;
+
+    uint64_t granted_;
+};
+
+#endif
@@ -0,0 +1,143 @@
+#include "forward_codec.h"
+
+static const char kHelloMagic[2] = { 'R', 'P' };
+enum {
+    kHelloMinSize = 8,
+    kHelloSize = 29
+};
+
+enum {
+    kHelloFlagResume = 1
+};
+
+static void PutUint32(unsigned char* p, uint32_t v) {
+    p[0] = (unsigned char)(v);
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static uint32_t GetUint32(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void PutUint64(unsigned char* p, uint64_t v) {
+    PutUint32(p, (uint32_t)v);
+    PutUint32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t GetUint64(const unsigned char* p) {
+    return (uint64_t)GetUint32(p) | ((uint64_t)GetUint32(p + 4) << 32);
+}
+
+static size_t PutVarint(unsigned char* p, uint32_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+//returns bytes used, 0 when more input is needed, -1 on a malformed value
+static int GetVarint(const unsigned char* p, size_t size, uint32_t* v) {
+    uint32_t result = 0;
+    for (size_t i = 0; i < 5; i++) {
+        if (i == size) return 0;
+        result |= (uint32_t)(p[i] & 0x7f) << (7 * i);
+        if ((p[i] & 0x80) == 0) {
+            if (i == 4 && p[i] > 0x0f) return -1;
+            *v = result;
+            return (int)i + 1;
+        }
+    }
+    return -1;
+}
+
+ForwardCodec::ForwardCodec():
+    send_version_(kVersion1),
+    recv_version_(kVersion1),
+    features_(0),
+    peer_window_(0) {
+}
+
+void ForwardCodec::Encode(ForwardData& data, evbuffer* out) {
+    unsigned char header[kMaxHeaderSize];
+    size_t header_size;
+    if (send_version_ >= kVersion2) {
+        header[0] = data.op_;
+        header_size = 1;
+        header_size += PutVarint(header + header_size, data.to_);
+        header_size += PutVarint(header + header_size, data.len_);
+    } else {
+        PutUint32(header, data.len_);
+        PutUint32(header + 4, data.to_);
+        header[8] = data.op_;
+        header_size = kV1HeaderSize;
+    }
+    evbuffer_add(out, header, header_size);
+    evbuffer_add_buffer(out, data.data_);
+}
+
+int ForwardCodec::Decode(evbuffer* in, ForwardData& data) {
+    unsigned char header[kMaxHeaderSize];
+    size_t input_len = evbuffer_get_length(in);
+    size_t header_size;
+    uint32_t len;
+    if (recv_version_ >= kVersion2) {
+        ev_ssize_t copied = evbuffer_copyout(in, header, kMaxHeaderSize);
+        if (copied < 1) return kNeedMore;
+        int used = GetVarint(header + 1, copied - 1, &data.to_);
+        if (used <= 0) return used < 0 ? kFrameError : kNeedMore;
+        header_size = 1 + used;
+        used = GetVarint(header + header_size, copied - header_size, &len);
+        if (used <= 0) return used < 0 ? kFrameError : kNeedMore;
+        header_size += used;
+        data.op_ = header[0];
+    } else {
+        if (evbuffer_copyout(in, header, kV1HeaderSize) != kV1HeaderSize) return kNeedMore;
+        len = GetUint32(header);
+        data.to_ = GetUint32(header + 4);
+        data.op_ = header[8];
+        header_size = kV1HeaderSize;
+    }
+    if (len > kMaxFrameSize) return kFrameError;
+    if (input_len < header_size + len) return kNeedMore;
+    evbuffer_drain(in, header_size);
+    data.MoveFrom(in, len);
+    return kFrameReady;
+}
+
+void ForwardCodec::EncodeHello(const HelloInfo& info, evbuffer* out) {
+    unsigned char hello[kHelloSize];
+    memcpy(hello, kHelloMagic, sizeof(kHelloMagic));
+    hello[2] = (unsigned char)info.kind;
+    hello[3] = (unsigned char)info.version;
+    PutUint32(hello + 4, info.features);
+    PutUint32(hello + 8, info.window);
+    PutUint64(hello + 12, info.session);
+    PutUint64(hello + 20, info.received);
+    hello[28] = info.resume ? kHelloFlagResume : 0;
+    ForwardData data(kHashTypeInvalid, kHelloSize, (const char*)hello, ForwardData::kHello);
+    Encode(data, out);
+}
+
+bool ForwardCodec::ParseHello(ForwardData& data, HelloInfo* info) {
+    unsigned char hello[kHelloSize];
+    memset(hello, 0, sizeof(hello));
+    //trailing fields are optional, older peers send a shorter hello
+    ev_ssize_t size = evbuffer_copyout(data.data_, hello, kHelloSize);
+    if (size < kHelloMinSize || memcmp(hello, kHelloMagic, sizeof(kHelloMagic)) != 0) {
+        return false;
+    }
+    info->kind = hello[2];
+    info->version = hello[3];
+    info->features = GetUint32(hello + 4);
+    info->window = GetUint32(hello + 8);
+    info->session = GetUint64(hello + 12);
+    info->received = GetUint64(hello + 20);
+    info->resume = (hello[28] & kHelloFlagResume) != 0;
+    return true;
+}
@@ -0,0 +1,177 @@
+#ifndef _FORWARD_CODEC_H_
+#define _FORWARD_CODEC_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <event2/buffer.h>
+
+typedef uint32_t HashType;
+enum {
+    kHashTypeInvalid = -1
+};
+
+//payload lives in an evbuffer, so relaying moves chains instead of copying
+struct ForwardData {
+    //new ops are only appended, a peer drops ops it does not know
+    enum {
+        kHeartBeat = 0,
+        kSendData,
+        kCloseConnect,
+        kHello,
+        kWindowUpdate,
+        kSendCompressed,
+        kMigrate,
+        kMigrateAck,
+        kAck
+    };
+    ForwardData(HashType to, uint8_t op = kSendData) {
+        len_ = 0;
+        op_ = op;
+        to_ = to;
+        data_ = evbuffer_new();
+    }
+    ForwardData(HashType to, uint32_t len, const char* data, uint8_t op = kSendData) {
+        len_ = len;
+        op_ = op;
+        to_ = to;
+        data_ = evbuffer_new();
+        evbuffer_add(data_, data, len_);
+    }
+    ~ForwardData() {
+        if (data_) evbuffer_free(data_);
+    }
+    //move len bytes out of src, whole chains are handed over without memcpy
+    bool MoveFrom(evbuffer* src, size_t len) {
+        int moved = evbuffer_remove_buffer(src, data_, len);
+        if (moved < 0) return false;
+        len_ += moved;
+        return (size_t)moved == len;
+    }
+    uint32_t len_;
+    HashType to_;
+    uint8_t op_;
+    evbuffer* data_;
+};
+
+//handshake payload: magic(2) kind(1) version(1) features(4) window(4)
+//session(8) received(8) flags(1)
+struct HelloInfo {
+    HelloInfo():
+        kind(0),
+        version(0),
+        features(0),
+        window(0),
+        session(0),
+        received(0),
+        resume(false) {
+    }
+    int kind;
+    int version;
+    uint32_t features;
+    //receive window the sender grants each stream, 0 when not announced
+    uint32_t window;
+    //tunnel session the agent keeps across reconnects, 0 when not announced
+    uint64_t session;
+    //numbered frames the sender got on that session so far
+    uint64_t received;
+    //offer: carry on with the session's streams, accept: the forwarder does
+    bool resume;
+};
+
+//tunnel framing, one instance per tunnel connection.
+//v1: len(4) to(4) op(1) payload, little endian
+//v2: op(1) varint(to) varint(len) payload
+//
+//both sides start in v1. the agent sends a kHello offer, the forwarder
+//answers with an accept and switches its encoder, the agent switches its
+//decoder on the accept, answers with a commit and switches its encoder,
+//the forwarder switches its decoder on the commit. every switch happens
+//at a frame both ends have seen, and a v1 peer ignores the offer.
+//optional features are settled by the offer/accept pair: the forwarder
+//turns them on when it sends the accept and the agent when it reads it,
+//so a stream opened on either side of the accept sees the same set.
+//a reconnecting agent names its session in the offer, see TunnelSession
+class ForwardCodec {
+public:
+    enum {
+        kVersion1 = 1,
+        kVersion2 = 2,
+        kMaxVersion = kVersion2
+    };
+    enum {
+        kHelloOffer = 0,
+        kHelloAccept,
+        kHelloCommit
+    };
+    enum {
+        kFeatureFlowControl = 1 << 0,
+        kFeatureCompression = 1 << 1,
+        kFeatureSplice = 1 << 2,
+        kFeatureResume = 1 << 3,
+        kFeatureHeartbeat = 1 << 4
+    };
+    enum {
+        kNeedMore = 0,
+        kFrameReady,
+        kFrameError
+    };
+    enum {
+        kV1HeaderSize = 9,
+        kMaxHeaderSize = 11,
+        kMaxFrameSize = 64 * 1024 * 1024
+    };
+
+    ForwardCodec();
+
+    //payload of data is moved into out
+    void Encode(ForwardData& data, evbuffer* out);
+
+    //take one complete frame off the front of in
+    int Decode(evbuffer* in, ForwardData& data);
+
+    void EncodeHello(const HelloInfo& hello, evbuffer* out);
+
+    static bool ParseHello(ForwardData& data, HelloInfo* hello);
+
+    void SetSendVersion(int version) {
+        send_version_ = version;
+    }
+
+    void SetRecvVersion(int version) {
+        recv_version_ = version;
+    }
+
+    int GetSendVersion() const {
+        return send_version_;
+    }
+
+    int GetRecvVersion() const {
+        return recv_version_;
+    }
+
+    //features and stream window agreed with the peer
+    void SetPeer(uint32_t features, uint32_t window) {
+        features_ = features;
+        peer_window_ = window;
+    }
+
+    bool HasFeature(uint32_t feature) const {
+        return (features_ & feature) != 0;
+    }
+
+    uint32_t GetPeerWindow() const {
+        return peer_window_;
+    }
+
+private:
+    int send_version_;
+
+    int recv_version_;
+
+    uint32_t features_;
+
+    uint32_t peer_window_;
+};
+
+#endif
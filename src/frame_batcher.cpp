@@ -0,0 +1,96 @@
+#include "frame_batcher.h"
+#include "metrics.h"
+#include "uring_link.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+static void flushcb(evutil_socket_t fd, short what, void *ctx) {
+    FrameBatcher* pBatcher = static_cast<FrameBatcher*>(ctx);
+    pBatcher->Flush();
+}
+
+FrameBatcher::FrameBatcher(event_base* event_loop,
+                           ForwardCodec* codec,
+                           size_t max_bytes,
+                           int max_delay_us):
+    event_loop_(event_loop),
+    codec_(codec),
+    output_(NULL),
+    staging_(evbuffer_new()),
+    flush_event_(NULL),
+    max_bytes_(max_bytes),
+    max_delay_us_(max_delay_us),
+    armed_(false) {
+    flush_event_ = event_new(event_loop_, -1, 0, flushcb, this);
+}
+
+FrameBatcher::~FrameBatcher() {
+    if (flush_event_)
+        event_free(flush_event_);
+    evbuffer_free(staging_);
+}
+
+void FrameBatcher::SetOutput(evbuffer* output) {
+    output_ = output;
+}
+
+void FrameBatcher::Write(ForwardData& data) {
+    Metrics::OnFrame(kMetricsOut, data.len_);
+    bool is_data = data.op_ == ForwardData::kSendData ||
+                   data.op_ == ForwardData::kSendCompressed;
+    if (!is_data || max_bytes_ == 0) {
+        Flush();
+        codec_->Encode(data, output_);
+        return;
+    }
+    codec_->Encode(data, staging_);
+    if (evbuffer_get_length(staging_) >= max_bytes_) {
+        Flush();
+        return;
+    }
+    if (armed_)
+        return;
+    armed_ = true;
+    if (max_delay_us_ > 0) {
+        timeval delay = { max_delay_us_ / 1000000, max_delay_us_ % 1000000 };
+        event_add(flush_event_, &delay);
+    } else {
+        //runs after the callbacks already queued in this loop iteration
+        event_active(flush_event_, EV_TIMEOUT, 1);
+    }
+}
+
+void FrameBatcher::Flush() {
+    if (armed_) {
+        event_del(flush_event_);
+        armed_ = false;
+    }
+    if (evbuffer_get_length(staging_) > 0)
+        evbuffer_add_buffer(output_, staging_);
+}
+
+void FrameBatcher::Reset() {
+    if (armed_) {
+        event_del(flush_event_);
+        armed_ = false;
+    }
+    evbuffer_drain(staging_, evbuffer_get_length(staging_));
+}
+
+size_t FrameBatcher::Pending() const {
+    return evbuffer_get_length(staging_);
+}
+
+void FrameBatcher::DisableNagle(bufferevent* bev) {
+    evutil_socket_t fd = UringLink::GetFd(bev);
+    if (fd < 0)
+        return;
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+}
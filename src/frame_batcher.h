@@ -0,0 +1,61 @@
+#ifndef _FRAME_BATCHER_H_
+#define _FRAME_BATCHER_H_
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "forward_codec.h"
+
+//gathers the data frames a tunnel produces and hands them to the socket
+//in one evbuffer commit, so a burst of small stream reads leaves as a few
+//large writes. a batch is flushed when it reaches max_bytes, when
+//max_delay_us has passed since its first frame, or, with no delay, once
+//the loop has run every callback that is already active.
+//every other op flushes the batch first and then goes straight out, so
+//close, heartbeat, credit and hello frames never wait and never overtake
+//data queued ahead of them
+class FrameBatcher {
+public:
+    FrameBatcher(event_base* event_loop,
+                 ForwardCodec* codec,
+                 size_t max_bytes,
+                 int max_delay_us);
+
+    ~FrameBatcher();
+
+    void SetOutput(evbuffer* output);
+
+    void Write(ForwardData& data);
+
+    void Flush();
+
+    //drops frames not yet handed to the socket, the connection is gone
+    void Reset();
+
+    //bytes held back and not yet handed to the socket
+    size_t Pending() const;
+
+    //frames leave when the batcher says so, Nagle would only stack a
+    //delayed ack stall on top of that
+    static void DisableNagle(bufferevent* bev);
+
+private:
+    event_base* event_loop_;
+
+    ForwardCodec* codec_;
+
+    evbuffer* output_;
+
+    evbuffer* staging_;
+
+    event* flush_event_;
+
+    size_t max_bytes_;
+
+    int max_delay_us_;
+
+    bool armed_;
+};
+
+#endif
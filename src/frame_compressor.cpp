@@ -0,0 +1,137 @@
+#include "frame_compressor.h"
+
+#include <chrono>
+
+#include "log.hpp"
+
+enum {
+    kRawLenSize = 4
+};
+
+static uint64_t ElapsedUs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - start).count();
+}
+
+FrameCompressor::FrameCompressor(int level):
+    level_(level),
+    deflate_ready_(false),
+    inflate_ready_(false) {
+    memset(&deflate_, 0, sizeof(deflate_));
+    memset(&inflate_, 0, sizeof(inflate_));
+}
+
+FrameCompressor::~FrameCompressor() {
+    if (deflate_ready_)
+        deflateEnd(&deflate_);
+    if (inflate_ready_)
+        inflateEnd(&inflate_);
+}
+
+bool FrameCompressor::Init() {
+    //negative window bits: raw deflate, no zlib header or checksum per frame
+    if (deflateInit2(&deflate_, level_, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        LOGE << "deflateInit2 failed\n";
+        return false;
+    }
+    deflate_ready_ = true;
+    if (inflateInit2(&inflate_, -15) != Z_OK) {
+        LOGE << "inflateInit2 failed\n";
+        return false;
+    }
+    inflate_ready_ = true;
+    return true;
+}
+
+void FrameCompressor::Compress(ForwardData& data, CompressProbe* probe) {
+    if (data.op_ != ForwardData::kSendData || !probe->ShouldTry(data.len_)) {
+        stats_.skipped_bytes += data.len_;
+        return;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint32_t raw_len = data.len_;
+    unsigned char* raw = evbuffer_pullup(data.data_, -1);
+    uLong bound = deflateBound(&deflate_, raw_len) + kRawLenSize;
+    evbuffer* packed = evbuffer_new();
+    evbuffer_iovec vec;
+    if (evbuffer_reserve_space(packed, bound, &vec, 1) != 1) {
+        evbuffer_free(packed);
+        stats_.skipped_bytes += raw_len;
+        return;
+    }
+    unsigned char* out = (unsigned char*)vec.iov_base;
+    out[0] = (unsigned char)(raw_len);
+    out[1] = (unsigned char)(raw_len >> 8);
+    out[2] = (unsigned char)(raw_len >> 16);
+    out[3] = (unsigned char)(raw_len >> 24);
+    deflateReset(&deflate_);
+    deflate_.next_in = raw;
+    deflate_.avail_in = raw_len;
+    deflate_.next_out = out + kRawLenSize;
+    deflate_.avail_out = bound - kRawLenSize;
+    int ret = deflate(&deflate_, Z_FINISH);
+    size_t packed_len = bound - deflate_.avail_out;
+    stats_.deflate_us += ElapsedUs(start);
+    probe->OnResult(raw_len, packed_len);
+    if (ret != Z_STREAM_END || packed_len >= raw_len) {
+        evbuffer_free(packed);
+        stats_.skipped_bytes += raw_len;
+        return;
+    }
+    vec.iov_len = packed_len;
+    evbuffer_commit_space(packed, &vec, 1);
+    evbuffer_free(data.data_);
+    data.data_ = packed;
+    data.len_ = packed_len;
+    data.op_ = ForwardData::kSendCompressed;
+    stats_.raw_bytes += raw_len;
+    stats_.packed_bytes += packed_len;
+}
+
+bool FrameCompressor::Decompress(ForwardData& data) {
+    unsigned char header[kRawLenSize];
+    if (evbuffer_copyout(data.data_, header, kRawLenSize) != kRawLenSize)
+        return false;
+    uint32_t raw_len = (uint32_t)header[0] | ((uint32_t)header[1] << 8) |
+                       ((uint32_t)header[2] << 16) | ((uint32_t)header[3] << 24);
+    if (raw_len == 0 || raw_len > ForwardCodec::kMaxFrameSize)
+        return false;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    evbuffer_drain(data.data_, kRawLenSize);
+    size_t packed_len = evbuffer_get_length(data.data_);
+    unsigned char* packed = evbuffer_pullup(data.data_, -1);
+    evbuffer* raw = evbuffer_new();
+    evbuffer_iovec vec;
+    if (evbuffer_reserve_space(raw, raw_len, &vec, 1) != 1) {
+        evbuffer_free(raw);
+        return false;
+    }
+    inflateReset(&inflate_);
+    inflate_.next_in = packed;
+    inflate_.avail_in = packed_len;
+    inflate_.next_out = (unsigned char*)vec.iov_base;
+    inflate_.avail_out = raw_len;
+    int ret = inflate(&inflate_, Z_FINISH);
+    stats_.inflate_us += ElapsedUs(start);
+    if (ret != Z_STREAM_END || inflate_.avail_out != 0) {
+        evbuffer_free(raw);
+        return false;
+    }
+    vec.iov_len = raw_len;
+    evbuffer_commit_space(raw, &vec, 1);
+    evbuffer_free(data.data_);
+    data.data_ = raw;
+    data.len_ = raw_len;
+    data.op_ = ForwardData::kSendData;
+    return true;
+}
+
+void FrameCompressor::LogStats(const char* who) const {
+    if (stats_.raw_bytes == 0 && stats_.inflate_us == 0)
+        return;
+    double ratio = stats_.raw_bytes ? (double)stats_.packed_bytes / stats_.raw_bytes : 1.0;
+    LOGI << who << " compression: " << stats_.raw_bytes << " -> " << stats_.packed_bytes
+         << " bytes (ratio " << ratio << "), sent raw " << stats_.skipped_bytes
+         << ", deflate " << stats_.deflate_us / 1000 << "ms, inflate "
+         << stats_.inflate_us / 1000 << "ms\n";
+}
@@ -0,0 +1,105 @@
+#ifndef _FRAME_COMPRESSOR_H_
+#define _FRAME_COMPRESSOR_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <zlib.h>
+
+#include "forward_codec.h"
+
+//per stream guess whether its payload is worth compressing. a frame that
+//shrinks by less than 10% makes the stream skip compression for a while,
+//the skipped span doubles on every miss so tls or media streams settle
+//into sending raw frames and only probe now and then
+class CompressProbe {
+public:
+    enum {
+        kMinFrame = 256,
+        kMinBackoff = 256 * 1024,
+        kMaxBackoff = 16 * 1024 * 1024
+    };
+    CompressProbe():
+        skip_(0),
+        backoff_(kMinBackoff) {
+    }
+    bool ShouldTry(size_t len) {
+        if (len < kMinFrame)
+            return false;
+        if (skip_ > 0) {
+            skip_ = len >= skip_ ? 0 : skip_ - len;
+            return false;
+        }
+        return true;
+    }
+    void OnResult(size_t raw, size_t packed) {
+        if (packed * 10 >= raw * 9) {
+            skip_ = backoff_;
+            backoff_ = backoff_ * 2 > kMaxBackoff ? kMaxBackoff : backoff_ * 2;
+        } else {
+            backoff_ = kMinBackoff;
+        }
+    }
+private:
+    size_t skip_;
+
+    size_t backoff_;
+};
+
+struct CompressStats {
+    CompressStats():
+        raw_bytes(0),
+        packed_bytes(0),
+        skipped_bytes(0),
+        deflate_us(0),
+        inflate_us(0) {
+    }
+    //payload that went through deflate and what came out
+    uint64_t raw_bytes;
+    uint64_t packed_bytes;
+    //payload sent as is, by the probe or because deflate did not help
+    uint64_t skipped_bytes;
+    uint64_t deflate_us;
+    uint64_t inflate_us;
+};
+
+//raw deflate of kSendData payloads, one instance per tunnel once both
+//sides agreed on kFeatureCompression. every frame is compressed on its
+//own, so streams interleave freely and a frame never waits for more data.
+//kSendCompressed payload: raw length(4, little endian) deflate data
+class FrameCompressor {
+public:
+    explicit FrameCompressor(int level);
+
+    ~FrameCompressor();
+
+    bool Init();
+
+    //turns a kSendData frame into kSendCompressed when that pays off
+    void Compress(ForwardData& data, CompressProbe* probe);
+
+    //restores a kSendCompressed frame to kSendData, false on corrupt input
+    bool Decompress(ForwardData& data);
+
+    const CompressStats& GetStats() const {
+        return stats_;
+    }
+
+    //one line summary for the periodic log
+    void LogStats(const char* who) const;
+
+private:
+    int level_;
+
+    bool deflate_ready_;
+
+    bool inflate_ready_;
+
+    z_stream deflate_;
+
+    z_stream inflate_;
+
+    CompressStats stats_;
+};
+
+#endif
@@ -0,0 +1,133 @@
+#include "frame_scheduler.h"
+#include "uring_link.h"
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+FrameScheduler::FrameScheduler(size_t quantum, bool sparse):
+    quantum_(quantum),
+    sparse_(sparse),
+    bytes_(0),
+    frames_(0) {
+}
+
+FrameScheduler::~FrameScheduler() {
+    Clear();
+    for (size_t i = 0; i < spare_flows_.size(); i++)
+        delete spare_flows_[i];
+}
+
+bool FrameScheduler::IsStreamOp(uint8_t op) {
+    switch (op) {
+    case ForwardData::kSendData:
+    case ForwardData::kSendCompressed:
+    case ForwardData::kCloseConnect:
+    case ForwardData::kMigrate:
+    case ForwardData::kMigrateAck:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void FrameScheduler::Push(ForwardData& data) {
+    Flow* flow;
+    auto iter = flows_.find(data.to_);
+    if (iter != flows_.end()) {
+        flow = iter->second;
+    } else {
+        if (spare_flows_.empty()) {
+            flow = new Flow();
+        } else {
+            flow = spare_flows_.back();
+            spare_flows_.pop_back();
+        }
+        flow->id = data.to_;
+        flow->deficit = quantum_;
+        flows_[data.to_] = flow;
+        if (sparse_)
+            new_flows_.push_back(flow);
+        else
+            old_flows_.push_back(flow);
+    }
+    Frame frame;
+    frame.op = data.op_;
+    frame.len = data.len_;
+    frame.payload = data.data_;
+    data.data_ = NULL;
+    flow->frames.push_back(frame);
+    bytes_ += frame.len;
+    frames_++;
+}
+
+bool FrameScheduler::Pop(ForwardData& data) {
+    while (true) {
+        std::deque<Flow*>* list = new_flows_.empty() ? &old_flows_ : &new_flows_;
+        if (list->empty())
+            return false;
+        Flow* flow = list->front();
+        if (flow->deficit <= 0) {
+            //turn used up, to the back of the backlogged streams
+            flow->deficit += quantum_;
+            list->pop_front();
+            old_flows_.push_back(flow);
+            continue;
+        }
+        if (flow->frames.empty()) {
+            list->pop_front();
+            if (list == &new_flows_)
+                old_flows_.push_back(flow);
+            else
+                Retire(flow);
+            continue;
+        }
+        Frame frame = flow->frames.front();
+        flow->frames.pop_front();
+        //charged after the fact, a frame larger than the quantum still goes
+        flow->deficit -= frame.len;
+        bytes_ -= frame.len;
+        frames_--;
+        data.to_ = flow->id;
+        data.op_ = frame.op;
+        data.len_ = frame.len;
+        if (data.data_)
+            evbuffer_free(data.data_);
+        data.data_ = frame.payload;
+        return true;
+    }
+}
+
+void FrameScheduler::Retire(Flow* flow) {
+    flows_.erase(flow->id);
+    if (spare_flows_.size() < kSpareFlows)
+        spare_flows_.push_back(flow);
+    else
+        delete flow;
+}
+
+void FrameScheduler::Clear() {
+    for (auto iter = flows_.begin(); iter != flows_.end(); ++iter) {
+        Flow* flow = iter->second;
+        for (size_t i = 0; i < flow->frames.size(); i++)
+            evbuffer_free(flow->frames[i].payload);
+        delete flow;
+    }
+    flows_.clear();
+    new_flows_.clear();
+    old_flows_.clear();
+    bytes_ = 0;
+    frames_ = 0;
+}
+
+void FrameScheduler::LimitUnsent(bufferevent* bev, size_t bytes) {
+#ifdef TCP_NOTSENT_LOWAT
+    evutil_socket_t fd = UringLink::GetFd(bev);
+    if (fd < 0)
+        return;
+    int value = (int)bytes;
+    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (const char*)&value, sizeof(value));
+#endif
+}
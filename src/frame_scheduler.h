@@ -0,0 +1,101 @@
+#ifndef _FRAME_SCHEDULER_H_
+#define _FRAME_SCHEDULER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "forward_codec.h"
+
+//per stream queues in front of a tunnel. frames of one stream keep their
+//order, across streams they leave in deficit round robin, so a bulk
+//download no longer sits megabytes ahead of a keystroke. in sparse mode a
+//stream that just got backlogged is served ahead of the ones that stayed
+//backlogged until it used up its first quantum, as the new and old flow
+//lists of fq_codel do; short interactive bursts finish in that turn. as
+//there, a new stream that empties moves behind the old ones with what is
+//left of its deficit and only goes once it is found empty on the old
+//list, so a download queueing one frame at a time stays an old stream.
+//only ops that must stay in line with a stream's data are queued here,
+//credit, acks and heartbeats go to the tunnel directly
+class FrameScheduler {
+public:
+    enum {
+        kFifo = 0,
+        kDrr,
+        kSparse
+    };
+
+    //emptied flows kept for reuse, a flow and its deque cost three
+    //allocations and interactive streams empty theirs on nearly every pop
+    static const size_t kSpareFlows = 64;
+
+    FrameScheduler(size_t quantum, bool sparse);
+
+    ~FrameScheduler();
+
+    static bool IsStreamOp(uint8_t op);
+
+    //the payload is taken over, data is left without one
+    void Push(ForwardData& data);
+
+    //next frame for the tunnel, false when nothing is queued
+    bool Pop(ForwardData& data);
+
+    //payload bytes queued
+    size_t Pending() const {
+        return bytes_;
+    }
+
+    bool Empty() const {
+        return frames_ == 0;
+    }
+
+    //drops every queued frame, the streams are gone
+    void Clear();
+
+    //caps what the kernel holds unsent for the tunnel, the rest waits
+    //here where it can still be reordered
+    static void LimitUnsent(bufferevent* bev, size_t bytes);
+
+private:
+    struct Frame {
+        uint8_t op;
+        uint32_t len;
+        evbuffer* payload;
+    };
+
+    struct Flow {
+        HashType id;
+        std::deque<Frame> frames;
+        int64_t deficit;
+    };
+
+    //the flow leaves the lists and is kept for reuse
+    void Retire(Flow* flow);
+
+    size_t quantum_;
+
+    bool sparse_;
+
+    size_t bytes_;
+
+    size_t frames_;
+
+    //streams on the lists, each on exactly one. a flow emptied on the new
+    //list waits on the old one until its turn comes round
+    std::unordered_map<HashType, Flow*> flows_;
+
+    std::deque<Flow*> new_flows_;
+
+    std::deque<Flow*> old_flows_;
+
+    std::vector<Flow*> spare_flows_;
+};
+
+#endif
@@ -3,16 +3,42 @@
 #include <iostream>
 #include <sstream>
 #include <string>
-#include <fstream>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 
 #ifdef WIN32
 #pragma warning(disable:4996)
 #endif
 
-#define LOGI *(Log::GetInstance())<<white<<Log::FormatTime()<<" [info] "
-#define LOGW *(Log::GetInstance())<<yellow<<Log::FormatTime()<<" [warning] "
-#define LOGE *(Log::GetInstance())<<red<<Log::FormatTime()<<" [error] "
+enum {
+    kLogInfo = 0,
+    kLogWarning,
+    kLogError
+};
+
+//levels below this are compiled out, the statement and its arguments
+//alike. build with -DLOG_MIN_LEVEL=1 to drop every info line
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
+#define LOG_AT(level, tag) \
+    ((level) < LOG_MIN_LEVEL) ? (void)0 : LogVoidify() & LogLine(level) << tag
+
+#define LOGI LOG_AT(kLogInfo, " [info] ")
+#define LOGW LOG_AT(kLogWarning, " [warning] ")
+#define LOGE LOG_AT(kLogError, " [error] ")
 
 
 inline std::ostream& blue(std::ostream &s) {
@@ -60,52 +86,354 @@ inline std::ostream& white(std::ostream &s) {
     return s;
 }
 
-class Log {
+//lines of one producer thread waiting for the writer. single producer,
+//single consumer: the owning thread moves tail_, the writer moves head_.
+//record: len(4) level(1) text
+class LogRing {
 public:
-    Log() {
+    enum {
+        kSize = 256 * 1024,
+        kHeaderSize = 5
+    };
+    LogRing():
+        head_(0),
+        tail_(0) {
     }
-    ~Log() {
-        if(m_fs.is_open())
-            m_fs.close();
+    //false when the writer fell behind, the line is dropped
+    bool Push(int level, const char* text, uint32_t len) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_acquire);
+        if (kSize - (tail - head) < kHeaderSize + len)
+            return false;
+        unsigned char header[kHeaderSize];
+        memcpy(header, &len, 4);
+        header[4] = (unsigned char)level;
+        Copy(tail, header, kHeaderSize);
+        Copy(tail + kHeaderSize, text, len);
+        tail_.store(tail + kHeaderSize + len, std::memory_order_release);
+        return true;
     }
-    void SetLogFile(std::string filename) {
-        m_fs.open(filename, std::ios::app | std::ios::out);
-        std::streambuf* fileBuf = m_fs.rdbuf();
-        std::cout.rdbuf(fileBuf);
+    //next line into buf, which holds kSize bytes; false when empty
+    bool Pop(char* buf, uint32_t* len, int* level) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t tail = tail_.load(std::memory_order_acquire);
+        if (head == tail)
+            return false;
+        unsigned char header[kHeaderSize];
+        Read(head, header, kHeaderSize);
+        memcpy(len, header, 4);
+        *level = header[4];
+        Read(head + kHeaderSize, buf, *len);
+        head_.store(head + kHeaderSize + *len, std::memory_order_release);
+        return true;
     }
-    template <typename T> Log& operator<<(const T& value) {
-        std::cout << value;
-        return (*this);
+private:
+    void Copy(size_t pos, const void* src, size_t len) {
+        size_t at = pos % kSize;
+        size_t first = len < kSize - at ? len : kSize - at;
+        memcpy(buf_ + at, src, first);
+        memcpy(buf_, (const char*)src + first, len - first);
     }
-    static std::string FormatTime() {
-        time_t t;
-        struct tm *tm = NULL;
-
-        time(&t);
-        tm = localtime(&t);
-        char buf[100];
-        sprintf(buf, "%04d-%02d-%02d %02d:%02d:%02d",
-                tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
-                tm->tm_hour, tm->tm_min, tm->tm_sec);
-        return std::string(buf);
+    void Read(size_t pos, void* dst, size_t len) {
+        size_t at = pos % kSize;
+        size_t first = len < kSize - at ? len : kSize - at;
+        memcpy(dst, buf_ + at, first);
+        memcpy((char*)dst + first, buf_, len - first);
     }
+    std::atomic<size_t> head_;
+    std::atomic<size_t> tail_;
+    char buf_[kSize];
+};
+
+//one process wide logger. statements format on the calling thread into
+//that thread's ring and never wait on the output; a writer thread drains
+//the rings every kFlushMs and writes them out in one go
+class Log {
+public:
+    enum {
+        kFlushMs = 50,
+        kMaxLine = 4096
+    };
     static Log* GetInstance() {
-        if (instance == NULL) {
-            return new Log();
+        Log* log = instance.load(std::memory_order_acquire);
+        if (log)
+            return log;
+        static std::mutex create;
+        std::lock_guard<std::mutex> lock(create);
+        log = instance.load(std::memory_order_acquire);
+        if (!log) {
+            log = new Log();
+            instance.store(log, std::memory_order_release);
+        }
+        return log;
+    }
+    void SetLogFile(std::string filename) {
+        FILE* file = fopen(filename.c_str(), "a");
+        if (!file)
+            return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (out_ != stdout)
+            fclose(out_);
+        out_ = file;
+    }
+    void Commit(int level, const char* text, size_t len) {
+        if (!running_.load(std::memory_order_acquire))
+            Start();
+        if (!ThreadRing()->Push(level, text, (uint32_t)len))
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+    //"YYYY-mm-dd HH:MM:SS", formatted again only when the second changes
+    static const char* TimeText() {
+        static thread_local time_t last = (time_t)-1;
+        static thread_local char text[64];
+        time_t now = time(NULL);
+        if (now != last) {
+            struct tm tm;
+#ifdef _WIN32
+            localtime_s(&tm, &now);
+#else
+            localtime_r(&now, &tm);
+#endif
+            snprintf(text, sizeof(text), "%04d-%02d-%02d %02d:%02d:%02d",
+                     tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                     tm.tm_hour, tm.tm_min, tm.tm_sec);
+            last = now;
         }
-        return instance;
+        return text;
     }
+    static std::string FormatTime() {
+        return TimeText();
+    }
+    //writes out what is queued and stops the writer
     void Destory() {
-        if(instance)
-            delete instance;
+        Log* log = this;
+        if (!instance.compare_exchange_strong(log, NULL))
+            return;
+        Stop();
+        delete this;
+    }
+private:
+    Log():
+        out_(stdout),
+        writer_(NULL),
+        running_(false),
+        stop_(false),
+        dropped_(0),
+        scratch_(LogRing::kSize) {
+        static std::atomic<unsigned> generation(0);
+        id_ = ++generation;
+        //GetInstance serializes this, the handlers follow whichever
+        //instance is current
+        static bool hooked = false;
+        if (!hooked) {
+            //exit() from anywhere still gets the last lines out
+            atexit(OnExit);
+#ifndef _WIN32
+            pthread_atfork(BeforeFork, AfterForkParent, AfterForkChild);
+#endif
+            hooked = true;
+        }
+    }
+    ~Log() {
+        for (size_t i = 0; i < rings_.size(); i++)
+            delete rings_[i];
+        if (out_ != stdout)
+            fclose(out_);
+    }
+    LogRing* ThreadRing() {
+        static thread_local unsigned owner = 0;
+        static thread_local LogRing* ring = NULL;
+        if (owner != id_) {
+            ring = new LogRing();
+            owner = id_;
+            std::lock_guard<std::mutex> lock(mutex_);
+            rings_.push_back(ring);
+        }
+        return ring;
+    }
+    void Start() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (running_.load(std::memory_order_relaxed))
+            return;
+        stop_.store(false, std::memory_order_relaxed);
+        writer_ = new std::thread(&Log::Run, this);
+        running_.store(true, std::memory_order_release);
+    }
+    void Stop() {
+        stop_.store(true, std::memory_order_release);
+        if (writer_) {
+            writer_->join();
+            delete writer_;
+            writer_ = NULL;
+        }
+        running_.store(false, std::memory_order_release);
+        std::lock_guard<std::mutex> lock(mutex_);
+        Drain();
+    }
+    //plain sleeps instead of a condition variable, whose waiter state a
+    //forked child would inherit without the thread behind it
+    void Run() {
+        while (!stop_.load(std::memory_order_acquire)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(kFlushMs));
+            std::lock_guard<std::mutex> lock(mutex_);
+            Drain();
+        }
+    }
+    //mutex_ held
+    void Drain() {
+        std::string batch;
+        uint32_t len;
+        int level;
+        for (size_t i = 0; i < rings_.size(); i++) {
+            while (rings_[i]->Pop(&scratch_[0], &len, &level)) {
+#ifdef WIN32
+                //console colors apply to what is written next, line by line
+                fwrite(batch.data(), 1, batch.size(), out_);
+                fflush(out_);
+                batch.clear();
+                if (level == kLogError)
+                    red(std::cout);
+                else if (level == kLogWarning)
+                    yellow(std::cout);
+                else
+                    white(std::cout);
+#endif
+                batch.append(&scratch_[0], len);
+            }
+        }
+        uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0) {
+            char text[128];
+            snprintf(text, sizeof(text), "%s [warning] %llu log lines dropped\n",
+                     TimeText(), (unsigned long long)dropped);
+            batch.append(text);
+        }
+        if (batch.empty())
+            return;
+        fwrite(batch.data(), 1, batch.size(), out_);
+        fflush(out_);
+    }
+    static void OnExit() {
+        Log* log = instance.load(std::memory_order_acquire);
+        if (log)
+            log->Destory();
+    }
+#ifndef _WIN32
+    //the writer must not hold the lock across fork, and the child has to
+    //start its own writer since threads do not survive it
+    static void BeforeFork() {
+        Log* log = instance.load(std::memory_order_acquire);
+        if (!log)
+            return;
+        log->mutex_.lock();
+        //queued lines would otherwise come out of both processes
+        log->Drain();
+    }
+    static void AfterForkParent() {
+        Log* log = instance.load(std::memory_order_acquire);
+        if (log)
+            log->mutex_.unlock();
+    }
+    static void AfterForkChild() {
+        Log* log = instance.load(std::memory_order_acquire);
+        if (!log)
+            return;
+        log->writer_ = NULL;
+        log->running_.store(false, std::memory_order_release);
+        log->mutex_.unlock();
+    }
+#endif
+    //tells a thread's ring apart from one of an instance already destroyed
+    unsigned id_;
+    FILE* out_;
+    //guards rings_, out_ and the writer's state
+    std::mutex mutex_;
+    std::vector<LogRing*> rings_;
+    std::thread* writer_;
+    std::atomic<bool> running_;
+    std::atomic<bool> stop_;
+    std::atomic<uint64_t> dropped_;
+    std::vector<char> scratch_;
+    static std::atomic<Log*> instance;
+};
+
+//fixed buffer behind a line's ostream, overlong lines are cut short
+class LogBuffer : public std::streambuf {
+public:
+    LogBuffer() {
+        Reset();
+    }
+    void Reset() {
+        setp(buf_, buf_ + sizeof(buf_));
+    }
+    const char* Data() const {
+        return pbase();
+    }
+    size_t Size() const {
+        return pptr() - pbase();
+    }
+    //a cut line still ends the line
+    void Terminate() {
+        if (pptr() > pbase())
+            pptr()[-1] = '\n';
+    }
+private:
+    char buf_[Log::kMaxLine];
+};
+
+struct LogStream {
+    LogStream():
+        os(&buf),
+        busy(false) {
+    }
+    LogBuffer buf;
+    std::ostream os;
+    bool busy;
+};
+
+//one statement's output, formatted on the calling thread and committed
+//as a whole when the statement ends
+class LogLine {
+public:
+    explicit LogLine(int level):
+        level_(level),
+        own_(NULL) {
+        static thread_local LogStream* cached = NULL;
+        if (!cached)
+            cached = new LogStream();
+        //a log statement inside the arguments of another one
+        stream_ = cached->busy ? (own_ = new LogStream()) : cached;
+        stream_->busy = true;
+        stream_->buf.Reset();
+        stream_->os.clear();
+        stream_->os << Log::TimeText();
+    }
+    ~LogLine() {
+        if (stream_->buf.Size() == Log::kMaxLine)
+            stream_->buf.Terminate();
+        Log::GetInstance()->Commit(level_, stream_->buf.Data(), stream_->buf.Size());
+        stream_->busy = false;
+        delete own_;
+    }
+    template <typename T> LogLine& operator<<(const T& value) {
+        stream_->os << value;
+        return (*this);
     }
 private:
-    std::ofstream m_fs;
-    static Log* instance;
+    int level_;
+    LogStream* stream_;
+    LogStream* own_;
+};
+
+//turns the whole << chain into void so it fits the ?: in LOG_AT
+class LogVoidify {
+public:
+    void operator&(const LogLine&) {
+    }
 };
 
 #ifdef WIN32
 #pragma warning(default:4996)
 #endif
 
-#endif
\ No newline at end of file
+#endif
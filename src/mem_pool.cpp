@@ -0,0 +1,160 @@
+#include "mem_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/event.h>
+
+#include "metrics.h"
+
+namespace {
+
+//in front of every block, keeps the payload 16 byte aligned
+struct BlockHeader {
+    uint32_t cls;
+    uint32_t reserved;
+    //requested size of a block too large for any class
+    uint64_t size;
+};
+
+enum {
+    kLargeClass = BufferPool::kClasses
+};
+
+struct BufferCache {
+    BlockHeader* free[BufferPool::kClasses];
+    size_t bytes;
+};
+
+size_t cache_limit = 0;
+
+BufferCache* Cache() {
+    static thread_local BufferCache* cache = NULL;
+    if (!cache)
+        cache = (BufferCache*)calloc(1, sizeof(BufferCache));
+    return cache;
+}
+
+uint32_t ClassOf(size_t size) {
+    uint32_t cls = 0;
+    while (cls < kLargeClass && ((size_t)1 << (cls + BufferPool::kMinShift)) < size)
+        cls++;
+    return cls;
+}
+
+size_t Capacity(uint32_t cls) {
+    return (size_t)1 << (cls + BufferPool::kMinShift);
+}
+
+//the free list link lives where the payload would
+BlockHeader*& NextFree(BlockHeader* block) {
+    return *reinterpret_cast<BlockHeader**>(block + 1);
+}
+
+}
+
+void BufferPool::Install(size_t cache_bytes) {
+    cache_limit = cache_bytes;
+    event_set_mem_functions(Alloc, Realloc, Free);
+}
+
+void* BufferPool::Alloc(size_t size) {
+    uint32_t cls = ClassOf(size);
+    MetricsBlock* metrics = Metrics::Local();
+    if (cls < kLargeClass) {
+        BufferCache* cache = Cache();
+        BlockHeader* block = cache->free[cls];
+        if (block) {
+            cache->free[cls] = NextFree(block);
+            cache->bytes -= Capacity(cls);
+            metrics->pool_reused[kPoolBuffers].Add(1);
+            metrics->pool_cached_bytes.Set(cache->bytes);
+            return block + 1;
+        }
+        size = Capacity(cls);
+    }
+    BlockHeader* block = (BlockHeader*)malloc(sizeof(BlockHeader) + size);
+    if (!block)
+        return NULL;
+    block->cls = cls;
+    block->reserved = 0;
+    block->size = size;
+    metrics->pool_fresh[kPoolBuffers].Add(1);
+    return block + 1;
+}
+
+void* BufferPool::Realloc(void* p, size_t size) {
+    if (!p)
+        return Alloc(size);
+    BlockHeader* block = (BlockHeader*)p - 1;
+    if (block->cls == kLargeClass && ClassOf(size) == kLargeClass) {
+        block = (BlockHeader*)realloc(block, sizeof(BlockHeader) + size);
+        if (!block)
+            return NULL;
+        block->size = size;
+        return block + 1;
+    }
+    if (size <= block->size)
+        return p;
+    void* grown = Alloc(size);
+    if (!grown)
+        return NULL;
+    memcpy(grown, p, block->size);
+    Free(p);
+    return grown;
+}
+
+void BufferPool::Free(void* p) {
+    if (!p)
+        return;
+    BlockHeader* block = (BlockHeader*)p - 1;
+    uint32_t cls = block->cls;
+    BufferCache* cache = Cache();
+    if (cls == kLargeClass || cache->bytes + Capacity(cls) > cache_limit) {
+        free(block);
+        return;
+    }
+    NextFree(block) = cache->free[cls];
+    cache->free[cls] = block;
+    cache->bytes += Capacity(cls);
+    Metrics::Local()->pool_cached_bytes.Set(cache->bytes);
+}
+
+SlabPool::SlabPool(size_t size):
+    //16 keeps every slot as aligned as malloc would
+    size_((size + 15) & ~(size_t)15),
+    free_(NULL),
+    cursor_(NULL),
+    end_(NULL) {
+}
+
+void* SlabPool::Alloc() {
+    MetricsBlock* metrics = Metrics::Local();
+    if (free_) {
+        Slot* slot = free_;
+        free_ = slot->next;
+        metrics->pool_reused[kPoolStreams].Add(1);
+        return slot;
+    }
+    if (cursor_ + size_ > end_) {
+        cursor_ = (char*)malloc(kSlabBytes);
+        if (!cursor_) {
+            end_ = NULL;
+            throw std::bad_alloc();
+        }
+        end_ = cursor_ + kSlabBytes;
+        metrics->pool_slab_bytes.Add(kSlabBytes);
+    }
+    void* p = cursor_;
+    cursor_ += size_;
+    metrics->pool_fresh[kPoolStreams].Add(1);
+    return p;
+}
+
+void SlabPool::Free(void* p) {
+    if (!p)
+        return;
+    Slot* slot = (Slot*)p;
+    slot->next = free_;
+    free_ = slot;
+}
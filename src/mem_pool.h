@@ -0,0 +1,92 @@
+#ifndef _MEM_POOL_H_
+#define _MEM_POOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <new>
+
+//size classed caches for what libevent allocates: evbuffers, their
+//chains, bufferevents and events. every frame payload lives in evbuffer
+//chains, so routing libevent through here recycles frame buffers without
+//touching the relay code. each thread keeps its own free lists, a block
+//freed on another thread simply joins that thread's cache. classes are
+//powers of two up to 64KB plus a small header, libevent already rounds
+//chain sizes up to powers of two so a chain fits its class exactly
+class BufferPool {
+public:
+    enum {
+        kMinShift = 5,
+        kMaxShift = 16,
+        kClasses = kMaxShift - kMinShift + 1
+    };
+
+    //routes libevent's allocator here, must run before any other libevent
+    //call. cache_bytes caps the free blocks each thread holds on to
+    static void Install(size_t cache_bytes);
+
+    static void* Alloc(size_t size);
+
+    static void* Realloc(void* p, size_t size);
+
+    static void Free(void* p);
+};
+
+//fixed size slots carved from 64KB slabs, one pool per thread and object
+//type. freed slots are reused last in first out while still cache warm
+//and slabs are kept for the life of the process, so a connection storm
+//leaves the footprint at its high water mark instead of a fragmented heap
+class SlabPool {
+public:
+    enum {
+        kSlabBytes = 64 * 1024
+    };
+
+    explicit SlabPool(size_t size);
+
+    void* Alloc();
+
+    void Free(void* p);
+
+private:
+    struct Slot {
+        Slot* next;
+    };
+
+    size_t size_;
+
+    Slot* free_;
+
+    char* cursor_;
+
+    char* end_;
+};
+
+//gives T a per thread slab through class operator new and delete, so
+//`new T` and `delete this` keep working unchanged
+template <typename T>
+class Pooled {
+public:
+    static void* operator new(size_t size) {
+        if (size != sizeof(T))
+            return ::operator new(size);
+        return Local()->Alloc();
+    }
+
+    static void operator delete(void* p, size_t size) {
+        if (size != sizeof(T)) {
+            ::operator delete(p);
+            return;
+        }
+        Local()->Free(p);
+    }
+
+private:
+    static SlabPool* Local() {
+        static thread_local SlabPool* pool = NULL;
+        if (!pool)
+            pool = new SlabPool(sizeof(T));
+        return pool;
+    }
+};
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef _MEMORY_BUDGET_H_
+#define _MEMORY_BUDGET_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+//one cap on the bytes the forwarder holds in relay buffers: stream socket
+//output, the tunnels' scheduler queues, batchers, socket output and
+//replay copies. every loop charges the same budget with a relaxed atomic
+//add. past the shed mark the loops stop reading from their noisiest
+//streams, at the limit new socks clients are turned away as well
+class MemoryBudget {
+public:
+    enum {
+        kNormal = 0,
+        kShed,
+        kReject
+    };
+
+    MemoryBudget(size_t limit, int shed_percent):
+        used_(0),
+        limit_(limit),
+        shed_bytes_(limit / 100 * shed_percent) {
+    }
+
+    void Charge(int64_t delta) {
+        used_.fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    size_t Used() const {
+        int64_t used = used_.load(std::memory_order_relaxed);
+        return used > 0 ? (size_t)used : 0;
+    }
+
+    size_t Limit() const {
+        return limit_;
+    }
+
+    int Level() const {
+        size_t used = Used();
+        if (used >= limit_)
+            return kReject;
+        return used >= shed_bytes_ ? kShed : kNormal;
+    }
+
+private:
+    std::atomic<int64_t> used_;
+
+    size_t limit_;
+
+    size_t shed_bytes_;
+};
+
+//what one buffer holds against a budget. Update moves the charge to the
+//buffer's current length, the rest is given back on destruction
+class BudgetCharge {
+public:
+    BudgetCharge():
+        budget_(NULL),
+        bytes_(0) {
+    }
+
+    ~BudgetCharge() {
+        Update(0);
+    }
+
+    //NULL leaves the buffer uncharged
+    void Bind(MemoryBudget* budget) {
+        Update(0);
+        budget_ = budget;
+    }
+
+    void Update(size_t bytes) {
+        if (!budget_ || bytes == bytes_)
+            return;
+        budget_->Charge((int64_t)bytes - (int64_t)bytes_);
+        bytes_ = bytes;
+    }
+
+private:
+    BudgetCharge(const BudgetCharge&);
+
+    BudgetCharge& operator=(const BudgetCharge&);
+
+    MemoryBudget* budget_;
+
+    size_t bytes_;
+};
+
+#endif
@@ -0,0 +1,320 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <mutex>
+#include <vector>
+
+#include <event2/buffer.h>
+
+#include "log.hpp"
+
+static const char* kFrameBounds[kFrameBuckets] = {
+    "64", "256", "1024", "4096", "16384", "65536", "+Inf"
+};
+
+static const size_t kQueueLimits[kQueueBuckets - 1] = {
+    0, 4096, 65536, 262144, 1048576
+};
+
+static const char* kQueueBounds[kQueueBuckets] = {
+    "0", "4096", "65536", "262144", "1048576", "+Inf"
+};
+
+static const int64_t kRttLimits[kRttBuckets - 1] = {
+    1000, 5000, 20000, 100000, 500000
+};
+
+static const char* kRttBounds[kRttBuckets] = {
+    "0.001", "0.005", "0.02", "0.1", "0.5", "+Inf"
+};
+
+static const char* kStreamDirections[kMetricsDirections] = { "to_tunnel", "from_tunnel" };
+
+static const char* kFrameDirections[kMetricsDirections] = { "sent", "received" };
+
+static const char* kTimeoutNames[kTimeoutReasons] = { "idle", "connect", "close_wait" };
+
+static const char* kPoolNames[kPoolKinds] = { "buffers", "streams" };
+
+//blocks live as long as the process, a scrape may race a thread exit
+static std::mutex blocks_lock;
+static std::vector<MetricsBlock*> blocks;
+
+void MetricsSample::AddStream(size_t queued) {
+    int bucket = 0;
+    while (bucket < kQueueBuckets - 1 && queued > kQueueLimits[bucket])
+        bucket++;
+    queue_depths[bucket]++;
+    if (queued > queue_max)
+        queue_max = queued;
+}
+
+void MetricsSample::AddRtt(int64_t rtt_us, int64_t jitter_us) {
+    if (rtt_us > rtt_max_us)
+        rtt_max_us = rtt_us;
+    if (jitter_us > jitter_max_us)
+        jitter_max_us = jitter_us;
+}
+
+void Metrics::OnRtt(int64_t rtt_us) {
+    MetricsBlock* block = Local();
+    int bucket = 0;
+    while (bucket < kRttBuckets - 1 && rtt_us > kRttLimits[bucket])
+        bucket++;
+    block->rtt_samples[bucket].Add(1);
+    block->rtt_sum_us.Add(rtt_us);
+}
+
+MetricsBlock* Metrics::Register() {
+    MetricsBlock* block = new MetricsBlock();
+    std::lock_guard<std::mutex> lock(blocks_lock);
+    blocks.push_back(block);
+    return block;
+}
+
+void Metrics::Publish(const MetricsSample& sample) {
+    MetricsBlock* block = Local();
+    block->tunnels.Set(sample.tunnels);
+    block->send_backlog.Set(sample.send_backlog);
+    block->recv_backlog.Set(sample.recv_backlog);
+    for (int i = 0; i < kQueueBuckets; i++)
+        block->queue_depths[i].Set(sample.queue_depths[i]);
+    block->queue_max.Set(sample.queue_max);
+    block->rtt_max_us.Set(sample.rtt_max_us);
+    block->jitter_max_us.Set(sample.jitter_max_us);
+}
+
+static void Header(std::string* out, const char* name, const char* type, const char* help) {
+    *out += "# HELP ";
+    *out += name;
+    *out += " ";
+    *out += help;
+    *out += "\n# TYPE ";
+    *out += name;
+    *out += " ";
+    *out += type;
+    *out += "\n";
+}
+
+static void Sample(std::string* out, const char* name, const char* labels, uint64_t value) {
+    char line[256];
+    snprintf(line, sizeof(line), "%s%s %llu\n", name, labels, (unsigned long long)value);
+    *out += line;
+}
+
+static void SampleSeconds(std::string* out, const char* name, const char* labels, uint64_t us) {
+    char line[256];
+    snprintf(line, sizeof(line), "%s%s %.6f\n", name, labels, us / 1000000.0);
+    *out += line;
+}
+
+void Metrics::Render(std::string* out) {
+    MetricsBlock total;
+    uint64_t queue_max = 0;
+    uint64_t rtt_max = 0;
+    uint64_t jitter_max = 0;
+    uint64_t budget_used = 0;
+    {
+        std::lock_guard<std::mutex> lock(blocks_lock);
+        for (size_t b = 0; b < blocks.size(); b++) {
+            MetricsBlock* block = blocks[b];
+            total.stream_accepts.Add(block->stream_accepts.Get());
+            total.stream_closes.Add(block->stream_closes.Get());
+            for (int d = 0; d < kMetricsDirections; d++) {
+                total.stream_bytes[d].Add(block->stream_bytes[d].Get());
+                total.frames[d].Add(block->frames[d].Get());
+                total.frame_bytes[d].Add(block->frame_bytes[d].Get());
+                for (int i = 0; i < kFrameBuckets; i++)
+                    total.frame_sizes[d][i].Add(block->frame_sizes[d][i].Get());
+            }
+            for (int i = 0; i < kRttBuckets; i++)
+                total.rtt_samples[i].Add(block->rtt_samples[i].Get());
+            total.rtt_sum_us.Add(block->rtt_sum_us.Get());
+            total.peers_dead.Add(block->peers_dead.Get());
+            for (int i = 0; i < kTimeoutReasons; i++)
+                total.stream_timeouts[i].Add(block->stream_timeouts[i].Get());
+            for (int i = 0; i < kPoolKinds; i++) {
+                total.pool_reused[i].Add(block->pool_reused[i].Get());
+                total.pool_fresh[i].Add(block->pool_fresh[i].Get());
+            }
+            total.pool_slab_bytes.Add(block->pool_slab_bytes.Get());
+            total.pool_cached_bytes.Add(block->pool_cached_bytes.Get());
+            total.budget_rejects.Add(block->budget_rejects.Get());
+            total.streams_shed.Add(block->streams_shed.Get());
+            for (int d = 0; d < kMetricsDirections; d++)
+                total.datagrams[d].Add(block->datagrams[d].Get());
+            total.datagram_retransmits.Add(block->datagram_retransmits.Get());
+            total.datagram_sim_drops.Add(block->datagram_sim_drops.Get());
+            if (block->budget_used.Get() > budget_used)
+                budget_used = block->budget_used.Get();
+            total.tunnels.Add(block->tunnels.Get());
+            total.send_backlog.Add(block->send_backlog.Get());
+            total.recv_backlog.Add(block->recv_backlog.Get());
+            for (int i = 0; i < kQueueBuckets; i++)
+                total.queue_depths[i].Add(block->queue_depths[i].Get());
+            if (block->queue_max.Get() > queue_max)
+                queue_max = block->queue_max.Get();
+            if (block->rtt_max_us.Get() > rtt_max)
+                rtt_max = block->rtt_max_us.Get();
+            if (block->jitter_max_us.Get() > jitter_max)
+                jitter_max = block->jitter_max_us.Get();
+        }
+    }
+    char labels[64];
+    //counters are read one by one, a close can land before its accept
+    uint64_t accepts = total.stream_accepts.Get();
+    uint64_t closes = total.stream_closes.Get();
+    Header(out, "rproxy_streams_active", "gauge", "Streams currently open.");
+    Sample(out, "rproxy_streams_active", "", accepts > closes ? accepts - closes : 0);
+    Header(out, "rproxy_stream_accepts_total", "counter", "Streams opened.");
+    Sample(out, "rproxy_stream_accepts_total", "", accepts);
+    Header(out, "rproxy_stream_closes_total", "counter", "Streams closed.");
+    Sample(out, "rproxy_stream_closes_total", "", closes);
+    Header(out, "rproxy_stream_timeouts_total", "counter", "Streams closed by a timeout.");
+    for (int i = 0; i < kTimeoutReasons; i++) {
+        snprintf(labels, sizeof(labels), "{reason=\"%s\"}", kTimeoutNames[i]);
+        Sample(out, "rproxy_stream_timeouts_total", labels, total.stream_timeouts[i].Get());
+    }
+    Header(out, "rproxy_pool_allocs_total", "counter",
+           "Pool allocations, reused from a free list or fresh from malloc.");
+    for (int i = 0; i < kPoolKinds; i++) {
+        snprintf(labels, sizeof(labels), "{pool=\"%s\",source=\"reused\"}", kPoolNames[i]);
+        Sample(out, "rproxy_pool_allocs_total", labels, total.pool_reused[i].Get());
+        snprintf(labels, sizeof(labels), "{pool=\"%s\",source=\"fresh\"}", kPoolNames[i]);
+        Sample(out, "rproxy_pool_allocs_total", labels, total.pool_fresh[i].Get());
+    }
+    Header(out, "rproxy_pool_slab_bytes", "gauge", "Bytes of slabs backing stream handlers.");
+    Sample(out, "rproxy_pool_slab_bytes", "", total.pool_slab_bytes.Get());
+    Header(out, "rproxy_pool_cached_bytes", "gauge", "Free buffer blocks held by the thread caches.");
+    Sample(out, "rproxy_pool_cached_bytes", "", total.pool_cached_bytes.Get());
+    Header(out, "rproxy_memory_used_bytes", "gauge", "Relay buffer bytes charged to the memory budget.");
+    Sample(out, "rproxy_memory_used_bytes", "", budget_used);
+    Header(out, "rproxy_streams_shed", "gauge", "Streams not read from because of memory pressure.");
+    Sample(out, "rproxy_streams_shed", "", total.streams_shed.Get());
+    Header(out, "rproxy_memory_rejects_total", "counter",
+           "Socks clients refused because the memory budget ran out.");
+    Sample(out, "rproxy_memory_rejects_total", "", total.budget_rejects.Get());
+    Header(out, "rproxy_datagrams_total", "counter", "Datagrams of udp tunnels.");
+    for (int d = 0; d < kMetricsDirections; d++) {
+        snprintf(labels, sizeof(labels), "{direction=\"%s\"}", kFrameDirections[d]);
+        Sample(out, "rproxy_datagrams_total", labels, total.datagrams[d].Get());
+    }
+    Header(out, "rproxy_datagram_retransmits_total", "counter",
+           "Segments of udp tunnels sent again after a loss.");
+    Sample(out, "rproxy_datagram_retransmits_total", "", total.datagram_retransmits.Get());
+    Header(out, "rproxy_datagram_simulated_drops_total", "counter",
+           "Datagrams dropped by the loss simulator.");
+    Sample(out, "rproxy_datagram_simulated_drops_total", "", total.datagram_sim_drops.Get());
+    Header(out, "rproxy_stream_bytes_total", "counter", "Stream payload relayed.");
+    for (int d = 0; d < kMetricsDirections; d++) {
+        snprintf(labels, sizeof(labels), "{direction=\"%s\"}", kStreamDirections[d]);
+        Sample(out, "rproxy_stream_bytes_total", labels, total.stream_bytes[d].Get());
+    }
+    Header(out, "rproxy_tunnel_frames_total", "counter", "Tunnel frames.");
+    for (int d = 0; d < kMetricsDirections; d++) {
+        snprintf(labels, sizeof(labels), "{direction=\"%s\"}", kFrameDirections[d]);
+        Sample(out, "rproxy_tunnel_frames_total", labels, total.frames[d].Get());
+    }
+    Header(out, "rproxy_tunnel_frame_size_bytes", "histogram", "Tunnel frame payload sizes.");
+    for (int d = 0; d < kMetricsDirections; d++) {
+        uint64_t cumulative = 0;
+        for (int i = 0; i < kFrameBuckets; i++) {
+            cumulative += total.frame_sizes[d][i].Get();
+            snprintf(labels, sizeof(labels), "{direction=\"%s\",le=\"%s\"}",
+                     kFrameDirections[d], kFrameBounds[i]);
+            Sample(out, "rproxy_tunnel_frame_size_bytes_bucket", labels, cumulative);
+        }
+        snprintf(labels, sizeof(labels), "{direction=\"%s\"}", kFrameDirections[d]);
+        Sample(out, "rproxy_tunnel_frame_size_bytes_sum", labels, total.frame_bytes[d].Get());
+        Sample(out, "rproxy_tunnel_frame_size_bytes_count", labels, cumulative);
+    }
+    Header(out, "rproxy_tunnels_active", "gauge", "Connected tunnels.");
+    Sample(out, "rproxy_tunnels_active", "", total.tunnels.Get());
+    Header(out, "rproxy_tunnel_send_backlog_bytes", "gauge",
+           "Framed bytes not yet written to tunnel sockets.");
+    Sample(out, "rproxy_tunnel_send_backlog_bytes", "", total.send_backlog.Get());
+    Header(out, "rproxy_tunnel_recv_backlog_bytes", "gauge",
+           "Bytes read from tunnel sockets and not yet decoded.");
+    Sample(out, "rproxy_tunnel_recv_backlog_bytes", "", total.recv_backlog.Get());
+    Header(out, "rproxy_stream_queue_streams", "gauge",
+           "Streams whose queued bytes towards their socket were at most le at the last sample.");
+    uint64_t streams = 0;
+    for (int i = 0; i < kQueueBuckets; i++) {
+        streams += total.queue_depths[i].Get();
+        snprintf(labels, sizeof(labels), "{le=\"%s\"}", kQueueBounds[i]);
+        Sample(out, "rproxy_stream_queue_streams", labels, streams);
+    }
+    Header(out, "rproxy_stream_queue_bytes_max", "gauge",
+           "Deepest stream queue at the last sample.");
+    Sample(out, "rproxy_stream_queue_bytes_max", "", queue_max);
+    Header(out, "rproxy_tunnel_rtt_seconds", "histogram", "Heartbeat round trips.");
+    uint64_t rtts = 0;
+    for (int i = 0; i < kRttBuckets; i++) {
+        rtts += total.rtt_samples[i].Get();
+        snprintf(labels, sizeof(labels), "{le=\"%s\"}", kRttBounds[i]);
+        Sample(out, "rproxy_tunnel_rtt_seconds_bucket", labels, rtts);
+    }
+    SampleSeconds(out, "rproxy_tunnel_rtt_seconds_sum", "", total.rtt_sum_us.Get());
+    Sample(out, "rproxy_tunnel_rtt_seconds_count", "", rtts);
+    Header(out, "rproxy_tunnel_srtt_seconds_max", "gauge",
+           "Highest smoothed round trip time of the connected tunnels.");
+    SampleSeconds(out, "rproxy_tunnel_srtt_seconds_max", "", rtt_max);
+    Header(out, "rproxy_tunnel_jitter_seconds_max", "gauge",
+           "Highest round trip deviation of the connected tunnels.");
+    SampleSeconds(out, "rproxy_tunnel_jitter_seconds_max", "", jitter_max);
+    Header(out, "rproxy_tunnel_peer_dead_total", "counter",
+           "Tunnels dropped because the peer stopped answering.");
+    Sample(out, "rproxy_tunnel_peer_dead_total", "", total.peers_dead.Get());
+}
+
+static void metricscb(struct evhttp_request* request, void* ctx) {
+    if (evhttp_request_get_command(request) != EVHTTP_REQ_GET) {
+        evhttp_send_error(request, HTTP_BADMETHOD, NULL);
+        return;
+    }
+    std::string text;
+    Metrics::Render(&text);
+    evbuffer* body = evbuffer_new();
+    evbuffer_add(body, text.data(), text.size());
+    evhttp_add_header(evhttp_request_get_output_headers(request),
+                      "Content-Type", "text/plain; version=0.0.4");
+    evhttp_send_reply(request, HTTP_OK, "OK", body);
+    evbuffer_free(body);
+}
+
+MetricsServer::MetricsServer(event_base* event_loop):
+    event_loop_(event_loop),
+    http_(NULL) {
+}
+
+MetricsServer::~MetricsServer() {
+    if (http_)
+        evhttp_free(http_);
+}
+
+bool MetricsServer::Init(const std::string& address) {
+    std::string ip = "127.0.0.1";
+    int port;
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        port = atoi(address.c_str());
+    } else {
+        ip = address.substr(0, colon);
+        port = atoi(address.c_str() + colon + 1);
+    }
+    if (port <= 0) {
+        LOGE << "bad metrics address " << address << "\n";
+        return false;
+    }
+    http_ = evhttp_new(event_loop_);
+    if (!http_)
+        return false;
+    evhttp_set_cb(http_, "/metrics", metricscb, this);
+    if (evhttp_bind_socket(http_, ip.c_str(), port) != 0) {
+        LOGE << "Could not bind the metrics endpoint on " << ip << ":" << port << "\n";
+        return false;
+    }
+    LOGI << "metrics on http://" << ip << ":" << port << "/metrics\n";
+    return true;
+}
@@ -0,0 +1,187 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+
+#include <event2/event.h>
+#include <event2/http.h>
+
+enum {
+    //stream payload heading into the tunnel, frames the tunnel sent
+    kMetricsOut = 0,
+    //stream payload that came off the tunnel, frames it received
+    kMetricsIn,
+    kMetricsDirections
+};
+
+enum {
+    //frame size buckets: 64 256 1k 4k 16k 64k +Inf
+    kFrameBuckets = 7,
+    //stream queue buckets: 0 4k 64k 256k 1m +Inf
+    kQueueBuckets = 6,
+    //heartbeat rtt buckets: 1ms 5ms 20ms 100ms 500ms +Inf
+    kRttBuckets = 6
+};
+
+enum {
+    //stream timeouts, see TunnelConfig
+    kTimeoutIdle = 0,
+    kTimeoutConnect,
+    kTimeoutCloseWait,
+    kTimeoutReasons
+};
+
+enum {
+    //mem_pool: libevent's buffers, slab backed stream handlers
+    kPoolBuffers = 0,
+    kPoolStreams,
+    kPoolKinds
+};
+
+//a value with exactly one writing thread. the relay path bumps it with a
+//relaxed load and store, no lock and no locked instruction; the scrape
+//reads it from another thread
+class MetricCounter {
+public:
+    MetricCounter():
+        value_(0) {
+    }
+    void Add(uint64_t n) {
+        value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    void Set(uint64_t n) {
+        value_.store(n, std::memory_order_relaxed);
+    }
+    uint64_t Get() const {
+        return value_.load(std::memory_order_relaxed);
+    }
+private:
+    std::atomic<uint64_t> value_;
+};
+
+//counters of one loop thread
+struct MetricsBlock {
+    MetricCounter stream_accepts;
+    MetricCounter stream_closes;
+    MetricCounter stream_bytes[kMetricsDirections];
+    MetricCounter frames[kMetricsDirections];
+    MetricCounter frame_bytes[kMetricsDirections];
+    //per bucket, not cumulative
+    MetricCounter frame_sizes[kMetricsDirections][kFrameBuckets];
+    MetricCounter rtt_samples[kRttBuckets];
+    MetricCounter rtt_sum_us;
+    //tunnels given up because the peer went silent
+    MetricCounter peers_dead;
+    //streams closed by their wheel timer, per reason
+    MetricCounter stream_timeouts[kTimeoutReasons];
+    //allocations served from a pool's free list or from malloc
+    MetricCounter pool_reused[kPoolKinds];
+    MetricCounter pool_fresh[kPoolKinds];
+    //slabs never go back, this only grows
+    MetricCounter pool_slab_bytes;
+    //gauge, set by the allocator whenever this thread's cache changes
+    MetricCounter pool_cached_bytes;
+    //socks clients turned away because the memory budget ran out
+    MetricCounter budget_rejects;
+    //gauges, refreshed by the budget check of the owning loop. the budget
+    //is shared, every loop reports the same used bytes
+    MetricCounter budget_used;
+    MetricCounter streams_shed;
+    //udp transport: datagrams each way, segments sent again, datagrams
+    //the loss simulator dropped
+    MetricCounter datagrams[kMetricsDirections];
+    MetricCounter datagram_retransmits;
+    MetricCounter datagram_sim_drops;
+    //gauges, refreshed by the owning loop from its sampler
+    MetricCounter tunnels;
+    MetricCounter send_backlog;
+    MetricCounter recv_backlog;
+    MetricCounter queue_depths[kQueueBuckets];
+    MetricCounter queue_max;
+    MetricCounter rtt_max_us;
+    MetricCounter jitter_max_us;
+};
+
+//gauges gathered by one sampler pass before they are published
+struct MetricsSample {
+    MetricsSample():
+        tunnels(0),
+        send_backlog(0),
+        recv_backlog(0),
+        queue_max(0),
+        rtt_max_us(0),
+        jitter_max_us(0) {
+        for (int i = 0; i < kQueueBuckets; i++)
+            queue_depths[i] = 0;
+    }
+    void AddStream(size_t queued);
+    void AddRtt(int64_t rtt_us, int64_t jitter_us);
+    size_t tunnels;
+    size_t send_backlog;
+    size_t recv_backlog;
+    size_t queue_depths[kQueueBuckets];
+    size_t queue_max;
+    int64_t rtt_max_us;
+    int64_t jitter_max_us;
+};
+
+class Metrics {
+public:
+    //the calling thread's block, registered the first time it is asked for
+    static MetricsBlock* Local() {
+        static thread_local MetricsBlock* block = NULL;
+        if (!block)
+            block = Register();
+        return block;
+    }
+
+    static void OnFrame(int direction, size_t len) {
+        MetricsBlock* block = Local();
+        block->frames[direction].Add(1);
+        block->frame_bytes[direction].Add(len);
+        block->frame_sizes[direction][FrameBucket(len)].Add(1);
+    }
+
+    static void OnStreamBytes(int direction, size_t len) {
+        Local()->stream_bytes[direction].Add(len);
+    }
+
+    //one heartbeat round trip
+    static void OnRtt(int64_t rtt_us);
+
+    static void Publish(const MetricsSample& sample);
+
+    //prometheus text exposition of every thread's block
+    static void Render(std::string* out);
+
+private:
+    static MetricsBlock* Register();
+
+    static int FrameBucket(size_t len) {
+        int bucket = 0;
+        for (size_t bound = 64; bucket < kFrameBuckets - 1 && len > bound; bound *= 4)
+            bucket++;
+        return bucket;
+    }
+};
+
+//GET /metrics on a local port, served from the loop it is created on
+class MetricsServer {
+public:
+    explicit MetricsServer(event_base* event_loop);
+
+    ~MetricsServer();
+
+    //"port" or "ip:port", the address defaults to loopback
+    bool Init(const std::string& address);
+
+private:
+    event_base* event_loop_;
+
+    evhttp* http_;
+};
+
+#endif
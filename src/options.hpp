@@ -0,0 +1,45 @@
+#ifndef _OPTIONS_HPP_
+#define _OPTIONS_HPP_
+#include <map>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+
+//command line: positional arguments plus optional --key=value switches
+class Options {
+public:
+    Options(int argc, char *argv[]) {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.compare(0, 2, "--") != 0) {
+                positional_.push_back(arg);
+                continue;
+            }
+            size_t eq = arg.find('=');
+            if (eq == std::string::npos) {
+                values_[arg.substr(2)] = "1";
+            } else {
+                values_[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+            }
+        }
+    }
+    bool Has(const std::string& key) const {
+        return values_.count(key) > 0;
+    }
+    std::string Get(const std::string& key, const std::string& def) const {
+        std::map<std::string, std::string>::const_iterator it = values_.find(key);
+        return it == values_.end() ? def : it->second;
+    }
+    int GetInt(const std::string& key, int def) const {
+        std::map<std::string, std::string>::const_iterator it = values_.find(key);
+        return it == values_.end() ? def : atoi(it->second.c_str());
+    }
+    const std::vector<std::string>& Positional() const {
+        return positional_;
+    }
+private:
+    std::map<std::string, std::string> values_;
+    std::vector<std::string> positional_;
+};
+
+#endif
@@ -0,0 +1,118 @@
+#include "peer_monitor.h"
+
+#include <chrono>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#include "metrics.h"
+#include "uring_link.h"
+
+//stands in for the rtt until the first echo, as tcp's initial rto
+static const int64_t kInitialRtoMs = 1000;
+
+PeerMonitor::PeerMonitor(int min_interval_ms, int max_interval_ms, int dead_min_ms):
+    min_interval_ms_(min_interval_ms),
+    max_interval_ms_(max_interval_ms),
+    dead_min_ms_(dead_min_ms),
+    seq_(0),
+    srtt_(0),
+    rttvar_(0),
+    last_receive_(Now()),
+    last_check_(0),
+    user_timeout_ms_(0) {
+}
+
+int64_t PeerMonitor::Now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void PeerMonitor::Reset(int64_t now) {
+    last_receive_ = now;
+    last_check_ = 0;
+    user_timeout_ms_ = 0;
+}
+
+bool PeerMonitor::Dead(int64_t now) {
+    //the ping fired far too late, our own loop stood still and what the
+    //peer sent meanwhile is not read yet; decide on the next one
+    bool stalled = last_check_ && now - last_check_ > 2 * IntervalMs() * 1000;
+    last_check_ = now;
+    return !stalled && now - last_receive_ > DeadTimeoutMs() * 1000;
+}
+
+void PeerMonitor::MakePing(ForwardData& data, int64_t now) {
+    unsigned char buf[kPayloadSize];
+    uint32_t seq = seq_++;
+    for (int i = 0; i < 4; i++)
+        buf[i] = (unsigned char)(seq >> (8 * i));
+    buf[4] = kPing;
+    for (int i = 0; i < 8; i++)
+        buf[5 + i] = (unsigned char)((uint64_t)now >> (8 * i));
+    evbuffer_add(data.data_, buf, sizeof(buf));
+    data.len_ = sizeof(buf);
+}
+
+bool PeerMonitor::OnHeartbeat(ForwardData& data, int64_t now, ForwardData& echo) {
+    unsigned char buf[kPayloadSize];
+    if (data.len_ < sizeof(buf) ||
+            evbuffer_copyout(data.data_, buf, sizeof(buf)) != (ev_ssize_t)sizeof(buf)) {
+        return false;
+    }
+    if (buf[4] == kPing) {
+        buf[4] = kEcho;
+        evbuffer_add(echo.data_, buf, sizeof(buf));
+        echo.len_ = sizeof(buf);
+        return true;
+    }
+    uint64_t sent = 0;
+    for (int i = 0; i < 8; i++)
+        sent |= (uint64_t)buf[5 + i] << (8 * i);
+    //only our own clock is in an echo, anything from the future is garbage
+    if ((int64_t)sent <= now)
+        OnSample(now - (int64_t)sent);
+    return false;
+}
+
+void PeerMonitor::OnSample(int64_t rtt) {
+    if (srtt_ == 0) {
+        srtt_ = std::max(rtt, (int64_t)1);
+        rttvar_ = rtt / 2;
+    } else {
+        int64_t delta = srtt_ > rtt ? srtt_ - rtt : rtt - srtt_;
+        rttvar_ = (3 * rttvar_ + delta) / 4;
+        srtt_ = std::max((7 * srtt_ + rtt) / 8, (int64_t)1);
+    }
+    Metrics::OnRtt(rtt);
+}
+
+int64_t PeerMonitor::IntervalMs() const {
+    int64_t rto = srtt_ ? (srtt_ + 4 * rttvar_) / 1000 : kInitialRtoMs;
+    return std::min(std::max(4 * rto, (int64_t)min_interval_ms_), (int64_t)max_interval_ms_);
+}
+
+int64_t PeerMonitor::DeadTimeoutMs() const {
+    int64_t rto = srtt_ ? (srtt_ + 4 * rttvar_) / 1000 : kInitialRtoMs;
+    //three missed intervals plus the time an answer may take to come back
+    return std::max(3 * IntervalMs() + 2 * rto, (int64_t)dead_min_ms_);
+}
+
+void PeerMonitor::ApplyUserTimeout(bufferevent* bev) {
+#ifdef TCP_USER_TIMEOUT
+    evutil_socket_t fd = bev ? UringLink::GetFd(bev) : -1;
+    if (fd < 0)
+        return;
+    int64_t timeout = DeadTimeoutMs();
+    //a setsockopt per ping is wasted while the estimate hardly moves
+    if (user_timeout_ms_ && timeout * 4 > user_timeout_ms_ * 3 && timeout * 4 < user_timeout_ms_ * 5)
+        return;
+    unsigned int value = (unsigned int)timeout;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, (const char*)&value, sizeof(value)) == 0)
+        user_timeout_ms_ = timeout;
+#endif
+}
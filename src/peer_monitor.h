@@ -0,0 +1,91 @@
+#ifndef _PEER_MONITOR_H_
+#define _PEER_MONITOR_H_
+
+#include <stdint.h>
+
+#include <event2/bufferevent.h>
+
+#include "forward_codec.h"
+
+//round trip time of one tunnel and whether its peer is still there. with
+//kFeatureHeartbeat agreed both sides ping on an interval that follows the
+//smoothed rtt and echo the other's pings. any byte read from the peer is
+//a sign of life, it is dead once nothing arrived for DeadTimeoutMs().
+//rtt and jitter are smoothed as tcp does (rfc 6298).
+//kHeartBeat payload: seq(4) kind(1) sent(8, sender's clock in us), the
+//v1 beat carries the seq only
+class PeerMonitor {
+public:
+    enum {
+        kPing = 0,
+        kEcho = 1
+    };
+    enum {
+        kPayloadSize = 13
+    };
+
+    PeerMonitor(int min_interval_ms, int max_interval_ms, int dead_min_ms);
+
+    //monotonic microseconds
+    static int64_t Now();
+
+    //a new connection to the same peer, the estimates are kept
+    void Reset(int64_t now);
+
+    void OnReceive(int64_t now) {
+        last_receive_ = now;
+    }
+
+    void MakePing(ForwardData& data, int64_t now);
+
+    //true when data was a ping, echo then holds the answer
+    bool OnHeartbeat(ForwardData& data, int64_t now, ForwardData& echo);
+
+    //asked once per ping
+    bool Dead(int64_t now);
+
+    int64_t SilentMs(int64_t now) const {
+        return (now - last_receive_) / 1000;
+    }
+
+    //next ping after this long
+    int64_t IntervalMs() const;
+
+    int64_t DeadTimeoutMs() const;
+
+    //smoothed rtt and its mean deviation in us, 0 before the first echo
+    int64_t GetRtt() const {
+        return srtt_;
+    }
+
+    int64_t GetJitter() const {
+        return rttvar_;
+    }
+
+    //keeps TCP_USER_TIMEOUT in line with the dead timeout, so the kernel
+    //gives up on unacked tunnel bytes about when the heartbeats would
+    void ApplyUserTimeout(bufferevent* bev);
+
+private:
+    void OnSample(int64_t rtt);
+
+    int min_interval_ms_;
+
+    int max_interval_ms_;
+
+    int dead_min_ms_;
+
+    uint32_t seq_;
+
+    int64_t srtt_;
+
+    int64_t rttvar_;
+
+    int64_t last_receive_;
+
+    int64_t last_check_;
+
+    int64_t user_timeout_ms_;
+};
+
+#endif
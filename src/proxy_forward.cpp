@@ -1,7 +1,17 @@
 #include "tcp_server.h"
+#include "worker_group.h"
+#include "options.hpp"
+#include <event2/thread.h>
 
 void usage() {
-    LOGE << "usage:rproxy.exe [tcp port] [sock port]" << "\n";
+    LOGE << "usage:rproxy.exe [tcp port] [sock port] [--balance=hash|least] [--workers=N|auto] [--pin] [--protocol=1|2]"
+         << " [--tls-cert=pem --tls-key=pem] [--elephant=bytes [--elephant-port=N]]"
+         << " [--resume=0|1] [--resume-timeout=sec] [--replay-bytes=N]"
+         << " [--heartbeat=ms] [--heartbeat-max=ms] [--dead-timeout=ms]"
+         << " [--scheduler=fifo|drr|sparse] [--frame-bytes=N] [--tunnel-buffer=N] [--metrics=[ip:]port]"
+         << " [--idle-timeout=sec] [--close-wait-timeout=sec] [--pool-cache=bytes] [--direct-write=0|1] [--io=libevent|uring]"
+         << " [--memory-budget=MB [--memory-shed=percent]]"
+         << " [--transport=tcp|udp [--udp-mtu=N] [--sim-loss=percent --sim-delay=ms --sim-jitter=ms]]" << "\n";
     exit(1);
 }
 static void
@@ -14,22 +24,61 @@ signal_cb(evutil_socket_t sig, short events, void *user_data) {
     event_base_loopexit(base, &delay);
 }
 
-Log* Log::instance = NULL;
+std::atomic<Log*> Log::instance(NULL);
 
 int main(int argc, char *argv[]) {
     int tcp_port = 1587, sock_port = 1589;
-    if (argc > 2) {
-        tcp_port = atoi(argv[1]);
-        sock_port = atoi(argv[2]);
+    Options options(argc, argv);
+    if (options.Positional().size() > 1) {
+        tcp_port = atoi(options.Positional()[0].c_str());
+        sock_port = atoi(options.Positional()[1].c_str());
         if (tcp_port == 0 || sock_port == 0) {
             usage();
         }
     }
+    string balance = options.Get("balance", "hash");
+    if (balance != "hash" && balance != "least") {
+        usage();
+    }
+    int balance_policy = balance == "least" ? kBalanceLeastQueued : kBalanceHash;
+    TunnelConfig config;
+    config.Load(options);
+    //ahead of every other libevent call
+    if (config.pool_cache_bytes > 0)
+        BufferPool::Install(config.pool_cache_bytes);
+    if (config.memory_budget_mb > 0) {
+        //shared by every worker's streams and tunnels
+        config.budget = new MemoryBudget((size_t)config.memory_budget_mb * 1024 * 1024,
+                                         config.memory_shed_percent);
+    }
+    if (options.Has("tls-cert")) {
+        config.tls = new TlsContext();
+        if (!config.tls->InitServer(options.Get("tls-cert", ""),
+                                    options.Get("tls-key", options.Get("tls-cert", "")))) {
+            return 1;
+        }
+        //promoted streams would leave the encrypted tunnel
+        config.features &= ~ForwardCodec::kFeatureSplice;
+        if (config.transport == TunnelConfig::kTransportUdp) {
+            LOGE << "tls is not available over the udp transport\n";
+            return 1;
+        }
+    }
+    int workers = options.GetInt("workers", 1);
+    if (options.Get("workers", "") == "auto") {
+        workers = std::thread::hardware_concurrency();
+    }
 #ifdef _WIN32
     WSADATA wsaData;
     if (0 != WSAStartup(MAKEWORD(2, 2), &wsaData)) {
         return 1;
     }
+    if (workers > 1)
+        evthread_use_windows_threads();
+#else
+    if (workers > 1)
+        evthread_use_pthreads();
+    signal(SIGPIPE, SIG_IGN);
 #endif
     struct event_base *base;
     struct event *signal_event;
@@ -47,15 +96,49 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    TCPServer * tcp_server = new TCPServer(base, "0.0.0.0", tcp_port, "0.0.0.0", sock_port);
-    if (tcp_server->Init()) {
-        LOGI << "tcp server listen on " << tcp_port << "    sock5 server listen on " << sock_port << "\n";
-        event_base_dispatch(base);
+    //workers publish into their own counter blocks, the main loop serves the scrape
+    MetricsServer* metrics = NULL;
+    if (config.metrics) {
+        metrics = new MetricsServer(base);
+        if (!metrics->Init(options.Get("metrics", ""))) {
+            return 1;
+        }
+    }
+
+    if (config.elephant_bytes > 0 && (config.features & ForwardCodec::kFeatureSplice)) {
+        config.splice = new SpliceAcceptor(base, "0.0.0.0", options.GetInt("elephant-port", tcp_port + 1));
+        if (!config.splice->Init()) {
+            return 1;
+        }
+        LOGI << "promoted streams attach on " << config.splice->GetPort() << "\n";
+    } else {
+        config.features &= ~ForwardCodec::kFeatureSplice;
+    }
+
+    if (workers > 1) {
+        WorkerGroup * worker_group = new WorkerGroup(base, "0.0.0.0", tcp_port, "0.0.0.0", sock_port, workers);
+        if (worker_group->Init(balance_policy, config, options.Has("pin"))) {
+            LOGI << "tcp server listen on " << tcp_port << "    sock5 server listen on " << sock_port
+                 << "    workers " << workers << "\n";
+            event_base_dispatch(base);
+        }
+        delete worker_group;
+    } else {
+        TCPServer * tcp_server = new TCPServer(base, "0.0.0.0", tcp_port, "0.0.0.0", sock_port);
+        tcp_server->SetBalancePolicy(balance_policy);
+        tcp_server->SetTunnelConfig(config);
+        if (tcp_server->Init()) {
+            LOGI << "tcp server listen on " << tcp_port << "    sock5 server listen on " << sock_port << "\n";
+            event_base_dispatch(base);
+        }
+        tcp_server->Close();
+        delete tcp_server;
     }
-	tcp_server->Close();
-	delete tcp_server;
+    delete config.splice;
+    delete metrics;
     event_free(signal_event);
     event_base_free(base);
+    delete config.tls;
 
     Log::GetInstance()->Destory();
 
@@ -1,4 +1,6 @@
 #include "tcp_client.h"
+#include "options.hpp"
+#include <event2/dns.h>
 
 static void
 signal_cb(evutil_socket_t sig, short events, void *user_data)
@@ -11,20 +13,63 @@ signal_cb(evutil_socket_t sig, short events, void *user_data)
 	event_base_loopexit(base, &delay);
 }
 
-Log* Log::instance = NULL;
+std::atomic<Log*> Log::instance(NULL);
 
 int main(int argc, char *argv[]) {
-	if (argc < 2)
+	Options options(argc, argv);
+	if (options.Positional().size() < 2)
 	{
+		LOGE << "usage:proxy_server [proxy addr] [proxy port] [--tunnels=N] [--protocol=1|2]"
+			 << " [--tls [--tls-ca=pem] [--tls-name=host]]"
+			 << " [--upstream=ip:port[,ip:port...] [--upstream-balance=least|ewma]"
+			 << " [--upstream-idle=N] [--upstream-age=sec] [--health-interval=sec]]"
+			 << " [--resume=0|1] [--resume-timeout=sec] [--replay-bytes=N]"
+			 << " [--reconnect-min=ms] [--reconnect-max=ms]"
+			 << " [--heartbeat=ms] [--heartbeat-max=ms] [--dead-timeout=ms]"
+			 << " [--scheduler=fifo|drr|sparse] [--frame-bytes=N] [--tunnel-buffer=N] [--metrics=[ip:]port]"
+			 << " [--idle-timeout=sec] [--connect-timeout=sec] [--close-wait-timeout=sec]"
+			 << " [--pool-cache=bytes] [--direct-write=0|1] [--io=libevent|uring] [--foreground]"
+			 << " [--transport=tcp|udp [--udp-mtu=N] [--sim-loss=percent --sim-delay=ms --sim-jitter=ms]]\n";
 		exit(1);
 	}
-	char* tcp_addr = argv[1];
-	int tcp_port = atoi(argv[2]);
+	string tcp_addr = options.Positional()[0];
+	int tcp_port = atoi(options.Positional()[1].c_str());
+	int tunnels = options.GetInt("tunnels", 1);
+	//without an upstream the agent answers socks itself and dials directly
+	string upstream_list = options.Get("upstream", "");
+	string upstream_balance = options.Get("upstream-balance", "least");
+	if (upstream_balance != "least" && upstream_balance != "ewma") {
+		LOGE << "bad upstream balance " << upstream_balance << "\n";
+		exit(1);
+	}
+	TunnelConfig config;
+	config.Load(options);
+	//ahead of every other libevent call
+	if (config.pool_cache_bytes > 0)
+		BufferPool::Install(config.pool_cache_bytes);
+	if (options.Has("tls")) {
+		config.tls = new TlsContext();
+		if (!config.tls->InitClient(options.Get("tls-ca", ""), options.Get("tls-name", ""))) {
+			return 1;
+		}
+		config.features &= ~ForwardCodec::kFeatureSplice;
+	}
+	if (config.transport == TunnelConfig::kTransportUdp) {
+		if (config.tls) {
+			LOGE << "tls is not available over the udp transport\n";
+			return 1;
+		}
+		//lanes deliver frames of different streams out of order, the
+		//numbered frames a resumed tunnel replays from would not line up
+		config.features &= ~ForwardCodec::kFeatureResume;
+	}
 #ifdef _WIN32
 	WSADATA wsa_data;
 	WSAStartup(0x0201, &wsa_data);
 #else
-	pid_t pid = fork();
+	//a supervisor or the load generator keeps the agent in the foreground
+	//so it can signal and reap it
+	pid_t pid = options.Has("foreground") ? 0 : fork();
 	if (pid > 0) {
 		return 0;
 	}
@@ -32,6 +77,7 @@ int main(int argc, char *argv[]) {
 		perror("fork failed");
 		return -1;
 	}
+	signal(SIGPIPE, SIG_IGN);
 #endif
 	struct event_base *base;
 	struct event *signal_event;
@@ -49,13 +95,48 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	TCPClient * tcp_client = new TCPClient(base, tcp_addr, tcp_port);
-	if (tcp_client->Init()) {
-		LOGI << "Init TCPClient Success!\n";
+	if (!upstream_list.empty()) {
+		config.upstream = new UpstreamGroup(base,
+											upstream_balance == "ewma" ? kUpstreamEwma : kUpstreamLeastConn,
+											options.GetInt("upstream-idle", 4),
+											options.GetInt("upstream-age", 30),
+											options.GetInt("health-interval", 5));
+		if (!config.upstream->Parse(upstream_list)) {
+			LOGE << "bad upstream list " << upstream_list << "\n";
+			return 1;
+		}
+		if (!config.upstream->Init()) {
+			return 1;
+		}
+	} else {
+		config.dns = evdns_base_new(base, EVDNS_BASE_INITIALIZE_NAMESERVERS);
+		if (!config.dns) {
+			LOGE << "Could not initialize the resolver!\n";
+			return 1;
+		}
+	}
+
+	MetricsServer* metrics = NULL;
+	if (config.metrics) {
+		metrics = new MetricsServer(base);
+		if (!metrics->Init(options.Get("metrics", ""))) {
+			return 1;
+		}
+	}
+
+	TCPClientPool * tcp_pool = new TCPClientPool(base, tcp_addr, tcp_port, tunnels, config);
+	if (tcp_pool->Init()) {
+		LOGI << "Init TCPClient Success! tunnels: " << tunnels << "\n";
 		event_base_dispatch(base);
 	}
+	delete tcp_pool;
+	delete metrics;
+	delete config.upstream;
+	if (config.dns)
+		evdns_base_free(config.dns, 0);
 	event_free(signal_event);
 	event_base_free(base);
+	delete config.tls;
 
 	Log::GetInstance()->Destory();
 	return 0;
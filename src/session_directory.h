@@ -0,0 +1,48 @@
+#ifndef _SESSION_DIRECTORY_H_
+#define _SESSION_DIRECTORY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <mutex>
+
+//a worker holding tunnel sessions
+class ISessionOwner {
+public:
+    virtual ~ISessionOwner() {};
+    //thread safe, the agent resumed the session elsewhere or gave it up
+    virtual void PostDropSession(uint64_t session) = 0;
+};
+
+//which worker holds each tunnel session, shared by the workers and the
+//accepting thread. a reconnecting tunnel is dealt to the holder of the
+//session it names, a worker offered a session it does not hold tells the
+//holder to let it go
+class SessionDirectory {
+public:
+    void Add(uint64_t session, ISessionOwner* owner) {
+        std::lock_guard<std::mutex> guard(lock_);
+        owners_[session] = owner;
+    }
+
+    //only while owner still holds it, the agent may have moved it since
+    void Remove(uint64_t session, ISessionOwner* owner) {
+        std::lock_guard<std::mutex> guard(lock_);
+        auto iter = owners_.find(session);
+        if (iter != owners_.end() && iter->second == owner)
+            owners_.erase(iter);
+    }
+
+    ISessionOwner* Find(uint64_t session) {
+        std::lock_guard<std::mutex> guard(lock_);
+        auto iter = owners_.find(session);
+        return iter != owners_.end() ? iter->second : NULL;
+    }
+
+private:
+    std::mutex lock_;
+
+    std::map<uint64_t, ISessionOwner*> owners_;
+};
+
+#endif
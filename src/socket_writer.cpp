@@ -0,0 +1,14 @@
+#include "socket_writer.h"
+
+bool SocketWriter::WriteThrough(bufferevent* bev, evbuffer* data) {
+    evbuffer* output = bufferevent_get_output(bev);
+    evutil_socket_t fd = bufferevent_getfd(bev);
+    if (fd >= 0 && evbuffer_get_length(output) == 0 &&
+            (bufferevent_get_enabled(bev) & EV_WRITE)) {
+        //a short or failed write leaves the rest in data
+        evbuffer_write(data, fd);
+    }
+    if (evbuffer_get_length(data) == 0)
+        return true;
+    return bufferevent_write_buffer(bev, data) == 0;
+}
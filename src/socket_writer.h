@@ -0,0 +1,23 @@
+#ifndef _SOCKET_WRITER_H_
+#define _SOCKET_WRITER_H_
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+//stream socket writes that skip the readiness round trip. going through
+//a bufferevent's output buffer costs an EPOLLOUT registration, a wakeup,
+//the writev and a deregistration for every chunk written to a socket
+//that keeps up; writing straight away while nothing is queued ahead
+//costs the writev alone
+class SocketWriter {
+public:
+    //writes as much of data as the socket takes when the output buffer is
+    //empty and queues the rest behind it as bufferevent_write_buffer would.
+    //errors are left for the bufferevent to run into and report. plain
+    //socket bufferevents only, a tls one would put raw bytes on the wire.
+    //false when the rest could not be queued
+    static bool WriteThrough(bufferevent* bev, evbuffer* data);
+};
+
+#endif
@@ -0,0 +1,148 @@
+#include "socks5_engine.h"
+
+#include <string.h>
+
+enum {
+    kStateGreeting = 0,
+    kStateRequest,
+    kStateDone
+};
+
+enum {
+    kVersion = 5,
+    kMethodNoAuth = 0,
+    kMethodNone = 0xff,
+    kCommandConnect = 1,
+    //ver cmd rsv atyp, the longest address (a 255 byte name) and the port
+    kMaxRequestSize = 4 + 1 + 255 + 2
+};
+
+Socks5Engine::Socks5Engine():
+    state_(kStateGreeting),
+    address_type_(0),
+    port_(0),
+    address_len_(0) {
+    memset(&address_, 0, sizeof(address_));
+}
+
+int Socks5Engine::Feed(evbuffer* in, evbuffer* out) {
+    if (state_ == kStateGreeting) {
+        int ret = ReadGreeting(in, out);
+        if (ret != kConnect)
+            return ret;
+        state_ = kStateRequest;
+    }
+    if (state_ == kStateRequest) {
+        int ret = ReadRequest(in, out);
+        if (ret == kConnect)
+            state_ = kStateDone;
+        return ret;
+    }
+    return kError;
+}
+
+int Socks5Engine::ReadGreeting(evbuffer* in, evbuffer* out) {
+    unsigned char head[2];
+    if (evbuffer_copyout(in, head, sizeof(head)) != sizeof(head))
+        return kNeedMore;
+    if (head[0] != kVersion)
+        return kError;
+    size_t len = sizeof(head) + head[1];
+    if (evbuffer_get_length(in) < len)
+        return kNeedMore;
+    unsigned char greeting[2 + 255];
+    evbuffer_remove(in, greeting, len);
+    bool no_auth = false;
+    for (size_t i = sizeof(head); i < len; i++) {
+        if (greeting[i] == kMethodNoAuth)
+            no_auth = true;
+    }
+    unsigned char reply[2] = { kVersion, (unsigned char)(no_auth ? kMethodNoAuth : kMethodNone) };
+    evbuffer_add(out, reply, sizeof(reply));
+    return no_auth ? kConnect : kError;
+}
+
+int Socks5Engine::ReadRequest(evbuffer* in, evbuffer* out) {
+    unsigned char request[kMaxRequestSize];
+    ev_ssize_t got = evbuffer_copyout(in, request, sizeof(request));
+    if (got < 5)
+        return kNeedMore;
+    if (request[0] != kVersion) {
+        EncodeReply(kReplyFailure, NULL, out);
+        return kError;
+    }
+    size_t addr_len;
+    switch (request[3]) {
+    case kAddressIPv4:
+        addr_len = 4;
+        break;
+    case kAddressIPv6:
+        addr_len = 16;
+        break;
+    case kAddressDomain:
+        addr_len = 1 + request[4];
+        break;
+    default:
+        EncodeReply(kReplyAddressNotSupported, NULL, out);
+        return kError;
+    }
+    size_t len = 4 + addr_len + 2;
+    if ((size_t)got < len)
+        return kNeedMore;
+    evbuffer_drain(in, len);
+    if (request[1] != kCommandConnect) {
+        EncodeReply(kReplyCommandNotSupported, NULL, out);
+        return kError;
+    }
+    address_type_ = request[3];
+    port_ = (request[len - 2] << 8) | request[len - 1];
+    char text[INET6_ADDRSTRLEN];
+    if (address_type_ == kAddressIPv4) {
+        sockaddr_in* sin = (sockaddr_in*)&address_;
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, request + 4, 4);
+        sin->sin_port = htons(port_);
+        address_len_ = sizeof(sockaddr_in);
+        host_ = evutil_inet_ntop(AF_INET, &sin->sin_addr, text, sizeof(text));
+    } else if (address_type_ == kAddressIPv6) {
+        sockaddr_in6* sin6 = (sockaddr_in6*)&address_;
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, request + 4, 16);
+        sin6->sin6_port = htons(port_);
+        address_len_ = sizeof(sockaddr_in6);
+        host_ = evutil_inet_ntop(AF_INET6, &sin6->sin6_addr, text, sizeof(text));
+    } else {
+        if (request[4] == 0) {
+            EncodeReply(kReplyHostUnreachable, NULL, out);
+            return kError;
+        }
+        host_.assign((const char*)request + 5, request[4]);
+    }
+    return kConnect;
+}
+
+void Socks5Engine::EncodeReply(int reply, const sockaddr* bound, evbuffer* out) {
+    unsigned char buf[4 + 16 + 2];
+    size_t len;
+    buf[0] = kVersion;
+    buf[1] = (unsigned char)reply;
+    buf[2] = 0;
+    if (bound && bound->sa_family == AF_INET6) {
+        const sockaddr_in6* sin6 = (const sockaddr_in6*)bound;
+        buf[3] = kAddressIPv6;
+        memcpy(buf + 4, &sin6->sin6_addr, 16);
+        memcpy(buf + 20, &sin6->sin6_port, 2);
+        len = 22;
+    } else {
+        //failures and unknown families report 0.0.0.0:0
+        buf[3] = kAddressIPv4;
+        memset(buf + 4, 0, 6);
+        if (bound && bound->sa_family == AF_INET) {
+            const sockaddr_in* sin = (const sockaddr_in*)bound;
+            memcpy(buf + 4, &sin->sin_addr, 4);
+            memcpy(buf + 8, &sin->sin_port, 2);
+        }
+        len = 10;
+    }
+    evbuffer_add(out, buf, len);
+}
@@ -0,0 +1,93 @@
+#ifndef _SOCKS5_ENGINE_H_
+#define _SOCKS5_ENGINE_H_
+
+#include <stdint.h>
+#include <string>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include <event2/util.h>
+#include <event2/buffer.h>
+
+//server side of the socks5 handshake (rfc 1928) run inside the agent on
+//the bytes the forwarder relays for a new stream, so the agent can dial
+//the destination itself instead of handing the stream to a local socks
+//daemon. only the no auth method and CONNECT are served; ipv4, ipv6 and
+//domain name targets are accepted
+class Socks5Engine {
+public:
+    enum {
+        kNeedMore = 0,
+        //a complete CONNECT was read, GetTarget describes where to dial
+        kConnect,
+        //a failure reply was queued, the stream should close after it
+        kError
+    };
+    enum {
+        kReplySucceeded = 0,
+        kReplyFailure = 1,
+        kReplyHostUnreachable = 4,
+        kReplyConnectionRefused = 5,
+        kReplyCommandNotSupported = 7,
+        kReplyAddressNotSupported = 8
+    };
+    enum {
+        kAddressIPv4 = 1,
+        kAddressDomain = 3,
+        kAddressIPv6 = 4
+    };
+
+    Socks5Engine();
+
+    //consumes handshake bytes from in and queues replies on out. bytes
+    //after the CONNECT request stay in in, they are the stream payload
+    int Feed(evbuffer* in, evbuffer* out);
+
+    int GetAddressType() const {
+        return address_type_;
+    }
+
+    //the domain name for kAddressDomain, the literal address otherwise
+    const std::string& GetHost() const {
+        return host_;
+    }
+
+    int GetPort() const {
+        return port_;
+    }
+
+    //address to connect to for ipv4 and ipv6 targets
+    const sockaddr* GetAddress(int* len) const {
+        *len = address_len_;
+        return (const sockaddr*)&address_;
+    }
+
+    //reply to the CONNECT, bound is the local end of the upstream socket
+    //or NULL when the connect failed
+    static void EncodeReply(int reply, const sockaddr* bound, evbuffer* out);
+
+private:
+    int ReadGreeting(evbuffer* in, evbuffer* out);
+
+    int ReadRequest(evbuffer* in, evbuffer* out);
+
+    int state_;
+
+    int address_type_;
+
+    std::string host_;
+
+    int port_;
+
+    sockaddr_storage address_;
+
+    int address_len_;
+};
+
+#endif
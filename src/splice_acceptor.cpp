@@ -0,0 +1,150 @@
+#include "splice_acceptor.h"
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#include "log.hpp"
+#include "tcp_server.h"
+#include "splice_relay.h"
+
+struct AttachTask {
+    TCPServer* server;
+    HashType stream;
+    evutil_socket_t fd;
+    evbuffer* data;
+};
+
+static void attachcb(evutil_socket_t fd, short what, void *ctx) {
+    AttachTask* pTask = static_cast<AttachTask*>(ctx);
+    pTask->server->HandleSpliceAttach(pTask->stream, pTask->fd, pTask->data);
+    delete pTask;
+}
+
+static void
+accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+          struct sockaddr *sa, int socklen, void *user_data) {
+    SpliceAcceptor* pAcceptor = static_cast<SpliceAcceptor*>(user_data);
+    pAcceptor->OnAccept(fd);
+}
+
+static void readcb(struct bufferevent *bev, void *ctx) {
+    SpliceAcceptor* pAcceptor = static_cast<SpliceAcceptor*>(ctx);
+    pAcceptor->OnAttachRead(bev);
+}
+
+static void eventcb(struct bufferevent *bev, short events, void *ctx) {
+    SpliceAcceptor* pAcceptor = static_cast<SpliceAcceptor*>(ctx);
+    pAcceptor->OnAttachError(bev);
+}
+
+SpliceAcceptor::SpliceAcceptor(event_base* event_loop, std::string address, int port):
+    event_loop_(event_loop),
+    listener_(NULL),
+    address_(address),
+    port_(port) {
+}
+
+SpliceAcceptor::~SpliceAcceptor() {
+    if (listener_)
+        evconnlistener_free(listener_);
+    for (auto bev : pending_) {
+        evutil_closesocket(bufferevent_getfd(bev));
+        bufferevent_free(bev);
+    }
+}
+
+bool SpliceAcceptor::Init() {
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    inet_pton(AF_INET, address_.c_str(), &sin.sin_addr.s_addr);
+    sin.sin_port = htons(port_);
+    listener_ = evconnlistener_new_bind(event_loop_, accept_cb, this,
+                                        LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, -1,
+                                        (struct sockaddr*)&sin,
+                                        sizeof(sin));
+    if (!listener_) {
+        LOGE << "Could not create the splice listener!\n";
+        return false;
+    }
+    return true;
+}
+
+uint64_t SpliceAcceptor::Register(TCPServer* server, event_base* owner, HashType stream) {
+    Entry entry = { server, owner, stream };
+    uint64_t token;
+    std::lock_guard<std::mutex> guard(lock_);
+    do {
+        evutil_secure_rng_get_bytes(&token, sizeof(token));
+    } while (token == 0 || entries_.count(token) > 0);
+    entries_[token] = entry;
+    return token;
+}
+
+void SpliceAcceptor::Unregister(uint64_t token) {
+    std::lock_guard<std::mutex> guard(lock_);
+    entries_.erase(token);
+}
+
+void SpliceAcceptor::OnAccept(evutil_socket_t fd) {
+    //no close on free, a matched socket outlives this bufferevent
+    bufferevent* bev = bufferevent_socket_new(event_loop_, fd, 0);
+    if (!bev) {
+        evutil_closesocket(fd);
+        return;
+    }
+    timeval timeout = { 10, 0 };
+    bufferevent_set_timeouts(bev, &timeout, NULL);
+    bufferevent_setwatermark(bev, EV_READ, SpliceRelay::kAttachSize, 0);
+    bufferevent_setcb(bev, readcb, NULL, eventcb, this);
+    bufferevent_enable(bev, EV_READ);
+    pending_.insert(bev);
+}
+
+void SpliceAcceptor::OnAttachRead(bufferevent* bev) {
+    evbuffer* input = bufferevent_get_input(bev);
+    unsigned char attach[SpliceRelay::kAttachSize];
+    if (evbuffer_remove(input, attach, sizeof(attach)) != sizeof(attach))
+        return;
+    uint64_t token;
+    Entry entry;
+    bool found = false;
+    if (SpliceRelay::DecodeAttach(attach, &token)) {
+        std::lock_guard<std::mutex> guard(lock_);
+        std::map<uint64_t, Entry>::iterator it = entries_.find(token);
+        if (it != entries_.end()) {
+            entry = it->second;
+            entries_.erase(it);
+            found = true;
+        }
+    }
+    if (!found) {
+        LOGW << "splice attach with unknown token\n";
+        OnAttachError(bev);
+        return;
+    }
+    //bytes the agent already relayed behind the token
+    AttachTask* task = new AttachTask();
+    task->server = entry.server;
+    task->stream = entry.stream;
+    task->fd = bufferevent_getfd(bev);
+    task->data = evbuffer_new();
+    evbuffer_add_buffer(task->data, input);
+    pending_.erase(bev);
+    bufferevent_free(bev);
+    timeval now = { 0, 0 };
+    event_base_once(entry.owner, -1, EV_TIMEOUT, attachcb, task, &now);
+}
+
+void SpliceAcceptor::OnAttachError(bufferevent* bev) {
+    pending_.erase(bev);
+    evutil_closesocket(bufferevent_getfd(bev));
+    bufferevent_free(bev);
+}
@@ -0,0 +1,71 @@
+#ifndef _SPLICE_ACCEPTOR_H_
+#define _SPLICE_ACCEPTOR_H_
+
+#include <stdint.h>
+#include <map>
+#include <set>
+#include <mutex>
+#include <string>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+#include "forward_codec.h"
+
+class TCPServer;
+
+//forwarder end of stream promotion. a stream about to leave the tunnel
+//registers a token and sends it to the agent in kMigrate; the agent dials
+//this listener and presents the token as the first bytes. the socket is
+//then posted to the loop that owns the stream, which may be another
+//worker than the one running this listener
+class SpliceAcceptor {
+public:
+    SpliceAcceptor(event_base* event_loop, std::string address, int port);
+
+    ~SpliceAcceptor();
+
+    bool Init();
+
+    int GetPort() const {
+        return port_;
+    }
+
+    //thread safe
+    uint64_t Register(TCPServer* server, event_base* owner, HashType stream);
+
+    //thread safe
+    void Unregister(uint64_t token);
+
+    void OnAccept(evutil_socket_t fd);
+
+    void OnAttachRead(bufferevent* bev);
+
+    void OnAttachError(bufferevent* bev);
+
+private:
+    struct Entry {
+        TCPServer* server;
+        event_base* owner;
+        HashType stream;
+    };
+
+    event_base* event_loop_;
+
+    evconnlistener* listener_;
+
+    std::string address_;
+
+    int port_;
+
+    std::mutex lock_;
+
+    std::map<uint64_t, Entry> entries_;
+
+    //raw connections that have not shown their token yet
+    std::set<bufferevent*> pending_;
+};
+
+#endif
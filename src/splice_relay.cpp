@@ -0,0 +1,224 @@
+#include "splice_relay.h"
+
+#include <string.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#include "log.hpp"
+
+static const char kAttachMagic[4] = { 'R', 'P', 'A', 'T' };
+
+enum {
+    kPipeSize = 256 * 1024,
+    //chunks moved per wakeup before the direction yields to the loop
+    kMaxRounds = 16
+};
+
+static void relaycb(evutil_socket_t fd, short what, void *ctx) {
+    SpliceRelay::Direction* d = static_cast<SpliceRelay::Direction*>(ctx);
+    d->relay->OnEvent(d->index);
+}
+
+bool SpliceRelay::Supported() {
+#ifdef __linux__
+    return true;
+#else
+    return false;
+#endif
+}
+
+SpliceRelay::SpliceRelay(event_base* event_loop, evutil_socket_t a, evutil_socket_t b):
+    event_loop_(event_loop) {
+    socket_[0] = a;
+    socket_[1] = b;
+    for (int i = 0; i < 2; i++) {
+        Direction& d = dir_[i];
+        d.relay = this;
+        d.index = i;
+        d.from = socket_[i];
+        d.to = socket_[1 - i];
+        d.pipe[0] = d.pipe[1] = -1;
+        d.in_pipe = 0;
+        d.pending = evbuffer_new();
+        d.read_event = NULL;
+        d.write_event = NULL;
+        d.eof = false;
+        d.done = false;
+        d.bytes = 0;
+    }
+}
+
+SpliceRelay::~SpliceRelay() {
+    for (int i = 0; i < 2; i++) {
+        Direction& d = dir_[i];
+        if (d.read_event)
+            event_free(d.read_event);
+        if (d.write_event)
+            event_free(d.write_event);
+        evbuffer_free(d.pending);
+#ifdef __linux__
+        if (d.pipe[0] >= 0)
+            close(d.pipe[0]);
+        if (d.pipe[1] >= 0)
+            close(d.pipe[1]);
+#endif
+        if (socket_[i] >= 0)
+            evutil_closesocket(socket_[i]);
+    }
+}
+
+void SpliceRelay::Queue(int side, evbuffer* data) {
+    //bytes for side 0 travel in direction 1 and the other way round
+    evbuffer_unfreeze(data, 1);
+    evbuffer_add_buffer(dir_[1 - side].pending, data);
+}
+
+void SpliceRelay::Queue(int side, const void* data, size_t len) {
+    evbuffer_add(dir_[1 - side].pending, data, len);
+}
+
+bool SpliceRelay::Start() {
+#ifdef __linux__
+    for (int i = 0; i < 2; i++) {
+        Direction& d = dir_[i];
+        evutil_make_socket_nonblocking(d.from);
+        if (pipe2(d.pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+            LOGE << "splice relay could not create a pipe\n";
+            Destroy();
+            return false;
+        }
+        fcntl(d.pipe[1], F_SETPIPE_SZ, kPipeSize);
+        d.read_event = event_new(event_loop_, d.from, EV_READ, relaycb, &d);
+        d.write_event = event_new(event_loop_, d.to, EV_WRITE, relaycb, &d);
+    }
+    //pump both directions once, pending leftovers go out first
+    for (int i = 0; i < 2; i++) {
+        if (!Pump(dir_[i])) {
+            Destroy();
+            return false;
+        }
+    }
+    if (dir_[0].done && dir_[1].done)
+        Destroy();
+    return true;
+#else
+    Destroy();
+    return false;
+#endif
+}
+
+void SpliceRelay::OnEvent(int direction) {
+    if (!Pump(dir_[direction]) || (dir_[0].done && dir_[1].done))
+        Destroy();
+}
+
+bool SpliceRelay::Pump(Direction& d) {
+#ifdef __linux__
+    for (int round = 0; round < kMaxRounds && !d.done; round++) {
+        //leftovers of the replaced bufferevents keep their place in line
+        if (evbuffer_get_length(d.pending) > 0) {
+            int n = evbuffer_write(d.pending, d.to);
+            if (n < 0 && errno != EAGAIN && errno != EINTR)
+                return false;
+            if (n > 0)
+                d.bytes += n;
+            if (evbuffer_get_length(d.pending) > 0) {
+                event_add(d.write_event, NULL);
+                return true;
+            }
+            continue;
+        }
+        while (d.in_pipe > 0) {
+            ssize_t n = splice(d.pipe[0], NULL, d.to, NULL, d.in_pipe,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EAGAIN) {
+                    event_add(d.write_event, NULL);
+                    return true;
+                }
+                return false;
+            }
+            d.in_pipe -= n;
+            d.bytes += n;
+        }
+        if (d.eof) {
+            shutdown(d.to, SHUT_WR);
+            d.done = true;
+            break;
+        }
+        ssize_t n = splice(d.from, NULL, d.pipe[1], NULL, kPipeSize,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0) {
+            d.eof = true;
+        } else if (n < 0) {
+            if (errno != EAGAIN)
+                return false;
+            event_add(d.read_event, NULL);
+            return true;
+        } else {
+            d.in_pipe += n;
+        }
+    }
+    //out of rounds, come back on the next loop iteration
+    if (!d.done)
+        event_active(d.read_event, EV_READ, 1);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void SpliceRelay::Destroy() {
+    LOGI << "splice relay closed, " << dir_[0].bytes << " / " << dir_[1].bytes << " bytes\n";
+    delete this;
+}
+
+void SpliceRelay::EncodeAttach(uint64_t token, unsigned char* out) {
+    memcpy(out, kAttachMagic, sizeof(kAttachMagic));
+    for (int i = 0; i < 8; i++)
+        out[4 + i] = (unsigned char)(token >> (8 * i));
+}
+
+bool SpliceRelay::DecodeAttach(const unsigned char* in, uint64_t* token) {
+    if (memcmp(in, kAttachMagic, sizeof(kAttachMagic)) != 0)
+        return false;
+    *token = 0;
+    for (int i = 0; i < 8; i++)
+        *token |= (uint64_t)in[4 + i] << (8 * i);
+    return true;
+}
+
+evutil_socket_t SpliceRelay::ConnectRaw(const std::string& ip, int port) {
+#ifdef __linux__
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    inet_pton(AF_INET, ip.c_str(), &sin.sin_addr.s_addr);
+    sin.sin_port = htons(port);
+    evutil_socket_t fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr*)&sin, sizeof(sin)) != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+evutil_socket_t SpliceRelay::Duplicate(evutil_socket_t fd) {
+#ifdef __linux__
+    return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+#else
+    return -1;
+#endif
+}
@@ -0,0 +1,81 @@
+#ifndef _SPLICE_RELAY_H_
+#define _SPLICE_RELAY_H_
+
+#include <stdint.h>
+#include <string>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+//relays between two sockets without copying through userspace: bytes go
+//socket -> pipe -> socket with splice(). used for streams promoted off the
+//framed tunnel onto their own raw connection. the relay owns both sockets
+//and deletes itself once both directions reached eof or one side failed
+class SpliceRelay {
+public:
+    enum {
+        kAttachSize = 12
+    };
+
+    //false where splice() is not available, the feature is never offered
+    static bool Supported();
+
+    SpliceRelay(event_base* event_loop, evutil_socket_t a, evutil_socket_t b);
+
+    //bytes that must reach socket side (0 = a, 1 = b) before any spliced
+    //byte does: buffered leftovers of the bufferevents being replaced.
+    //data is drained even while a bufferevent keeps its start frozen
+    void Queue(int side, evbuffer* data);
+
+    void Queue(int side, const void* data, size_t len);
+
+    //on failure the relay closes everything and deletes itself
+    bool Start();
+
+    void OnEvent(int direction);
+
+    //first bytes on a raw connection: magic(4) token(8)
+    static void EncodeAttach(uint64_t token, unsigned char* out);
+
+    static bool DecodeAttach(const unsigned char* in, uint64_t* token);
+
+    //nonblocking connect, the relay waits for writability like any write
+    static evutil_socket_t ConnectRaw(const std::string& ip, int port);
+
+    //second descriptor for a socket still owned by a bufferevent, so the
+    //bufferevent can be freed without closing the connection
+    static evutil_socket_t Duplicate(evutil_socket_t fd);
+
+    //one way of the relay, handed to its events as the callback argument
+    struct Direction {
+        SpliceRelay* relay;
+        int index;
+        evutil_socket_t from;
+        evutil_socket_t to;
+        int pipe[2];
+        size_t in_pipe;
+        evbuffer* pending;
+        event* read_event;
+        event* write_event;
+        bool eof;
+        bool done;
+        uint64_t bytes;
+    };
+
+private:
+    ~SpliceRelay();
+
+    //false once the relay has to be torn down
+    bool Pump(Direction& d);
+
+    void Destroy();
+
+    event_base* event_loop_;
+
+    evutil_socket_t socket_[2];
+
+    //direction 0 carries a -> b, direction 1 carries b -> a
+    Direction dir_[2];
+};
+
+#endif
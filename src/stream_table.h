@@ -0,0 +1,210 @@
+#ifndef _STREAM_TABLE_H_
+#define _STREAM_TABLE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "forward_codec.h"
+
+//stream ids handed out by the forwarder: generation(12) | slot index(20).
+//the index resolves a frame with one vector access, the generation is
+//bumped whenever a slot is freed, so a late frame for a closed stream
+//never reaches the stream that reuses its slot
+template <typename T>
+class StreamTable {
+public:
+    enum {
+        kIndexBits = 20,
+        kIndexMask = (1 << kIndexBits) - 1,
+        kGenerationMask = (1 << (32 - kIndexBits)) - 1,
+        //the last index is left out so no id equals kHashTypeInvalid
+        kMaxSlots = kIndexMask
+    };
+
+    StreamTable():
+        size_(0) {
+    }
+
+    bool Full() const {
+        return free_.empty() && slots_.size() >= kMaxSlots;
+    }
+
+    //returns kHashTypeInvalid when every slot is taken
+    HashType Insert(T* value) {
+        uint32_t index;
+        if (!free_.empty()) {
+            index = free_.back();
+            free_.pop_back();
+        } else {
+            if (slots_.size() >= kMaxSlots)
+                return kHashTypeInvalid;
+            index = (uint32_t)slots_.size();
+            slots_.push_back(Slot());
+        }
+        slots_[index].value = value;
+        size_++;
+        return (slots_[index].generation << kIndexBits) | index;
+    }
+
+    T* Find(HashType id) const {
+        uint32_t index = id & kIndexMask;
+        if (index >= slots_.size())
+            return NULL;
+        const Slot& slot = slots_[index];
+        if (slot.generation != (id >> kIndexBits))
+            return NULL;
+        return slot.value;
+    }
+
+    bool Remove(HashType id) {
+        if (!Find(id))
+            return false;
+        uint32_t index = id & kIndexMask;
+        slots_[index].value = NULL;
+        slots_[index].generation = (slots_[index].generation + 1) & kGenerationMask;
+        free_.push_back(index);
+        size_--;
+        return true;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    //copy out the live values, callers may remove entries while walking them
+    void Snapshot(std::vector<T*>* values) const {
+        values->reserve(size_);
+        for (size_t i = 0; i < slots_.size(); i++) {
+            if (slots_[i].value)
+                values->push_back(slots_[i].value);
+        }
+    }
+
+private:
+    struct Slot {
+        Slot():
+            value(NULL),
+            generation(0) {
+        }
+        T* value;
+        uint32_t generation;
+    };
+
+    std::vector<Slot> slots_;
+
+    //freed slot indexes, reused last in first out while still cache warm
+    std::vector<uint32_t> free_;
+
+    size_t size_;
+};
+
+//ids chosen by the peer, kept in an open addressed table with linear
+//probing. the agent uses it so it also copes with the hashed ids an
+//older forwarder sends
+template <typename T>
+class StreamMap {
+public:
+    StreamMap():
+        size_(0),
+        bits_(0) {
+        Rehash(6);
+    }
+
+    //false when the id is already bound
+    bool Insert(HashType id, T* value) {
+        if (Find(id))
+            return false;
+        if ((size_ + 1) * 2 > entries_.size())
+            Rehash(bits_ + 1);
+        Place(id, value);
+        size_++;
+        return true;
+    }
+
+    T* Find(HashType id) const {
+        size_t mask = entries_.size() - 1;
+        for (size_t i = Home(id); entries_[i].value; i = (i + 1) & mask) {
+            if (entries_[i].id == id)
+                return entries_[i].value;
+        }
+        return NULL;
+    }
+
+    bool Remove(HashType id) {
+        size_t mask = entries_.size() - 1;
+        size_t i = Home(id);
+        while (entries_[i].value && entries_[i].id != id)
+            i = (i + 1) & mask;
+        if (!entries_[i].value)
+            return false;
+        //backward shift, so lookups never need tombstones
+        size_t hole = i;
+        for (size_t j = (i + 1) & mask; entries_[j].value; j = (j + 1) & mask) {
+            size_t home = Home(entries_[j].id);
+            if (((j - home) & mask) >= ((j - hole) & mask)) {
+                entries_[hole] = entries_[j];
+                hole = j;
+            }
+        }
+        entries_[hole] = Entry();
+        size_--;
+        return true;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    //copy out the live values, callers may remove entries while walking them
+    void Snapshot(std::vector<T*>* values) const {
+        values->reserve(size_);
+        for (size_t i = 0; i < entries_.size(); i++) {
+            if (entries_[i].value)
+                values->push_back(entries_[i].value);
+        }
+    }
+
+private:
+    struct Entry {
+        Entry():
+            id(kHashTypeInvalid),
+            value(NULL) {
+        }
+        HashType id;
+        T* value;
+    };
+
+    size_t Home(HashType id) const {
+        //fibonacci hashing, the high bits of the product are well mixed
+        return (uint32_t)(id * 2654435769u) >> (32 - bits_);
+    }
+
+    void Place(HashType id, T* value) {
+        size_t mask = entries_.size() - 1;
+        size_t i = Home(id);
+        while (entries_[i].value)
+            i = (i + 1) & mask;
+        entries_[i].id = id;
+        entries_[i].value = value;
+    }
+
+    void Rehash(int bits) {
+        std::vector<Entry> old;
+        old.swap(entries_);
+        bits_ = bits;
+        entries_.resize((size_t)1 << bits_);
+        for (size_t i = 0; i < old.size(); i++) {
+            if (old[i].value)
+                Place(old[i].id, old[i].value);
+        }
+    }
+
+    std::vector<Entry> entries_;
+
+    size_t size_;
+
+    int bits_;
+};
+
+#endif
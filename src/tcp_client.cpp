@@ -1,11 +1,29 @@
 #include "tcp_client.h"
 
-TCPClient::TCPClient(event_base* event_loop, string ip, int port):
+TCPClient::TCPClient(event_base* event_loop,
+                     string ip,
+                     int port,
+                     const TunnelConfig& config,
+                     TCPClientPool* pool):
     event_loop_(event_loop),
+    pool_(pool),
+    config_(config),
+    session_(NULL),
+    resuming_(false),
+    lost_time_(0),
+    reconnect_event_(NULL),
+    attempts_(0),
+    batcher_(NULL),
+    compressor_(NULL),
+    scheduler_(NULL),
     connect_address_(ip),
     connect_port_(port),
+    slot_(0),
+    data_to_send_(evbuffer_new()),
     heart_(0),
     periodic_event_(NULL),
+    monitor_(config.heartbeat_ms, config.heartbeat_max_ms, config.dead_timeout_ms),
+    heartbeat_event_(NULL),
     status_(kConstruct) {
 }
 
@@ -16,18 +34,31 @@ static void readcb(struct bufferevent *bev, void *ctx) {
 
 static void
 writecb(struct bufferevent *bev, void *user_data) {
-    struct evbuffer *output = bufferevent_get_output(bev);
-    if (evbuffer_get_length(output) == 0) {
-        ITCPClientNotify* pNotify = static_cast<ITCPClientNotify*>(user_data);
-        pNotify->OnSockWrote(bev);
-    }
+    //output drained below the write low watermark
+    ITCPClientNotify* pNotify = static_cast<ITCPClientNotify*>(user_data);
+    pNotify->OnSockWrote(bev);
+}
+
+static void metricscb(evutil_socket_t fd, short what, void *ctx) {
+    TCPClientPool* pPool = static_cast<TCPClientPool*>(ctx);
+    pPool->SampleMetrics();
 }
 
 static void periodiccb(evutil_socket_t fd, short what, void *ctx) {
-    IPeriodicNotify* pNotify = static_cast<IPeriodicNotify*>(static_cast<TCPClient*>(ctx));
+    IPeriodicNotify* pNotify = static_cast<IPeriodicNotify*>(ctx);
     pNotify->HandlePeriodic();
 }
 
+static void heartbeatcb(evutil_socket_t fd, short what, void *ctx) {
+    TCPClient* pClient = static_cast<TCPClient*>(ctx);
+    pClient->HandleHeartbeat();
+}
+
+static void reconnectcb(evutil_socket_t fd, short what, void *ctx) {
+    TCPClient* pClient = static_cast<TCPClient*>(ctx);
+    pClient->Reconnect();
+}
+
 static void eventcb(struct bufferevent *bev, short events, void *ptr) {
     ITCPClientNotify* pNotify = static_cast<ITCPClientNotify*>(ptr);
     if (events & BEV_EVENT_CONNECTED) {
@@ -39,15 +70,27 @@ static void eventcb(struct bufferevent *bev, short events, void *ptr) {
 }
 
 
-bufferevent* CreateConnectSocket(event_base* base, string ip, int port, void* ctx) {
+bufferevent* CreateConnectSocket(event_base* base, string ip, int port, void* ctx, TlsContext* tls = NULL,
+                                 UringLoop* uring = NULL) {
     struct sockaddr_in sin;
     memset(&sin, 0, sizeof(sin));
     sin.sin_family = AF_INET;
     inet_pton(AF_INET, ip.c_str(), &sin.sin_addr.s_addr);
     sin.sin_port = htons(port);
-    struct bufferevent *bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+    struct bufferevent *bev;
+    if (tls)
+        bev = tls->NewConnectSocket(base);
+    else if (uring)
+        bev = UringLink::Connect(uring, (struct sockaddr *)&sin, sizeof(sin));
+    else
+        bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+    if (!bev)
+        return NULL;
     bufferevent_setcb(bev, readcb, writecb, eventcb, ctx);
     bufferevent_enable(bev, EV_READ | EV_WRITE);
+    //the link dials on its own
+    if (!tls && uring)
+        return bev;
 
     if (bufferevent_socket_connect(bev, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
         /* Error starting connection */
@@ -57,6 +100,17 @@ bufferevent* CreateConnectSocket(event_base* base, string ip, int port, void* ct
     return bev;
 }
 
+//the link stands in for the socket and reports BEV_EVENT_CONNECTED once
+//the forwarder answered
+bufferevent* CreateDatagramSocket(event_base* base, string ip, int port, uint8_t slot, void* ctx, const TunnelConfig& config) {
+    bufferevent* bev = DatagramLink::Connect(base, ip, port, slot, config);
+    if (!bev)
+        return NULL;
+    bufferevent_setcb(bev, readcb, writecb, eventcb, ctx);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+    return bev;
+}
+
 int64_t GetTimeStamp() {
 #ifdef _WIN32
     _timeb timebuffer;
@@ -69,68 +123,164 @@ int64_t GetTimeStamp() {
 #endif
 }
 
+bufferevent* TCPClient::Dial() {
+    if (config_.transport == TunnelConfig::kTransportUdp)
+        return CreateDatagramSocket(event_loop_, connect_address_, connect_port_, slot_, this, config_);
+    return CreateConnectSocket(event_loop_, connect_address_, connect_port_, this, config_.tls, GetUring());
+}
+
 bool TCPClient::Init() {
-    socket_ = CreateConnectSocket(event_loop_, connect_address_, connect_port_, this);
+    socket_ = Dial();
     if (!socket_) {
         return false;
     }
+    batcher_ = new FrameBatcher(event_loop_, &codec_, config_.batch_bytes, config_.batch_delay_us);
+    batcher_->SetOutput(bufferevent_get_output(socket_));
+    reconnect_event_ = event_new(event_loop_, -1, 0, reconnectcb, this);
+    heartbeat_event_ = event_new(event_loop_, -1, 0, heartbeatcb, this);
+    if (config_.features & ForwardCodec::kFeatureResume)
+        session_ = new TunnelSession(TunnelSession::NewId(), config_.replay_bytes);
+    if (config_.scheduler != FrameScheduler::kFifo)
+        scheduler_ = new FrameScheduler(config_.frame_bytes ? config_.frame_bytes : 16 * 1024,
+                                        config_.scheduler == FrameScheduler::kSparse);
     //Ӷʱ
     timeval thrity_sec = { 30, 0 };
-    periodic_event_ = event_new(event_loop_, -1, EV_PERSIST | EV_TIMEOUT, periodiccb, this);
+    periodic_event_ = event_new(event_loop_, -1, EV_PERSIST | EV_TIMEOUT, periodiccb,
+                                static_cast<IPeriodicNotify*>(this));
     event_add(periodic_event_, &thrity_sec);
     status_ = kInit;
     return true;
 }
 
 void TCPClient::AppendData(ForwardData& data) {
-    data_to_send_.insert(data_to_send_.end(), (char*)&data.len_, (char*)&data.len_ + sizeof(uint32_t));
-    data_to_send_.insert(data_to_send_.end(), (char*)&data.to_, (char*)&data.to_ + sizeof(HashType));
-    data_to_send_.insert(data_to_send_.end(), (char*)&data.op_, (char*)&data.op_ + sizeof(uint8_t));
-    data_to_send_.insert(data_to_send_.end(), data.data_, data.data_ + data.len_);
-    WriteToSock();
+    if (!scheduler_ || !FrameScheduler::IsStreamOp(data.op_)) {
+        SendFrame(data);
+        return;
+    }
+    scheduler_->Push(data);
+    Drain();
+}
+
+void TCPClient::Drain() {
+    //stream frames wait here until the tunnel is up and caught up
+    if (status_ != kConnected || resuming_)
+        return;
+    ForwardData data(kHashTypeInvalid);
+    while (GetBufferedBytes() < (size_t)config_.tunnel_buffer && scheduler_->Pop(data))
+        SendFrame(data);
+}
+
+size_t TCPClient::GetBufferedBytes() {
+    return evbuffer_get_length(bufferevent_get_output(socket_)) + batcher_->Pending();
+}
+
+void TCPClient::OnSockWrote(bufferevent * bev) {
+    if (scheduler_)
+        Drain();
+}
+
+void TCPClient::SendFrame(ForwardData& data) {
+    if ((resuming_ || codec_.HasFeature(ForwardCodec::kFeatureResume)) &&
+            TunnelSession::IsSequenced(data.op_)) {
+        session_->OnSend(data);
+        //the replay sends it once the session is picked up again
+        if (resuming_)
+            return;
+    }
+    if (status_ <= kInit) {
+        Metrics::OnFrame(kMetricsOut, data.len_);
+        codec_.Encode(data, data_to_send_);
+        return;
+    }
+    assert(status_ == kConnected || status_ == kCloseWait);
+    batcher_->Write(data);
 }
 
 bool TCPClient::WriteToSock() {
-    int send_size = data_to_send_.size();
-    if (status_ <= kInit || send_size == 0) return false;
+    if (status_ <= kInit || evbuffer_get_length(data_to_send_) == 0) return false;
     assert(status_ == kConnected || status_ == kCloseWait);
-    if (0 != bufferevent_write(socket_, data_to_send_.data(), send_size)) {
+    if (0 != bufferevent_write_buffer(socket_, data_to_send_)) {
         LOGE << "bufferevent_write error\n";
         return false;
     }
-    data_to_send_.clear();
     return true;
 }
 
 void TCPClient::OnSockRead(bufferevent *bev) {
-    struct evbuffer *input = bufferevent_get_input(socket_);
-    size_t input_len = evbuffer_get_length(input);
-    shared_ptr<char> recv_buffer(new char[input_len]);
-    int recv_size = evbuffer_remove(input, recv_buffer.get(), input_len);
-    assert(recv_size == input_len);
-    data_to_recv_.insert(data_to_recv_.end(), recv_buffer.get(), recv_buffer.get() + input_len);
+    monitor_.OnReceive(PeerMonitor::Now());
     ParseData();
 }
 
 void TCPClient::ParseData() {
-    while (data_to_recv_.size() > 4) {
-        size_t size = data_to_recv_.size();
-        char* pData = data_to_recv_.data();
-        int datalen = *(int*)pData;
-        uint32_t needlen = datalen + offsetof(ForwardData, data_);
-        if (size < needlen) return;
-        HashType to = *(HashType*)(pData + offsetof(ForwardData, to_));
-        uint8_t op = *(uint8_t*)(pData + offsetof(ForwardData, op_));
-        ForwardData data(to, datalen, pData + offsetof(ForwardData, data_), op);
-        data_to_recv_.erase(data_to_recv_.begin(), data_to_recv_.begin() + needlen);
+    //frames are decoded in place from the socket's input buffer
+    struct evbuffer *input = bufferevent_get_input(socket_);
+    while (true) {
+        ForwardData data(kHashTypeInvalid);
+        int ret = codec_.Decode(input, data);
+        if (ret == ForwardCodec::kNeedMore) return;
+        if (ret == ForwardCodec::kFrameError) {
+            LOGE << "bad frame on tunnel\n";
+            Disconnect(false);
+            return;
+        }
+        Metrics::OnFrame(kMetricsIn, data.len_);
+        HashType to = data.to_;
+        uint8_t op = data.op_;
+        if (codec_.HasFeature(ForwardCodec::kFeatureResume) && TunnelSession::IsSequenced(op)) {
+            session_->OnReceive(data);
+            if (session_->AckDue())
+                SendAck();
+        }
+        if (op == ForwardData::kAck) {
+            if (!session_ || !session_->OnAck(data))
+                LOGW << "bad ack on tunnel\n";
+            continue;
+        }
         if (op == ForwardData::kHeartBeat) {
             last_heart_time_ = GetTimeStamp();
-            LOGI << "client recieve heart beat" << "\n";
+            if (!codec_.HasFeature(ForwardCodec::kFeatureHeartbeat)) {
+                LOGI << "client recieve heart beat" << "\n";
+                continue;
+            }
+            ForwardData echo(kHashTypeInvalid, ForwardData::kHeartBeat);
+            if (monitor_.OnHeartbeat(data, PeerMonitor::Now(), echo))
+                AppendData(echo);
+            continue;
+        }
+        if (op == ForwardData::kHello) {
+            HandleHello(data);
+            if (!socket_)
+                return;
+            continue;
+        }
+        if (op == ForwardData::kSendCompressed) {
+            if (!compressor_ || !compressor_->Decompress(data)) {
+                LOGE << "bad compressed frame on tunnel\n";
+                Disconnect(false);
+                return;
+            }
+            op = data.op_;
+        }
+        if (op == ForwardData::kWindowUpdate) {
+            ITCPClientNotify* handler = socket_handler_.Find(to);
+            if (handler)
+                static_cast<SOCK5ClientHandler*>(handler)->HandleCredit(data);
+            continue;
+        }
+        if (op == ForwardData::kMigrate) {
+            ITCPClientNotify* handler = socket_handler_.Find(to);
+            if (handler)
+                static_cast<SOCK5ClientHandler*>(handler)->HandleMigrate(data);
+            continue;
+        }
+        if (op != ForwardData::kSendData && op != ForwardData::kCloseConnect) {
+            LOGW << "drop unknown op " << (int)op << "\n";
             continue;
         }
         if (op == ForwardData::kCloseConnect) {
-            if (socket_handler_.count(to) > 0) {
-                static_cast<SOCK5ClientHandler*>(socket_handler_[to])->SetCloseWait();
+            ITCPClientNotify* handler = socket_handler_.Find(to);
+            if (handler) {
+                static_cast<SOCK5ClientHandler*>(handler)->SetCloseWait();
                 continue;
             }
         }
@@ -138,11 +288,126 @@ void TCPClient::ParseData() {
     }
 }
 
+void TCPClient::HandleHello(ForwardData & data) {
+    HelloInfo hello;
+    if (!ForwardCodec::ParseHello(data, &hello) || hello.kind != ForwardCodec::kHelloAccept) {
+        LOGW << "bad hello on tunnel\n";
+        return;
+    }
+    HelloInfo commit;
+    commit.kind = ForwardCodec::kHelloCommit;
+    commit.version = max(hello.version, (int)ForwardCodec::kVersion1);
+    commit.features = hello.features & config_.features;
+    commit.window = config_.window;
+    codec_.SetRecvVersion(commit.version);
+    codec_.SetPeer(commit.features, hello.window ? hello.window : config_.window);
+    bool resumed = false;
+    if (resuming_) {
+        resumed = hello.resume && codec_.HasFeature(ForwardCodec::kFeatureResume) &&
+                  session_->CanReplay(hello.received);
+        if (hello.resume && !resumed) {
+            //the forwarder kept its streams but ours lost frames it still
+            //needs, the next offer tells it to let them go
+            LOGW << "tunnel session can not be replayed\n";
+            Disconnect(false);
+            return;
+        }
+        resuming_ = false;
+        if (!resumed) {
+            LOGW << "tunnel session could not be resumed, dropping "
+                 << socket_handler_.Size() << " streams\n";
+            DropStreams();
+        }
+    }
+    if (codec_.HasFeature(ForwardCodec::kFeatureCompression) && !compressor_) {
+        compressor_ = new FrameCompressor(config_.compress_level);
+        if (!compressor_->Init()) {
+            delete compressor_;
+            compressor_ = NULL;
+        }
+    }
+    //frames batched under the old version must leave ahead of the switch
+    batcher_->Flush();
+    codec_.EncodeHello(commit, bufferevent_get_output(socket_));
+    codec_.SetSendVersion(commit.version);
+    LOGI << "tunnel protocol v" << commit.version << " features " << commit.features << "\n";
+    if (resumed) {
+        //everything the forwarder did not get goes out again, in order
+        session_->Replay(hello.received, batcher_);
+        LOGI << "tunnel session resumed, " << socket_handler_.Size() << " streams carried over\n";
+    }
+    if (codec_.HasFeature(ForwardCodec::kFeatureHeartbeat)) {
+        monitor_.Reset(PeerMonitor::Now());
+        HandleHeartbeat();
+    }
+    if (scheduler_)
+        Drain();
+}
+
+FlowWindow TCPClient::NewFlowWindow() {
+    if (!codec_.HasFeature(ForwardCodec::kFeatureFlowControl)) {
+        return FlowWindow();
+    }
+    return FlowWindow(codec_.GetPeerWindow(), config_.window);
+}
+
+FrameCompressor* TCPClient::GetCompressor() {
+    return compressor_;
+}
+
+size_t TCPClient::GetFrameBytes() {
+    return config_.frame_bytes;
+}
+
+const string& TCPClient::GetAddress() {
+    return connect_address_;
+}
+
+TimerWheel* TCPClient::GetWheel() {
+    return pool_ ? pool_->GetWheel() : NULL;
+}
+
+UringLoop* TCPClient::GetUring() {
+    return pool_ ? pool_->GetUring() : NULL;
+}
+
+const TunnelConfig& TCPClient::GetConfig() {
+    return config_;
+}
+
+void TCPClient::SetSlot(uint8_t slot) {
+    slot_ = slot;
+}
+
+uint8_t TCPClient::GetSlot() {
+    return slot_;
+}
+
+UpstreamGroup* TCPClient::GetUpstream() {
+    return config_.upstream;
+}
+
+evdns_base* TCPClient::GetResolver() {
+    return config_.dns;
+}
+
+void TCPClient::SampleMetrics(MetricsSample* sample) {
+    if (status_ == kConnected && socket_) {
+        sample->tunnels++;
+        sample->AddRtt(monitor_.GetRtt(), monitor_.GetJitter());
+        sample->send_backlog += GetBufferedBytes() + (scheduler_ ? scheduler_->Pending() : 0);
+        sample->recv_backlog += evbuffer_get_length(bufferevent_get_input(socket_));
+    }
+    vector<ITCPClientNotify*> streams;
+    socket_handler_.Snapshot(&streams);
+    for (auto handler : streams)
+        sample->AddStream(static_cast<SOCK5ClientHandler*>(handler)->GetQueuedBytes());
+}
+
 void TCPClient::AddHandler(HashType s, ITCPClientNotify * handler) {
-    if (socket_handler_.count(s) > 0) {
-        LOGW << "this socket has bind a handler,it may cause memory leak" << "\n";
+    if (!socket_handler_.Insert(s, handler)) {
+        LOGW << "stream " << s << " is already bound\n";
     }
-    socket_handler_[s] = handler;
 }
 
 void TCPClient::CloseRemoteConnect(HashType s) {
@@ -153,14 +418,13 @@ void TCPClient::CloseRemoteConnect(HashType s) {
 
 void TCPClient::RemoveHandler(HashType s) {
     //֪ͨԶ̹رsocket
-    assert(socket_handler_.count(s) > 0);
-    socket_handler_.erase(s);
-    LOGI << "ʣ" << socket_handler_.size() << "\n";
+    socket_handler_.Remove(s);
+    LOGI << "ʣ" << socket_handler_.Size() << "\n";
 }
 
 bool TCPClient::ForwardToHandler(ForwardData & data) {
     if (data.op_ == ForwardData::kCloseConnect) {
-        if (socket_handler_.count(data.to_) == 0) {
+        if (!socket_handler_.Find(data.to_)) {
             //Ѿɾˣν ؾ
             assert(data.len_ == 1);
             return true;
@@ -168,23 +432,43 @@ bool TCPClient::ForwardToHandler(ForwardData & data) {
         AppendData(data);
         return true;
     } else {
-        if (socket_handler_.count(data.to_) == 0) {
+        ITCPClientNotify* handler = socket_handler_.Find(data.to_);
+        if (!handler) {
             SOCK5ClientHandler* pSocketClient = new SOCK5ClientHandler(this, data.to_, event_loop_);
             if (!pSocketClient->Init()) {
                 pSocketClient->OnSockClose(NULL);
                 LOGE << "error!\n";
                 return false;
             }
+            handler = pSocketClient;
         }
-        static_cast<SOCK5ClientHandler*>(socket_handler_[data.to_])->AppendData(data);
+        static_cast<SOCK5ClientHandler*>(handler)->AppendData(data);
         return true;
     }
 }
 
 void TCPClient::HandlePeriodic() {
-    if (last_heart_time_ - GetTimeStamp() > 1000 * 120) {
+    if (status_ != kConnected)
+        return;
+    if (resuming_ && GetTimeStamp() - lost_time_ > config_.resume_timeout_sec * 1000) {
+        //connected, but no accept came back in time
+        resuming_ = false;
+        DropStreams();
+    }
+    bool fast = codec_.HasFeature(ForwardCodec::kFeatureHeartbeat);
+    //the heartbeat timer watches the peer when it answers pings
+    if (!fast && GetTimeStamp() - last_heart_time_ > 1000 * 120) {
         LOGE << "long time don't recieve heartbeat!\n";
-        Close();
+        Disconnect(true);
+        return;
+    }
+    if (compressor_)
+        compressor_->LogStats("tunnel");
+    if (codec_.HasFeature(ForwardCodec::kFeatureResume) && session_->HasUnacked())
+        SendAck();
+    if (fast) {
+        LOGI << "tunnel rtt " << monitor_.GetRtt() / 1000.0 << " ms jitter "
+             << monitor_.GetJitter() / 1000.0 << " ms\n";
         return;
     }
     //send heart beat
@@ -193,17 +477,136 @@ void TCPClient::HandlePeriodic() {
     AppendData(data);
 }
 
+void TCPClient::HandleHeartbeat() {
+    int64_t now = PeerMonitor::Now();
+    if (monitor_.Dead(now)) {
+        LOGW << "forwarder silent for " << monitor_.SilentMs(now) << " ms, reconnect\n";
+        Metrics::Local()->peers_dead.Add(1);
+        Disconnect(true);
+        return;
+    }
+    ForwardData ping(kHashTypeInvalid, ForwardData::kHeartBeat);
+    monitor_.MakePing(ping, now);
+    AppendData(ping);
+    monitor_.ApplyUserTimeout(socket_);
+    int64_t interval = monitor_.IntervalMs();
+    timeval timeout = { (long)(interval / 1000), (long)(interval % 1000) * 1000 };
+    event_add(heartbeat_event_, &timeout);
+}
+
 void TCPClient::SendToProxy(ForwardData & data) {
     AppendData(data);
 }
 
 void TCPClient::OnSockConnected(bufferevent* bev) {
     status_ = kConnected;
+    attempts_ = 0;
+    last_heart_time_ = GetTimeStamp();
+    FrameBatcher::DisableNagle(socket_);
+    if (config_.tls)
+        TlsContext::OnHandshakeDone(socket_);
+    //the offer goes ahead of anything queued while connecting
+    if (config_.max_version > ForwardCodec::kVersion1) {
+        HelloInfo offer;
+        offer.kind = ForwardCodec::kHelloOffer;
+        offer.version = config_.max_version;
+        offer.features = config_.features;
+        offer.window = config_.window;
+        if (session_) {
+            offer.session = session_->GetId();
+            offer.received = session_->GetReceived();
+            offer.resume = resuming_ && session_->Resumable();
+        }
+        codec_.EncodeHello(offer, bufferevent_get_output(socket_));
+    }
     WriteToSock();
+    if (scheduler_) {
+        bufferevent_setwatermark(socket_, EV_WRITE, config_.tunnel_buffer / 2, 0);
+        FrameScheduler::LimitUnsent(socket_, config_.tunnel_buffer);
+        Drain();
+    }
 }
 
 void TCPClient::OnSockClose(bufferevent* bev) {
-    Close();
+    string error = TlsContext::GetError(socket_);
+    if (!error.empty())
+        LOGE << "tunnel tls error: " << error << "\n";
+    Disconnect(true);
+}
+
+void TCPClient::Disconnect(bool resumable) {
+    event_del(heartbeat_event_);
+    if (socket_) {
+        UringLink::Free(socket_);
+        socket_ = NULL;
+    }
+    //frames still in the batcher were kept by the session or belong to
+    //streams that are about to go
+    batcher_->Reset();
+    batcher_->SetOutput(NULL);
+    evbuffer_drain(data_to_send_, evbuffer_get_length(data_to_send_));
+    bool keep = resumable && session_ && session_->Resumable() &&
+                (resuming_ || codec_.HasFeature(ForwardCodec::kFeatureResume));
+    if (keep && !resuming_) {
+        resuming_ = true;
+        lost_time_ = GetTimeStamp();
+        LOGW << "tunnel lost, " << socket_handler_.Size() << " streams wait for a resume\n";
+    } else if (!keep) {
+        resuming_ = false;
+        DropStreams();
+    }
+    //the next connection starts over at v1 and settles features again
+    codec_ = ForwardCodec();
+    status_ = kInit;
+    ScheduleReconnect();
+}
+
+void TCPClient::DropStreams() {
+    vector<ITCPClientNotify*> streams;
+    socket_handler_.Snapshot(&streams);
+    for (auto handler : streams) {
+        delete handler;
+    }
+    if (scheduler_)
+        scheduler_->Clear();
+    if (session_)
+        session_->Reset();
+    if (!streams.empty())
+        LOGW << "tunnel lost, " << streams.size() << " streams closed\n";
+}
+
+void TCPClient::ScheduleReconnect() {
+    int64_t delay = config_.reconnect_max_ms;
+    if (attempts_ < 20)
+        delay = min((int64_t)config_.reconnect_min_ms << attempts_, delay);
+    //0.5x to 1.5x, so agents cut off together do not all dial back at once
+    uint32_t random;
+    evutil_secure_rng_get_bytes(&random, sizeof(random));
+    delay = delay / 2 + random % (delay + 1);
+    attempts_++;
+    timeval timeout = { (long)(delay / 1000), (long)(delay % 1000) * 1000 };
+    event_add(reconnect_event_, &timeout);
+    LOGI << "reconnect tunnel in " << delay << " ms\n";
+}
+
+void TCPClient::Reconnect() {
+    if (resuming_ && GetTimeStamp() - lost_time_ > config_.resume_timeout_sec * 1000) {
+        LOGW << "tunnel stayed down past the resume timeout\n";
+        resuming_ = false;
+        DropStreams();
+    }
+    socket_ = Dial();
+    if (!socket_) {
+        ScheduleReconnect();
+        return;
+    }
+    batcher_->SetOutput(bufferevent_get_output(socket_));
+}
+
+void TCPClient::SendAck() {
+    ForwardData ack(kHashTypeInvalid, ForwardData::kAck);
+    session_->MakeAck(ack);
+    AppendData(ack);
 }
 
 void TCPClient::Close() {
@@ -213,76 +616,403 @@ void TCPClient::Close() {
 }
 
 TCPClient::~TCPClient() {
-    if (bufferevent_getfd( socket_ ) != INVALID_SOCKET) {
-        bufferevent_free(socket_);
+    //a udp link's end has no fd of its own
+    if (socket_ && (UringLink::GetFd(socket_) != INVALID_SOCKET ||
+                    config_.transport == TunnelConfig::kTransportUdp)) {
+        UringLink::Free(socket_);
         socket_ = NULL;
     }
     if (periodic_event_) {
         event_free(periodic_event_);
     }
-    for (auto& it : socket_handler_) {
-        delete it.second;
+    if (reconnect_event_)
+        event_free(reconnect_event_);
+    if (heartbeat_event_)
+        event_free(heartbeat_event_);
+    evbuffer_free(data_to_send_);
+    delete batcher_;
+    delete compressor_;
+    delete scheduler_;
+    vector<ITCPClientNotify*> streams;
+    socket_handler_.Snapshot(&streams);
+    for (auto handler : streams) {
+        delete handler;
     }
-    struct timeval delay = { 1, 0 };
+    delete session_;
     LOGE << "TCPClient " << "\n";
 
-    event_base_loopexit(event_loop_, &delay);
+    //a pool member only closes when it could not be set up
+    if (!pool_) {
+        struct timeval delay = { 1, 0 };
+        event_base_loopexit(event_loop_, &delay);
+    }
 }
 
 ////////////////
-SOCK5ClientHandler::SOCK5ClientHandler(TCPClient * client, HashType hash, event_base * event_loop) {
+TCPClientPool::TCPClientPool(event_base* event_loop,
+                             string ip,
+                             int port,
+                             int size,
+                             const TunnelConfig& config):
+    event_loop_(event_loop),
+    connect_address_(ip),
+    connect_port_(port),
+    size_(size > 0 ? size : 1),
+    config_(config),
+    metrics_event_(NULL),
+    wheel_(NULL),
+    uring_(NULL) {
+}
+
+bool TCPClientPool::Init() {
+    wheel_ = new TimerWheel(event_loop_, 100);
+    if (config_.io == TunnelConfig::kIoUring) {
+        uring_ = new UringLoop(event_loop_);
+        if (!uring_->Init()) {
+            LOGW << "io_uring unavailable, sockets stay on libevent\n";
+            delete uring_;
+            uring_ = NULL;
+        }
+    }
+    for (size_t i = 0; i < size_; i++) {
+        AddClient();
+    }
+    if (clients_.empty()) {
+        return false;
+    }
+    if (clients_.size() < size_)
+        LOGW << "only " << clients_.size() << " of " << size_ << " tunnels could be set up\n";
+    if (config_.metrics) {
+        timeval one_sec = { 1, 0 };
+        metrics_event_ = event_new(event_loop_, -1, EV_PERSIST, metricscb, this);
+        event_add(metrics_event_, &one_sec);
+    }
+    return true;
+}
+
+bool TCPClientPool::AddClient() {
+    TCPClient* client = new TCPClient(event_loop_, connect_address_, connect_port_, config_, this);
+    //the lowest slot no live tunnel holds, so forwarder workers keep one each
+    uint8_t slot = 0;
+    while (find_if(clients_.begin(), clients_.end(),
+                   [slot](TCPClient* other) { return other->GetSlot() == slot; }) != clients_.end())
+        slot++;
+    client->SetSlot(slot);
+    if (!client->Init()) {
+        client->Close();
+        return false;
+    }
+    clients_.push_back(client);
+    return true;
+}
+
+void TCPClientPool::SampleMetrics() {
+    MetricsSample sample;
+    for (auto client : clients_)
+        client->SampleMetrics(&sample);
+    Metrics::Publish(sample);
+}
+
+TCPClientPool::~TCPClientPool() {
+    if (metrics_event_) {
+        event_free(metrics_event_);
+    }
+    delete wheel_;
+    delete uring_;
+}
+
+TimerWheel* TCPClientPool::GetWheel() {
+    return wheel_;
+}
+
+UringLoop* TCPClientPool::GetUring() {
+    return uring_;
+}
+
+////////////////
+SOCK5ClientHandler::SOCK5ClientHandler(TCPClient * client, HashType hash, event_base * event_loop):
+    timer_(this) {
     hash_ = hash;
     status_ = kConstruct;
     client_ = client;
     event_loop_ = event_loop;
+    socket_ = NULL;
+    data_to_send_ = evbuffer_new();
+    flow_ = client->NewFlowWindow();
+    socks_ = NULL;
+    backend_ = NULL;
+    connect_start_ = 0;
+    wheel_ = client->GetWheel();
+    active_ms_ = 0;
+    Metrics::Local()->stream_accepts.Add(1);
 }
 
 bool SOCK5ClientHandler::Init() {
-    socket_ = CreateConnectSocket(event_loop_, "127.0.0.1", 1081, this);
-    if (!socket_) {
-        return false;
+    if (client_->GetResolver()) {
+        //the destination is only known once the handshake is read
+        socks_ = new Socks5Engine();
+        client_->AddHandler(hash_, this);
+        status_ = kInit;
+        ArmTimer(client_->GetConfig().connect_timeout_sec * 1000LL);
+        return true;
+    }
+    UpstreamGroup* upstream = client_->GetUpstream();
+    backend_ = upstream ? upstream->Pick() : NULL;
+    //a warm connection lets the first frame go straight out
+    socket_ = backend_ ? backend_->Acquire() : NULL;
+    if (socket_) {
+        bufferevent_setcb(socket_, readcb, writecb, eventcb, this);
+        bufferevent_enable(socket_, EV_READ | EV_WRITE);
+        status_ = kConnected;
+    } else {
+        if (backend_) {
+            socket_ = CreateConnectSocket(event_loop_, backend_->GetAddress(), backend_->GetPort(), this,
+                                          NULL, client_->GetUring());
+            connect_start_ = GetTimeStamp();
+        } else {
+            socket_ = CreateConnectSocket(event_loop_, "127.0.0.1", 1081, this, NULL, client_->GetUring());
+        }
+        if (!socket_) {
+            backend_ = NULL;
+            return false;
+        }
+        status_ = kInit;
     }
+    if (backend_)
+        backend_->AddStream();
+    bufferevent_setwatermark(socket_, EV_WRITE, flow_.WriteLowWatermark(), 0);
+    bufferevent_setwatermark(socket_, EV_READ, 0, flow_.ReadHighWatermark());
     client_->AddHandler(hash_, this);
-    status_ = kInit;
+    if (status_ == kConnected) {
+        ArmTimer(client_->GetConfig().idle_timeout_sec * 1000LL);
+        Touch();
+    } else {
+        ArmTimer(client_->GetConfig().connect_timeout_sec * 1000LL);
+    }
     return true;
 }
 
 void SOCK5ClientHandler::AppendData(ForwardData& data) {
-    data_to_send_.insert(data_to_send_.end(), data.data_, data.data_ + data.len_);
-    WriteToSock();
+    Touch();
+    flow_.OnReceived(data.len_);
+    Metrics::OnStreamBytes(kMetricsIn, data.len_);
+    evbuffer_add_buffer(data_to_send_, data.data_);
+    if (socks_ && !socket_) {
+        HandleHandshake();
+        return;
+    }
+    //written straight through, no write callback comes for it
+    if (WriteToSock() && evbuffer_get_length(bufferevent_get_output(socket_)) == 0)
+        GrantCredit(0);
+}
+
+void SOCK5ClientHandler::HandleHandshake() {
+    evbuffer* reply = evbuffer_new();
+    int ret = socks_->Feed(data_to_send_, reply);
+    SendReply(reply);
+    evbuffer_free(reply);
+    if (ret == Socks5Engine::kNeedMore)
+        return;
+    if (ret == Socks5Engine::kConnect && ConnectTarget())
+        return;
+    if (ret == Socks5Engine::kConnect) {
+        evbuffer* failure = evbuffer_new();
+        Socks5Engine::EncodeReply(Socks5Engine::kReplyFailure, NULL, failure);
+        SendReply(failure);
+        evbuffer_free(failure);
+    }
+    client_->CloseRemoteConnect(hash_);
+    Close();
+}
+
+bool SOCK5ClientHandler::ConnectTarget() {
+    bool domain = socks_->GetAddressType() == Socks5Engine::kAddressDomain;
+    int len = 0;
+    const sockaddr* address = domain ? NULL : socks_->GetAddress(&len);
+    //names are left to evdns and libevent's connect
+    bool uring = !domain && client_->GetUring();
+    //deferred callbacks: a name evdns answers at once must not close the
+    //stream while it is still being set up here
+    if (uring)
+        socket_ = UringLink::Connect(client_->GetUring(), address, len);
+    else
+        socket_ = bufferevent_socket_new(event_loop_, -1, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+    if (!socket_)
+        return false;
+    bufferevent_setcb(socket_, readcb, writecb, eventcb, this);
+    bufferevent_enable(socket_, EV_READ | EV_WRITE);
+    bufferevent_setwatermark(socket_, EV_WRITE, flow_.WriteLowWatermark(), 0);
+    bufferevent_setwatermark(socket_, EV_READ, 0, flow_.ReadHighWatermark());
+    if (uring)
+        return true;
+    int ret;
+    if (domain) {
+        ret = bufferevent_socket_connect_hostname(socket_, client_->GetResolver(), AF_UNSPEC,
+                                                  socks_->GetHost().c_str(), socks_->GetPort());
+    } else {
+        ret = bufferevent_socket_connect(socket_, (sockaddr*)address, len);
+    }
+    if (ret < 0) {
+        bufferevent_free(socket_);
+        socket_ = NULL;
+        return false;
+    }
+    return true;
+}
+
+void SOCK5ClientHandler::SendReply(evbuffer* reply) {
+    size_t len = evbuffer_get_length(reply);
+    if (len == 0)
+        return;
+    //handshake replies travel as stream payload and use up credit like it
+    flow_.OnSent(len);
+    ForwardData data(hash_);
+    data.MoveFrom(reply, len);
+    client_->SendToProxy(data);
+}
+
+void SOCK5ClientHandler::HandleCredit(ForwardData & data) {
+    uint32_t credit;
+    if (!FlowWindow::DecodeCredit(data, &credit))
+        return;
+    //the peer drained what this stream sent
+    Touch();
+    bool blocked = flow_.Blocked();
+    flow_.OnCredit(credit);
+    if (blocked && status_ == kConnected) {
+        bufferevent_enable(socket_, EV_READ);
+        //bytes that were left in the input buffer while blocked
+        if (evbuffer_get_length(bufferevent_get_input(socket_)) > 0)
+            OnSockRead(socket_);
+    }
+}
+
+void SOCK5ClientHandler::HandleMigrate(ForwardData & data) {
+    unsigned char buf[10];
+    evutil_socket_t raw = -1;
+    evutil_socket_t local = -1;
+    uint64_t token = 0;
+    //everything the forwarder framed for this stream came before kMigrate,
+    //so once it is queued on the upstream the stream can leave the tunnel
+    if (status_ == kConnected && evbuffer_copyout(data.data_, buf, sizeof(buf)) == sizeof(buf)) {
+        for (int i = 0; i < 8; i++)
+            token |= (uint64_t)buf[i] << (8 * i);
+        int port = buf[8] | (buf[9] << 8);
+        raw = SpliceRelay::ConnectRaw(client_->GetAddress(), port);
+        if (raw >= 0)
+            local = SpliceRelay::Duplicate(bufferevent_getfd(socket_));
+        if (local < 0 && raw >= 0) {
+            evutil_closesocket(raw);
+            raw = -1;
+        }
+    }
+    unsigned char accepted = raw >= 0 ? 1 : 0;
+    ForwardData ack(hash_, 1, (const char*)&accepted, ForwardData::kMigrateAck);
+    client_->SendToProxy(ack);
+    if (!accepted)
+        return;
+    SpliceRelay* relay = new SpliceRelay(event_loop_, local, raw);
+    unsigned char attach[SpliceRelay::kAttachSize];
+    SpliceRelay::EncodeAttach(token, attach);
+    relay->Queue(1, attach, sizeof(attach));
+    relay->Queue(1, bufferevent_get_input(socket_));
+    relay->Queue(0, bufferevent_get_output(socket_));
+    relay->Queue(0, data_to_send_);
+    LOGI << "stream " << hash_ << " promoted to a spliced connection\n";
+    relay->Start();
+    Close();
 }
 
 bool SOCK5ClientHandler::WriteToSock() {
-    int send_size = data_to_send_.size();
-    if (status_ <= kInit || send_size == 0) return false;
+    if (status_ <= kInit || evbuffer_get_length(data_to_send_) == 0) return false;
     assert(status_ == kConnected || status_ == kCloseWait);
-    if (0 != bufferevent_write(socket_, data_to_send_.data(), send_size)) {
+    bool written = client_->GetConfig().direct_write ?
+        SocketWriter::WriteThrough(socket_, data_to_send_) :
+        0 == bufferevent_write_buffer(socket_, data_to_send_);
+    if (!written) {
         LOGE << "bufferevent_write error\n";
         return false;
     }
-    data_to_send_.clear();
     return true;
 }
 
 void SOCK5ClientHandler::OnSockRead(bufferevent *bev) {
+    Touch();
     struct evbuffer *input = bufferevent_get_input(socket_);
-    size_t input_len = evbuffer_get_length(input);
-    shared_ptr<char> recv_buffer(new char[input_len]);
-    int recv_size = evbuffer_remove(input, recv_buffer.get(), input_len);
-    assert(recv_size == input_len);
-    ForwardData data(hash_, input_len, recv_buffer.get());
-    client_->SendToProxy(data);
+    size_t len = flow_.Sendable(evbuffer_get_length(input));
+    //peer window exhausted, the rest waits until credit arrives
+    flow_.OnSent(len);
+    if (flow_.Blocked())
+        bufferevent_disable(socket_, EV_READ);
+    if (len == 0)
+        return;
+    //cut so no frame holds the tunnel for long
+    size_t frame_bytes = client_->GetFrameBytes();
+    FrameCompressor* compressor = client_->GetCompressor();
+    for (size_t left = len; left > 0; ) {
+        size_t chunk = frame_bytes && left > frame_bytes ? frame_bytes : left;
+        ForwardData data(hash_);
+        data.MoveFrom(input, chunk);
+        if (compressor)
+            compressor->Compress(data, &probe_);
+        client_->SendToProxy(data);
+        left -= chunk;
+    }
+    Metrics::OnStreamBytes(kMetricsOut, len);
 }
 
 void SOCK5ClientHandler::SetCloseWait() {
     status_ = kCloseWait;
-    struct evbuffer *output = bufferevent_get_output(socket_);
-    if (evbuffer_get_length(output) == 0) {
+    if (!socket_ || evbuffer_get_length(bufferevent_get_output(socket_)) == 0) {
         LOGI << "Close For Remote\n";
         Close();
     } else {
         LOGI << "Wait For Close\n";
+        ArmTimer(client_->GetConfig().close_wait_timeout_sec * 1000LL);
+    }
+}
+
+void SOCK5ClientHandler::ArmTimer(int64_t delay_ms) {
+    if (wheel_ && delay_ms > 0)
+        timer_.Start(wheel_, delay_ms);
+    else
+        timer_.Stop();
+}
+
+void SOCK5ClientHandler::OnWheelTimeout() {
+    const TunnelConfig& config = client_->GetConfig();
+    if (status_ == kCloseWait) {
+        LOGW << "stream " << hash_ << " not drained " << config.close_wait_timeout_sec
+             << "s after close\n";
+        Metrics::Local()->stream_timeouts[kTimeoutCloseWait].Add(1);
+        Close();
+        return;
+    }
+    if (status_ != kConnected) {
+        LOGW << "stream " << hash_ << " not connected after " << config.connect_timeout_sec << "s\n";
+        Metrics::Local()->stream_timeouts[kTimeoutConnect].Add(1);
+        if (socks_ && socket_) {
+            //the CONNECT was read, the socks client waits for an answer
+            evbuffer* reply = evbuffer_new();
+            Socks5Engine::EncodeReply(Socks5Engine::kReplyHostUnreachable, NULL, reply);
+            SendReply(reply);
+            evbuffer_free(reply);
+        }
+        client_->CloseRemoteConnect(hash_);
+        Close();
+        return;
+    }
+    //activity only stamps a time, the timer catches up on it here
+    int64_t idle = wheel_->NowMs() - active_ms_;
+    int64_t limit = config.idle_timeout_sec * 1000LL;
+    if (idle < limit) {
+        ArmTimer(limit - idle);
+        return;
     }
+    LOGW << "stream " << hash_ << " idle for " << idle / 1000 << "s\n";
+    Metrics::Local()->stream_timeouts[kTimeoutIdle].Add(1);
+    client_->CloseRemoteConnect(hash_);
+    Close();
 }
 
 void SOCK5ClientHandler::Close() {
@@ -292,25 +1022,79 @@ void SOCK5ClientHandler::Close() {
 }
 
 void SOCK5ClientHandler::OnSockConnected(bufferevent *bev) {
+    if (backend_ && connect_start_) {
+        backend_->OnConnectTime(GetTimeStamp() - connect_start_);
+        connect_start_ = 0;
+    }
+    if (socks_) {
+        sockaddr_storage bound;
+        ev_socklen_t len = sizeof(bound);
+        evbuffer* reply = evbuffer_new();
+        if (getsockname(UringLink::GetFd(bev), (sockaddr*)&bound, &len) != 0)
+            bound.ss_family = AF_UNSPEC;
+        Socks5Engine::EncodeReply(Socks5Engine::kReplySucceeded, (sockaddr*)&bound, reply);
+        SendReply(reply);
+        evbuffer_free(reply);
+        delete socks_;
+        socks_ = NULL;
+    }
     status_ = kConnected;
+    ArmTimer(client_->GetConfig().idle_timeout_sec * 1000LL);
+    Touch();
     WriteToSock();
 }
 
 void SOCK5ClientHandler::OnSockClose(bufferevent *bev) {
+    if (socks_ && socket_) {
+        //the destination could not be reached, tell the socks client why
+        evbuffer* reply = evbuffer_new();
+        Socks5Engine::EncodeReply(bufferevent_socket_get_dns_error(socket_) != 0 ?
+                                  Socks5Engine::kReplyHostUnreachable :
+                                  Socks5Engine::kReplyConnectionRefused, NULL, reply);
+        SendReply(reply);
+        evbuffer_free(reply);
+    }
     client_->CloseRemoteConnect(hash_);
     Close();
 }
 
 void SOCK5ClientHandler::OnSockWrote(bufferevent * bev) {
+    Touch();
+    size_t queued = evbuffer_get_length(bufferevent_get_output(socket_));
     if (status_ == kCloseWait) {
-        Close();
+        if (queued == 0)
+            Close();
+        return;
+    }
+    GrantCredit(queued);
+}
+
+void SOCK5ClientHandler::GrantCredit(size_t queued) {
+    uint32_t credit = flow_.TakeCredit(queued + evbuffer_get_length(data_to_send_));
+    if (credit > 0) {
+        unsigned char buf[4];
+        FlowWindow::EncodeCredit(credit, buf);
+        ForwardData data(hash_, sizeof(buf), (const char*)buf, ForwardData::kWindowUpdate);
+        client_->SendToProxy(data);
     }
 }
 
+size_t SOCK5ClientHandler::GetQueuedBytes() {
+    size_t queued = evbuffer_get_length(data_to_send_);
+    if (socket_)
+        queued += evbuffer_get_length(bufferevent_get_output(socket_));
+    return queued;
+}
+
 SOCK5ClientHandler::~SOCK5ClientHandler() {
+    Metrics::Local()->stream_closes.Add(1);
+    client_->RemoveHandler(hash_);
     if (socket_) {
-        client_->RemoveHandler(hash_);
-        bufferevent_free(socket_);
+        UringLink::Free(socket_);
         socket_ = NULL;
     }
+    delete socks_;
+    if (backend_)
+        backend_->RemoveStream();
+    evbuffer_free(data_to_send_);
 }
@@ -1,6 +1,7 @@
 #ifndef _TCP_CLIENT_H_
 #define _TCP_CLIENT_H_
 
+#include <algorithm>
 #include <list>
 #include <iostream>
 #include <set>
@@ -53,6 +54,24 @@ typedef int SOCKET;
 #endif
 
 #include "log.hpp"
+#include "forward_codec.h"
+#include "tunnel_config.h"
+#include "flow_control.h"
+#include "stream_table.h"
+#include "frame_batcher.h"
+#include "frame_compressor.h"
+#include "tls_context.h"
+#include "splice_relay.h"
+#include "upstream_group.h"
+#include "socks5_engine.h"
+#include "tunnel_session.h"
+#include "metrics.h"
+#include "peer_monitor.h"
+#include "timer_wheel.h"
+#include "mem_pool.h"
+#include "socket_writer.h"
+#include "datagram_link.h"
+#include "uring_link.h"
 
 class ITCPClientNotify {
 public:
@@ -71,37 +90,15 @@ public:
     virtual void HandlePeriodic() = 0;
 };
 
-typedef uint32_t HashType;
-enum {
-    kHashTypeInvalid = -1
-};
-
-#pragma pack(1)
-struct ForwardData {
-    enum {
-        kHeartBeat = 0,
-        kSendData,
-        kCloseConnect
-    };
-    ForwardData(HashType to, uint32_t len, char* data, uint8_t op = kSendData) {
-        len_ = len;
-        data_ = new char[len_];
-        op_ = op;
-        to_ = to;
-        memcpy(data_, data, len_);
-    }
-    ~ForwardData() {
-        if (data_) delete data_;
-    }
-    uint32_t len_;
-    HashType to_;
-    uint8_t op_;
-    char* data_;
-};
+class TCPClientPool;
 
 class TCPClient : public ITCPClientNotify, public IPeriodicNotify {
 public:
-    TCPClient(event_base * event_loop, string ip, int port);
+    TCPClient(event_base * event_loop,
+              string ip,
+              int port,
+              const TunnelConfig& config,
+              TCPClientPool* pool = NULL);
 
     bool Init();
 
@@ -111,6 +108,9 @@ public:
 
     virtual void HandlePeriodic();
 
+    //pings the forwarder, or gives the connection up once it went silent
+    void HandleHeartbeat();
+
 	void SendToProxy(ForwardData & data);
 
     bool ForwardToHandler(ForwardData& data);
@@ -119,25 +119,95 @@ public:
 
     virtual void OnSockClose(bufferevent * bev);
 
+    virtual void OnSockWrote(bufferevent * bev);
+
     void Close();
 
+    //dial the forwarder again after a lost connection
+    void Reconnect();
+
     void AddHandler(HashType s, ITCPClientNotify * handler);
 
     void CloseRemoteConnect(HashType s);
 
     void RemoveHandler(HashType s);
 
+    //credit window for a stream opened on this tunnel
+    FlowWindow NewFlowWindow();
+
+    //NULL unless both sides agreed on compression
+    FrameCompressor* GetCompressor();
+
+    //stream reads are cut into frames of at most this, 0 keeps them whole
+    size_t GetFrameBytes();
+
+    //forwarder address, promoted streams dial it again
+    const string& GetAddress();
+
+    //where new streams take their upstream connection from
+    UpstreamGroup* GetUpstream();
+
+    //NULL when streams are relayed to an upstream socks server
+    evdns_base* GetResolver();
+
+    //adds this tunnel and its streams to a metrics sample
+    void SampleMetrics(MetricsSample* sample);
+
+    //stream timeouts of the loop, NULL without a pool
+    TimerWheel* GetWheel();
+
+    //NULL unless sockets are driven by io_uring
+    UringLoop* GetUring();
+
+    const TunnelConfig& GetConfig();
+
+    //set ahead of Init
+    void SetSlot(uint8_t slot);
+
+    uint8_t GetSlot();
+
 private:
     ~TCPClient();
 
     event_base* event_loop_;
 
+    TCPClientPool* pool_;
+
+    TunnelConfig config_;
+
+    //frames kept for a resume, NULL when resume is not offered
+    TunnelSession* session_;
+
+    //the streams outlived a lost connection and wait for the next one
+    bool resuming_;
+
+    int64_t lost_time_;
+
+    event* reconnect_event_;
+
+    //failed dials in a row, sets the backoff
+    int attempts_;
+
+    ForwardCodec codec_;
+
+    FrameBatcher* batcher_;
+
+    FrameCompressor* compressor_;
+
+    //NULL sends stream frames in the order they were read
+    FrameScheduler* scheduler_;
+
     bufferevent* socket_;
 
     event* periodic_event_;
 
+    PeerMonitor monitor_;
+
+    //armed for the next ping when kFeatureHeartbeat is agreed
+    event* heartbeat_event_;
+
     //Զsocketŵر
-    map<HashType, ITCPClientNotify*> socket_handler_;
+    StreamMap<ITCPClientNotify> socket_handler_;
 
     int status_;
 
@@ -145,19 +215,90 @@ private:
 
     uint16_t	connect_port_;
 
-    vector<char> data_to_send_;
+    //which of the pool's tunnels this is, kept across reconnects so a
+    //udp tunnel comes back to the same forwarder worker
+    uint8_t slot_;
 
-    vector<char> data_to_recv_;
+    //frames queued before the tunnel is connected
+    evbuffer* data_to_send_;
 
     bool WriteToSock();
 
+    //tcp connection or udp link to the forwarder, as the config says
+    bufferevent* Dial();
+
+    void SendFrame(ForwardData & data);
+
+    //moves scheduled frames on while the tunnel has room
+    void Drain();
+
+    //framed bytes past the scheduler, not yet written to the socket
+    size_t GetBufferedBytes();
+
     void ParseData();
 
+    void HandleHello(ForwardData & data);
+
+    //connection gone: keep the streams for a resume when allowed and dial again
+    void Disconnect(bool resumable);
+
+    void DropStreams();
+
+    void ScheduleReconnect();
+
+    void SendAck();
+
     int64_t last_heart_time_;
 
     int heart_;
 };
 
+//keeps several parallel tunnel connections to the forwarder, each one
+//carries its own set of streams so losing a member only drops those.
+//members are permanent, a lost one dials again on its own
+class TCPClientPool {
+public:
+    TCPClientPool(event_base * event_loop,
+                  string ip,
+                  int port,
+                  int size,
+                  const TunnelConfig& config);
+
+    bool Init();
+
+    //publishes the loop's gauges, once a second when metrics are on
+    void SampleMetrics();
+
+    TimerWheel* GetWheel();
+
+    UringLoop* GetUring();
+
+    ~TCPClientPool();
+
+private:
+    event_base* event_loop_;
+
+    string connect_address_;
+
+    uint16_t connect_port_;
+
+    size_t size_;
+
+    TunnelConfig config_;
+
+    vector<TCPClient*> clients_;
+
+    event* metrics_event_;
+
+    //every stream of every member times out on this
+    TimerWheel* wheel_;
+
+    //tunnels and streams of every member, NULL on libevent
+    UringLoop* uring_;
+
+    bool AddClient();
+};
+
 enum CLIENT_STATUS {
     kConstruct = 0,
     kInit,
@@ -166,7 +307,8 @@ enum CLIENT_STATUS {
     kClosed
 };
 
-class SOCK5ClientHandler : public ITCPClientNotify {
+class SOCK5ClientHandler : public ITCPClientNotify, public IWheelNotify,
+    public Pooled<SOCK5ClientHandler> {
 public:
     SOCK5ClientHandler(TCPClient * client,
                        HashType hash,
@@ -178,6 +320,10 @@ public:
 
 	void AppendData(ForwardData & data);
 
+    void HandleCredit(ForwardData & data);
+
+    void HandleMigrate(ForwardData & data);
+
     virtual void OnSockRead(bufferevent * bev);
 
     virtual void OnSockConnected(bufferevent *bev);
@@ -186,6 +332,12 @@ public:
 
     virtual void OnSockWrote(bufferevent* bev);
 
+    //bytes waiting to be written to the upstream
+    size_t GetQueuedBytes();
+
+    //connect, idle or close wait timeout, whichever status_ is in
+    virtual void OnWheelTimeout();
+
 private:
     void Close();
 
@@ -201,11 +353,46 @@ private:
 
     HashType hash_;
 
-    vector<char> data_to_send_;
+    //payload queued before the upstream is connected
+    evbuffer* data_to_send_;
+
+    FlowWindow flow_;
+
+    CompressProbe probe_;
+
+    //built-in socks handshake, NULL once the destination is connected
+    Socks5Engine* socks_;
+
+    //upstream server the stream was balanced onto, NULL for direct dials
+    UpstreamBackend* backend_;
 
-    vector<char> data_to_recv_;
+    int64_t connect_start_;
+
+    TimerWheel* wheel_;
+
+    WheelTimer timer_;
+
+    int64_t active_ms_;
+
+    //stamps stream activity, the idle timer checks it when it fires
+    void Touch() {
+        if (wheel_)
+            active_ms_ = wheel_->NowMs();
+    }
+
+    //(re)arms timer_, 0 stops it
+    void ArmTimer(int64_t delay_ms);
 
     bool WriteToSock();
+
+    //hands back the credit for what left the upstream's output buffer
+    void GrantCredit(size_t queued);
+
+    void HandleHandshake();
+
+    bool ConnectTarget();
+
+    void SendReply(evbuffer* reply);
 };
 
 #endif
@@ -1,7 +1,5 @@
 #include "tcp_server.h"
 
-const int kCycleBufferSize = 1024 * 1024;
-
 static void readcb(struct bufferevent *bev, void *ctx) {
     IProxyNotify* pNotify = static_cast<IProxyNotify*>(ctx);
     pNotify->OnSockRead(bev);
@@ -9,11 +7,9 @@ static void readcb(struct bufferevent *bev, void *ctx) {
 
 static void
 writecb(struct bufferevent *bev, void *user_data) {
-    struct evbuffer *output = bufferevent_get_output(bev);
-    if (evbuffer_get_length(output) == 0) {
-        IProxyNotify* pNotify = static_cast<IProxyNotify*>(user_data);
-        pNotify->OnSockWrote(bev);
-    }
+    //output drained below the write low watermark
+    IProxyNotify* pNotify = static_cast<IProxyNotify*>(user_data);
+    pNotify->OnSockWrote(bev);
 }
 
 static void periodiccb(evutil_socket_t fd, short what, void *ctx) {
@@ -21,6 +17,31 @@ static void periodiccb(evutil_socket_t fd, short what, void *ctx) {
     pNotify->HandlePeriodic();
 }
 
+static void heartbeatcb(evutil_socket_t fd, short what, void *ctx) {
+    ProxyClient* pClient = static_cast<ProxyClient*>(ctx);
+    pClient->HandleHeartbeat();
+}
+
+static void resumecb(evutil_socket_t fd, short what, void *ctx) {
+    ProxyClient* pClient = static_cast<ProxyClient*>(ctx);
+    pClient->OnResumeTimeout();
+}
+
+static void hellocb(evutil_socket_t fd, short what, void *ctx) {
+    ProxyClient* pClient = static_cast<ProxyClient*>(ctx);
+    pClient->OnHelloTimeout();
+}
+
+static void metricscb(evutil_socket_t fd, short what, void *ctx) {
+    TCPServer* pServer = static_cast<TCPServer*>(ctx);
+    pServer->SampleMetrics();
+}
+
+static void budgetcb(evutil_socket_t fd, short what, void *ctx) {
+    TCPServer* pServer = static_cast<TCPServer*>(ctx);
+    pServer->CheckBudget();
+}
+
 static void eventcb(struct bufferevent *bev, short events, void *ptr) {
     IProxyNotify* pNotify = static_cast<IProxyNotify*>(ptr);
     if (events & BEV_EVENT_CONNECTED) {
@@ -31,76 +52,308 @@ static void eventcb(struct bufferevent *bev, short events, void *ptr) {
     }
 }
 
-static HashType GetHashFromConnectInfo(void* sa, int len) {
-    static std::hash<string> pStrHash;
-    stringstream ss;
-    unsigned char* pAddr = (unsigned char*)sa;
-    for(int i = 0; i < len; i++)
-        ss << std::hex << std::setw(2) << std::setfill('0') << (int)pAddr[i];
-    HashType hash = pStrHash(ss.str());
-    return hash == kHashTypeInvalid ? 0 : hash;
-}
-
 Sock5Client::Sock5Client(TCPServer* server,
                          event_base* event_loop,
-                         bufferevent* local_socket,
-                         HashType hash):
+                         bufferevent* local_socket):
     server_(server),
+    proxy_(NULL),
     event_loop_(event_loop),
     socket_(local_socket),
     status_(kConnected),
-    hash_(hash),
-    heart_(0) {
+    heart_(0),
+    hash_(kHashTypeInvalid),
+    bytes_(0),
+    migrate_token_(0),
+    migrate_acked_(false),
+    attach_fd_(-1),
+    attach_data_(NULL),
+    wheel_(server->GetWheel()),
+    timer_(this),
+    active_ms_(0),
+    recent_bytes_(0),
+    shed_(false) {
+    Metrics::Local()->stream_accepts.Add(1);
+    queued_.Bind(server_->GetTunnelConfig().budget);
+    hash_ = server_->AddHandler(this);
+    proxy_ = server_->SelectProxy(hash_);
+    if (proxy_)
+        flow_ = proxy_->NewFlowWindow();
     bufferevent_setcb(socket_, readcb, writecb, eventcb, this);
-    bufferevent_enable(socket_, EV_READ | EV_WRITE);
-    server_->AddHandler(hash_, this);
+    bufferevent_setwatermark(socket_, EV_WRITE, flow_.WriteLowWatermark(), 0);
+    bufferevent_setwatermark(socket_, EV_READ, 0, flow_.ReadHighWatermark());
+    //the window is only known once the tunnel's hello is answered, until
+    //then the stream is not read
+    if (proxy_ || !server_->HasPendingProxy())
+        bufferevent_enable(socket_, EV_READ | EV_WRITE);
+    else
+        bufferevent_enable(socket_, EV_WRITE);
+    ArmTimer(server_->GetTunnelConfig().idle_timeout_sec * 1000LL);
+    Touch();
 }
 
 void Sock5Client::AppendData(ForwardData& data) {
     //sock5 clear header
-    assert(status_ == kConnected || status_ == kCloseWait);
+    assert(status_ == kConnected || status_ == kCloseWait || status_ == kMigrating);
     if (data.len_ > 0) {
-        if (0 != bufferevent_write(socket_, data.data_, data.len_)) {
+        bool written = server_->GetTunnelConfig().direct_write ?
+            SocketWriter::WriteThrough(socket_, data.data_) :
+            0 == bufferevent_write_buffer(socket_, data.data_);
+        if (!written) {
             LOGE << "bufferevent_write error\n";
             return;
         }
+        flow_.OnReceived(data.len_);
+        size_t queued = evbuffer_get_length(bufferevent_get_output(socket_));
+        queued_.Update(queued);
+        //written straight through, no write callback comes for it
+        if (queued == 0 && status_ != kCloseWait && !shed_)
+            GrantCredit(0);
+        Metrics::OnStreamBytes(kMetricsIn, data.len_);
+        bytes_ += data.len_;
+        recent_bytes_ += data.len_;
+        Touch();
+        MaybeMigrate();
     }
 }
 
 void Sock5Client::OnSockRead(bufferevent *bev) {
+    Touch();
+    if (shed_) {
+        bufferevent_disable(socket_, EV_READ);
+        return;
+    }
     struct evbuffer *input = bufferevent_get_input(socket_);
-    size_t input_len = evbuffer_get_length(input);
-    shared_ptr<char> recv_buffer(new char[input_len]);
-    int recv_size = evbuffer_remove(input, recv_buffer.get(), input_len);
-    assert(recv_size == input_len);
-    //forward data to proxy
-    ForwardData data(hash_, input_len, recv_buffer.get());
-    if (!server_->SendToProxy(data)) {
+    size_t len = flow_.Sendable(evbuffer_get_length(input));
+    //peer window exhausted, the rest waits until credit arrives
+    flow_.OnSent(len);
+    if (flow_.Blocked())
+        bufferevent_disable(socket_, EV_READ);
+    if (len == 0)
+        return;
+    //forward data to proxy, cut so no frame holds the tunnel for long
+    if (!proxy_) {
         LOGW << "ûProxyߣ\n";
         Close();
         return;
     }
+    size_t frame_bytes = server_->GetTunnelConfig().frame_bytes;
+    FrameCompressor* compressor = proxy_->GetCompressor();
+    for (size_t left = len; left > 0; ) {
+        size_t chunk = frame_bytes && left > frame_bytes ? frame_bytes : left;
+        ForwardData data(hash_);
+        data.MoveFrom(input, chunk);
+        if (compressor)
+            compressor->Compress(data, &probe_);
+        server_->SendToProxy(proxy_, data);
+        left -= chunk;
+    }
+    Metrics::OnStreamBytes(kMetricsOut, len);
+    bytes_ += len;
+    recent_bytes_ += len;
+    MaybeMigrate();
 }
 
 void Sock5Client::OnSockWrote(bufferevent * bev) {
+    Touch();
+    size_t queued = evbuffer_get_length(bufferevent_get_output(socket_));
+    queued_.Update(queued);
     if (status_ == kCloseWait) {
-        Close();
+        if (queued == 0)
+            Close();
+        return;
+    }
+    //a shed stream gets no credit either, the agent stops sending it
+    if (shed_)
+        return;
+    GrantCredit(queued);
+}
+
+void Sock5Client::GrantCredit(size_t queued) {
+    uint32_t credit = flow_.TakeCredit(queued);
+    if (credit > 0) {
+        unsigned char buf[4];
+        FlowWindow::EncodeCredit(credit, buf);
+        ForwardData data(hash_, sizeof(buf), (const char*)buf, ForwardData::kWindowUpdate);
+        server_->SendToProxy(proxy_, data);
+    }
+}
+
+void Sock5Client::HandleCredit(ForwardData & data) {
+    uint32_t credit;
+    if (!FlowWindow::DecodeCredit(data, &credit))
+        return;
+    //the peer drained what this stream sent
+    Touch();
+    bool blocked = flow_.Blocked();
+    flow_.OnCredit(credit);
+    if (blocked && status_ == kConnected && !shed_) {
+        bufferevent_enable(socket_, EV_READ);
+        //bytes that were left in the input buffer while blocked
+        if (evbuffer_get_length(bufferevent_get_input(socket_)) > 0)
+            OnSockRead(socket_);
     }
 }
 
 void Sock5Client::OnSockClose(bufferevent * bev) {
-    server_->CloseRemoteConnect(hash_);
+    server_->CloseRemoteConnect(proxy_, hash_);
+    Close();
+}
+
+size_t Sock5Client::GetQueuedBytes() {
+    return evbuffer_get_length(bufferevent_get_output(socket_));
+}
+
+uint64_t Sock5Client::TakeRecentBytes() {
+    uint64_t bytes = recent_bytes_;
+    recent_bytes_ = 0;
+    return bytes;
+}
+
+void Sock5Client::SetShed(bool shed) {
+    if (shed == shed_)
+        return;
+    shed_ = shed;
+    //migrating streams are not read either way, HandleMigrateAck looks at shed_,
+    //nor are streams waiting for a tunnel, OnProxyReady does
+    if (status_ != kConnected || !proxy_)
+        return;
+    if (shed) {
+        bufferevent_disable(socket_, EV_READ);
+        return;
+    }
+    //credit held back while shed, then what waited in the input buffer
+    OnSockWrote(socket_);
+    if (!flow_.Blocked()) {
+        bufferevent_enable(socket_, EV_READ);
+        if (evbuffer_get_length(bufferevent_get_input(socket_)) > 0)
+            OnSockRead(socket_);
+    }
+}
+
+bool Sock5Client::IsShed() {
+    return shed_;
+}
+
+IProxyNotify* Sock5Client::GetProxy() {
+    return proxy_;
+}
+
+void Sock5Client::OnProxyClose() {
+    proxy_ = NULL;
     Close();
 }
 
+void Sock5Client::OnProxyReady(IProxyNotify* proxy) {
+    proxy_ = proxy;
+    flow_ = proxy_->NewFlowWindow();
+    bufferevent_setwatermark(socket_, EV_WRITE, flow_.WriteLowWatermark(), 0);
+    bufferevent_setwatermark(socket_, EV_READ, 0, flow_.ReadHighWatermark());
+    if (!shed_)
+        bufferevent_enable(socket_, EV_READ);
+}
+
 void Sock5Client::HandleForward(ForwardData & data) {
     if (data.op_ == ForwardData::kCloseConnect) {
         SetCloseWait();
         return;
     }
+    if (data.op_ == ForwardData::kWindowUpdate) {
+        HandleCredit(data);
+        return;
+    }
+    if (data.op_ == ForwardData::kMigrateAck) {
+        HandleMigrateAck(data);
+        return;
+    }
     AppendData(data);
 }
 
+void Sock5Client::MaybeMigrate() {
+    const TunnelConfig& config = server_->GetTunnelConfig();
+    if (status_ != kConnected || migrate_token_ != 0 || !config.splice ||
+            config.elephant_bytes <= 0 || bytes_ < (uint64_t)config.elephant_bytes ||
+            !proxy_ || !proxy_->HasFeature(ForwardCodec::kFeatureSplice) ||
+            bufferevent_getfd(socket_) < 0) {
+        //an io_uring stream has no socket of its own to hand over
+        return;
+    }
+    //stop feeding the tunnel, the kMigrate frame is the last one sent for
+    //this stream and the agent answers after its last one
+    status_ = kMigrating;
+    bufferevent_disable(socket_, EV_READ);
+    migrate_token_ = config.splice->Register(server_, event_loop_, hash_);
+    unsigned char buf[10];
+    for (int i = 0; i < 8; i++)
+        buf[i] = (unsigned char)(migrate_token_ >> (8 * i));
+    buf[8] = (unsigned char)(config.splice->GetPort());
+    buf[9] = (unsigned char)(config.splice->GetPort() >> 8);
+    ForwardData data(hash_, sizeof(buf), (const char*)buf, ForwardData::kMigrate);
+    server_->SendToProxy(proxy_, data);
+    ArmTimer(10 * 1000);
+    LOGI << "stream " << hash_ << " moved " << bytes_ << " bytes, offer splice\n";
+}
+
+void Sock5Client::HandleMigrateAck(ForwardData & data) {
+    if (status_ != kMigrating)
+        return;
+    unsigned char accepted = 0;
+    evbuffer_copyout(data.data_, &accepted, 1);
+    if (accepted) {
+        migrate_acked_ = true;
+        TryPromote();
+        return;
+    }
+    //the agent keeps the stream framed, carry on as before
+    server_->GetTunnelConfig().splice->Unregister(migrate_token_);
+    status_ = kConnected;
+    ArmTimer(server_->GetTunnelConfig().idle_timeout_sec * 1000LL);
+    Touch();
+    if (!flow_.Blocked() && !shed_) {
+        bufferevent_enable(socket_, EV_READ);
+        if (evbuffer_get_length(bufferevent_get_input(socket_)) > 0)
+            OnSockRead(socket_);
+    }
+}
+
+void Sock5Client::HandleAttach(evutil_socket_t fd, evbuffer* data) {
+    if (status_ != kMigrating || attach_fd_ >= 0) {
+        evutil_closesocket(fd);
+        evbuffer_free(data);
+        return;
+    }
+    attach_fd_ = fd;
+    attach_data_ = data;
+    TryPromote();
+}
+
+void Sock5Client::TryPromote() {
+    if (!migrate_acked_ || attach_fd_ < 0)
+        return;
+    evutil_socket_t local = SpliceRelay::Duplicate(bufferevent_getfd(socket_));
+    if (local < 0) {
+        LOGE << "could not take over the stream socket\n";
+        server_->CloseRemoteConnect(proxy_, hash_);
+        Close();
+        return;
+    }
+    SpliceRelay* relay = new SpliceRelay(event_loop_, local, attach_fd_);
+    attach_fd_ = -1;
+    //tunnel payload not yet written to the client goes ahead of the agent's
+    //first raw bytes, unread client bytes go ahead of anything spliced
+    relay->Queue(0, bufferevent_get_output(socket_));
+    relay->Queue(0, attach_data_);
+    relay->Queue(1, bufferevent_get_input(socket_));
+    LOGI << "stream " << hash_ << " promoted to a spliced connection\n";
+    relay->Start();
+    Close();
+}
+
+void Sock5Client::OnMigrateTimeout() {
+    LOGW << "stream " << hash_ << " splice attach timed out\n";
+    server_->CloseRemoteConnect(proxy_, hash_);
+    Close();
+}
+
 void Sock5Client::SetCloseWait() {
     status_ = kCloseWait;
     struct evbuffer *output = bufferevent_get_output(socket_);
@@ -109,7 +362,41 @@ void Sock5Client::SetCloseWait() {
         Close();
     } else {
         LOGI << "Wait For Close\n";
+        ArmTimer(server_->GetTunnelConfig().close_wait_timeout_sec * 1000LL);
+    }
+}
+
+void Sock5Client::ArmTimer(int64_t delay_ms) {
+    if (delay_ms > 0)
+        timer_.Start(wheel_, delay_ms);
+    else
+        timer_.Stop();
+}
+
+void Sock5Client::OnWheelTimeout() {
+    const TunnelConfig& config = server_->GetTunnelConfig();
+    if (status_ == kMigrating) {
+        OnMigrateTimeout();
+        return;
+    }
+    if (status_ == kCloseWait) {
+        LOGW << "stream " << hash_ << " not drained " << config.close_wait_timeout_sec
+             << "s after close\n";
+        Metrics::Local()->stream_timeouts[kTimeoutCloseWait].Add(1);
+        Close();
+        return;
+    }
+    //activity only stamps a time, the timer catches up on it here
+    int64_t idle = wheel_->NowMs() - active_ms_;
+    int64_t limit = config.idle_timeout_sec * 1000LL;
+    if (idle < limit) {
+        ArmTimer(limit - idle);
+        return;
     }
+    LOGW << "stream " << hash_ << " idle for " << idle / 1000 << "s\n";
+    Metrics::Local()->stream_timeouts[kTimeoutIdle].Add(1);
+    server_->CloseRemoteConnect(proxy_, hash_);
+    Close();
 }
 
 void Sock5Client::Close() {
@@ -120,10 +407,57 @@ void Sock5Client::Close() {
 }
 
 Sock5Client::~Sock5Client() {
+    Metrics::Local()->stream_closes.Add(1);
     if (socket_) {
-        bufferevent_free(socket_);
+        UringLink::Free(socket_);
         socket_ = NULL;
     }
+    if (migrate_token_ && server_->GetTunnelConfig().splice)
+        server_->GetTunnelConfig().splice->Unregister(migrate_token_);
+    if (attach_fd_ >= 0)
+        evutil_closesocket(attach_fd_);
+    if (attach_data_)
+        evbuffer_free(attach_data_);
+}
+
+SocksRejecter::SocksRejecter(TCPServer* server, bufferevent* local_socket):
+    socket_(local_socket),
+    timer_(this) {
+    Metrics::Local()->budget_rejects.Add(1);
+    bufferevent_setcb(socket_, readcb, writecb, eventcb, this);
+    bufferevent_enable(socket_, EV_READ | EV_WRITE);
+    //a client that never finishes its handshake is not waited on for long
+    timer_.Start(server->GetWheel(), 10 * 1000);
+}
+
+void SocksRejecter::OnSockRead(bufferevent *bev) {
+    struct evbuffer *input = bufferevent_get_input(socket_);
+    struct evbuffer *output = bufferevent_get_output(socket_);
+    int ret = engine_.Feed(input, output);
+    if (ret == Socks5Engine::kNeedMore)
+        return;
+    //a bad handshake got its failure reply from the engine already
+    if (ret == Socks5Engine::kConnect)
+        Socks5Engine::EncodeReply(Socks5Engine::kReplyFailure, NULL, output);
+    bufferevent_disable(socket_, EV_READ);
+}
+
+void SocksRejecter::OnSockWrote(bufferevent *bev) {
+    //the write callback only fires once the reply left, so close after it
+    if (!(bufferevent_get_enabled(socket_) & EV_READ))
+        delete this;
+}
+
+void SocksRejecter::OnSockClose(bufferevent *bev) {
+    delete this;
+}
+
+void SocksRejecter::OnWheelTimeout() {
+    delete this;
+}
+
+SocksRejecter::~SocksRejecter() {
+    UringLink::Free(socket_);
 }
 
 /////////////////////////////
@@ -135,93 +469,432 @@ ProxyClient::ProxyClient(TCPServer* server,
     event_loop_(event_loop),
     socket_(local_socket),
     status_(kConnected),
-    heart_(0) {
+    batcher_(NULL),
+    compressor_(NULL),
+    scheduler_(NULL),
+    heart_(0),
+    monitor_(server->GetTunnelConfig().heartbeat_ms,
+             server->GetTunnelConfig().heartbeat_max_ms,
+             server->GetTunnelConfig().dead_timeout_ms),
+    heartbeat_event_(NULL),
+    session_(NULL),
+    resume_timer_(NULL),
+    hello_timer_(NULL),
+    legacy_(false) {
+    const TunnelConfig& config = server_->GetTunnelConfig();
+    backlog_.Bind(config.budget);
+    batcher_ = new FrameBatcher(event_loop_, &codec_, config.batch_bytes, config.batch_delay_us);
+    batcher_->SetOutput(bufferevent_get_output(socket_));
+    FrameBatcher::DisableNagle(socket_);
+    if (config.scheduler != FrameScheduler::kFifo) {
+        scheduler_ = new FrameScheduler(config.frame_bytes ? config.frame_bytes : 16 * 1024,
+                                        config.scheduler == FrameScheduler::kSparse);
+        bufferevent_setwatermark(socket_, EV_WRITE, config.tunnel_buffer / 2, 0);
+        FrameScheduler::LimitUnsent(socket_, config.tunnel_buffer);
+    }
     bufferevent_setcb(socket_, readcb, writecb, eventcb, this);
     bufferevent_enable(socket_, EV_READ | EV_WRITE);
-    data_to_send_.reserve(kCycleBufferSize);
-    data_to_recv_.reserve(kCycleBufferSize);
     //Ӷʱ
     timeval thrity_sec = { 30, 0 };
     periodic_event_ = event_new(event_loop_, -1, EV_PERSIST | EV_TIMEOUT, periodiccb, this);
     event_add(periodic_event_, &thrity_sec);
+    heartbeat_event_ = event_new(event_loop_, -1, 0, heartbeatcb, this);
+    timeval hello_wait = { kHelloWaitSec, 0 };
+    hello_timer_ = event_new(event_loop_, -1, 0, hellocb, this);
+    event_add(hello_timer_, &hello_wait);
 }
 
 void ProxyClient::AppendData(ForwardData& data) {
-    data_to_send_.insert(data_to_send_.end(), (char*)&data.len_, (char*)&data.len_ + sizeof(uint32_t));
-    data_to_send_.insert(data_to_send_.end(), (char*)&data.to_, (char*)&data.to_ + sizeof(HashType));
-    data_to_send_.insert(data_to_send_.end(), (char*)&data.op_, (char*)&data.op_ + sizeof(uint8_t));
-    data_to_send_.insert(data_to_send_.end(), data.data_, data.data_ + data.len_);
-    WriteToSock();
+    assert(status_ == kConnected || status_ == kCloseWait || status_ == kDetached);
+    if (!scheduler_ || !FrameScheduler::IsStreamOp(data.op_)) {
+        SendFrame(data);
+        return;
+    }
+    scheduler_->Push(data);
+    if (status_ != kDetached) {
+        Drain();
+        return;
+    }
+    //streams wait in the scheduler for the resume, within the replay budget
+    if (scheduler_->Pending() > (size_t)server_->GetTunnelConfig().replay_bytes)
+        event_active(resume_timer_, EV_TIMEOUT, 0);
+}
+
+void ProxyClient::Drain() {
+    ForwardData data(kHashTypeInvalid);
+    size_t limit = server_->GetTunnelConfig().tunnel_buffer;
+    while (GetBufferedBytes() < limit && scheduler_->Pop(data))
+        SendFrame(data);
+}
+
+void ProxyClient::OnSockWrote(bufferevent * bev) {
+    if (scheduler_ && status_ == kConnected)
+        Drain();
+    ChargeBudget();
+}
+
+size_t ProxyClient::GetBufferedBytes() {
+    return evbuffer_get_length(bufferevent_get_output(socket_)) + batcher_->Pending();
+}
+
+void ProxyClient::ChargeBudget() {
+    size_t bytes = scheduler_ ? scheduler_->Pending() : 0;
+    if (socket_)
+        bytes += GetBufferedBytes();
+    //replay copies share chains with frames not yet sent, those count twice
+    if (session_)
+        bytes += session_->Held();
+    backlog_.Update(bytes);
+}
+
+void ProxyClient::SendFrame(ForwardData& data) {
+    if (session_ && TunnelSession::IsSequenced(data.op_))
+        session_->OnSend(data);
+    if (status_ == kDetached) {
+        //streams call in here, let them unwind before closing under them
+        if (!session_->Resumable())
+            event_active(resume_timer_, EV_TIMEOUT, 0);
+        return;
+    }
+    batcher_->Write(data);
 }
 
 void ProxyClient::HandleForward(ForwardData & data) {
     AppendData(data);
+    ChargeBudget();
+}
+
+void ProxyClient::OnSockRead(bufferevent *bev) {
+    monitor_.OnReceive(PeerMonitor::Now());
+    ParseData();
+}
+
+size_t ProxyClient::GetQueuedBytes() {
+    return GetBufferedBytes() + (scheduler_ ? scheduler_->Pending() : 0);
+}
+
+void ProxyClient::SampleMetrics(MetricsSample* sample) {
+    sample->tunnels++;
+    sample->send_backlog += GetQueuedBytes();
+    sample->recv_backlog += evbuffer_get_length(bufferevent_get_input(socket_));
+    sample->AddRtt(monitor_.GetRtt(), monitor_.GetJitter());
+}
+
+FlowWindow ProxyClient::NewFlowWindow() {
+    if (!codec_.HasFeature(ForwardCodec::kFeatureFlowControl)) {
+        return FlowWindow();
+    }
+    return FlowWindow(codec_.GetPeerWindow(), server_->GetTunnelConfig().window);
+}
+
+FrameCompressor* ProxyClient::GetCompressor() {
+    return compressor_;
+}
+
+bool ProxyClient::HasFeature(uint32_t feature) {
+    return codec_.HasFeature(feature);
+}
+
+void ProxyClient::OnSockConnected(bufferevent * bev) {
+    //only tls tunnels report this, once the handshake is done
+    TlsContext::OnHandshakeDone(socket_);
+}
+
+void ProxyClient::OnSockClose(bufferevent * bev) {
+    string error = TlsContext::GetError(socket_);
+    if (!error.empty())
+        LOGE << "tunnel tls error: " << error << "\n";
+    if (session_ && session_->Resumable() && status_ == kConnected) {
+        Detach();
+        return;
+    }
+    Close();
+}
+
+void ProxyClient::Detach() {
+    event_del(heartbeat_event_);
+    UringLink::Free(socket_);
+    socket_ = NULL;
+    //the session kept a copy of every stream frame still in the batcher
+    batcher_->Reset();
+    batcher_->SetOutput(NULL);
+    status_ = kDetached;
+    server_->DetachProxy(this, session_->GetId());
+    const TunnelConfig& config = server_->GetTunnelConfig();
+    timeval timeout = { config.resume_timeout_sec, 0 };
+    if (!resume_timer_)
+        resume_timer_ = event_new(event_loop_, -1, 0, resumecb, this);
+    event_add(resume_timer_, &timeout);
 }
 
-bool ProxyClient::WriteToSock() {
-    int send_size = data_to_send_.size();
-    if (send_size == 0) return false;
-    assert(status_ == kConnected || status_ == kCloseWait);
-    if (0 != bufferevent_write(socket_, data_to_send_.data(), send_size)) {
-        LOGE << "bufferevent_write error\n";
+bool ProxyClient::Resume(bufferevent* bev, const HelloInfo& hello) {
+    if (!hello.resume || !session_->CanReplay(hello.received))
         return false;
+    event_del(resume_timer_);
+    socket_ = bev;
+    bufferevent_setcb(socket_, readcb, writecb, eventcb, this);
+    codec_ = ForwardCodec();
+    batcher_->SetOutput(bufferevent_get_output(socket_));
+    status_ = kConnected;
+    SendAccept(hello, true);
+    //everything the agent did not get goes out again, in order
+    session_->Replay(hello.received, batcher_);
+    if (scheduler_) {
+        const TunnelConfig& config = server_->GetTunnelConfig();
+        bufferevent_setwatermark(socket_, EV_WRITE, config.tunnel_buffer / 2, 0);
+        FrameScheduler::LimitUnsent(socket_, config.tunnel_buffer);
+        Drain();
     }
-    data_to_send_.clear();
+    LOGI << "tunnel session resumed\n";
+    //the commit and anything behind it already sit in the input buffer
+    if (evbuffer_get_length(bufferevent_get_input(socket_)) > 0)
+        bufferevent_trigger(socket_, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
     return true;
 }
 
-void ProxyClient::OnSockRead(bufferevent *bev) {
-    struct evbuffer *input = bufferevent_get_input(socket_);
-    size_t input_len = evbuffer_get_length(input);
-    shared_ptr<char> recv_buffer(new char[input_len]);
-    int recv_size = evbuffer_remove(input, recv_buffer.get(), input_len);
-    assert(recv_size == input_len);
-    data_to_recv_.insert(data_to_recv_.end(), recv_buffer.get(), recv_buffer.get() + input_len);
-    ParseData();
+uint64_t ProxyClient::GetSession() {
+    return session_ ? session_->GetId() : 0;
 }
 
-void ProxyClient::OnSockClose(bufferevent * bev) {
+void ProxyClient::Supersede() {
+    LOGW << "agent resumes a session its old connection still holds\n";
+    //detaches when resumable, else closes with the session's streams
+    OnSockClose(socket_);
+}
+
+void ProxyClient::Abandon() {
+    LOGW << "tunnel session went to another worker\n";
     Close();
 }
 
+void ProxyClient::OnResumeTimeout() {
+    LOGW << "tunnel session was not resumed in time\n";
+    Close();
+}
+
+void ProxyClient::SendAck() {
+    ForwardData ack(kHashTypeInvalid, ForwardData::kAck);
+    session_->MakeAck(ack);
+    AppendData(ack);
+}
+
 void ProxyClient::ParseData() {
-    while (data_to_recv_.size() > 4) {
-        size_t size = data_to_recv_.size();
-        char* pData = data_to_recv_.data();
-        uint32_t datalen = *(uint32_t*)pData;
-        uint32_t needlen = datalen + offsetof(ForwardData, data_);
-        if (size < needlen) return;
-        HashType to = *(HashType*)(pData + offsetof(ForwardData, to_));
-        uint8_t op = *(uint8_t*)(pData + offsetof(ForwardData, op_));
-        ForwardData data(to, datalen, pData + offsetof(ForwardData, data_), op);
-        data_to_recv_.erase(data_to_recv_.begin(), data_to_recv_.begin() + needlen);
-        if (op == ForwardData::kHeartBeat) {
-            LOGI << "server recieve heart beat" << "\n";
-            continue;
+    //frames are decoded in place from the socket's input buffer
+    struct evbuffer *input = bufferevent_get_input(socket_);
+    while (true) {
+        ForwardData data(kHashTypeInvalid);
+        int ret = codec_.Decode(input, data);
+        if (ret == ForwardCodec::kNeedMore) return;
+        if (ret == ForwardCodec::kFrameError) {
+            LOGE << "bad frame on tunnel\n";
+            Close();
+            return;
+        }
+        Metrics::OnFrame(kMetricsIn, data.len_);
+        //any other frame first means the agent speaks v1 and sends no offer
+        if (hello_timer_ && data.op_ != ForwardData::kHello)
+            Activate(true);
+        if (session_ && TunnelSession::IsSequenced(data.op_)) {
+            session_->OnReceive(data);
+            if (session_->AckDue())
+                SendAck();
+        }
+        switch (data.op_) {
+        case ForwardData::kHeartBeat:
+            if (codec_.HasFeature(ForwardCodec::kFeatureHeartbeat)) {
+                ForwardData echo(kHashTypeInvalid, ForwardData::kHeartBeat);
+                if (monitor_.OnHeartbeat(data, PeerMonitor::Now(), echo))
+                    AppendData(echo);
+            } else {
+                LOGI << "server recieve heart beat" << "\n";
+            }
+            break;
+        case ForwardData::kHello:
+            if (HandleHello(data)) {
+                //the connection now belongs to the resumed session
+                delete this;
+                return;
+            }
+            break;
+        case ForwardData::kAck:
+            if (!session_ || !session_->OnAck(data))
+                LOGW << "bad ack on tunnel\n";
+            ChargeBudget();
+            break;
+        case ForwardData::kSendCompressed:
+            if (!compressor_ || !compressor_->Decompress(data)) {
+                LOGE << "bad compressed frame on tunnel\n";
+                Close();
+                return;
+            }
+            server_->SendToSock5(data);
+            break;
+        case ForwardData::kSendData:
+        case ForwardData::kCloseConnect:
+        case ForwardData::kWindowUpdate:
+        case ForwardData::kMigrateAck:
+            server_->SendToSock5(data);
+            break;
+        default:
+            LOGW << "drop unknown op " << (int)data.op_ << "\n";
+            break;
+        }
+    }
+}
+
+bool ProxyClient::HandleHello(ForwardData & data) {
+    HelloInfo hello;
+    if (!ForwardCodec::ParseHello(data, &hello)) {
+        LOGW << "bad hello on tunnel\n";
+        return false;
+    }
+    if (hello.kind == ForwardCodec::kHelloOffer) {
+        ProxyClient* detached = hello.session ? server_->TakeDetached(hello.session) : NULL;
+        if (detached) {
+            //a v1 fallback may have taken streams, they can not move to the
+            //session and none of their frames may reach the agent ahead of
+            //the accept
+            if (legacy_)
+                DropStreams();
+            if (detached->Resume(socket_, hello)) {
+                server_->ReplaceProxy(this, detached);
+                socket_ = NULL;
+                status_ = kClosed;
+                return true;
+            }
+            //the agent let its streams go, or they can not be replayed
+            detached->Close();
+        }
+        SendAccept(hello, false);
+    } else if (hello.kind == ForwardCodec::kHelloCommit) {
+        codec_.SetRecvVersion(hello.version);
+        LOGI << "tunnel protocol v" << hello.version << " features " << hello.features << "\n";
+    }
+    return false;
+}
+
+void ProxyClient::DropStreams() {
+    size_t closed = server_->CloseStreams(this);
+    if (scheduler_)
+        scheduler_->Clear();
+    batcher_->Reset();
+    struct evbuffer* output = bufferevent_get_output(socket_);
+    evbuffer_drain(output, evbuffer_get_length(output));
+    ChargeBudget();
+    LOGW << "late offer on a v1 tunnel, " << closed << " streams closed\n";
+}
+
+void ProxyClient::SendAccept(const HelloInfo& hello, bool resumed) {
+    const TunnelConfig& config = server_->GetTunnelConfig();
+    HelloInfo accept;
+    accept.kind = ForwardCodec::kHelloAccept;
+    accept.version = max(min(hello.version, config.max_version), (int)ForwardCodec::kVersion1);
+    accept.features = hello.features & config.features;
+    accept.window = config.window;
+    if (hello.session == 0)
+        accept.features &= ~ForwardCodec::kFeatureResume;
+    //streams already bound without a window would never hand out credit
+    if (legacy_)
+        accept.features &= ~ForwardCodec::kFeatureFlowControl;
+    if ((accept.features & ForwardCodec::kFeatureResume) && !session_) {
+        session_ = new TunnelSession(hello.session, config.replay_bytes);
+        server_->RegisterSession(hello.session);
+    }
+    accept.session = hello.session;
+    accept.resume = resumed;
+    accept.received = session_ ? session_->GetReceived() : 0;
+    //frames batched under the old version must leave ahead of the switch
+    batcher_->Flush();
+    codec_.EncodeHello(accept, bufferevent_get_output(socket_));
+    codec_.SetSendVersion(accept.version);
+    codec_.SetPeer(accept.features, hello.window ? hello.window : config.window);
+    if (codec_.HasFeature(ForwardCodec::kFeatureCompression) && !compressor_) {
+        compressor_ = new FrameCompressor(config.compress_level);
+        if (!compressor_->Init()) {
+            delete compressor_;
+            compressor_ = NULL;
         }
-        server_->SendToSock5(data);
     }
+    if (codec_.HasFeature(ForwardCodec::kFeatureHeartbeat)) {
+        monitor_.Reset(PeerMonitor::Now());
+        HandleHeartbeat();
+    }
+    if (hello_timer_)
+        Activate(false);
+}
+
+void ProxyClient::Activate(bool legacy) {
+    event_free(hello_timer_);
+    hello_timer_ = NULL;
+    legacy_ = legacy;
+    server_->ActivateProxy(this);
+}
+
+void ProxyClient::OnHelloTimeout() {
+    LOGI << "no hello from the agent, tunnel runs protocol v1\n";
+    Activate(true);
 }
 
 void ProxyClient::HandlePeriodic() {
+    if (status_ == kDetached)
+        return;
+    if (compressor_)
+        compressor_->LogStats("tunnel");
+    if (session_ && session_->HasUnacked())
+        SendAck();
+    if (codec_.HasFeature(ForwardCodec::kFeatureHeartbeat)) {
+        LOGI << "tunnel rtt " << monitor_.GetRtt() / 1000.0 << " ms jitter "
+             << monitor_.GetJitter() / 1000.0 << " ms\n";
+        return;
+    }
     //send heart beat
     ForwardData data(kHashTypeInvalid, 4, (char*)&heart_, ForwardData::kHeartBeat);
     heart_++;
     AppendData(data);
 }
 
+void ProxyClient::HandleHeartbeat() {
+    int64_t now = PeerMonitor::Now();
+    if (monitor_.Dead(now)) {
+        LOGW << "agent silent for " << monitor_.SilentMs(now) << " ms, drop the tunnel\n";
+        Metrics::Local()->peers_dead.Add(1);
+        //a resumable session waits for the agent to dial again
+        OnSockClose(socket_);
+        return;
+    }
+    ForwardData ping(kHashTypeInvalid, ForwardData::kHeartBeat);
+    monitor_.MakePing(ping, now);
+    AppendData(ping);
+    monitor_.ApplyUserTimeout(socket_);
+    int64_t interval = monitor_.IntervalMs();
+    timeval timeout = { (long)(interval / 1000), (long)(interval % 1000) * 1000 };
+    event_add(heartbeat_event_, &timeout);
+}
+
 void ProxyClient::Close() {
     assert(status_ != kClosed);
     status_ = kClosed;
-    server_->RemoveProxyHandler();
+    server_->RemoveProxyHandler(this);
     delete this;
 }
 
 ProxyClient::~ProxyClient() {
     if (periodic_event_)
         event_free(periodic_event_);
+    if (resume_timer_)
+        event_free(resume_timer_);
+    if (hello_timer_)
+        event_free(hello_timer_);
+    if (heartbeat_event_)
+        event_free(heartbeat_event_);
+    delete batcher_;
+    delete compressor_;
+    delete scheduler_;
+    if (session_)
+        server_->UnregisterSession(session_->GetId());
+    delete session_;
     if (socket_) {
-        bufferevent_free(socket_);
+        UringLink::Free(socket_);
         socket_ = NULL;
     }
 }
@@ -241,31 +914,105 @@ listener_cb(struct evconnlistener *listener, evutil_socket_t fd,
     pNotify->OnSockListen(listener, bev, sa, socklen);
 }
 
+static void
+proxy_listener_cb(struct evconnlistener *listener, evutil_socket_t fd,
+                  struct sockaddr *sa, int socklen, void *user_data) {
+    TCPServer* pServer = static_cast<TCPServer*>(user_data);
+    pServer->AdoptProxySocket(fd);
+}
+
 bool TCPServer::Init() {
     return InitProxyServer() && InitSock5Server();
 }
 
 bool TCPServer::InitSock5Server() {
+    if (config_.io == TunnelConfig::kIoUring) {
+        uring_ = new UringLoop(event_loop_);
+        if (!uring_->Init()) {
+            LOGW << "io_uring unavailable, sockets stay on libevent\n";
+            delete uring_;
+            uring_ = NULL;
+        }
+    }
+    //bound even when paused right away, a taken port shows at startup
+    if (!ListenSock5())
+        return false;
+    if (pause_without_tunnel_ && GetLiveTunnels() == 0)
+        StopSock5();
+    wheel_ = new TimerWheel(event_loop_, 100);
+    //every loop serving streams, worker or not, samples its own gauges
+    if (config_.metrics) {
+        timeval one_sec = { 1, 0 };
+        metrics_event_ = event_new(event_loop_, -1, EV_PERSIST, metricscb, this);
+        event_add(metrics_event_, &one_sec);
+    }
+    if (config_.budget) {
+        timeval tick = { 0, 100 * 1000 };
+        budget_event_ = event_new(event_loop_, -1, EV_PERSIST, budgetcb, this);
+        event_add(budget_event_, &tick);
+    }
+    return true;
+}
+
+bool TCPServer::ListenSock5() {
     struct sockaddr_in sin;
     memset(&sin, 0, sizeof(sin));
     sin.sin_family = AF_INET;
     inet_pton(AF_INET, sock5_address_.c_str(), &sin.sin_addr.s_addr);
     sin.sin_port = htons(sock5_port_);
 
-    struct evconnlistener *listener;
-    listener = evconnlistener_new_bind(event_loop_, listener_cb, this,
-                                       LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, -1,
-                                       (struct sockaddr*)&sin,
-                                       sizeof(sin));
+    if (uring_) {
+        sock5_uring_ = new UringListener(uring_, this);
+        if (!sock5_uring_->Init((struct sockaddr*)&sin, sizeof(sin), reuse_port_)) {
+            LOGE << "Could not create a listener!\n";
+            sock5_uring_->Close();
+            sock5_uring_ = NULL;
+            return false;
+        }
+    } else {
+        //workers share the port, the kernel spreads accepts across them
+        unsigned flags = LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE;
+        if (reuse_port_)
+            flags |= LEV_OPT_REUSEABLE_PORT;
+        struct evconnlistener *listener;
+        listener = evconnlistener_new_bind(event_loop_, listener_cb, this,
+                                           flags, -1,
+                                           (struct sockaddr*)&sin,
+                                           sizeof(sin));
 
-    if (!listener) {
-        LOGE << "Could not create a listener!\n";
-        return false;
+        if (!listener) {
+            LOGE << "Could not create a listener!\n";
+            return false;
+        }
+        this->sock5_socket_ = listener;
     }
-    this->sock5_socket_ = listener;
     return true;
 }
 
+void TCPServer::StopSock5() {
+    if (sock5_socket_)
+        evconnlistener_free(sock5_socket_);
+    sock5_socket_ = NULL;
+    if (sock5_uring_)
+        sock5_uring_->Close();
+    sock5_uring_ = NULL;
+}
+
+void TCPServer::OnTunnelsChanged() {
+    int live = (int)(proxy_handler_.size() + pending_.size());
+    live_tunnels_.store(live, std::memory_order_relaxed);
+    if (!pause_without_tunnel_ || is_closed_)
+        return;
+    bool listening = sock5_socket_ || sock5_uring_;
+    if (live == 0 && listening) {
+        LOGI << "no tunnel left, socks listener paused\n";
+        StopSock5();
+    } else if (live > 0 && !listening) {
+        if (ListenSock5())
+            LOGI << "socks listener resumed\n";
+    }
+}
+
 bool TCPServer::InitProxyServer() {
     struct sockaddr_in sin;
     memset(&sin, 0, sizeof(sin));
@@ -274,7 +1021,8 @@ bool TCPServer::InitProxyServer() {
     sin.sin_port = htons(proxy_port_);
 
     struct evconnlistener *listener;
-    listener = evconnlistener_new_bind(event_loop_, listener_cb, this,
+    //tunnels are wrapped by AdoptProxySocket, which knows about tls
+    listener = evconnlistener_new_bind(event_loop_, proxy_listener_cb, this,
                                        LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, -1,
                                        (struct sockaddr*)&sin,
                                        sizeof(sin));
@@ -284,6 +1032,16 @@ bool TCPServer::InitProxyServer() {
         return false;
     }
     this->proxy_socket_ = listener;
+    if (config_.transport == TunnelConfig::kTransportUdp)
+        return InitDatagramServer(proxy_address_, proxy_port_, 1);
+    return true;
+}
+
+bool TCPServer::InitDatagramServer(string address, int port, int workers) {
+    datagram_ = new DatagramListener(event_loop_, this, config_);
+    if (!datagram_->Init(address, port, reuse_port_, workers))
+        return false;
+    LOGI << "udp tunnels on " << port << "\n";
     return true;
 }
 
@@ -297,35 +1055,242 @@ TCPServer::TCPServer(
     event_loop_(event_loop),
     proxy_socket_(NULL),
     sock5_socket_(NULL),
+    uring_(NULL),
+    sock5_uring_(NULL),
+    datagram_(NULL),
     proxy_address_(proxy_address),
     proxy_port_(proxy_port),
     sock5_address_(sock5_address),
     sock5_port_(sock5_port),
-    proxy_handler_(NULL) {
+    reuse_port_(false),
+    sessions_(NULL),
+    session_owner_(NULL),
+    balance_policy_(kBalanceHash),
+    metrics_event_(NULL),
+    wheel_(NULL),
+    budget_event_(NULL),
+    shed_count_(0),
+    pause_without_tunnel_(false),
+    live_tunnels_(0) {
 }
 
-void TCPServer::AddHandler(HashType hash, ISock5Notify * handler) {
-    if (sock5_handler_.count(hash) > 0) {
-        LOGW << "this socket has bind a handler,it may cause memory leak" << "\n";
-    }
-    sock5_handler_[hash] = handler;
+HashType TCPServer::AddHandler(ISock5Notify * handler) {
+    return sock5_handler_.Insert(handler);
 }
 
-void TCPServer::CloseRemoteConnect(HashType s) {
+void TCPServer::CloseRemoteConnect(IProxyNotify* proxy, HashType s) {
     char flag = 0x1;
     ForwardData data(s, 1, &flag, ForwardData::kCloseConnect);
-    if(proxy_handler_)
-        proxy_handler_->HandleForward(data);
+    if(proxy)
+        proxy->HandleForward(data);
 }
 
 void TCPServer::RemoveHandler(HashType s) {
     //رԶsocket
-    sock5_handler_.erase(s);
-    LOGI << "ʣ" << sock5_handler_.size() << "\n";
+    sock5_handler_.Remove(s);
+    LOGI << "ʣ" << sock5_handler_.Size() << "\n";
+}
+
+void TCPServer::RemoveProxyHandler(IProxyNotify* proxy) {
+    for (auto iter = proxy_handler_.begin(); iter != proxy_handler_.end(); ++iter) {
+        if (*iter == proxy) {
+            proxy_handler_.erase(iter);
+            break;
+        }
+    }
+    for (auto iter = pending_.begin(); iter != pending_.end(); ++iter) {
+        if (*iter == proxy) {
+            pending_.erase(iter);
+            break;
+        }
+    }
+    for (auto iter = detached_.begin(); iter != detached_.end(); ++iter) {
+        if (iter->second == proxy) {
+            detached_.erase(iter);
+            break;
+        }
+    }
+    //only the streams carried by the lost tunnel are dropped, and the ones
+    //waiting for a hello when no tunnel is left to answer it
+    size_t closed = CloseStreams(proxy);
+    if (proxy_handler_.empty() && pending_.empty())
+        closed += CloseStreams(NULL);
+    LOGW << "tunnel lost, " << closed << " streams closed, "
+         << proxy_handler_.size() << " tunnels left\n";
+    OnTunnelsChanged();
+}
+
+void TCPServer::ActivateProxy(ProxyClient* proxy) {
+    auto iter = find(pending_.begin(), pending_.end(), proxy);
+    if (iter == pending_.end())
+        return;
+    pending_.erase(iter);
+    proxy_handler_.push_back(proxy);
+    LOGI << "tunnel ready, tunnels: " << proxy_handler_.size() << "\n";
+    vector<ISock5Notify*> streams;
+    sock5_handler_.Snapshot(&streams);
+    for (auto handler : streams) {
+        if (!handler->GetProxy())
+            handler->OnProxyReady(proxy);
+    }
 }
 
-void TCPServer::RemoveProxyHandler() {
-    proxy_handler_ = NULL;
+void TCPServer::DetachProxy(ProxyClient* proxy, uint64_t session) {
+    for (auto iter = proxy_handler_.begin(); iter != proxy_handler_.end(); ++iter) {
+        if (*iter == proxy) {
+            proxy_handler_.erase(iter);
+            break;
+        }
+    }
+    detached_[session] = proxy;
+    LOGW << "tunnel lost, streams wait for a resume, "
+         << proxy_handler_.size() << " tunnels left\n";
+    OnTunnelsChanged();
+}
+
+ProxyClient* TCPServer::TakeDetached(uint64_t session) {
+    auto iter = detached_.find(session);
+    if (iter == detached_.end()) {
+        for (auto proxy : proxy_handler_) {
+            ProxyClient* live = static_cast<ProxyClient*>(proxy);
+            if (live->GetSession() == session) {
+                live->Supersede();
+                break;
+            }
+        }
+        iter = detached_.find(session);
+    }
+    if (iter == detached_.end()) {
+        //its streams would otherwise wait out the resume timeout there
+        ISessionOwner* owner = sessions_ ? sessions_->Find(session) : NULL;
+        if (owner && owner != session_owner_)
+            owner->PostDropSession(session);
+        return NULL;
+    }
+    ProxyClient* proxy = iter->second;
+    detached_.erase(iter);
+    return proxy;
+}
+
+void TCPServer::DropSession(uint64_t session) {
+    ProxyClient* proxy = TakeDetached(session);
+    if (!proxy)
+        return;
+    proxy->Abandon();
+}
+
+void TCPServer::SetSessionDirectory(SessionDirectory* sessions, ISessionOwner* owner) {
+    sessions_ = sessions;
+    session_owner_ = owner;
+}
+
+void TCPServer::RegisterSession(uint64_t session) {
+    if (sessions_)
+        sessions_->Add(session, session_owner_);
+}
+
+void TCPServer::UnregisterSession(uint64_t session) {
+    if (sessions_)
+        sessions_->Remove(session, session_owner_);
+}
+
+void TCPServer::ReplaceProxy(IProxyNotify* from, IProxyNotify* to) {
+    auto pending = find(pending_.begin(), pending_.end(), from);
+    if (pending != pending_.end())
+        pending_.erase(pending);
+    auto iter = find(proxy_handler_.begin(), proxy_handler_.end(), from);
+    if (iter != proxy_handler_.end())
+        *iter = to;
+    else
+        proxy_handler_.push_back(to);
+    OnTunnelsChanged();
+}
+
+size_t TCPServer::CloseStreams(IProxyNotify* proxy) {
+    vector<ISock5Notify*> streams;
+    sock5_handler_.Snapshot(&streams);
+    size_t closed = 0;
+    for (auto handler : streams) {
+        if (handler->GetProxy() == proxy) {
+            handler->OnProxyClose();
+            closed++;
+        }
+    }
+    return closed;
+}
+
+void TCPServer::SetBalancePolicy(int policy) {
+    balance_policy_ = policy;
+}
+
+void TCPServer::SetReusePort(bool reuse_port) {
+    reuse_port_ = reuse_port;
+}
+
+void TCPServer::SetPauseWithoutTunnel(bool pause) {
+    pause_without_tunnel_ = pause;
+}
+
+int TCPServer::GetLiveTunnels() {
+    return live_tunnels_.load(std::memory_order_relaxed);
+}
+
+void TCPServer::SetTunnelConfig(const TunnelConfig& config) {
+    config_ = config;
+}
+
+const TunnelConfig& TCPServer::GetTunnelConfig() {
+    return config_;
+}
+
+void TCPServer::AdoptProxySocket(evutil_socket_t fd) {
+    struct bufferevent *bev;
+    if (config_.tls)
+        bev = config_.tls->NewAcceptSocket(event_loop_, fd);
+    else if (uring_)
+        bev = UringLink::Adopt(uring_, fd);
+    else
+        bev = bufferevent_socket_new(event_loop_, fd, BEV_OPT_CLOSE_ON_FREE);
+    if (!bev) {
+        LOGE << "Error constructing bufferevent!\n";
+        evutil_closesocket(fd);
+        return;
+    }
+    AddProxySocket(bev);
+}
+
+void TCPServer::OnDatagramTunnel(bufferevent* bev) {
+    AddProxySocket(bev);
+}
+
+void TCPServer::AddProxySocket(bufferevent* bev) {
+    //streams are bound once the hello is answered and features are known
+    pending_.push_back(new ProxyClient(this, event_loop_, bev));
+    LOGI << "Handle Proxy Socket, tunnels: " << proxy_handler_.size() << "\n";
+    OnTunnelsChanged();
+}
+
+bool TCPServer::HasPendingProxy() {
+    return !pending_.empty();
+}
+
+IProxyNotify* TCPServer::SelectProxy(HashType s) {
+    if (proxy_handler_.empty()) {
+        return NULL;
+    }
+    if (balance_policy_ == kBalanceLeastQueued) {
+        IProxyNotify* best = proxy_handler_[0];
+        size_t best_queued = best->GetQueuedBytes();
+        for (size_t i = 1; i < proxy_handler_.size(); i++) {
+            size_t queued = proxy_handler_[i]->GetQueuedBytes();
+            if (queued < best_queued) {
+                best = proxy_handler_[i];
+                best_queued = queued;
+            }
+        }
+        return best;
+    }
+    return proxy_handler_[s % proxy_handler_.size()];
 }
 
 void TCPServer::OnSockListen(struct evconnlistener *listener,
@@ -333,21 +1298,37 @@ void TCPServer::OnSockListen(struct evconnlistener *listener,
                              struct sockaddr *sa,
                              int socklen) {
     assert(bev && listener);
-    if (listener == proxy_socket_) {
-        LOGI << "Handle Proxy Socket" << "\n";
-        if (proxy_handler_) {
-            delete proxy_handler_;
-        }
-        proxy_handler_ = new ProxyClient(this, event_loop_, bev);
-    } else if (listener == sock5_socket_) {
-        LOGI << "Handle Sock5 Socket" << "\n";
-        HashType hash = GetHashFromConnectInfo(sa, socklen);
-        new Sock5Client(this, event_loop_, bev, hash);
+    if (listener == sock5_socket_) {
+        AcceptSock5(bev);
     } else {
         assert(false);
     }
 }
 
+void TCPServer::OnUringAccept(UringListener* listener, evutil_socket_t fd) {
+    bufferevent* bev = UringLink::Adopt(uring_, fd);
+    if (!bev) {
+        evutil_closesocket(fd);
+        return;
+    }
+    AcceptSock5(bev);
+}
+
+void TCPServer::AcceptSock5(bufferevent* bev) {
+    LOGI << "Handle Sock5 Socket" << "\n";
+    if (sock5_handler_.Full()) {
+        LOGW << "stream table full, refuse sock5 socket\n";
+        UringLink::Free(bev);
+        return;
+    }
+    if (config_.budget && config_.budget->Level() == MemoryBudget::kReject) {
+        LOGW << "memory budget exhausted, refuse sock5 socket\n";
+        new SocksRejecter(this, bev);
+        return;
+    }
+    new Sock5Client(this, event_loop_, bev);
+}
+
 void TCPServer::Close() {
     LOGI << "TCP Server close" << "\n";
     is_closed_ = true;
@@ -356,11 +1337,29 @@ void TCPServer::Close() {
     }
     if (proxy_socket_)
         evconnlistener_free(proxy_socket_);
-    if (sock5_socket_)
-        evconnlistener_free(sock5_socket_);
-    for (auto& iter : sock5_handler_) {
-        delete iter.second;
+    StopSock5();
+    delete datagram_;
+    datagram_ = NULL;
+    if (metrics_event_)
+        event_free(metrics_event_);
+    metrics_event_ = NULL;
+    if (budget_event_)
+        event_free(budget_event_);
+    budget_event_ = NULL;
+    vector<ISock5Notify*> streams;
+    sock5_handler_.Snapshot(&streams);
+    for (auto handler : streams) {
+        delete handler;
     }
+    delete wheel_;
+    wheel_ = NULL;
+    //links still sending what closed streams left go with the ring
+    delete uring_;
+    uring_ = NULL;
+}
+
+TimerWheel* TCPServer::GetWheel() {
+    return wheel_;
 }
 
 bool TCPServer::SendToSock5(ForwardData & data) {
@@ -369,19 +1368,87 @@ bool TCPServer::SendToSock5(ForwardData & data) {
         LOGW << "Invalid HashType" << "\n";
         return false;
     }
-    if (sock5_handler_.count(s) == 0) {
-        if(data.op_ != ForwardData::kCloseConnect)
+    ISock5Notify* handler = sock5_handler_.Find(s);
+    if (!handler) {
+        if(data.op_ == ForwardData::kSendData)
             LOGW << "No This HashType" << "\n";
         return false;
     }
-    sock5_handler_[s]->HandleForward(data);
+    handler->HandleForward(data);
     return true;
 }
 
-bool TCPServer::SendToProxy(ForwardData & data) {
-    if (proxy_handler_ == NULL) {
+void TCPServer::SampleMetrics() {
+    MetricsSample sample;
+    for (auto proxy : proxy_handler_)
+        proxy->SampleMetrics(&sample);
+    vector<ISock5Notify*> streams;
+    sock5_handler_.Snapshot(&streams);
+    for (auto handler : streams)
+        sample.AddStream(handler->GetQueuedBytes());
+    Metrics::Publish(sample);
+}
+
+void TCPServer::CheckBudget() {
+    MemoryBudget* budget = config_.budget;
+    int level = budget->Level();
+    Metrics::Local()->budget_used.Set(budget->Used());
+    if (level == MemoryBudget::kNormal && shed_count_ == 0)
+        return;
+    vector<ISock5Notify*> streams;
+    sock5_handler_.Snapshot(&streams);
+    //streams already shed stay ahead, their reads stopped so they look
+    //quiet now. the rest noisiest first, by what they relayed since the
+    //previous check. quiet ones hold little and are never shed, stopping
+    //them would only stall handshakes and keystrokes
+    vector<pair<uint64_t, ISock5Notify*> > ranked;
+    ranked.reserve(streams.size());
+    size_t candidates = 0;
+    for (auto handler : streams) {
+        uint64_t recent = handler->TakeRecentBytes();
+        if (handler->IsShed())
+            recent = UINT64_MAX;
+        if (recent >= kShedMinBytes)
+            candidates++;
+        ranked.push_back(make_pair(recent, handler));
+    }
+    if (level == MemoryBudget::kNormal) {
+        shed_count_ = 0;
+    } else if (level == MemoryBudget::kReject) {
+        shed_count_ = candidates;
+    } else {
+        //a sixteenth of the candidates first, twice as many each check
+        //the pressure holds on
+        size_t first = candidates / 16 > 0 ? candidates / 16 : 1;
+        shed_count_ = shed_count_ > 0 ? shed_count_ * 2 : first;
+        if (shed_count_ > candidates)
+            shed_count_ = candidates;
+    }
+    std::sort(ranked.begin(), ranked.end(),
+              [](const pair<uint64_t, ISock5Notify*>& a, const pair<uint64_t, ISock5Notify*>& b) {
+                  return a.first > b.first;
+              });
+    Metrics::Local()->streams_shed.Set(shed_count_);
+    //a resumed stream may close while reading what waited, it only
+    //removes itself
+    for (size_t i = 0; i < ranked.size(); i++)
+        ranked[i].second->SetShed(i < shed_count_);
+}
+
+void TCPServer::HandleSpliceAttach(HashType s, evutil_socket_t fd, evbuffer* data) {
+    ISock5Notify* handler = sock5_handler_.Find(s);
+    if (!handler) {
+        evutil_closesocket(fd);
+        evbuffer_free(data);
+        return;
+    }
+    handler->HandleAttach(fd, data);
+}
+
+bool TCPServer::SendToProxy(IProxyNotify* proxy, ForwardData & data) {
+    if (proxy == NULL) {
         return false;
     }
-    proxy_handler_->HandleForward(data);
+    proxy->HandleForward(data);
     return true;
-}
\ No newline at end of file
+}
@@ -1,6 +1,7 @@
 #ifndef _TCP_SERVER_H_
 #define _TCP_SERVER_H_
 
+#include <algorithm>
 #include <list>
 #include <iostream>
 #include <set>
@@ -11,6 +12,7 @@
 #include <sstream>
 #include <stdint.h>
 #include <memory>
+#include <atomic>
 #include <sys/timeb.h>
 #include <time.h>
 #include <string.h>
@@ -53,12 +55,26 @@ typedef int SOCKET;
 #endif
 
 #include "log.hpp"
-
-
-typedef uint32_t HashType;
-enum {
-    kHashTypeInvalid = -1
-};
+#include "forward_codec.h"
+#include "tunnel_config.h"
+#include "flow_control.h"
+#include "stream_table.h"
+#include "frame_batcher.h"
+#include "frame_compressor.h"
+#include "tls_context.h"
+#include "splice_relay.h"
+#include "splice_acceptor.h"
+#include "tunnel_session.h"
+#include "metrics.h"
+#include "peer_monitor.h"
+#include "timer_wheel.h"
+#include "mem_pool.h"
+#include "memory_budget.h"
+#include "session_directory.h"
+#include "socks5_engine.h"
+#include "socket_writer.h"
+#include "datagram_link.h"
+#include "uring_link.h"
 
 class ITCPServerNotify {
 public:
@@ -83,67 +99,157 @@ public:
     virtual void HandlePeriodic() = 0;
 };
 
-#pragma pack(1)
-struct ForwardData {
-    enum {
-        kHeartBeat = 0,
-        kSendData,
-        kCloseConnect
-    };
-    ForwardData(HashType to, uint32_t len, char* data, uint8_t op = kSendData) {
-        len_ = len;
-        data_ = new char[len_];
-        op_ = op;
-        to_ = to;
-        memcpy(data_, data, len_);
-    }
-    ~ForwardData() {
-        if (data_) delete data_;
-    }
-    uint32_t len_;
-    HashType to_;
-    uint8_t op_;
-    char* data_;
-} ;
-
 class IProxyNotify: public ITCPClientNotify, public IPeriodicNotify {
 public:
     virtual ~IProxyNotify() {};
     virtual void HandleForward(ForwardData& data) = 0;
+    //bytes waiting to be written to the tunnel
+    virtual size_t GetQueuedBytes() = 0;
+    //adds this tunnel's backlogs and rtt to a metrics sample
+    virtual void SampleMetrics(MetricsSample* sample) = 0;
+    //credit window for a stream opened on this tunnel
+    virtual FlowWindow NewFlowWindow() = 0;
+    //NULL unless both sides agreed on compression
+    virtual FrameCompressor* GetCompressor() = 0;
+    //optional feature agreed in the hello
+    virtual bool HasFeature(uint32_t feature) = 0;
 };
 
 class ISock5Notify : public ITCPClientNotify {
 public:
     virtual ~ISock5Notify() {};
     virtual void HandleForward(ForwardData& data) = 0;
+    //tunnel this stream is bound to
+    virtual IProxyNotify* GetProxy() = 0;
+    //invoke when the bound tunnel is lost
+    virtual void OnProxyClose() = 0;
+    //binds a stream that came in while every tunnel waited for its hello
+    virtual void OnProxyReady(IProxyNotify* proxy) = 0;
+    //raw connection for a promoted stream arrived, takes fd and data
+    virtual void HandleAttach(evutil_socket_t fd, evbuffer* data) = 0;
+    //bytes waiting to be written to the stream's socket
+    virtual size_t GetQueuedBytes() = 0;
+    //payload relayed since the last call, ranks streams for shedding
+    virtual uint64_t TakeRecentBytes() = 0;
+    //stops or resumes reading the stream under memory pressure
+    virtual void SetShed(bool shed) = 0;
+    virtual bool IsShed() = 0;
+};
+
+class ProxyClient;
+
+enum BALANCE_POLICY {
+    kBalanceHash = 0,
+    kBalanceLeastQueued
 };
 
 //tcp socket server
-class TCPServer : public ITCPServerNotify {
+class TCPServer : public ITCPServerNotify, public IDatagramTunnelNotify, public IUringAcceptNotify {
 public:
     bool Init();
     bool InitSock5Server();
     bool InitProxyServer();
+    //udp tunnels on address:port, next to the tcp listener. with workers
+    //above 1 the socket is one of theirs, bound in worker order
+    bool InitDatagramServer(string address, int port, int workers);
     TCPServer(event_base* event_loop, string proxy_address, int proxy_port, string sock5_address, int sock5_port);
-    void AddHandler(HashType s, ISock5Notify* handler) ;
-    void CloseRemoteConnect(HashType s);
+    //binds a new stream, kHashTypeInvalid when no id is free
+    HashType AddHandler(ISock5Notify* handler);
+    void CloseRemoteConnect(IProxyNotify* proxy, HashType s);
     void RemoveHandler(HashType s);
-    void RemoveProxyHandler();
+    void RemoveProxyHandler(IProxyNotify* proxy);
+    //a tunnel takes streams once its hello is answered
+    void ActivateProxy(ProxyClient* proxy);
+    //a tunnel whose connection dropped keeps its streams until the agent
+    //resumes the session or the resume timeout closes it
+    void DetachProxy(ProxyClient* proxy, uint64_t session);
+    //a session still held by a live connection is detached from it first,
+    //the agent dials again before the old connection looks dead here. one
+    //held by another worker is dropped there, the agent starts over
+    ProxyClient* TakeDetached(uint64_t session);
+    //runs on this server's loop, the agent's tunnel reached another worker
+    void DropSession(uint64_t session);
+    //NULL outside a worker group, sessions are then only this server's
+    void SetSessionDirectory(SessionDirectory* sessions, ISessionOwner* owner);
+    void RegisterSession(uint64_t session);
+    void UnregisterSession(uint64_t session);
+    //a resumed tunnel takes over the slot of the connection it arrived on
+    void ReplaceProxy(IProxyNotify* from, IProxyNotify* to);
+    //closes the streams bound to a tunnel, it stays in place
+    size_t CloseStreams(IProxyNotify* proxy);
+    void SetBalancePolicy(int policy);
+    void SetReusePort(bool reuse_port);
+    //a worker's listener is one of several on the port. it is closed while
+    //the worker has no tunnel, so the kernel hands socks clients to the
+    //workers able to carry them
+    void SetPauseWithoutTunnel(bool pause);
+    //thread safe, tunnels connected or waiting for their hello
+    int GetLiveTunnels();
+    void SetTunnelConfig(const TunnelConfig& config);
+    const TunnelConfig& GetTunnelConfig();
+    void AdoptProxySocket(evutil_socket_t fd);
+    IProxyNotify* SelectProxy(HashType s);
+    //a tunnel is connected but its hello not answered yet
+    bool HasPendingProxy();
     virtual void OnSockListen(struct evconnlistener *listener, bufferevent* bev, struct sockaddr *sa, int socklen);
+    virtual void OnDatagramTunnel(bufferevent* bev);
+    virtual void OnUringAccept(UringListener* listener, evutil_socket_t fd);
     void Close();
     bool SendToSock5(ForwardData& data);
-    bool SendToProxy(ForwardData& data);
+    bool SendToProxy(IProxyNotify* proxy, ForwardData& data);
+    //runs on this server's loop, posted by the SpliceAcceptor
+    void HandleSpliceAttach(HashType s, evutil_socket_t fd, evbuffer* data);
+    //publishes this loop's gauges, once a second when metrics are on
+    void SampleMetrics();
+    //stream timeouts of this loop
+    TimerWheel* GetWheel();
+    //sheds or resumes this loop's streams as the memory budget fills and
+    //empties, every 100ms while a budget is set
+    void CheckBudget();
+    //payload a stream must relay between two checks to be shed
+    static const uint64_t kShedMinBytes = 64 * 1024;
 private:
     bool is_closed_;
     event_base* event_loop_;
     evconnlistener* proxy_socket_;
     evconnlistener* sock5_socket_;
+    //NULL unless sockets are driven by io_uring, sock5_socket_ is then
+    //unused and socks clients come through sock5_uring_
+    UringLoop* uring_;
+    UringListener* sock5_uring_;
+    //NULL unless udp tunnels are taken
+    DatagramListener* datagram_;
     string proxy_address_;
     int proxy_port_;
     string sock5_address_;
     int sock5_port_;
-    map<HashType, ISock5Notify*> sock5_handler_;
-    IProxyNotify* proxy_handler_;
+    bool reuse_port_;
+    TunnelConfig config_;
+    StreamTable<ISock5Notify> sock5_handler_;
+    //tunnel connections from the agent, streams are spread across them
+    vector<IProxyNotify*> proxy_handler_;
+    //tunnels still waiting for the agent's hello, no stream is bound to them
+    vector<ProxyClient*> pending_;
+    //detached tunnels by session id, only ever resumed on this server's
+    //loop so a worker does not pick up another worker's session
+    map<uint64_t, ProxyClient*> detached_;
+    SessionDirectory* sessions_;
+    ISessionOwner* session_owner_;
+    int balance_policy_;
+    event* metrics_event_;
+    TimerWheel* wheel_;
+    event* budget_event_;
+    //streams of this loop not read from, noisiest first
+    size_t shed_count_;
+    void AddProxySocket(bufferevent* bev);
+    //a socks client connected, on either kind of listener
+    void AcceptSock5(bufferevent* bev);
+    bool ListenSock5();
+    void StopSock5();
+    //after every change to proxy_handler_ or pending_
+    void OnTunnelsChanged();
+    bool pause_without_tunnel_;
+    std::atomic<int> live_tunnels_;
 };
 
 
@@ -152,15 +258,18 @@ enum CLIENT_STATUS {
     kInit,
     kConnected,
     kCloseWait,
-    kClosed
+    kClosed,
+    //reads stopped, waiting for the agent's ack and raw connection
+    kMigrating,
+    //tunnel connection lost, frames are only kept for a resume
+    kDetached
 };
 
-class Sock5Client : public ISock5Notify {
+class Sock5Client : public ISock5Notify, public IWheelNotify, public Pooled<Sock5Client> {
 public:
     Sock5Client(TCPServer* server,
                 event_base* event_loop,
-                bufferevent* local_socket,
-                HashType hash);
+                bufferevent* local_socket);
     void SetCloseWait();
 
     virtual void HandleForward(ForwardData& data);
@@ -171,11 +280,34 @@ public:
 
     virtual void OnSockClose(bufferevent *bev);
 
+    virtual IProxyNotify* GetProxy();
+
+    virtual void OnProxyClose();
+
+    virtual void OnProxyReady(IProxyNotify* proxy);
+
+    virtual void HandleAttach(evutil_socket_t fd, evbuffer* data);
+
+    virtual size_t GetQueuedBytes();
+
+    virtual uint64_t TakeRecentBytes();
+
+    virtual void SetShed(bool shed);
+
+    virtual bool IsShed();
+
+    void OnMigrateTimeout();
+
+    //idle, close wait or migrate timeout, whichever status_ is in
+    virtual void OnWheelTimeout();
+
 private:
     ~Sock5Client();
 
     TCPServer* server_;
 
+    IProxyNotify* proxy_;
+
     event_base* event_loop_;
 
     bufferevent* socket_;
@@ -186,9 +318,82 @@ private:
 
     void AppendData(ForwardData & data);
 
+    void HandleCredit(ForwardData & data);
+
+    //hands back the credit for what left the socket's output buffer
+    void GrantCredit(size_t queued);
+
+    void MaybeMigrate();
+
+    void HandleMigrateAck(ForwardData & data);
+
+    void TryPromote();
+
+    //stamps stream activity, the idle timer checks it when it fires
+    void Touch() {
+        active_ms_ = wheel_->NowMs();
+    }
+
+    //(re)arms timer_, 0 stops it
+    void ArmTimer(int64_t delay_ms);
+
     int heart_;
 
     HashType hash_;
+
+    FlowWindow flow_;
+
+    CompressProbe probe_;
+
+    //payload relayed in both directions, checked against elephant_bytes
+    uint64_t bytes_;
+
+    //0 until a migration was offered, a stream is offered only once
+    uint64_t migrate_token_;
+
+    bool migrate_acked_;
+
+    evutil_socket_t attach_fd_;
+
+    evbuffer* attach_data_;
+
+    TimerWheel* wheel_;
+
+    WheelTimer timer_;
+
+    int64_t active_ms_;
+
+    uint64_t recent_bytes_;
+
+    //reads stopped and credit held back until memory pressure eases
+    bool shed_;
+
+    //the socket's output buffer
+    BudgetCharge queued_;
+};
+
+//answers the socks handshake of a client turned away because the memory
+//budget ran out with a general failure, then closes
+class SocksRejecter : public ITCPClientNotify, public IWheelNotify {
+public:
+    SocksRejecter(TCPServer* server, bufferevent* local_socket);
+
+    virtual void OnSockRead(bufferevent *bev);
+
+    virtual void OnSockWrote(bufferevent *bev);
+
+    virtual void OnSockClose(bufferevent *bev);
+
+    virtual void OnWheelTimeout();
+
+private:
+    ~SocksRejecter();
+
+    bufferevent* socket_;
+
+    Socks5Engine engine_;
+
+    WheelTimer timer_;
 };
 
 class ProxyClient : public IProxyNotify {
@@ -201,10 +406,49 @@ public:
 
     virtual void HandlePeriodic();
 
+    virtual size_t GetQueuedBytes();
+
+    virtual void SampleMetrics(MetricsSample* sample);
+
+    virtual FlowWindow NewFlowWindow();
+
+    virtual FrameCompressor* GetCompressor();
+
+    virtual bool HasFeature(uint32_t feature);
+
     virtual void OnSockRead(bufferevent *bev);
 
+    virtual void OnSockConnected(bufferevent *bev);
+
     virtual void OnSockClose(bufferevent *bev);
 
+    virtual void OnSockWrote(bufferevent *bev);
+
+    //continue a detached session on the connection an offer came in on,
+    //false when its frames can not be replayed from where the agent is
+    bool Resume(bufferevent* bev, const HelloInfo& hello);
+
+    void OnResumeTimeout();
+
+    //0 unless the agent's offer asked for a resumable session
+    uint64_t GetSession();
+
+    //gives up the connection for a newer one the agent resumes on
+    void Supersede();
+
+    //a detached session the agent started over on another worker, its
+    //streams are closed
+    void Abandon();
+
+    //an agent on protocol v1 sends no hello, its tunnel takes streams anyway
+    void OnHelloTimeout();
+
+    //how long a new tunnel waits for the agent's offer
+    static const int kHelloWaitSec = 2;
+
+    //pings the agent, or gives the connection up once it went silent
+    void HandleHeartbeat();
+
 private:
     ~ProxyClient();
 
@@ -216,21 +460,69 @@ private:
 
     int status_;
 
-    vector<char> data_to_send_;
+    ForwardCodec codec_;
+
+    FrameBatcher* batcher_;
 
-    vector<char> data_to_recv_;
+    FrameCompressor* compressor_;
+
+    //NULL sends stream frames in the order they were read
+    FrameScheduler* scheduler_;
 
     void AppendData(ForwardData & data);
 
-    bool WriteToSock();
+    void SendFrame(ForwardData & data);
+
+    //moves scheduled frames on while the tunnel has room
+    void Drain();
+
+    //framed bytes past the scheduler, not yet written to the socket
+    size_t GetBufferedBytes();
+
+    //moves backlog_ to what the tunnel holds now
+    void ChargeBudget();
 
     void ParseData();
 
+    //true when the connection was handed to a resumed session
+    bool HandleHello(ForwardData & data);
+
+    void SendAccept(const HelloInfo& hello, bool resumed);
+
+    //closes this connection's streams and discards their queued frames
+    void DropStreams();
+
+    //moves the tunnel from pending to the ones streams are spread across
+    void Activate(bool legacy);
+
+    void SendAck();
+
+    void Detach();
+
     void Close();
 
     int heart_;
 
     event* periodic_event_;
+
+    PeerMonitor monitor_;
+
+    //armed for the next ping when kFeatureHeartbeat is agreed
+    event* heartbeat_event_;
+
+    //frames kept for a resume, NULL unless the agent's offer asked for it
+    TunnelSession* session_;
+
+    event* resume_timer_;
+
+    //NULL once the tunnel is active
+    event* hello_timer_;
+
+    //took streams before any offer, a late one can not turn credit on
+    bool legacy_;
+
+    //scheduled, batched and unsent frames plus replay copies
+    BudgetCharge backlog_;
 };
 
 
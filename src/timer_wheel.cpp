@@ -0,0 +1,161 @@
+#include "timer_wheel.h"
+
+#include <chrono>
+
+static void tickcb(evutil_socket_t fd, short what, void *ctx) {
+    TimerWheel* pWheel = static_cast<TimerWheel*>(ctx);
+    pWheel->Advance();
+}
+
+static int64_t SteadyMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+WheelTimer::WheelTimer(IWheelNotify* notify):
+    notify_(notify),
+    wheel_(NULL),
+    prev_(NULL),
+    next_(NULL),
+    expire_(0) {
+}
+
+WheelTimer::~WheelTimer() {
+    Stop();
+}
+
+void WheelTimer::Start(TimerWheel* wheel, int64_t delay_ms) {
+    Stop();
+    wheel->Add(this, delay_ms);
+}
+
+void WheelTimer::Stop() {
+    if (wheel_)
+        wheel_->Remove(this);
+}
+
+TimerWheel::TimerWheel(event_base* event_loop, int tick_ms):
+    event_loop_(event_loop),
+    tick_event_(NULL),
+    tick_ms_(tick_ms > 0 ? tick_ms : 1),
+    origin_ms_(SteadyMs()),
+    current_(0),
+    size_(0) {
+    for (int level = 0; level < kLevels; level++) {
+        for (int slot = 0; slot < kSlots; slot++) {
+            WheelTimer* head = new WheelTimer(NULL);
+            head->prev_ = head;
+            head->next_ = head;
+            slots_[level][slot] = head;
+        }
+    }
+    tick_event_ = event_new(event_loop_, -1, EV_PERSIST, tickcb, this);
+}
+
+TimerWheel::~TimerWheel() {
+    for (int level = 0; level < kLevels; level++) {
+        for (int slot = 0; slot < kSlots; slot++) {
+            WheelTimer* head = slots_[level][slot];
+            //owners outliving the wheel find their timers stopped
+            while (head->next_ != head) {
+                WheelTimer* timer = head->next_;
+                Remove(timer);
+            }
+            delete head;
+        }
+    }
+    event_free(tick_event_);
+}
+
+uint64_t TimerWheel::ClockTicks() const {
+    return (uint64_t)((SteadyMs() - origin_ms_) / tick_ms_);
+}
+
+void TimerWheel::Add(WheelTimer* timer, int64_t delay_ms) {
+    if (size_ == 0) {
+        //the clock stood still while nothing was pending
+        current_ = ClockTicks();
+        timeval tick = { tick_ms_ / 1000, (tick_ms_ % 1000) * 1000 };
+        event_add(tick_event_, &tick);
+    }
+    //rounded up, a timer never fires early and never in the current tick
+    int64_t ticks = (delay_ms + tick_ms_ - 1) / tick_ms_;
+    timer->expire_ = current_ + (ticks > 0 ? ticks : 1);
+    timer->wheel_ = this;
+    size_++;
+    Place(timer);
+}
+
+void TimerWheel::Unlink(WheelTimer* timer) {
+    timer->prev_->next_ = timer->next_;
+    timer->next_->prev_ = timer->prev_;
+    timer->prev_ = NULL;
+    timer->next_ = NULL;
+}
+
+void TimerWheel::Remove(WheelTimer* timer) {
+    Unlink(timer);
+    timer->wheel_ = NULL;
+    size_--;
+    if (size_ == 0)
+        event_del(tick_event_);
+}
+
+void TimerWheel::Place(WheelTimer* timer) {
+    uint64_t distance = timer->expire_ - current_;
+    int level = 0;
+    while (level < kLevels - 1 && distance >= ((uint64_t)1 << (kSlotBits * (level + 1))))
+        level++;
+    //past the top level the timer waits a full turn and is placed again
+    uint64_t span = (uint64_t)1 << (kSlotBits * kLevels);
+    uint64_t expire = distance < span ? timer->expire_ : current_ + span - 1;
+    WheelTimer* head = slots_[level][(expire >> (kSlotBits * level)) & kSlotMask];
+    timer->prev_ = head->prev_;
+    timer->next_ = head;
+    head->prev_->next_ = timer;
+    head->prev_ = timer;
+}
+
+void TimerWheel::Cascade(int level) {
+    WheelTimer* head = slots_[level][(current_ >> (kSlotBits * level)) & kSlotMask];
+    WheelTimer* timer = head->next_;
+    head->prev_ = head;
+    head->next_ = head;
+    while (timer != head) {
+        WheelTimer* next = timer->next_;
+        Place(timer);
+        timer = next;
+    }
+}
+
+void TimerWheel::Tick() {
+    current_++;
+    for (int level = 1; level < kLevels; level++) {
+        if ((current_ & (((uint64_t)1 << (kSlotBits * level)) - 1)) != 0)
+            break;
+        Cascade(level);
+    }
+    WheelTimer* head = slots_[0][current_ & kSlotMask];
+    //callbacks may stop other timers or start new ones, a new one never
+    //lands in this slot again, so take them off one at a time
+    while (head->next_ != head) {
+        WheelTimer* timer = head->next_;
+        if (timer->expire_ > current_) {
+            //a timer from past the top level, not due yet
+            Unlink(timer);
+            Place(timer);
+            continue;
+        }
+        Remove(timer);
+        timer->notify_->OnWheelTimeout();
+    }
+}
+
+void TimerWheel::Advance() {
+    //a late or stalled loop catches up, every tick still runs in order
+    uint64_t target = ClockTicks();
+    while (current_ < target && size_ > 0)
+        Tick();
+    if (size_ == 0)
+        current_ = target;
+}
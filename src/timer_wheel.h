@@ -0,0 +1,116 @@
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <event2/event.h>
+
+class TimerWheel;
+
+class IWheelNotify {
+public:
+    virtual ~IWheelNotify() {};
+    //invoke when the timer expired, it is no longer pending
+    virtual void OnWheelTimeout() = 0;
+};
+
+//one deadline on a TimerWheel, embedded in the object it times so
+//starting and stopping it never allocates
+class WheelTimer {
+public:
+    explicit WheelTimer(IWheelNotify* notify);
+
+    ~WheelTimer();
+
+    //(re)arms the timer to fire after delay_ms, O(1)
+    void Start(TimerWheel* wheel, int64_t delay_ms);
+
+    void Stop();
+
+    bool Pending() const {
+        return wheel_ != NULL;
+    }
+
+private:
+    friend class TimerWheel;
+
+    IWheelNotify* notify_;
+
+    TimerWheel* wheel_;
+
+    WheelTimer* prev_;
+
+    WheelTimer* next_;
+
+    uint64_t expire_;
+};
+
+//hierarchical timing wheel for the per stream timeouts of one loop, in
+//place of a libevent timer per stream. four levels of 64 slots cover
+//64^4 ticks; a timer sits in the level its distance falls into and moves
+//one level down each time the level below wraps, so scheduling,
+//cancelling and expiring are all O(1). one libevent timer drives it,
+//armed only while some timer is pending
+class TimerWheel {
+public:
+    enum {
+        kSlotBits = 6,
+        kSlots = 1 << kSlotBits,
+        kSlotMask = kSlots - 1,
+        kLevels = 4
+    };
+
+    TimerWheel(event_base* event_loop, int tick_ms);
+
+    ~TimerWheel();
+
+    //the wheel's clock, advanced once per tick. stream activity stamps
+    //itself with this, reading it costs no syscall
+    int64_t NowMs() const {
+        return (int64_t)(current_ * tick_ms_);
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    //runs the ticks that are due, from the libevent timer
+    void Advance();
+
+private:
+    friend class WheelTimer;
+
+    void Add(WheelTimer* timer, int64_t delay_ms);
+
+    void Remove(WheelTimer* timer);
+
+    void Unlink(WheelTimer* timer);
+
+    void Place(WheelTimer* timer);
+
+    //moves the timers of a higher level slot down now that it came due
+    void Cascade(int level);
+
+    void Tick();
+
+    //ticks of the monotonic clock since the wheel was made
+    uint64_t ClockTicks() const;
+
+    event_base* event_loop_;
+
+    event* tick_event_;
+
+    int tick_ms_;
+
+    int64_t origin_ms_;
+
+    uint64_t current_;
+
+    size_t size_;
+
+    //list heads, a slot is empty when its head points at itself
+    WheelTimer* slots_[kLevels][kSlots];
+};
+
+#endif
@@ -0,0 +1,142 @@
+#include "tls_context.h"
+
+#include "log.hpp"
+
+static int new_session_cb(SSL* ssl, SSL_SESSION* session) {
+    TlsContext* pContext = static_cast<TlsContext*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    pContext->SaveSession(session);
+    //the reference is kept
+    return 1;
+}
+
+TlsContext::TlsContext():
+    ctx_(NULL),
+    session_(NULL),
+    verify_(false) {
+}
+
+TlsContext::~TlsContext() {
+    if (session_)
+        SSL_SESSION_free(session_);
+    if (ctx_)
+        SSL_CTX_free(ctx_);
+}
+
+bool TlsContext::InitContext(bool server) {
+    ctx_ = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+    if (!ctx_) {
+        LOGE << "SSL_CTX_new failed\n";
+        return false;
+    }
+    SSL_CTX_set_app_data(ctx_, this);
+    SSL_CTX_set_min_proto_version(ctx_, TLS1_2_VERSION);
+    //aes-gcm first, it is what kernels offload
+    SSL_CTX_set_ciphersuites(ctx_, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:"
+                             "TLS_CHACHA20_POLY1305_SHA256");
+    SSL_CTX_set_cipher_list(ctx_, "ECDHE+AESGCM:ECDHE+CHACHA20");
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ctx_, SSL_OP_ENABLE_KTLS);
+#endif
+    SSL_CTX_set_mode(ctx_, SSL_MODE_RELEASE_BUFFERS);
+    return true;
+}
+
+bool TlsContext::InitServer(const std::string& cert_file, const std::string& key_file) {
+    if (!InitContext(true))
+        return false;
+    if (SSL_CTX_use_certificate_chain_file(ctx_, cert_file.c_str()) != 1 ||
+            SSL_CTX_use_PrivateKey_file(ctx_, key_file.c_str(), SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(ctx_) != 1) {
+        LOGE << "could not load tls certificate " << cert_file << " / " << key_file << "\n";
+        return false;
+    }
+    //stateless tickets, any worker holding this context can resume a session
+    static const unsigned char kSessionContext[] = "rproxy";
+    SSL_CTX_set_session_id_context(ctx_, kSessionContext, sizeof(kSessionContext) - 1);
+    return true;
+}
+
+bool TlsContext::InitClient(const std::string& ca_file, const std::string& server_name) {
+    if (!InitContext(false))
+        return false;
+    server_name_ = server_name;
+    if (!ca_file.empty()) {
+        if (SSL_CTX_load_verify_locations(ctx_, ca_file.c_str(), NULL) != 1) {
+            LOGE << "could not load tls ca " << ca_file << "\n";
+            return false;
+        }
+        SSL_CTX_set_verify(ctx_, SSL_VERIFY_PEER, NULL);
+        verify_ = true;
+    } else {
+        LOGW << "tls without --tls-ca, the forwarder certificate is not verified\n";
+    }
+    SSL_CTX_set_session_cache_mode(ctx_, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx_, new_session_cb);
+    return true;
+}
+
+bufferevent* TlsContext::NewAcceptSocket(event_base* base, evutil_socket_t fd) {
+    SSL* ssl = SSL_new(ctx_);
+    if (!ssl)
+        return NULL;
+    bufferevent* bev = bufferevent_openssl_socket_new(base, fd, ssl, BUFFEREVENT_SSL_ACCEPTING,
+                                                      BEV_OPT_CLOSE_ON_FREE);
+    if (!bev) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    bufferevent_openssl_set_allow_dirty_shutdown(bev, 1);
+    return bev;
+}
+
+bufferevent* TlsContext::NewConnectSocket(event_base* base) {
+    SSL* ssl = SSL_new(ctx_);
+    if (!ssl)
+        return NULL;
+    if (!server_name_.empty()) {
+        SSL_set_tlsext_host_name(ssl, server_name_.c_str());
+        if (verify_)
+            SSL_set1_host(ssl, server_name_.c_str());
+    }
+    if (session_)
+        SSL_set_session(ssl, session_);
+    bufferevent* bev = bufferevent_openssl_socket_new(base, -1, ssl, BUFFEREVENT_SSL_CONNECTING,
+                                                      BEV_OPT_CLOSE_ON_FREE);
+    if (!bev) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    bufferevent_openssl_set_allow_dirty_shutdown(bev, 1);
+    return bev;
+}
+
+void TlsContext::SaveSession(SSL_SESSION* session) {
+    if (session_)
+        SSL_SESSION_free(session_);
+    session_ = session;
+}
+
+void TlsContext::OnHandshakeDone(bufferevent* bev) {
+    SSL* ssl = bufferevent_openssl_get_ssl(bev);
+    if (!ssl)
+        return;
+    int ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    int ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+    LOGI << "tunnel " << SSL_get_version(ssl) << " " << SSL_get_cipher_name(ssl)
+         << (SSL_session_reused(ssl) ? " resumed" : " full handshake")
+         << ", ktls send " << (ktls_send ? "on" : "off")
+         << " recv " << (ktls_recv ? "on" : "off") << "\n";
+}
+
+std::string TlsContext::GetError(bufferevent* bev) {
+    if (!bufferevent_openssl_get_ssl(bev))
+        return "";
+    unsigned long err = bufferevent_get_openssl_error(bev);
+    //libevent also queues plain SSL_get_error codes, a socket error shows
+    //up as SSL_ERROR_SYSCALL and carries nothing tls specific
+    if (err == 0 || err == SSL_ERROR_SYSCALL)
+        return "";
+    char buf[256];
+    ERR_error_string_n(err, buf, sizeof(buf));
+    return buf;
+}
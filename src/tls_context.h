@@ -0,0 +1,58 @@
+#ifndef _TLS_CONTEXT_H_
+#define _TLS_CONTEXT_H_
+
+#include <string>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+#include <event2/bufferevent_ssl.h>
+
+//tls for the tunnel connection. once the handshake is done openssl moves
+//record encryption into the kernel (kTLS) when the kernel and cipher allow
+//it, otherwise records are sealed in userspace as usual. the agent keeps
+//the last session ticket so a reconnecting tunnel resumes instead of
+//running a full handshake. one instance is shared by every tunnel of the
+//process, SSL_CTX is safe to use from several worker loops
+class TlsContext {
+public:
+    TlsContext();
+
+    ~TlsContext();
+
+    //forwarder side
+    bool InitServer(const std::string& cert_file, const std::string& key_file);
+
+    //agent side, ca_file empty skips verifying the forwarder
+    bool InitClient(const std::string& ca_file, const std::string& server_name);
+
+    //accepted tunnel socket, the handshake runs inside the bufferevent
+    bufferevent* NewAcceptSocket(event_base* base, evutil_socket_t fd);
+
+    //call bufferevent_socket_connect on the result
+    bufferevent* NewConnectSocket(event_base* base);
+
+    //log version, resumption and kTLS state once BEV_EVENT_CONNECTED fired
+    static void OnHandshakeDone(bufferevent* bev);
+
+    //last openssl error of a failed tunnel, empty if there is none
+    static std::string GetError(bufferevent* bev);
+
+    //new session tickets sent by the forwarder
+    void SaveSession(SSL_SESSION* session);
+
+private:
+    bool InitContext(bool server);
+
+    SSL_CTX* ctx_;
+
+    SSL_SESSION* session_;
+
+    std::string server_name_;
+
+    bool verify_;
+};
+
+#endif
@@ -0,0 +1,245 @@
+#ifndef _TUNNEL_CONFIG_H_
+#define _TUNNEL_CONFIG_H_
+
+#include "options.hpp"
+#include "forward_codec.h"
+#include "frame_scheduler.h"
+
+class TlsContext;
+class SpliceAcceptor;
+class UpstreamGroup;
+class MemoryBudget;
+struct evdns_base;
+
+//settings both tunnel endpoints share, filled from the command line
+struct TunnelConfig {
+    enum {
+        kTransportTcp = 0,
+        //DatagramLink, streams are not held up by each other's losses
+        kTransportUdp
+    };
+    enum {
+        kIoLibevent = 0,
+        //UringLoop, falls back to libevent where io_uring is missing
+        kIoUring
+    };
+    TunnelConfig():
+        max_version(ForwardCodec::kMaxVersion),
+        features(ForwardCodec::kFeatureFlowControl),
+        window(256 * 1024),
+        batch_bytes(64 * 1024),
+        batch_delay_us(0),
+        compress_level(1),
+        elephant_bytes(0),
+        replay_bytes(8 * 1024 * 1024),
+        resume_timeout_sec(60),
+        reconnect_min_ms(200),
+        reconnect_max_ms(10000),
+        heartbeat_ms(1000),
+        heartbeat_max_ms(10000),
+        dead_timeout_ms(3000),
+        scheduler(FrameScheduler::kSparse),
+        frame_bytes(16 * 1024),
+        tunnel_buffer(64 * 1024),
+        idle_timeout_sec(1800),
+        connect_timeout_sec(30),
+        close_wait_timeout_sec(60),
+        pool_cache_bytes(8 * 1024 * 1024),
+        direct_write(true),
+        io(kIoLibevent),
+        memory_budget_mb(0),
+        memory_shed_percent(75),
+        transport(kTransportTcp),
+        udp_mtu(1400),
+        sim_loss_percent(0),
+        sim_delay_ms(0),
+        sim_jitter_ms(0),
+        metrics(false),
+        budget(NULL),
+        tls(NULL),
+        splice(NULL),
+        upstream(NULL),
+        dns(NULL) {
+    }
+    void Load(const Options& options) {
+        max_version = options.GetInt("protocol", ForwardCodec::kMaxVersion);
+        if (max_version < ForwardCodec::kVersion1 || max_version > ForwardCodec::kMaxVersion)
+            max_version = ForwardCodec::kMaxVersion;
+        if (options.Get("flow-control", "1") == "0")
+            features &= ~ForwardCodec::kFeatureFlowControl;
+        int stream_window = options.GetInt("window", window);
+        if (stream_window >= 16 * 1024)
+            window = stream_window;
+        batch_bytes = options.GetInt("batch-bytes", batch_bytes);
+        batch_delay_us = options.GetInt("batch-delay", batch_delay_us);
+        if (batch_bytes < 0) batch_bytes = 0;
+        if (batch_delay_us < 0) batch_delay_us = 0;
+        if (options.Get("compress", "0") != "0")
+            features |= ForwardCodec::kFeatureCompression;
+        compress_level = options.GetInt("compress-level", compress_level);
+        if (compress_level < 1 || compress_level > 9)
+            compress_level = 1;
+#ifdef __linux__
+        if (options.Get("elephant", "") != "0")
+            features |= ForwardCodec::kFeatureSplice;
+#endif
+        elephant_bytes = options.GetInt("elephant", 0);
+        if (elephant_bytes > 0 && elephant_bytes < 1024 * 1024)
+            elephant_bytes = 1024 * 1024;
+        if (options.Get("resume", "1") != "0")
+            features |= ForwardCodec::kFeatureResume;
+        replay_bytes = options.GetInt("replay-bytes", replay_bytes);
+        if (replay_bytes < 1024 * 1024)
+            replay_bytes = 1024 * 1024;
+        resume_timeout_sec = options.GetInt("resume-timeout", resume_timeout_sec);
+        if (resume_timeout_sec < 1)
+            resume_timeout_sec = 1;
+        reconnect_min_ms = options.GetInt("reconnect-min", reconnect_min_ms);
+        reconnect_max_ms = options.GetInt("reconnect-max", reconnect_max_ms);
+        if (reconnect_min_ms < 10)
+            reconnect_min_ms = 10;
+        if (reconnect_max_ms < reconnect_min_ms)
+            reconnect_max_ms = reconnect_min_ms;
+        heartbeat_ms = options.GetInt("heartbeat", heartbeat_ms);
+        if (heartbeat_ms > 0) {
+            features |= ForwardCodec::kFeatureHeartbeat;
+            if (heartbeat_ms < 100)
+                heartbeat_ms = 100;
+        }
+        heartbeat_max_ms = options.GetInt("heartbeat-max", heartbeat_max_ms);
+        if (heartbeat_max_ms < heartbeat_ms)
+            heartbeat_max_ms = heartbeat_ms;
+        dead_timeout_ms = options.GetInt("dead-timeout", dead_timeout_ms);
+        if (dead_timeout_ms < 500)
+            dead_timeout_ms = 500;
+        std::string policy = options.Get("scheduler", "sparse");
+        if (policy == "fifo")
+            scheduler = FrameScheduler::kFifo;
+        else if (policy == "drr")
+            scheduler = FrameScheduler::kDrr;
+        frame_bytes = options.GetInt("frame-bytes", frame_bytes);
+        if (frame_bytes < 0)
+            frame_bytes = 0;
+        else if (frame_bytes > 0 && frame_bytes < 1024)
+            frame_bytes = 1024;
+        tunnel_buffer = options.GetInt("tunnel-buffer", tunnel_buffer);
+        if (tunnel_buffer < 16 * 1024)
+            tunnel_buffer = 16 * 1024;
+        idle_timeout_sec = options.GetInt("idle-timeout", idle_timeout_sec);
+        connect_timeout_sec = options.GetInt("connect-timeout", connect_timeout_sec);
+        close_wait_timeout_sec = options.GetInt("close-wait-timeout", close_wait_timeout_sec);
+        if (idle_timeout_sec < 0) idle_timeout_sec = 0;
+        if (connect_timeout_sec < 0) connect_timeout_sec = 0;
+        if (close_wait_timeout_sec < 0) close_wait_timeout_sec = 0;
+        pool_cache_bytes = options.GetInt("pool-cache", pool_cache_bytes);
+        if (pool_cache_bytes < 0)
+            pool_cache_bytes = 0;
+        if (options.Get("direct-write", "1") == "0")
+            direct_write = false;
+#ifdef __linux__
+        if (options.Get("io", "libevent") == "uring")
+            io = kIoUring;
+#endif
+        memory_budget_mb = options.GetInt("memory-budget", memory_budget_mb);
+        if (memory_budget_mb < 0)
+            memory_budget_mb = 0;
+        memory_shed_percent = options.GetInt("memory-shed", memory_shed_percent);
+        if (memory_shed_percent < 1 || memory_shed_percent > 100)
+            memory_shed_percent = 75;
+        if (options.Get("transport", "tcp") == "udp")
+            transport = kTransportUdp;
+        udp_mtu = options.GetInt("udp-mtu", udp_mtu);
+        if (udp_mtu < 576)
+            udp_mtu = 576;
+        else if (udp_mtu > 9000)
+            udp_mtu = 9000;
+        sim_loss_percent = atof(options.Get("sim-loss", "0").c_str());
+        if (sim_loss_percent < 0 || sim_loss_percent > 100)
+            sim_loss_percent = 0;
+        sim_delay_ms = options.GetInt("sim-delay", 0);
+        sim_jitter_ms = options.GetInt("sim-jitter", 0);
+        if (sim_delay_ms < 0) sim_delay_ms = 0;
+        if (sim_jitter_ms < 0) sim_jitter_ms = 0;
+        metrics = options.Has("metrics");
+    }
+    //highest framing version offered or accepted, 1 keeps the tunnel on v1
+    int max_version;
+    //optional features offered or accepted
+    uint32_t features;
+    //bytes a peer may send on one stream before it waits for credit
+    uint32_t window;
+    //data frames are held until this many bytes are batched, 0 writes each frame at once
+    int batch_bytes;
+    //longest a batched frame may wait in microseconds, 0 flushes once per loop iteration
+    int batch_delay_us;
+    //zlib level for kSendData payloads when compression is agreed
+    int compress_level;
+    //forwarder: a stream that moved this many bytes leaves the tunnel for
+    //its own spliced connection, 0 keeps every stream framed
+    int elephant_bytes;
+    //unacked stream frames each side keeps for a resume, past this the
+    //session gives up its copies and a reconnect drops its streams
+    int replay_bytes;
+    //how long streams of a dropped tunnel wait for the agent to come back
+    int resume_timeout_sec;
+    //agent: first redial delay, doubled per failed attempt up to the max
+    int reconnect_min_ms;
+    int reconnect_max_ms;
+    //shortest and longest ping interval, the rtt picks one in between.
+    //0 keeps the 30 second beats that carry no timestamp
+    int heartbeat_ms;
+    int heartbeat_max_ms;
+    //a silent peer is never given up on sooner than this
+    int dead_timeout_ms;
+    //order streams share the tunnel in, FrameScheduler::kFifo sends as read
+    int scheduler;
+    //stream reads are cut into frames of at most this, 0 sends each read whole
+    int frame_bytes;
+    //framed bytes a tunnel holds ahead of the scheduler, in the output
+    //buffer and unsent in the kernel each
+    int tunnel_buffer;
+    //a stream that moved no byte either way for this long is closed
+    int idle_timeout_sec;
+    //agent: socks handshake plus upstream connect must finish in this
+    int connect_timeout_sec;
+    //a closed stream whose socket does not drain is dropped after this.
+    //0 turns the respective timeout off
+    int close_wait_timeout_sec;
+    //free buffer blocks each loop thread keeps for reuse, 0 leaves libevent
+    //on plain malloc
+    int pool_cache_bytes;
+    //stream payload is written to the socket at once when nothing is
+    //queued ahead, false always goes through libevent's output buffer
+    bool direct_write;
+    //what drives plain tcp stream and tunnel sockets, tls tunnels and
+    //spliced streams always stay on libevent
+    int io;
+    //forwarder: megabytes all relay buffers together may hold, 0 is unbounded
+    int memory_budget_mb;
+    //share of the budget past which the noisiest streams stop being read
+    int memory_shed_percent;
+    //agent: what tunnels are dialed over. forwarder: kTransportUdp also
+    //takes udp tunnels on the tunnel port, tcp ones are always taken
+    int transport;
+    //largest datagram the udp transport sends
+    int udp_mtu;
+    //udp transport: share of outgoing datagrams dropped, delay and extra
+    //random delay added to the rest, all 0 outside of tests
+    double sim_loss_percent;
+    int sim_delay_ms;
+    int sim_jitter_ms;
+    //loops sample their gauges once a second for the metrics endpoint
+    bool metrics;
+    //forwarder: shared budget set up by main, NULL when unbounded
+    MemoryBudget* budget;
+    //shared tls state set up by main, NULL keeps the tunnel in plaintext
+    TlsContext* tls;
+    //forwarder listener for promoted streams, NULL when promotion is off
+    SpliceAcceptor* splice;
+    //agent: upstream socks servers streams are balanced over
+    UpstreamGroup* upstream;
+    //agent: resolver for the built-in socks engine, used when no upstream is set
+    evdns_base* dns;
+};
+
+#endif
@@ -0,0 +1,143 @@
+#include "tunnel_session.h"
+
+#include <event2/util.h>
+
+TunnelSession::TunnelSession(uint64_t id, size_t max_bytes):
+    id_(id),
+    max_bytes_(max_bytes),
+    sent_(0),
+    acked_(0),
+    received_(0),
+    unacked_frames_(0),
+    unacked_bytes_(0),
+    bytes_(0),
+    overflow_(false) {
+}
+
+TunnelSession::~TunnelSession() {
+    Clear();
+}
+
+uint64_t TunnelSession::NewId() {
+    uint64_t id = 0;
+    while (id == 0)
+        evutil_secure_rng_get_bytes(&id, sizeof(id));
+    return id;
+}
+
+bool TunnelSession::IsSequenced(uint8_t op) {
+    switch (op) {
+    case ForwardData::kSendData:
+    case ForwardData::kCloseConnect:
+    case ForwardData::kWindowUpdate:
+    case ForwardData::kSendCompressed:
+    case ForwardData::kMigrate:
+    case ForwardData::kMigrateAck:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void TunnelSession::OnSend(ForwardData& data) {
+    sent_++;
+    if (overflow_)
+        return;
+    size_t len = evbuffer_get_length(data.data_);
+    if (bytes_ + len > max_bytes_) {
+        overflow_ = true;
+        Clear();
+        return;
+    }
+    //the copy keeps the original chains, the frame leaves with read only
+    //references to them so nothing appended to the socket buffer can touch
+    //bytes that may have to be sent again
+    Frame frame;
+    frame.to = data.to_;
+    frame.op = data.op_;
+    frame.payload = evbuffer_new();
+    evbuffer_add_buffer(frame.payload, data.data_);
+    if (evbuffer_add_buffer_reference(data.data_, frame.payload) != 0) {
+        //payload that is itself made of references, give up on the copies
+        evbuffer_add_buffer(data.data_, frame.payload);
+        evbuffer_free(frame.payload);
+        overflow_ = true;
+        Clear();
+        return;
+    }
+    frames_.push_back(frame);
+    bytes_ += len;
+}
+
+void TunnelSession::OnReceive(const ForwardData& data) {
+    received_++;
+    unacked_frames_++;
+    unacked_bytes_ += data.len_;
+}
+
+void TunnelSession::MakeAck(ForwardData& data) {
+    unsigned char buf[8];
+    for (int i = 0; i < 8; i++)
+        buf[i] = (unsigned char)(received_ >> (8 * i));
+    data.op_ = ForwardData::kAck;
+    data.to_ = kHashTypeInvalid;
+    evbuffer_add(data.data_, buf, sizeof(buf));
+    data.len_ += sizeof(buf);
+    unacked_frames_ = 0;
+    unacked_bytes_ = 0;
+}
+
+bool TunnelSession::OnAck(ForwardData& data) {
+    unsigned char buf[8];
+    if (evbuffer_copyout(data.data_, buf, sizeof(buf)) != sizeof(buf))
+        return false;
+    uint64_t acked = 0;
+    for (int i = 0; i < 8; i++)
+        acked |= (uint64_t)buf[i] << (8 * i);
+    if (acked > sent_)
+        return false;
+    Trim(acked);
+    return true;
+}
+
+bool TunnelSession::CanReplay(uint64_t received) const {
+    return !overflow_ && received >= acked_ && received <= sent_;
+}
+
+void TunnelSession::Replay(uint64_t received, FrameBatcher* batcher) {
+    Trim(received);
+    for (size_t i = 0; i < frames_.size(); i++) {
+        ForwardData data(frames_[i].to, frames_[i].op);
+        evbuffer_add_buffer_reference(data.data_, frames_[i].payload);
+        data.len_ = evbuffer_get_length(data.data_);
+        batcher->Write(data);
+    }
+}
+
+void TunnelSession::Reset() {
+    Clear();
+    sent_ = 0;
+    acked_ = 0;
+    received_ = 0;
+    unacked_frames_ = 0;
+    unacked_bytes_ = 0;
+    overflow_ = false;
+}
+
+void TunnelSession::Trim(uint64_t acked) {
+    while (acked_ < acked && !frames_.empty()) {
+        acked_++;
+        bytes_ -= evbuffer_get_length(frames_.front().payload);
+        evbuffer_free(frames_.front().payload);
+        frames_.pop_front();
+    }
+    if (acked_ < acked)
+        acked_ = acked;
+}
+
+void TunnelSession::Clear() {
+    for (size_t i = 0; i < frames_.size(); i++)
+        evbuffer_free(frames_[i].payload);
+    frames_.clear();
+    bytes_ = 0;
+}
@@ -0,0 +1,120 @@
+#ifndef _TUNNEL_SESSION_H_
+#define _TUNNEL_SESSION_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+
+#include <event2/buffer.h>
+
+#include "forward_codec.h"
+#include "frame_batcher.h"
+
+//stream frames of one tunnel, numbered in the order they are sent. each
+//side keeps a copy of what it sent until the peer acks it, so when the
+//connection drops the agent can dial again and both ends carry on from
+//the first frame the other did not get instead of failing every stream.
+//heartbeats, hellos and acks are not numbered. copies share the payload
+//chains with the frame that went out, they cost no memcpy.
+//kAck payload: frames received so far(8, little endian)
+class TunnelSession {
+public:
+    enum {
+        //an ack goes out after this many frames or bytes, whichever is first
+        kAckFrames = 32,
+        kAckBytes = 64 * 1024
+    };
+
+    TunnelSession(uint64_t id, size_t max_bytes);
+
+    ~TunnelSession();
+
+    //random non zero id for a new agent session
+    static uint64_t NewId();
+
+    //ops that belong to a stream and are replayed after a reconnect
+    static bool IsSequenced(uint8_t op);
+
+    uint64_t GetId() const {
+        return id_;
+    }
+
+    //keep a copy of a frame that is about to be encoded
+    void OnSend(ForwardData& data);
+
+    //a numbered frame arrived
+    void OnReceive(const ForwardData& data);
+
+    uint64_t GetReceived() const {
+        return received_;
+    }
+
+    bool AckDue() const {
+        return unacked_frames_ >= kAckFrames || unacked_bytes_ >= kAckBytes;
+    }
+
+    bool HasUnacked() const {
+        return unacked_frames_ > 0;
+    }
+
+    //the kAck frame for what was received so far
+    void MakeAck(ForwardData& data);
+
+    //drops the copies the peer has, false on a malformed ack
+    bool OnAck(ForwardData& data);
+
+    //false once more than max_bytes went unacked, the copies were given
+    //up and the session can no longer survive a reconnect
+    bool Resumable() const {
+        return !overflow_;
+    }
+
+    //payload bytes of the copies held for a replay
+    size_t Held() const {
+        return bytes_;
+    }
+
+    //every frame after the peer's received count is still held
+    bool CanReplay(uint64_t received) const;
+
+    //sends the frames after received again, on a new connection
+    void Replay(uint64_t received, FrameBatcher* batcher);
+
+    //forget every frame and count, the streams were dropped on both ends
+    void Reset();
+
+private:
+    struct Frame {
+        HashType to;
+        uint8_t op;
+        evbuffer* payload;
+    };
+
+    void Trim(uint64_t acked);
+
+    void Clear();
+
+    uint64_t id_;
+
+    size_t max_bytes_;
+
+    //numbered frames sent, and the ones of those the peer acked
+    uint64_t sent_;
+
+    uint64_t acked_;
+
+    uint64_t received_;
+
+    uint32_t unacked_frames_;
+
+    size_t unacked_bytes_;
+
+    //frames acked_ + 1 .. sent_
+    std::deque<Frame> frames_;
+
+    size_t bytes_;
+
+    bool overflow_;
+};
+
+#endif
@@ -0,0 +1,220 @@
+#include "upstream_group.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+#include "log.hpp"
+
+enum {
+    //probe results in a row needed to flip a backend's state
+    kHealthStreak = 2
+};
+
+static const double kEwmaWeight = 0.3;
+
+static int64_t NowMs() {
+    struct timeval tv;
+    evutil_gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void probe_eventcb(struct bufferevent *bev, short events, void *ctx) {
+    static_cast<UpstreamBackend*>(ctx)->OnProbeEvent(bev, events);
+}
+
+static void probe_readcb(struct bufferevent *bev, void *ctx) {
+    static_cast<UpstreamBackend*>(ctx)->OnProbeRead(bev);
+}
+
+static void probecb(evutil_socket_t fd, short what, void *ctx) {
+    static_cast<UpstreamGroup*>(ctx)->Probe();
+}
+
+UpstreamBackend::UpstreamBackend(UpstreamGroup* group, UpstreamPool* pool):
+    group_(group),
+    pool_(pool),
+    active_(0),
+    ewma_ms_(0),
+    healthy_(true),
+    streak_(0),
+    probe_(NULL),
+    probe_start_(0) {
+    pool_->SetNotify(this);
+}
+
+UpstreamBackend::~UpstreamBackend() {
+    if (probe_)
+        bufferevent_free(probe_);
+    delete pool_;
+}
+
+void UpstreamBackend::OnConnectTime(int64_t ms) {
+    if (ewma_ms_ == 0)
+        ewma_ms_ = (double)ms;
+    else
+        ewma_ms_ = ewma_ms_ * (1 - kEwmaWeight) + ms * kEwmaWeight;
+}
+
+void UpstreamBackend::StartProbe(int timeout_sec) {
+    //the last probe never finished within a whole interval
+    if (probe_)
+        ProbeDone(false);
+    probe_ = bufferevent_socket_new(group_->GetEventLoop(), -1, BEV_OPT_CLOSE_ON_FREE);
+    if (!probe_)
+        return;
+    timeval timeout = { timeout_sec, 0 };
+    bufferevent_set_timeouts(probe_, &timeout, &timeout);
+    bufferevent_setcb(probe_, probe_readcb, NULL, probe_eventcb, this);
+    bufferevent_setwatermark(probe_, EV_READ, 2, 0);
+    bufferevent_enable(probe_, EV_READ | EV_WRITE);
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    inet_pton(AF_INET, GetAddress().c_str(), &sin.sin_addr.s_addr);
+    sin.sin_port = htons(GetPort());
+    probe_start_ = NowMs();
+    if (bufferevent_socket_connect(probe_, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+        ProbeDone(false);
+}
+
+void UpstreamBackend::OnProbeEvent(bufferevent* bev, short events) {
+    if (events & BEV_EVENT_CONNECTED) {
+        OnConnectTime(NowMs() - probe_start_);
+        //no auth greeting, a live socks server answers 05 00
+        static const unsigned char greeting[3] = { 5, 1, 0 };
+        bufferevent_write(bev, greeting, sizeof(greeting));
+        return;
+    }
+    ProbeDone(false);
+}
+
+void UpstreamBackend::OnProbeRead(bufferevent* bev) {
+    unsigned char reply[2];
+    if (evbuffer_remove(bufferevent_get_input(bev), reply, sizeof(reply)) != sizeof(reply))
+        return;
+    ProbeDone(reply[0] == 5 && reply[1] == 0);
+}
+
+void UpstreamBackend::ProbeDone(bool ok) {
+    if (probe_) {
+        bufferevent_free(probe_);
+        probe_ = NULL;
+    }
+    if (ok == healthy_) {
+        streak_ = 0;
+        return;
+    }
+    if (++streak_ < kHealthStreak)
+        return;
+    healthy_ = ok;
+    streak_ = 0;
+    pool_->SetEnabled(healthy_);
+    if (healthy_)
+        LOGI << "upstream " << GetAddress() << ":" << GetPort() << " is back\n";
+    else
+        LOGW << "upstream " << GetAddress() << ":" << GetPort() << " failed its probes, draining "
+             << active_ << " streams\n";
+}
+
+/////////////////////////////
+UpstreamGroup::UpstreamGroup(event_base* event_loop,
+                             int policy,
+                             int min_idle,
+                             int max_age_sec,
+                             int probe_interval_sec):
+    event_loop_(event_loop),
+    policy_(policy),
+    min_idle_(min_idle),
+    max_age_sec_(max_age_sec),
+    probe_interval_sec_(probe_interval_sec),
+    next_(0),
+    probe_event_(NULL) {
+}
+
+UpstreamGroup::~UpstreamGroup() {
+    if (probe_event_)
+        event_free(probe_event_);
+    for (size_t i = 0; i < backends_.size(); i++)
+        delete backends_[i];
+}
+
+bool UpstreamGroup::Parse(const std::string& list) {
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos)
+            end = list.size();
+        std::string item = list.substr(start, end - start);
+        size_t colon = item.rfind(':');
+        if (colon == std::string::npos || colon == 0 || atoi(item.c_str() + colon + 1) <= 0)
+            return false;
+        UpstreamPool* pool = new UpstreamPool(event_loop_, item.substr(0, colon),
+                                              atoi(item.c_str() + colon + 1),
+                                              min_idle_, max_age_sec_);
+        backends_.push_back(new UpstreamBackend(this, pool));
+        start = end + 1;
+    }
+    return !backends_.empty();
+}
+
+bool UpstreamGroup::Init() {
+    if (backends_.empty())
+        return false;
+    for (size_t i = 0; i < backends_.size(); i++) {
+        if (!backends_[i]->Init())
+            return false;
+    }
+    if (probe_interval_sec_ > 0) {
+        timeval interval = { probe_interval_sec_, 0 };
+        probe_event_ = event_new(event_loop_, -1, EV_PERSIST | EV_TIMEOUT, probecb, this);
+        if (!probe_event_)
+            return false;
+        event_add(probe_event_, &interval);
+    }
+    return true;
+}
+
+UpstreamBackend* UpstreamGroup::Pick() {
+    bool any_healthy = false;
+    for (size_t i = 0; i < backends_.size(); i++) {
+        if (backends_[i]->Healthy())
+            any_healthy = true;
+    }
+    UpstreamBackend* best = NULL;
+    double best_score = 0;
+    size_t count = backends_.size();
+    for (size_t n = 0; n < count; n++) {
+        UpstreamBackend* backend = backends_[(next_ + n) % count];
+        if (any_healthy && !backend->Healthy())
+            continue;
+        double score;
+        if (policy_ == kUpstreamEwma) {
+            //expected wait: latency scaled by the streams already queued on it
+            score = (backend->GetLatency() + 1) * (backend->GetActive() + 1);
+        } else {
+            score = backend->GetActive();
+        }
+        if (!best || score < best_score) {
+            best = backend;
+            best_score = score;
+        }
+    }
+    next_++;
+    return best;
+}
+
+void UpstreamGroup::Probe() {
+    for (size_t i = 0; i < backends_.size(); i++)
+        backends_[i]->StartProbe(probe_interval_sec_);
+}
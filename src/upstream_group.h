@@ -0,0 +1,145 @@
+#ifndef _UPSTREAM_GROUP_H_
+#define _UPSTREAM_GROUP_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+
+#include "upstream_pool.h"
+
+enum {
+    kUpstreamLeastConn = 0,
+    //latency weighted, see UpstreamGroup::Pick
+    kUpstreamEwma
+};
+
+class UpstreamGroup;
+
+//one upstream socks server: its warm pool, the streams it carries, a
+//moving average of its connect latency and its health as seen by probes
+class UpstreamBackend : public IUpstreamNotify {
+public:
+    UpstreamBackend(UpstreamGroup* group, UpstreamPool* pool);
+
+    ~UpstreamBackend();
+
+    bool Init() {
+        return pool_->Init();
+    }
+
+    //warm connection or NULL, see UpstreamPool::Acquire
+    bufferevent* Acquire() {
+        return pool_->Acquire();
+    }
+
+    const std::string& GetAddress() const {
+        return pool_->GetAddress();
+    }
+
+    int GetPort() const {
+        return pool_->GetPort();
+    }
+
+    //a stream bound to this backend opened or went away
+    void AddStream() {
+        active_++;
+    }
+
+    void RemoveStream() {
+        active_--;
+    }
+
+    int GetActive() const {
+        return active_;
+    }
+
+    double GetLatency() const {
+        return ewma_ms_;
+    }
+
+    bool Healthy() const {
+        return healthy_;
+    }
+
+    virtual void OnConnectTime(int64_t ms);
+
+    void StartProbe(int timeout_sec);
+
+    void OnProbeEvent(bufferevent* bev, short events);
+
+    void OnProbeRead(bufferevent* bev);
+
+private:
+    void ProbeDone(bool ok);
+
+    UpstreamGroup* group_;
+
+    UpstreamPool* pool_;
+
+    int active_;
+
+    double ewma_ms_;
+
+    bool healthy_;
+
+    //consecutive probe results against the current state
+    int streak_;
+
+    bufferevent* probe_;
+
+    int64_t probe_start_;
+};
+
+//the upstream servers an agent balances its streams over. probes run on
+//the agent's loop: a socks greeting must be answered within the probe
+//interval, a backend that fails twice in a row gets no new streams and
+//loses its warm pool until it passes twice again. streams already on a
+//failed backend are left alone
+class UpstreamGroup {
+public:
+    UpstreamGroup(event_base* event_loop,
+                  int policy,
+                  int min_idle,
+                  int max_age_sec,
+                  int probe_interval_sec);
+
+    ~UpstreamGroup();
+
+    //"ip:port[,ip:port...]", false on a malformed entry
+    bool Parse(const std::string& list);
+
+    bool Init();
+
+    //never NULL once Init succeeded; with every backend down the least
+    //loaded one is still tried rather than failing the stream outright
+    UpstreamBackend* Pick();
+
+    void Probe();
+
+    event_base* GetEventLoop() const {
+        return event_loop_;
+    }
+
+private:
+    event_base* event_loop_;
+
+    int policy_;
+
+    int min_idle_;
+
+    int max_age_sec_;
+
+    int probe_interval_sec_;
+
+    std::vector<UpstreamBackend*> backends_;
+
+    //where ties start, so equal backends share the load
+    size_t next_;
+
+    event* probe_event_;
+};
+
+#endif
@@ -0,0 +1,169 @@
+#include "upstream_pool.h"
+
+#include <string.h>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#include <event2/util.h>
+
+#include "log.hpp"
+
+static int64_t NowMs() {
+    struct timeval tv;
+    evutil_gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void eventcb(struct bufferevent *bev, short events, void *ctx) {
+    UpstreamPool::Entry* entry = static_cast<UpstreamPool::Entry*>(ctx);
+    if (events & BEV_EVENT_CONNECTED) {
+        entry->pool->OnConnected(entry);
+    } else {
+        entry->pool->OnClosed(entry);
+    }
+}
+
+static void readcb(struct bufferevent *bev, void *ctx) {
+    //a socks server speaks only after the greeting, bytes on an idle
+    //connection mean it is not one we can hand out
+    UpstreamPool::Entry* entry = static_cast<UpstreamPool::Entry*>(ctx);
+    entry->pool->OnClosed(entry);
+}
+
+static void refillcb(evutil_socket_t fd, short what, void *ctx) {
+    static_cast<UpstreamPool*>(ctx)->Refill();
+}
+
+static void periodiccb(evutil_socket_t fd, short what, void *ctx) {
+    static_cast<UpstreamPool*>(ctx)->Expire();
+}
+
+UpstreamPool::UpstreamPool(event_base* event_loop,
+                           std::string ip,
+                           int port,
+                           int min_idle,
+                           int max_age_sec):
+    event_loop_(event_loop),
+    connect_address_(ip),
+    connect_port_(port),
+    min_idle_(min_idle > 0 ? min_idle : 0),
+    enabled_(true),
+    notify_(NULL),
+    max_age_ms_((int64_t)(max_age_sec > 0 ? max_age_sec : 1) * 1000),
+    refill_event_(NULL),
+    periodic_event_(NULL) {
+}
+
+UpstreamPool::~UpstreamPool() {
+    while (!entries_.empty())
+        Drop(entries_.begin());
+    if (refill_event_)
+        event_free(refill_event_);
+    if (periodic_event_)
+        event_free(periodic_event_);
+}
+
+bool UpstreamPool::Init() {
+    refill_event_ = event_new(event_loop_, -1, 0, refillcb, this);
+    timeval one_sec = { 1, 0 };
+    periodic_event_ = event_new(event_loop_, -1, EV_PERSIST | EV_TIMEOUT, periodiccb, this);
+    if (!refill_event_ || !periodic_event_)
+        return false;
+    event_add(periodic_event_, &one_sec);
+    Refill();
+    return true;
+}
+
+bufferevent* UpstreamPool::Acquire() {
+    //oldest first, it is the one closest to being expired unused
+    for (std::list<Entry*>::iterator it = entries_.begin(); it != entries_.end(); ++it) {
+        Entry* entry = *it;
+        if (!entry->connected)
+            continue;
+        bufferevent* bev = entry->bev;
+        bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+        entries_.erase(it);
+        delete entry;
+        event_active(refill_event_, EV_TIMEOUT, 1);
+        return bev;
+    }
+    //drained by a burst, start topping up now rather than on the timer
+    if (min_idle_ > 0 && enabled_)
+        event_active(refill_event_, EV_TIMEOUT, 1);
+    return NULL;
+}
+
+void UpstreamPool::OnConnected(Entry* entry) {
+    entry->connected = true;
+    if (notify_)
+        notify_->OnConnectTime(NowMs() - entry->created);
+}
+
+void UpstreamPool::SetEnabled(bool enabled) {
+    enabled_ = enabled;
+    if (!enabled_) {
+        while (!entries_.empty())
+            Drop(entries_.begin());
+    } else {
+        Refill();
+    }
+}
+
+void UpstreamPool::OnClosed(Entry* entry) {
+    std::list<Entry*>::iterator it = std::find(entries_.begin(), entries_.end(), entry);
+    if (it != entries_.end())
+        Drop(it);
+    //no refill here, a refused connect would spin; the timer tops up
+}
+
+void UpstreamPool::Refill() {
+    while (enabled_ && entries_.size() < min_idle_) {
+        Entry* entry = new Entry();
+        entry->pool = this;
+        entry->created = NowMs();
+        entry->connected = false;
+        entry->bev = bufferevent_socket_new(event_loop_, -1, BEV_OPT_CLOSE_ON_FREE);
+        if (!entry->bev) {
+            delete entry;
+            return;
+        }
+        bufferevent_setcb(entry->bev, readcb, NULL, eventcb, entry);
+        bufferevent_enable(entry->bev, EV_READ);
+        struct sockaddr_in sin;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        inet_pton(AF_INET, connect_address_.c_str(), &sin.sin_addr.s_addr);
+        sin.sin_port = htons(connect_port_);
+        if (bufferevent_socket_connect(entry->bev, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+            bufferevent_free(entry->bev);
+            delete entry;
+            return;
+        }
+        entries_.push_back(entry);
+    }
+}
+
+void UpstreamPool::Expire() {
+    int64_t now = NowMs();
+    std::list<Entry*>::iterator it = entries_.begin();
+    while (it != entries_.end()) {
+        std::list<Entry*>::iterator cur = it++;
+        if (now - (*cur)->created >= max_age_ms_)
+            Drop(cur);
+    }
+    Refill();
+}
+
+void UpstreamPool::Drop(std::list<Entry*>::iterator it) {
+    Entry* entry = *it;
+    entries_.erase(it);
+    bufferevent_free(entry->bev);
+    delete entry;
+}
@@ -0,0 +1,95 @@
+#ifndef _UPSTREAM_POOL_H_
+#define _UPSTREAM_POOL_H_
+
+#include <stdint.h>
+#include <list>
+#include <string>
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+
+//told how long each pooled connect took, feeds balancing decisions
+class IUpstreamNotify {
+public:
+    virtual ~IUpstreamNotify() {};
+    virtual void OnConnectTime(int64_t ms) = 0;
+};
+
+//keeps connections to the upstream socks endpoint open before any stream
+//asks for one, so a new stream starts writing on its first frame instead
+//of waiting a connect round trip. idle connections are dropped after
+//max_age seconds and whenever the upstream closes them, and the pool is
+//topped up to min_idle again from a timer and after every hand out
+class UpstreamPool {
+public:
+    UpstreamPool(event_base* event_loop,
+                 std::string ip,
+                 int port,
+                 int min_idle,
+                 int max_age_sec);
+
+    ~UpstreamPool();
+
+    bool Init();
+
+    //a connected bufferevent with no callbacks set, NULL when none is idle.
+    //the caller owns it and is expected to setcb and enable it
+    bufferevent* Acquire();
+
+    const std::string& GetAddress() const {
+        return connect_address_;
+    }
+
+    int GetPort() const {
+        return connect_port_;
+    }
+
+    void SetNotify(IUpstreamNotify* notify) {
+        notify_ = notify;
+    }
+
+    //a disabled pool drops its idle connections and opens no new ones
+    void SetEnabled(bool enabled);
+
+    //one pooled connection, handed to its bufferevent as callback context
+    struct Entry {
+        UpstreamPool* pool;
+        bufferevent* bev;
+        int64_t created;
+        bool connected;
+    };
+
+    void OnConnected(Entry* entry);
+
+    void OnClosed(Entry* entry);
+
+    void Refill();
+
+    void Expire();
+
+private:
+    void Drop(std::list<Entry*>::iterator it);
+
+    event_base* event_loop_;
+
+    std::string connect_address_;
+
+    int connect_port_;
+
+    size_t min_idle_;
+
+    bool enabled_;
+
+    IUpstreamNotify* notify_;
+
+    int64_t max_age_ms_;
+
+    //connecting entries count too, so a burst never overshoots min_idle
+    std::list<Entry*> entries_;
+
+    event* refill_event_;
+
+    event* periodic_event_;
+};
+
+#endif
@@ -0,0 +1,486 @@
+#include "uring_link.h"
+
+#include <string.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "log.hpp"
+
+static void endreadcb(struct bufferevent *bev, void *ctx) {
+    UringLink* pLink = static_cast<UringLink*>(ctx);
+    pLink->OnEndRead();
+}
+
+static void endwritecb(struct bufferevent *bev, void *ctx) {
+    UringLink* pLink = static_cast<UringLink*>(ctx);
+    pLink->OnEndWrite();
+}
+
+static void lingercb(evutil_socket_t fd, short what, void *ctx) {
+    UringLink* pLink = static_cast<UringLink*>(ctx);
+    pLink->OnLinger();
+}
+
+static void drainedcb(struct evbuffer *buffer, const struct evbuffer_cb_info *info, void *ctx) {
+    UringLink* pLink = static_cast<UringLink*>(ctx);
+    if (info->n_deleted > 0)
+        pLink->OnEndWrite();
+}
+
+static void retrycb(evutil_socket_t fd, short what, void *ctx) {
+    UringListener* pListener = static_cast<UringListener*>(ctx);
+    pListener->OnRetry();
+}
+
+UringLink::UringLink(UringLoop* loop, evutil_socket_t fd):
+    loop_(loop),
+    fd_(fd),
+    end_(NULL),
+    sending_(evbuffer_new()),
+    pending_(0),
+    connecting_(false),
+    receiving_(false),
+    sending_busy_(false),
+    paused_(false),
+    eof_(false),
+    eof_reported_(false),
+    eof_watch_(NULL),
+    released_(false),
+    stopped_(false),
+    linger_(NULL) {
+    loop_->AddLink(this);
+}
+
+UringLink::~UringLink() {
+    loop_->RemoveLink(this);
+    if (linger_)
+        event_free(linger_);
+    if (end_)
+        bufferevent_free(end_);
+    evbuffer_free(sending_);
+    if (fd_ >= 0)
+        evutil_closesocket(fd_);
+}
+
+bufferevent* UringLink::Adopt(UringLoop* loop, evutil_socket_t fd) {
+    UringLink* link = new UringLink(loop, fd);
+    bufferevent* bev = link->Init();
+    if (!bev) {
+        link->fd_ = -1;
+        delete link;
+        return NULL;
+    }
+    link->Receive();
+    return bev;
+}
+
+bufferevent* UringLink::Connect(UringLoop* loop, const sockaddr* address, int len) {
+#ifdef __linux__
+    if (len <= 0 || len > (int)sizeof(sockaddr_storage))
+        return NULL;
+    evutil_socket_t fd = socket(address->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return NULL;
+    UringLink* link = new UringLink(loop, fd);
+    bufferevent* bev = link->Init();
+    if (!bev) {
+        delete link;
+        return NULL;
+    }
+    io_uring_sqe* sqe = loop->Queue(link, kOpConnect);
+    if (!sqe) {
+        bufferevent_free(bev);
+        delete link;
+        return NULL;
+    }
+    memcpy(&link->address_, address, len);
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)&link->address_;
+    sqe->off = len;
+    link->connecting_ = true;
+    link->pending_++;
+    return bev;
+#else
+    return NULL;
+#endif
+}
+
+void UringLink::Free(bufferevent* bev) {
+    UringLink* link = Of(bev);
+    if (link)
+        link->Release(bev);
+    else
+        bufferevent_free(bev);
+}
+
+evutil_socket_t UringLink::GetFd(bufferevent* bev) {
+    UringLink* link = Of(bev);
+    return link ? link->fd_ : bufferevent_getfd(bev);
+}
+
+UringLink* UringLink::Of(bufferevent* bev) {
+    bufferevent* end = bufferevent_pair_get_partner(bev);
+    if (!end)
+        return NULL;
+    bufferevent_data_cb readcb = NULL;
+    void* ctx = NULL;
+    bufferevent_getcb(end, &readcb, NULL, NULL, &ctx);
+    return readcb == endreadcb ? static_cast<UringLink*>(ctx) : NULL;
+}
+
+bufferevent* UringLink::Init() {
+    bufferevent* pair[2];
+    if (bufferevent_pair_new(loop_->GetBase(), BEV_OPT_DEFER_CALLBACKS, pair) != 0) {
+        LOGE << "Could not create a bufferevent pair!\n";
+        return NULL;
+    }
+    end_ = pair[0];
+    bufferevent_setcb(end_, endreadcb, endwritecb, NULL, this);
+    //the owner's output only moves over as fast as it is sent, so its
+    //write watermarks keep working
+    bufferevent_setwatermark(end_, EV_READ, 0, kSendBatch);
+    bufferevent_setwatermark(end_, EV_WRITE, kReadLimit / 2, 0);
+    bufferevent_enable(end_, EV_READ | EV_WRITE);
+    return pair[1];
+}
+
+void UringLink::Receive() {
+#ifdef __linux__
+    if (receiving_ || paused_ || eof_ || connecting_ || released_ || stopped_)
+        return;
+    io_uring_sqe* sqe = loop_->Queue(this, kOpRecv);
+    if (!sqe) {
+        Fail(BEV_EVENT_ERROR | BEV_EVENT_READING);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd_;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    if (loop_->Multishot())
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+    receiving_ = true;
+    pending_++;
+#endif
+}
+
+void UringLink::Send() {
+#ifdef __linux__
+    if (sending_busy_ || connecting_ || stopped_)
+        return;
+    if (evbuffer_get_length(sending_) == 0)
+        evbuffer_remove_buffer(bufferevent_get_input(end_), sending_, kSendBatch);
+    if (evbuffer_get_length(sending_) == 0)
+        return;
+    //sending_ is only touched again once the kernel is done with it
+    evbuffer_iovec vec[kMaxIov];
+    int count = evbuffer_peek(sending_, -1, NULL, vec, kMaxIov);
+    if (count > kMaxIov)
+        count = kMaxIov;
+    for (int i = 0; i < count; i++) {
+        iov_[i].iov_base = vec[i].iov_base;
+        iov_[i].iov_len = vec[i].iov_len;
+    }
+    io_uring_sqe* sqe = loop_->Queue(this, kOpSend);
+    if (!sqe) {
+        Fail(BEV_EVENT_ERROR | BEV_EVENT_WRITING);
+        return;
+    }
+    memset(&message_, 0, sizeof(message_));
+    message_.msg_iov = iov_;
+    message_.msg_iovlen = count;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd_;
+    sqe->addr = (uint64_t)(uintptr_t)&message_;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sending_busy_ = true;
+    pending_++;
+#endif
+}
+
+void UringLink::OnComplete(int op, int res, uint32_t flags) {
+#ifdef __linux__
+    if (op == kOpRecv) {
+        if (!(flags & IORING_CQE_F_MORE)) {
+            receiving_ = false;
+            pending_--;
+        }
+        if (res > 0) {
+            if (!released_ && !stopped_)
+                bufferevent_write(end_, loop_->Buffer(flags), res);
+            loop_->ReleaseBuffer(flags);
+            //the owner stopped taking, the socket buffer holds the rest
+            if (!paused_ && evbuffer_get_length(bufferevent_get_output(end_)) >= kReadLimit) {
+                paused_ = true;
+                io_uring_sqe* sqe = receiving_ ? loop_->Queue(this, kOpCancel) : NULL;
+                if (sqe) {
+                    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                    sqe->addr = (uint64_t)(uintptr_t)this | kOpRecv;
+                    pending_++;
+                }
+            }
+        } else if (res == 0) {
+            if (flags & IORING_CQE_F_BUFFER)
+                loop_->ReleaseBuffer(flags);
+            eof_ = true;
+            CheckEof();
+        } else if (res == -EINVAL && loop_->Multishot()) {
+            LOGW << "io_uring multishot recv refused, one recv per read from now on\n";
+            loop_->DisableMultishot();
+        } else if (res != -ENOBUFS && res != -ECANCELED && res != -EAGAIN && res != -EINTR) {
+            Fail(BEV_EVENT_ERROR | BEV_EVENT_READING);
+        }
+        //every buffer goes back in the completion that filled it, so those
+        //missing on ENOBUFS are back before this pass submits the new recv
+        Receive();
+    } else if (op == kOpSend) {
+        sending_busy_ = false;
+        pending_--;
+        if (res > 0)
+            evbuffer_drain(sending_, res);
+        if (res >= 0 || res == -EAGAIN || res == -EINTR)
+            Send();
+        else if (res != -ECANCELED)
+            Fail(BEV_EVENT_ERROR | BEV_EVENT_WRITING);
+    } else if (op == kOpConnect) {
+        connecting_ = false;
+        pending_--;
+        bufferevent* owner = bufferevent_pair_get_partner(end_);
+        if (res == 0 && !stopped_) {
+            if (owner)
+                bufferevent_trigger_event(owner, BEV_EVENT_CONNECTED, BEV_TRIG_DEFER_CALLBACKS);
+            Receive();
+            Send();
+        } else if (res != 0) {
+            Fail(BEV_EVENT_ERROR);
+        }
+    } else {
+        pending_--;
+    }
+    Settle();
+#endif
+}
+
+void UringLink::OnEndRead() {
+    Send();
+}
+
+void UringLink::OnEndWrite() {
+    if (paused_ && evbuffer_get_length(bufferevent_get_output(end_)) <= kReadLimit / 2) {
+        paused_ = false;
+        Receive();
+    }
+    CheckEof();
+}
+
+void UringLink::OnLinger() {
+    LOGW << "socket closed with " << evbuffer_get_length(bufferevent_get_input(end_)) +
+            evbuffer_get_length(sending_) << " bytes its peer never took\n";
+    Stop();
+    Settle();
+}
+
+void UringLink::Release(bufferevent* bev) {
+    evbuffer* input = bufferevent_get_input(end_);
+    evbuffer* rest = bufferevent_get_output(bev);
+    if (eof_watch_) {
+        evbuffer_remove_cb_entry(bufferevent_get_input(bev), eof_watch_);
+        eof_watch_ = NULL;
+    }
+    //what the pair had no room for yet still goes out
+    evbuffer_unfreeze(rest, 1);
+    evbuffer_unfreeze(input, 0);
+    evbuffer_add_buffer(input, rest);
+    bufferevent_free(bev);
+    released_ = true;
+    Send();
+    if (!stopped_ && sending_busy_) {
+        linger_ = evtimer_new(loop_->GetBase(), lingercb, this);
+        timeval timeout = { kLingerSec, 0 };
+        event_add(linger_, &timeout);
+    }
+    Settle();
+}
+
+void UringLink::Fail(short what) {
+    if (stopped_)
+        return;
+    bufferevent* owner = released_ ? NULL : bufferevent_pair_get_partner(end_);
+    if (owner)
+        bufferevent_trigger_event(owner, what, BEV_TRIG_DEFER_CALLBACKS);
+    Stop();
+}
+
+void UringLink::CheckEof() {
+    if (!eof_ || eof_reported_ || released_ || stopped_)
+        return;
+    bufferevent* owner = bufferevent_pair_get_partner(end_);
+    if (!owner)
+        return;
+    evbuffer* unread = bufferevent_get_input(owner);
+    if (evbuffer_get_length(bufferevent_get_output(end_)) > 0 || evbuffer_get_length(unread) > 0) {
+        if (!eof_watch_)
+            eof_watch_ = evbuffer_add_cb(unread, drainedcb, this);
+        return;
+    }
+    if (eof_watch_) {
+        evbuffer_remove_cb_entry(unread, eof_watch_);
+        eof_watch_ = NULL;
+    }
+    eof_reported_ = true;
+    bufferevent_trigger_event(owner, BEV_EVENT_EOF | BEV_EVENT_READING, BEV_TRIG_DEFER_CALLBACKS);
+}
+
+void UringLink::Stop() {
+#ifdef __linux__
+    if (stopped_)
+        return;
+    stopped_ = true;
+    if (pending_ == 0)
+        return;
+    io_uring_sqe* sqe = loop_->Queue(this, kOpCancel);
+    if (!sqe) {
+        //the requests still end, with an error or eof
+        shutdown(fd_, SHUT_RDWR);
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd_;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    pending_++;
+#endif
+}
+
+bool UringLink::Settle() {
+    //an end freed without Free is noticed here, later than it could be
+    if (!released_ && !bufferevent_pair_get_partner(end_))
+        released_ = true;
+    if (released_ && !stopped_ && !sending_busy_ &&
+            (connecting_ || evbuffer_get_length(bufferevent_get_input(end_)) == 0))
+        Stop();
+    if (released_ && stopped_ && pending_ == 0) {
+        delete this;
+        return false;
+    }
+    return true;
+}
+
+//////////////////////////////////////////////
+UringListener::UringListener(UringLoop* loop, IUringAcceptNotify* notify):
+    loop_(loop),
+    notify_(notify),
+    fd_(-1),
+    pending_(0),
+    accepting_(false),
+    closed_(false),
+    retry_(NULL) {
+    loop_->AddLink(this);
+}
+
+UringListener::~UringListener() {
+    loop_->RemoveLink(this);
+    if (retry_)
+        event_free(retry_);
+    if (fd_ >= 0)
+        evutil_closesocket(fd_);
+}
+
+bool UringListener::Init(const sockaddr* address, int len, bool reuse_port) {
+#ifdef __linux__
+    fd_ = socket(address->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd_ < 0)
+        return false;
+    evutil_make_listen_socket_reuseable(fd_);
+    if (reuse_port && evutil_make_listen_socket_reuseable_port(fd_) != 0)
+        return false;
+    if (bind(fd_, address, len) != 0 || listen(fd_, SOMAXCONN) != 0)
+        return false;
+    retry_ = evtimer_new(loop_->GetBase(), retrycb, this);
+    Accept();
+    return true;
+#else
+    return false;
+#endif
+}
+
+void UringListener::Close() {
+#ifdef __linux__
+    closed_ = true;
+    notify_ = NULL;
+    if (retry_)
+        event_del(retry_);
+    if (pending_ > 0) {
+        //the ring holds the socket open until its accept is cancelled
+        io_uring_sqe* sqe = loop_->Queue(this, kOpCancel);
+        if (sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = fd_;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            pending_++;
+            return;
+        }
+        shutdown(fd_, SHUT_RDWR);
+        return;
+    }
+#endif
+    delete this;
+}
+
+void UringListener::Accept() {
+#ifdef __linux__
+    if (accepting_ || closed_)
+        return;
+    io_uring_sqe* sqe = loop_->Queue(this, kOpAccept);
+    if (!sqe) {
+        timeval timeout = { 1, 0 };
+        event_add(retry_, &timeout);
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd_;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    accepting_ = true;
+    pending_++;
+#endif
+}
+
+void UringListener::OnComplete(int op, int res, uint32_t flags) {
+#ifdef __linux__
+    if (op == kOpAccept) {
+        if (!(flags & IORING_CQE_F_MORE)) {
+            accepting_ = false;
+            pending_--;
+        }
+        if (res >= 0) {
+            if (notify_)
+                notify_->OnUringAccept(this, res);
+            else
+                evutil_closesocket(res);
+        } else if (res != -ECANCELED && res != -EINTR && res != -EAGAIN && res != -ECONNABORTED) {
+            //out of descriptors most likely, the backlog waits meanwhile
+            LOGE << "accept failed: " << strerror(-res) << "\n";
+            if (!accepting_ && !closed_) {
+                timeval timeout = { 1, 0 };
+                event_add(retry_, &timeout);
+            }
+        }
+        if (!accepting_ && !event_pending(retry_, EV_TIMEOUT, NULL))
+            Accept();
+    } else {
+        pending_--;
+    }
+    if (closed_ && pending_ == 0)
+        delete this;
+#endif
+}
+
+void UringListener::OnRetry() {
+    Accept();
+}
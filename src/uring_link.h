@@ -0,0 +1,190 @@
+#ifndef _URING_LINK_H_
+#define _URING_LINK_H_
+
+#include <stdint.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#include "uring_loop.h"
+
+//tcp socket driven through io_uring instead of readiness events. it holds
+//one end of a bufferevent pair and the stream or tunnel the other, so the
+//relay code above keeps its bufferevent calls.
+//bytes arrive through one multishot recv into the loop's buffers and are
+//copied into the pair, reads stop while the owner does not take them.
+//what the owner writes leaves in sendmsg requests, one in flight at a
+//time. an end handed to Free keeps being sent before the socket closes,
+//as the kernel would keep sending what a closed socket still held
+class UringLink : public IUringNotify {
+public:
+    enum {
+        //bytes read ahead of the owner before the recv is cancelled
+        kReadLimit = 64 * 1024,
+        //bytes taken from the owner per sendmsg
+        kSendBatch = 64 * 1024,
+        kMaxIov = 64,
+        //a freed end whose peer does not read is given up on after this
+        kLingerSec = 30
+    };
+
+    //takes over a connected socket, NULL on failure
+    static bufferevent* Adopt(UringLoop* loop, evutil_socket_t fd);
+
+    //the returned end reports BEV_EVENT_CONNECTED or BEV_EVENT_ERROR
+    static bufferevent* Connect(UringLoop* loop, const sockaddr* address, int len);
+
+    //bufferevent_free for any socket that may have come from here
+    static void Free(bufferevent* bev);
+
+    //the socket behind bev, a link's included
+    static evutil_socket_t GetFd(bufferevent* bev);
+
+    virtual void OnComplete(int op, int res, uint32_t flags);
+
+    //the owner wrote
+    void OnEndRead();
+
+    //the owner took what was read
+    void OnEndWrite();
+
+    void OnLinger();
+
+private:
+    enum {
+        kOpRecv = 1,
+        kOpSend,
+        kOpConnect,
+        kOpCancel
+    };
+
+    UringLink(UringLoop* loop, evutil_socket_t fd);
+
+    virtual ~UringLink();
+
+    static UringLink* Of(bufferevent* bev);
+
+    bufferevent* Init();
+
+    void Receive();
+
+    void Send();
+
+    //the owner let go of its end
+    void Release(bufferevent* bev);
+
+    //reports what to the owner and stops
+    void Fail(short what);
+
+    //eof goes to the owner once it took every byte read before it
+    void CheckEof();
+
+    //cancels every request on the socket
+    void Stop();
+
+    //false once the link deleted itself
+    bool Settle();
+
+    UringLoop* loop_;
+
+    evutil_socket_t fd_;
+
+    //the owner holds the partner
+    bufferevent* end_;
+
+    //bytes handed to the kernel in the sendmsg in flight
+    evbuffer* sending_;
+
+#ifdef __linux__
+    msghdr message_;
+
+    iovec iov_[kMaxIov];
+#endif
+
+    sockaddr_storage address_;
+
+    //requests the kernel still has to complete
+    int pending_;
+
+    bool connecting_;
+
+    bool receiving_;
+
+    bool sending_busy_;
+
+    //recv cancelled until the owner catches up
+    bool paused_;
+
+    bool eof_;
+
+    bool eof_reported_;
+
+    //watches the owner's input while an eof waits for it to drain
+    evbuffer_cb_entry* eof_watch_;
+
+    bool released_;
+
+    bool stopped_;
+
+    event* linger_;
+};
+
+class UringListener;
+
+class IUringAcceptNotify {
+public:
+    virtual ~IUringAcceptNotify() {};
+    virtual void OnUringAccept(UringListener* listener, evutil_socket_t fd) = 0;
+};
+
+//listening socket with one multishot accept armed, each connection comes
+//as a completion without a wakeup per accept call
+class UringListener : public IUringNotify {
+public:
+    UringListener(UringLoop* loop, IUringAcceptNotify* notify);
+
+    bool Init(const sockaddr* address, int len, bool reuse_port);
+
+    //stops accepting, the listener goes once the kernel let go of it
+    void Close();
+
+    virtual void OnComplete(int op, int res, uint32_t flags);
+
+    void OnRetry();
+
+private:
+    enum {
+        kOpAccept = 1,
+        kOpCancel
+    };
+
+    virtual ~UringListener();
+
+    void Accept();
+
+    UringLoop* loop_;
+
+    IUringAcceptNotify* notify_;
+
+    evutil_socket_t fd_;
+
+    int pending_;
+
+    bool accepting_;
+
+    bool closed_;
+
+    //accepts failing for want of descriptors are retried after a pause
+    event* retry_;
+};
+
+#endif
@@ -0,0 +1,337 @@
+#include "uring_loop.h"
+
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "log.hpp"
+
+enum {
+    kSqEntries = 256,
+    //multishot receives post many completions per request
+    kCqEntries = 4096,
+    //the only buffer group the loop registers
+    kBufferGroup = 0
+};
+
+static void completioncb(evutil_socket_t fd, short what, void *ctx) {
+    UringLoop* pLoop = static_cast<UringLoop*>(ctx);
+    pLoop->OnCompletions();
+}
+
+static void submitcb(evutil_socket_t fd, short what, void *ctx) {
+    UringLoop* pLoop = static_cast<UringLoop*>(ctx);
+    pLoop->Submit();
+}
+
+UringLoop::UringLoop(event_base* event_loop):
+    event_loop_(event_loop),
+    ring_fd_(-1),
+    event_fd_(-1),
+    completion_event_(NULL),
+    submit_event_(NULL),
+    submit_queued_(false),
+    sq_ring_(NULL),
+    sq_ring_bytes_(0),
+    cq_ring_(NULL),
+    cq_ring_bytes_(0),
+    sqes_(NULL),
+    sqes_bytes_(0),
+    sq_entries_(0),
+    sq_head_(NULL),
+    sq_tail_(NULL),
+    sq_flags_(NULL),
+    sq_mask_(0),
+    sq_local_tail_(0),
+    cq_head_(NULL),
+    cq_tail_(NULL),
+    cq_mask_(0),
+    cqes_(NULL),
+    buffer_ring_(NULL),
+    buffers_(NULL),
+    buffer_tail_(0),
+    multishot_(true),
+    in_flight_(0),
+    draining_(false) {
+}
+
+UringLoop::~UringLoop() {
+#ifdef __linux__
+    //a request the kernel still holds may write into a buffer or complete
+    //for a link, both go only once nothing is in flight
+    if (in_flight_ > 0)
+        Drain();
+    std::set<IUringNotify*> links;
+    links.swap(links_);
+    for (auto link : links)
+        delete link;
+#endif
+    if (completion_event_)
+        event_free(completion_event_);
+    if (submit_event_)
+        event_free(submit_event_);
+#ifdef __linux__
+    if (ring_fd_ >= 0)
+        close(ring_fd_);
+    if (event_fd_ >= 0)
+        close(event_fd_);
+    if (sqes_)
+        munmap(sqes_, sqes_bytes_);
+    if (cq_ring_ && cq_ring_ != sq_ring_)
+        munmap(cq_ring_, cq_ring_bytes_);
+    if (sq_ring_)
+        munmap(sq_ring_, sq_ring_bytes_);
+    if (buffer_ring_)
+        munmap(buffer_ring_, kBufferCount * sizeof(io_uring_buf));
+    if (buffers_)
+        munmap(buffers_, (size_t)kBufferCount * kBufferSize);
+#endif
+}
+
+bool UringLoop::Init() {
+#ifdef __linux__
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    params.cq_entries = kCqEntries;
+    ring_fd_ = (int)syscall(__NR_io_uring_setup, kSqEntries, &params);
+    if (ring_fd_ < 0 && errno == EINVAL) {
+        //kernels before 5.18 know no SUBMIT_ALL
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = kCqEntries;
+        ring_fd_ = (int)syscall(__NR_io_uring_setup, kSqEntries, &params);
+    }
+    if (ring_fd_ < 0) {
+        LOGW << "io_uring_setup failed: " << strerror(errno) << "\n";
+        return false;
+    }
+    char* sq = NULL;
+    char* cq = NULL;
+    sq_ring_bytes_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_bytes_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sq_ring_bytes_ = cq_ring_bytes_ = std::max(sq_ring_bytes_, cq_ring_bytes_);
+    void* ring = mmap(NULL, sq_ring_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd_, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        LOGW << "io_uring ring could not be mapped\n";
+        return false;
+    }
+    sq_ring_ = ring;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring_ = sq_ring_;
+    } else {
+        ring = mmap(NULL, cq_ring_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd_, IORING_OFF_CQ_RING);
+        if (ring == MAP_FAILED) {
+            LOGW << "io_uring ring could not be mapped\n";
+            return false;
+        }
+        cq_ring_ = ring;
+    }
+    sqes_bytes_ = params.sq_entries * sizeof(io_uring_sqe);
+    ring = mmap(NULL, sqes_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring_fd_, IORING_OFF_SQES);
+    if (ring == MAP_FAILED) {
+        LOGW << "io_uring ring could not be mapped\n";
+        return false;
+    }
+    sqes_ = (io_uring_sqe*)ring;
+    sq = (char*)sq_ring_;
+    cq = (char*)cq_ring_;
+    sq_head_ = (unsigned*)(sq + params.sq_off.head);
+    sq_tail_ = (unsigned*)(sq + params.sq_off.tail);
+    sq_flags_ = (unsigned*)(sq + params.sq_off.flags);
+    sq_mask_ = *(unsigned*)(sq + params.sq_off.ring_mask);
+    sq_entries_ = *(unsigned*)(sq + params.sq_off.ring_entries);
+    //entry i always sits in slot i, the tail alone says what is new
+    unsigned* array = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries_; i++)
+        array[i] = i;
+    sq_local_tail_ = *sq_tail_;
+    cq_head_ = (unsigned*)(cq + params.cq_off.head);
+    cq_tail_ = (unsigned*)(cq + params.cq_off.tail);
+    cq_mask_ = *(unsigned*)(cq + params.cq_off.ring_mask);
+    cqes_ = cq + params.cq_off.cqes;
+
+    ring = mmap(NULL, kBufferCount * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+                MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring == MAP_FAILED)
+        return false;
+    buffer_ring_ = (io_uring_buf_ring*)ring;
+    ring = mmap(NULL, (size_t)kBufferCount * kBufferSize, PROT_READ | PROT_WRITE,
+                MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring == MAP_FAILED)
+        return false;
+    buffers_ = (unsigned char*)ring;
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buffer_ring_;
+    reg.ring_entries = kBufferCount;
+    reg.bgid = kBufferGroup;
+    if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        LOGW << "io_uring buffer ring not supported: " << strerror(errno) << "\n";
+        return false;
+    }
+    for (uint32_t bid = 0; bid < kBufferCount; bid++)
+        ReleaseBuffer(bid << IORING_CQE_BUFFER_SHIFT);
+
+    event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd_ < 0 ||
+            syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_EVENTFD, &event_fd_, 1) != 0) {
+        LOGW << "io_uring eventfd could not be registered\n";
+        return false;
+    }
+    //edge triggered, the counter is never read back
+    completion_event_ = event_new(event_loop_, event_fd_, EV_READ | EV_PERSIST | EV_ET,
+                                  completioncb, this);
+    submit_event_ = event_new(event_loop_, -1, 0, submitcb, this);
+    event_add(completion_event_, NULL);
+    return true;
+#else
+    return false;
+#endif
+}
+
+io_uring_sqe* UringLoop::Queue(IUringNotify* notify, int op) {
+#ifdef __linux__
+    if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+        Submit();
+        if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+            return NULL;
+    }
+    io_uring_sqe* sqe = &sqes_[sq_local_tail_ & sq_mask_];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = notify ? ((uint64_t)(uintptr_t)notify | (uint64_t)op) : 0;
+    sq_local_tail_++;
+    in_flight_++;
+    //everything queued in this pass of the loop goes in one syscall
+    if (!submit_queued_) {
+        submit_queued_ = true;
+        event_active(submit_event_, EV_TIMEOUT, 0);
+    }
+    return sqe;
+#else
+    return NULL;
+#endif
+}
+
+const unsigned char* UringLoop::Buffer(uint32_t flags) {
+#ifdef __linux__
+    return buffers_ + (size_t)(flags >> IORING_CQE_BUFFER_SHIFT) * kBufferSize;
+#else
+    return NULL;
+#endif
+}
+
+void UringLoop::ReleaseBuffer(uint32_t flags) {
+#ifdef __linux__
+    uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+    //indexed by hand, the header's flexible array member sits past an
+    //empty struct that takes a byte in c++
+    io_uring_buf* buf = (io_uring_buf*)buffer_ring_ + (buffer_tail_ & (kBufferCount - 1));
+    buf->addr = (uint64_t)(uintptr_t)(buffers_ + (size_t)bid * kBufferSize);
+    buf->len = kBufferSize;
+    buf->bid = bid;
+    buffer_tail_++;
+    __atomic_store_n(&buffer_ring_->tail, buffer_tail_, __ATOMIC_RELEASE);
+#endif
+}
+
+void UringLoop::Submit() {
+#ifdef __linux__
+    submit_queued_ = false;
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    unsigned pending = sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (pending == 0)
+        return;
+    int ret = (int)syscall(__NR_io_uring_enter, ring_fd_, pending, 0, 0, NULL, 0);
+    //a full completion queue refuses more work until it is reaped, the
+    //rest goes in after the next completions
+    if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        LOGE << "io_uring_enter failed: " << strerror(errno) << "\n";
+#endif
+}
+
+void UringLoop::OnCompletions() {
+#ifdef __linux__
+    for (;;) {
+        Reap();
+        //completions the full queue could not take wait in the kernel
+        if (!(__atomic_load_n(sq_flags_, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW))
+            break;
+        syscall(__NR_io_uring_enter, ring_fd_, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+    if (!submit_queued_ && sq_local_tail_ != __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE))
+        Submit();
+#endif
+}
+
+void UringLoop::Reap() {
+#ifdef __linux__
+    io_uring_cqe* cqes = (io_uring_cqe*)cqes_;
+    unsigned head = *cq_head_;
+    for (;;) {
+        if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+            break;
+        io_uring_cqe* cqe = &cqes[head & cq_mask_];
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        uint32_t flags = cqe->flags;
+        //the slot is free for the kernel before the handler runs, handlers
+        //may queue and submit
+        head++;
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        if (!(flags & IORING_CQE_F_MORE))
+            in_flight_--;
+        if (!data || draining_)
+            continue;
+        IUringNotify* notify = (IUringNotify*)(uintptr_t)(data & ~(uint64_t)((1 << kOpBits) - 1));
+        notify->OnComplete((int)(data & ((1 << kOpBits) - 1)), res, flags);
+    }
+#endif
+}
+
+void UringLoop::Drain() {
+#ifdef __linux__
+    draining_ = true;
+    bool cancelled = false;
+    while (in_flight_ > 0) {
+        //one request cancels all the others, the buffer ring Init insists
+        //on came in the same kernel as CANCEL_ANY. a queue too full to
+        //take it has completions to reap first
+        io_uring_sqe* sqe = cancelled ? NULL : Queue(NULL, 0);
+        if (sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+            cancelled = true;
+        }
+        __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+        unsigned pending = sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (syscall(__NR_io_uring_enter, ring_fd_, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                errno != EINTR && errno != EBUSY) {
+            LOGE << "io_uring_enter failed: " << strerror(errno) << "\n";
+            break;
+        }
+        Reap();
+    }
+#endif
+}
+
+void UringLoop::AddLink(IUringNotify* link) {
+    links_.insert(link);
+}
+
+void UringLoop::RemoveLink(IUringNotify* link) {
+    links_.erase(link);
+}
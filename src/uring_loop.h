@@ -0,0 +1,145 @@
+#ifndef _URING_LOOP_H_
+#define _URING_LOOP_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <set>
+
+#include <event2/event.h>
+
+struct io_uring_sqe;
+struct io_uring_buf_ring;
+
+class IUringNotify {
+public:
+    virtual ~IUringNotify() {};
+    //a request queued with op finished, flags are the completion's
+    virtual void OnComplete(int op, int res, uint32_t flags) = 0;
+};
+
+//io_uring instance of one event loop, driven by raw syscalls since
+//liburing is not a dependency. requests queued during a pass of the loop
+//reach the kernel in one io_uring_enter at its end, completions wake the
+//loop through an eventfd the ring signals. receives take their buffer
+//from a ring of kBufferCount buffers registered once, so a socket waiting
+//for data holds no memory of its own
+class UringLoop {
+public:
+    enum {
+        kBufferSize = 16 * 1024,
+        kBufferCount = 512,
+        //ops are told apart by the low bits of the request's user data
+        kOpBits = 3
+    };
+
+    explicit UringLoop(event_base* event_loop);
+
+    ~UringLoop();
+
+    //false where the kernel lacks io_uring or provided buffer rings
+    bool Init();
+
+    //the entry to fill in for a request, zeroed and tagged. NULL when the
+    //submission queue stays full even after submitting what it holds
+    io_uring_sqe* Queue(IUringNotify* notify, int op);
+
+    //first byte of the buffer a completion picked, and the buffer going
+    //back to the kernel once its bytes were copied out
+    const unsigned char* Buffer(uint32_t flags);
+
+    void ReleaseBuffer(uint32_t flags);
+
+    bool Multishot() const {
+        return multishot_;
+    }
+
+    //a multishot recv was refused, receives take one buffer per request
+    void DisableMultishot() {
+        multishot_ = false;
+    }
+
+    void Submit();
+
+    void OnCompletions();
+
+    event_base* GetBase() {
+        return event_loop_;
+    }
+
+    //links still around when the loop goes are freed with it
+    void AddLink(IUringNotify* link);
+
+    void RemoveLink(IUringNotify* link);
+
+private:
+    bool Map();
+
+    void Reap();
+
+    //cancels every request still with the kernel and waits them out
+    void Drain();
+
+    event_base* event_loop_;
+
+    int ring_fd_;
+
+    int event_fd_;
+
+    event* completion_event_;
+
+    event* submit_event_;
+
+    bool submit_queued_;
+
+    void* sq_ring_;
+
+    size_t sq_ring_bytes_;
+
+    void* cq_ring_;
+
+    size_t cq_ring_bytes_;
+
+    io_uring_sqe* sqes_;
+
+    size_t sqes_bytes_;
+
+    unsigned sq_entries_;
+
+    unsigned* sq_head_;
+
+    unsigned* sq_tail_;
+
+    unsigned* sq_flags_;
+
+    unsigned sq_mask_;
+
+    //entries filled in but not yet handed to the kernel end here
+    unsigned sq_local_tail_;
+
+    unsigned* cq_head_;
+
+    unsigned* cq_tail_;
+
+    unsigned cq_mask_;
+
+    void* cqes_;
+
+    io_uring_buf_ring* buffer_ring_;
+
+    unsigned char* buffers_;
+
+    uint16_t buffer_tail_;
+
+    bool multishot_;
+
+    //requests queued and not yet completed for good, a multishot one
+    //counts until its last completion
+    unsigned in_flight_;
+
+    //completions are counted but not handed to their links
+    bool draining_;
+
+    std::set<IUringNotify*> links_;
+};
+
+#endif
@@ -0,0 +1,284 @@
+#include "worker_group.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+static void notifycb(evutil_socket_t fd, short what, void *ctx) {
+    Worker* pWorker = static_cast<Worker*>(ctx);
+    pWorker->HandleNotify();
+}
+
+static void probecb(evutil_socket_t fd, short what, void *ctx) {
+    HelloProbe* pProbe = static_cast<HelloProbe*>(ctx);
+    pProbe->group->OnHelloProbe(pProbe, what);
+}
+
+static void
+proxy_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+                struct sockaddr *sa, int socklen, void *user_data) {
+    WorkerGroup* pGroup = static_cast<WorkerGroup*>(user_data);
+    pGroup->OnProxyAccept(fd);
+}
+
+Worker::Worker(int index,
+               string sock5_address,
+               int sock5_port,
+               int balance_policy,
+               const TunnelConfig& config,
+               SessionDirectory* sessions):
+    index_(index),
+    event_loop_(NULL),
+    server_(NULL),
+    notify_event_(NULL),
+    sock5_address_(sock5_address),
+    sock5_port_(sock5_port),
+    balance_policy_(balance_policy),
+    config_(config),
+    sessions_(sessions),
+    incoming_(0) {
+}
+
+bool Worker::Init() {
+    event_loop_ = event_base_new();
+    if (!event_loop_) {
+        LOGE << "Could not initialize libevent!\n";
+        return false;
+    }
+    //also keeps the loop alive while there is nothing else to wait for
+    notify_event_ = event_new(event_loop_, -1, EV_PERSIST | EV_READ, notifycb, this);
+    event_add(notify_event_, NULL);
+    server_ = new TCPServer(event_loop_, "", 0, sock5_address_, sock5_port_);
+    server_->SetBalancePolicy(balance_policy_);
+    server_->SetTunnelConfig(config_);
+    server_->SetReusePort(true);
+    server_->SetPauseWithoutTunnel(true);
+    server_->SetSessionDirectory(sessions_, this);
+    return server_->InitSock5Server();
+}
+
+bool Worker::ListenDatagram(string address, int port, int workers) {
+    return server_->InitDatagramServer(address, port, workers);
+}
+
+void Worker::Start(bool pin_cpu) {
+    thread_ = std::thread(&Worker::Run, this, pin_cpu);
+}
+
+void Worker::Run(bool pin_cpu) {
+#ifdef __linux__
+    if (pin_cpu) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(index_ % std::thread::hardware_concurrency(), &cpus);
+        if (0 != pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) {
+            LOGW << "worker " << index_ << " could not pin cpu\n";
+        }
+    }
+#endif
+    event_base_dispatch(event_loop_);
+}
+
+void Worker::Stop() {
+    if (!thread_.joinable())
+        return;
+    event_base_loopexit(event_loop_, NULL);
+    thread_.join();
+}
+
+void Worker::PostProxySocket(evutil_socket_t fd) {
+    incoming_++;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        pending_socket_.push_back(fd);
+    }
+    event_active(notify_event_, EV_READ, 1);
+}
+
+void Worker::PostDropSession(uint64_t session) {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        pending_drop_.push_back(session);
+    }
+    event_active(notify_event_, EV_READ, 1);
+}
+
+void Worker::HandleNotify() {
+    vector<evutil_socket_t> sockets;
+    vector<uint64_t> drops;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        sockets.swap(pending_socket_);
+        drops.swap(pending_drop_);
+    }
+    for (auto session : drops) {
+        server_->DropSession(session);
+    }
+    for (auto fd : sockets) {
+        LOGI << "worker " << index_ << " adopt tunnel\n";
+        server_->AdoptProxySocket(fd);
+        incoming_--;
+    }
+}
+
+int Worker::GetTunnels() {
+    return server_->GetLiveTunnels() + incoming_;
+}
+
+Worker::~Worker() {
+    if (server_) {
+        server_->Close();
+        delete server_;
+    }
+    for (auto fd : pending_socket_) {
+        evutil_closesocket(fd);
+    }
+    if (notify_event_)
+        event_free(notify_event_);
+    if (event_loop_)
+        event_base_free(event_loop_);
+}
+
+//////////////////////////////////////////////
+WorkerGroup::WorkerGroup(event_base* event_loop,
+                         string proxy_address,
+                         int proxy_port,
+                         string sock5_address,
+                         int sock5_port,
+                         int count):
+    event_loop_(event_loop),
+    proxy_socket_(NULL),
+    proxy_address_(proxy_address),
+    proxy_port_(proxy_port),
+    sock5_address_(sock5_address),
+    sock5_port_(sock5_port),
+    count_(count),
+    next_worker_(0),
+    probe_hello_(false) {
+}
+
+bool WorkerGroup::Init(int balance_policy, const TunnelConfig& config, bool pin_cpu) {
+    for (int i = 0; i < count_; i++) {
+        Worker* worker = new Worker(i, sock5_address_, sock5_port_, balance_policy, config, &sessions_);
+        workers_.push_back(worker);
+        if (!worker->Init()) {
+            return false;
+        }
+        if (config.transport == TunnelConfig::kTransportUdp &&
+                !worker->ListenDatagram(proxy_address_, proxy_port_, count_)) {
+            return false;
+        }
+    }
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    inet_pton(AF_INET, proxy_address_.c_str(), &sin.sin_addr.s_addr);
+    sin.sin_port = htons(proxy_port_);
+    proxy_socket_ = evconnlistener_new_bind(event_loop_, proxy_accept_cb, this,
+                                            LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, -1,
+                                            (struct sockaddr*)&sin,
+                                            sizeof(sin));
+    if (!proxy_socket_) {
+        LOGE << "Could not create a listener!\n";
+        return false;
+    }
+
+    probe_hello_ = (config.features & ForwardCodec::kFeatureResume) && !config.tls;
+
+    for (auto worker : workers_) {
+        worker->Start(pin_cpu);
+    }
+    return true;
+}
+
+void WorkerGroup::OnProxyAccept(evutil_socket_t fd) {
+    if (!probe_hello_) {
+        Deal(fd, 0);
+        return;
+    }
+    //the agent sends its offer as soon as it connects, a v1 agent sends
+    //some other frame or nothing
+    HelloProbe* probe = new HelloProbe;
+    probe->group = this;
+    probe->fd = fd;
+    probe->wait = event_new(event_loop_, fd, EV_READ, probecb, probe);
+    timeval timeout = { ProxyClient::kHelloWaitSec, 0 };
+    event_add(probe->wait, &timeout);
+    probes_.insert(probe);
+}
+
+//session the hello offer at the front of the socket names, 0 when the
+//first frame is another one or not all there. nothing is taken off
+static uint64_t PeekSession(evutil_socket_t fd) {
+    char buf[256];
+    int n = (int)recv(fd, buf, sizeof(buf), MSG_PEEK);
+    if (n <= 0)
+        return 0;
+    evbuffer* input = evbuffer_new();
+    evbuffer_add(input, buf, n);
+    ForwardCodec codec;
+    ForwardData data(kHashTypeInvalid);
+    HelloInfo hello;
+    uint64_t session = 0;
+    if (codec.Decode(input, data) == ForwardCodec::kFrameReady && data.op_ == ForwardData::kHello &&
+            ForwardCodec::ParseHello(data, &hello) && hello.kind == ForwardCodec::kHelloOffer)
+        session = hello.session;
+    evbuffer_free(input);
+    return session;
+}
+
+void WorkerGroup::OnHelloProbe(HelloProbe* probe, short what) {
+    uint64_t session = (what & EV_READ) ? PeekSession(probe->fd) : 0;
+    probes_.erase(probe);
+    event_free(probe->wait);
+    Deal(probe->fd, session);
+    delete probe;
+}
+
+void WorkerGroup::Deal(evutil_socket_t fd, uint64_t session) {
+    ISessionOwner* owner = session ? sessions_.Find(session) : NULL;
+    for (auto worker : workers_) {
+        if (worker == owner) {
+            worker->PostProxySocket(fd);
+            return;
+        }
+    }
+    //ties go round robin, so tunnels spread evenly while none is lost
+    size_t best = next_worker_;
+    int best_tunnels = workers_[best]->GetTunnels();
+    for (size_t i = 1; i < workers_.size(); i++) {
+        size_t index = (next_worker_ + i) % workers_.size();
+        int tunnels = workers_[index]->GetTunnels();
+        if (tunnels < best_tunnels) {
+            best = index;
+            best_tunnels = tunnels;
+        }
+    }
+    workers_[best]->PostProxySocket(fd);
+    next_worker_ = (best + 1) % workers_.size();
+}
+
+void WorkerGroup::Stop() {
+    if (proxy_socket_) {
+        evconnlistener_free(proxy_socket_);
+        proxy_socket_ = NULL;
+    }
+    for (auto probe : probes_) {
+        event_free(probe->wait);
+        evutil_closesocket(probe->fd);
+        delete probe;
+    }
+    probes_.clear();
+    for (auto worker : workers_) {
+        worker->Stop();
+    }
+}
+
+WorkerGroup::~WorkerGroup() {
+    Stop();
+    for (auto worker : workers_) {
+        delete worker;
+    }
+}
@@ -0,0 +1,141 @@
+#ifndef _WORKER_GROUP_H_
+#define _WORKER_GROUP_H_
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#include "tcp_server.h"
+#include "session_directory.h"
+
+//one event loop on its own thread, with a SO_REUSEPORT sock5 listener.
+//tunnel sockets are handed over by the WorkerGroup and stay on this loop,
+//so streams accepted here are only spread across tunnels owned here. the
+//listener is closed while the worker has no tunnel
+class Worker : public ISessionOwner {
+public:
+    Worker(int index,
+           string sock5_address,
+           int sock5_port,
+           int balance_policy,
+           const TunnelConfig& config,
+           SessionDirectory* sessions);
+
+    bool Init();
+
+    //own SO_REUSEPORT udp socket. udp tunnels are never handed over, the
+    //kernel steers each by its conv to one of the workers instead
+    bool ListenDatagram(string address, int port, int workers);
+
+    void Start(bool pin_cpu);
+
+    void Stop();
+
+    //thread safe, invoke from the accepting thread
+    void PostProxySocket(evutil_socket_t fd);
+
+    virtual void PostDropSession(uint64_t session);
+
+    //thread safe, tunnels this worker carries or was handed
+    int GetTunnels();
+
+    void HandleNotify();
+
+    ~Worker();
+
+private:
+    void Run(bool pin_cpu);
+
+    int index_;
+
+    event_base* event_loop_;
+
+    TCPServer* server_;
+
+    event* notify_event_;
+
+    string sock5_address_;
+
+    int sock5_port_;
+
+    int balance_policy_;
+
+    TunnelConfig config_;
+
+    SessionDirectory* sessions_;
+
+    std::thread thread_;
+
+    std::mutex lock_;
+
+    vector<evutil_socket_t> pending_socket_;
+
+    vector<uint64_t> pending_drop_;
+
+    //posted and not adopted yet
+    std::atomic<int> incoming_;
+};
+
+class WorkerGroup;
+
+//a tunnel connection held on the accepting thread until its first frame
+//shows which session the agent's hello names
+struct HelloProbe {
+    WorkerGroup* group;
+    evutil_socket_t fd;
+    event* wait;
+};
+
+//accepts tunnel connections on the main loop and deals each to the worker
+//with the fewest tunnels; the agent should open at least as many tunnels
+//as workers. a reconnecting tunnel goes to the worker holding the session
+//it resumes, read from its hello offer unless tls hides it
+class WorkerGroup {
+public:
+    WorkerGroup(event_base* event_loop,
+                string proxy_address,
+                int proxy_port,
+                string sock5_address,
+                int sock5_port,
+                int count);
+
+    bool Init(int balance_policy, const TunnelConfig& config, bool pin_cpu);
+
+    void OnProxyAccept(evutil_socket_t fd);
+
+    void OnHelloProbe(HelloProbe* probe, short what);
+
+    void Stop();
+
+    ~WorkerGroup();
+
+private:
+    void Deal(evutil_socket_t fd, uint64_t session);
+
+    event_base* event_loop_;
+
+    evconnlistener* proxy_socket_;
+
+    string proxy_address_;
+
+    int proxy_port_;
+
+    string sock5_address_;
+
+    int sock5_port_;
+
+    int count_;
+
+    size_t next_worker_;
+
+    vector<Worker*> workers_;
+
+    SessionDirectory sessions_;
+
+    //off when sessions are not resumed or tls hides the hello
+    bool probe_hello_;
+
+    std::set<HelloProbe*> probes_;
+};
+
+#endif